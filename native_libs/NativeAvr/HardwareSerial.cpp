@@ -0,0 +1,203 @@
+#include "Arduino.h"
+#include "HardwareSerial.h"
+#include "HardwareSerial_private.h"
+
+#include <util/atomic.h>
+
+HardwareSerial::HardwareSerial()
+    : _written(false), _rx_buffer_head(0), _rx_buffer_tail(0), _tx_buffer_head(0), _tx_buffer_tail(0)
+{
+}
+
+void HardwareSerial::_tx_udr_empty_irq(void)
+{
+  // If interrupts are enabled, there must be more data in the output
+  // buffer. Send the next byte
+  unsigned char c = _tx_buffer[_tx_buffer_tail];
+  _tx_buffer_tail = (_tx_buffer_tail + 1) % SERIAL_TX_BUFFER_SIZE;
+
+  UDR0 = c;
+
+  // clear the TXC bit -- "can be cleared by writing a one to its bit
+  // location". This makes sure flush() won't return until the bytes
+  // actually got written
+  UCSR0A = (UCSR0A & ((1 << U2X0) | (1 << MPCM0))) | (1 << TXC0);
+
+  if (_tx_buffer_head == _tx_buffer_tail)
+  {
+    // Buffer empty, so disable interrupts
+    UCSR0B &= ~(1 << UDRIE0);
+  }
+}
+
+void HardwareSerial::begin(unsigned long baud, byte config)
+{
+  // Try u2x mode first
+  uint16_t baud_setting = (F_CPU / 4 / baud - 1) / 2;
+  UCSR0A = 1 << U2X0;
+
+  // hardcoded exception for 57600 for compatibility with the bootloader
+  // shipped with the Duemilanove and previous boards and the firmware
+  // on the 8U2 on the Uno and Mega 2560. Also, The baud_setting cannot
+  // be > 4095, so switch back to non-u2x mode if the baud rate is too
+  // low.
+  if (((F_CPU == 16000000UL) && (baud == 57600)) || (baud_setting > 4095))
+  {
+    UCSR0A = 0;
+    baud_setting = (F_CPU / 8 / baud - 1) / 2;
+  }
+
+  // assign the baud_setting, a.k.a. ubrr (USART Baud Rate Register)
+  UBRR0H = baud_setting >> 8;
+  UBRR0L = baud_setting;
+
+  _written = false;
+
+  UCSR0C = config;
+
+  UCSR0B |= 1 << RXEN0;
+  UCSR0B |= 1 << TXEN0;
+  UCSR0B |= 1 << RXCIE0;
+  UCSR0B &= ~(1 << UDRIE0);
+}
+
+void HardwareSerial::end()
+{
+  // wait for transmission of outgoing data
+  flush();
+
+  UCSR0B &= ~(1 << RXEN0);
+  UCSR0B &= ~(1 << TXEN0);
+  UCSR0B &= ~(1 << RXCIE0);
+  UCSR0B &= ~(1 << UDRIE0);
+
+  // clear any received data
+  _rx_buffer_head = _rx_buffer_tail;
+}
+
+int HardwareSerial::available(void)
+{
+  return ((unsigned int)(SERIAL_RX_BUFFER_SIZE + _rx_buffer_head - _rx_buffer_tail)) % SERIAL_RX_BUFFER_SIZE;
+}
+
+int HardwareSerial::peek(void)
+{
+  if (_rx_buffer_head == _rx_buffer_tail)
+  {
+    return -1;
+  }
+  return _rx_buffer[_rx_buffer_tail];
+}
+
+int HardwareSerial::read(void)
+{
+  // if the head isn't ahead of the tail, we don't have any characters
+  if (_rx_buffer_head == _rx_buffer_tail)
+  {
+    return -1;
+  }
+  unsigned char c = _rx_buffer[_rx_buffer_tail];
+  _rx_buffer_tail = (rx_buffer_index_t)(_rx_buffer_tail + 1) % SERIAL_RX_BUFFER_SIZE;
+  return c;
+}
+
+int HardwareSerial::availableForWrite(void)
+{
+  tx_buffer_index_t head;
+  tx_buffer_index_t tail;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    head = _tx_buffer_head;
+    tail = _tx_buffer_tail;
+  }
+  if (head >= tail)
+  {
+    return SERIAL_TX_BUFFER_SIZE - 1 - head + tail;
+  }
+  return tail - head - 1;
+}
+
+void HardwareSerial::flush()
+{
+  // If we have never written a byte, no need to flush. This special
+  // case is needed since there is no way to force the TXC (transmit
+  // complete) bit to 1 during initialization
+  if (!_written)
+  {
+    return;
+  }
+
+  while (bit_is_set(UCSR0B, UDRIE0) || bit_is_clear(UCSR0A, TXC0))
+  {
+    if (bit_is_clear(SREG, SREG_I) && bit_is_set(UCSR0B, UDRIE0))
+    {
+      // Interrupts are globally disabled, but the DR empty
+      // interrupt should be enabled, so poll the DR empty flag to
+      // prevent deadlock
+      if (bit_is_set(UCSR0A, UDRE0))
+      {
+        _tx_udr_empty_irq();
+      }
+    }
+  }
+  // If we get here, nothing is queued anymore (DRIE is disabled) and
+  // the hardware finished transmission (TXC is set).
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  _written = true;
+  // If the buffer and the data register is empty, just write the byte
+  // to the data register and be done. This shortcut helps
+  // significantly improve the effective datarate at high (>
+  // 500kbit/s) bitrates, where interrupt overhead becomes a slowdown.
+  if (_tx_buffer_head == _tx_buffer_tail && bit_is_set(UCSR0A, UDRE0))
+  {
+    // If TXC is cleared before writing UDR and the previous byte
+    // completes before writing to UDR, TXC will be set but a byte
+    // is still being transmitted causing flush() to return too soon.
+    // So writing UDR must happen first.
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      UDR0 = c;
+      UCSR0A = (UCSR0A & ((1 << U2X0) | (1 << MPCM0))) | (1 << TXC0);
+    }
+    return 1;
+  }
+  tx_buffer_index_t i = (_tx_buffer_head + 1) % SERIAL_TX_BUFFER_SIZE;
+
+  // If the output buffer is full, there's nothing for it other than to
+  // wait for the interrupt handler to empty it a bit
+  while (i == _tx_buffer_tail)
+  {
+    if (bit_is_clear(SREG, SREG_I))
+    {
+      // Interrupts are disabled, so we'll have to poll the data
+      // register empty flag ourselves. If it is set, pretend an
+      // interrupt has happened and call the handler to free up
+      // space for us.
+      if (bit_is_set(UCSR0A, UDRE0))
+      {
+        _tx_udr_empty_irq();
+      }
+    }
+    else
+    {
+      // nop, the interrupt handler will free up space for us
+    }
+  }
+
+  _tx_buffer[_tx_buffer_head] = c;
+
+  // make atomic to prevent execution of ISR between setting the
+  // head pointer and setting the interrupt flag resulting in buffer
+  // retransmission
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    _tx_buffer_head = i;
+    UCSR0B |= 1 << UDRIE0;
+  }
+
+  return 1;
+}
@@ -0,0 +1,82 @@
+/*
+ * HardwareSerial from the Arduino AVR core for the native test environment.
+ *
+ * The same ring buffers and interrupt handlers as the AVR core, on the
+ * emulated USART0, so a sketch using Serial sees the same buffering, the same
+ * dropped bytes when the receive buffer is full and the same waits when the
+ * transmit buffer is full. Serial and its interrupt handlers are only linked
+ * in when a sketch uses Serial, as on the AVR.
+ */
+
+#ifndef HardwareSerial_h
+#define HardwareSerial_h
+
+#include <inttypes.h>
+
+#include "Stream.h"
+
+#if !defined(SERIAL_TX_BUFFER_SIZE)
+#define SERIAL_TX_BUFFER_SIZE 64
+#endif
+#if !defined(SERIAL_RX_BUFFER_SIZE)
+#define SERIAL_RX_BUFFER_SIZE 64
+#endif
+#if (SERIAL_TX_BUFFER_SIZE > 256)
+typedef uint16_t tx_buffer_index_t;
+#else
+typedef uint8_t tx_buffer_index_t;
+#endif
+#if (SERIAL_RX_BUFFER_SIZE > 256)
+typedef uint16_t rx_buffer_index_t;
+#else
+typedef uint8_t rx_buffer_index_t;
+#endif
+
+#define SERIAL_5N1 0x00
+#define SERIAL_6N1 0x02
+#define SERIAL_7N1 0x04
+#define SERIAL_8N1 0x06
+#define SERIAL_8N2 0x0E
+#define SERIAL_8E1 0x26
+#define SERIAL_8O1 0x36
+
+class HardwareSerial : public Stream
+{
+protected:
+  bool _written;
+
+  volatile rx_buffer_index_t _rx_buffer_head;
+  volatile rx_buffer_index_t _rx_buffer_tail;
+  volatile tx_buffer_index_t _tx_buffer_head;
+  volatile tx_buffer_index_t _tx_buffer_tail;
+
+  unsigned char _rx_buffer[SERIAL_RX_BUFFER_SIZE];
+  unsigned char _tx_buffer[SERIAL_TX_BUFFER_SIZE];
+
+public:
+  HardwareSerial();
+  void begin(unsigned long baud) { begin(baud, SERIAL_8N1); }
+  void begin(unsigned long, uint8_t);
+  void end();
+  virtual int available(void);
+  virtual int peek(void);
+  virtual int read(void);
+  virtual int availableForWrite(void);
+  virtual void flush(void);
+  virtual size_t write(uint8_t);
+  inline size_t write(unsigned long n) { return write((uint8_t)n); }
+  inline size_t write(long n) { return write((uint8_t)n); }
+  inline size_t write(unsigned int n) { return write((uint8_t)n); }
+  inline size_t write(int n) { return write((uint8_t)n); }
+  using Print::write;
+  operator bool() { return true; }
+
+  // Interrupt handlers - Not intended to be called externally
+  inline void _rx_complete_irq(void);
+  void _tx_udr_empty_irq(void);
+};
+
+extern HardwareSerial Serial;
+#define HAVE_HWSERIAL0
+
+#endif
@@ -0,0 +1,17 @@
+#include "Arduino.h"
+#include "HardwareSerial.h"
+#include "HardwareSerial_private.h"
+
+// Only linked in when the sketch uses Serial, so a sketch with its own
+// USART0 driver can define these vectors itself
+ISR(USART_RX_vect)
+{
+  Serial._rx_complete_irq();
+}
+
+ISR(USART_UDRE_vect)
+{
+  Serial._tx_udr_empty_irq();
+}
+
+HardwareSerial Serial;
@@ -0,0 +1,30 @@
+/*
+ * The receive interrupt handler of HardwareSerial, inlined into the vector as
+ * in the AVR core.
+ */
+
+void HardwareSerial::_rx_complete_irq(void)
+{
+  if (bit_is_clear(UCSR0A, UPE0))
+  {
+    // No Parity error, read byte and store it in the buffer if there is
+    // room
+    unsigned char c = UDR0;
+    rx_buffer_index_t i = (unsigned int)(_rx_buffer_head + 1) % SERIAL_RX_BUFFER_SIZE;
+
+    // if we should be storing the received character into the location
+    // just before the tail (meaning that the head would advance to the
+    // current location of the tail), we're about to overflow the buffer
+    // and so we don't write the character or advance the head.
+    if (i != _rx_buffer_tail)
+    {
+      _rx_buffer[_rx_buffer_head] = c;
+      _rx_buffer_head = i;
+    }
+  }
+  else
+  {
+    // Parity error, read byte but discard it
+    (void)UDR0;
+  }
+}
@@ -0,0 +1,1264 @@
+#include "NativeAvr.h"
+
+#include <queue>
+#include <stdarg.h>
+#include <stdio.h>
+
+// The handlers the sketch defines with ISR(). Any it doesn't define are null.
+extern "C"
+{
+  void __vector_1(void) __attribute__((weak));
+  void __vector_2(void) __attribute__((weak));
+  void __vector_3(void) __attribute__((weak));
+  void __vector_4(void) __attribute__((weak));
+  void __vector_5(void) __attribute__((weak));
+  void __vector_6(void) __attribute__((weak));
+  void __vector_7(void) __attribute__((weak));
+  void __vector_8(void) __attribute__((weak));
+  void __vector_9(void) __attribute__((weak));
+  void __vector_10(void) __attribute__((weak));
+  void __vector_11(void) __attribute__((weak));
+  void __vector_12(void) __attribute__((weak));
+  void __vector_13(void) __attribute__((weak));
+  void __vector_14(void) __attribute__((weak));
+  void __vector_15(void) __attribute__((weak));
+  void __vector_16(void) __attribute__((weak));
+  void __vector_17(void) __attribute__((weak));
+  void __vector_18(void) __attribute__((weak));
+  void __vector_19(void) __attribute__((weak));
+  void __vector_20(void) __attribute__((weak));
+  void __vector_21(void) __attribute__((weak));
+  void __vector_22(void) __attribute__((weak));
+  void __vector_23(void) __attribute__((weak));
+  void __vector_24(void) __attribute__((weak));
+  void __vector_25(void) __attribute__((weak));
+}
+
+volatile uint8_t PINB, DDRB, PORTB;
+volatile uint8_t PINC, DDRC, PORTC;
+volatile uint8_t PIND, DDRD, PORTD;
+volatile uint8_t PCICR, PCIFR, PCMSK0, PCMSK1, PCMSK2;
+
+namespace NativeAvr
+{
+Cycles loopPassCycles = 10 * CYCLES_PER_US;
+Cycles timeLimit = 600000 * CYCLES_PER_MS;
+}
+
+namespace
+{
+using namespace NativeAvr;
+
+typedef void (*Vector)(void);
+
+Vector const vectors[] = {
+    NULL, __vector_1, __vector_2, __vector_3, __vector_4, __vector_5, __vector_6, __vector_7, __vector_8,
+    __vector_9, __vector_10, __vector_11, __vector_12, __vector_13, __vector_14, __vector_15, __vector_16,
+    __vector_17, __vector_18, __vector_19, __vector_20, __vector_21, __vector_22, __vector_23, __vector_24,
+    __vector_25};
+
+const Cycles INTERRUPT_CYCLES = 40;                 // Entry, saving registers and reti
+const Cycles EEPROM_WRITE_CYCLES = 3400 * CYCLES_PER_US;
+const Cycles TIMER0_OVERFLOW_CYCLES = 64 * 256;     // Prescaler 64, as set up by the Arduino core
+const Cycles ADC_CONVERSION_CYCLES = 27 * 64;       // 13.5 ADC clocks at F_CPU / 128
+const Cycles ANALOG_READ_CYCLES = 112 * CYCLES_PER_US;
+const Cycles DIGITAL_IO_CYCLES = 60;                // digitalWrite() and friends look the pin up in flash
+const Cycles MILLIS_CYCLES = 32;
+const Cycles MICROS_CYCLES = 58;
+const byte RX_FIFO_SIZE = 2;                        // The USART receive buffer, behind the shift register
+const Cycles TIMER1_PRESCALE[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+
+enum EventKind
+{
+  EVENT_RECEIVE,  // A byte has arrived on RXD
+  EVENT_TRANSMIT, // The transmit shift register has sent its byte
+  EVENT_EEPROM,   // An EEPROM write has finished
+  EVENT_ADC,      // An ADC conversion has finished
+  EVENT_SPI,      // An SPI transfer has finished
+  EVENT_CALLBACK  // Something scheduled by the test
+};
+
+struct Event
+{
+  Cycles at;
+  unsigned long order; // Events at the same time happen in the order they were scheduled
+  byte kind;
+  byte value;
+  unsigned long generation;
+  Callback callback;
+  void *context;
+};
+
+struct Later
+{
+  bool operator()(const Event &a, const Event &b) const
+  {
+    return (a.at != b.at) ? a.at > b.at : a.order > b.order;
+  }
+};
+
+typedef std::priority_queue<Event, std::vector<Event>, Later> EventQueue;
+
+// The containers are made on first use, as the sketch's constructors can run first
+EventQueue &events()
+{
+  static EventQueue queue;
+  return queue;
+}
+
+std::vector<SentByte> &sentLog()
+{
+  static std::vector<SentByte> log;
+  return log;
+}
+
+std::vector<uint8_t> &spiLog()
+{
+  static std::vector<uint8_t> log;
+  return log;
+}
+
+// Everything else is plain data, which is zero before any constructor runs
+struct State
+{
+  Cycles now;
+  unsigned long order;
+  unsigned long epoch; // Moves on whenever anything happens that the sketch could be waiting for
+  bool interruptFlag;
+  byte sreg; // SREG other than the I flag
+  bool inInterrupt;
+  bool poweredOff;
+  unsigned long loops;
+  Cycles longestLoop;
+
+  // Status register reads, to see when the sketch is polling
+  bool readSeen[REGISTER_COUNT];
+  unsigned long readEpoch[REGISTER_COUNT];
+  uint16_t readValue[REGISTER_COUNT];
+
+  // USART0
+  byte ucsr0a; // U2X0, MPCM0, TXC0 and DOR0, the rest are worked out
+  byte ucsr0b;
+  byte ucsr0c;
+  byte ubrr0h;
+  byte ubrr0l;
+  byte rxFifo[RX_FIFO_SIZE];
+  byte rxCount;
+  byte rxLast;
+  Cycles rxIdleAt; // When the last byte queued by the test has arrived
+  unsigned long rxOverruns;
+  bool shifting;
+  byte shiftValue;
+  bool txFull;
+  byte txValue;
+
+  // EEPROM
+  bool eepromErased;
+  byte cells[EEPROM_SIZE];
+  byte eecr; // EERIE and EEPM, the rest are worked out
+  byte eedr;
+  uint16_t eear;
+  bool masterEnabled;
+  Cycles masterEnableUntil;
+  bool eepromBusy;
+  uint16_t writeAddr;
+  byte writeValue;
+  unsigned long eepromWrites;
+  unsigned long eepromViolations;
+  bool cutArmed;
+  unsigned long cutBefore;
+
+  // ADC
+  bool analogSet;
+  uint16_t analog[8];
+  byte admux;
+  byte adcsra;
+  byte adcsrb;
+  uint16_t adc;
+  unsigned long adcGeneration;
+
+  // SPI
+  byte spcr;
+  byte spsr;
+  byte spdr;
+  bool spiBusy;
+  unsigned long spiCollisions;
+
+  // Timer1
+  byte tccr1a;
+  byte tccr1b;
+  uint16_t timer1Count; // The count at timer1Since
+  Cycles timer1Since;
+
+  // Pins driven by the test, for ports B, C and D
+  byte driven[3];
+  byte drivenHigh[3];
+};
+
+State state;
+
+void fail(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  fflush(stdout);
+  fprintf(stderr, "NativeAvr at %.3fms: ", (double)state.now / CYCLES_PER_MS);
+  vfprintf(stderr, format, args);
+  fputc('\n', stderr);
+  va_end(args);
+  abort();
+}
+
+void scheduleEvent(Cycles at, byte kind, byte value = 0, unsigned long generation = 0)
+{
+  Event event = {at, state.order++, kind, value, generation, NULL, NULL};
+  events().push(event);
+}
+
+uint8_t *cells()
+{
+  if (!state.eepromErased)
+  {
+    memset(state.cells, 0xFF, sizeof(state.cells));
+    state.eepromErased = true;
+  }
+  return state.cells;
+}
+
+uint16_t *analogValues()
+{
+  if (!state.analogSet)
+  {
+    // Nothing pressed on the keypad
+    for (byte i = 0; i < 8; i++)
+    {
+      state.analog[i] = 1023;
+    }
+    state.analogSet = true;
+  }
+  return state.analog;
+}
+
+/* ---- INTERRUPTS ---- */
+
+// Returns the highest priority interrupt that is pending and enabled, or 0
+int pendingVector()
+{
+  byte pinChanges = PCIFR & PCICR;
+  if (pinChanges & (1 << PCIF0))
+  {
+    return 3;
+  }
+  if (pinChanges & (1 << PCIF1))
+  {
+    return 4;
+  }
+  if (pinChanges & (1 << PCIF2))
+  {
+    return 5;
+  }
+  if ((state.spcr & (1 << SPIE)) && (state.spsr & (1 << SPIF)))
+  {
+    return 17;
+  }
+  if ((state.ucsr0b & (1 << RXCIE0)) && state.rxCount > 0)
+  {
+    return 18;
+  }
+  if ((state.ucsr0b & (1 << UDRIE0)) && !state.txFull)
+  {
+    return 19;
+  }
+  if ((state.ucsr0b & (1 << TXCIE0)) && (state.ucsr0a & (1 << TXC0)))
+  {
+    return 20;
+  }
+  if ((state.adcsra & (1 << ADIE)) && (state.adcsra & (1 << ADIF)))
+  {
+    return 21;
+  }
+  if ((state.eecr & (1 << EERIE)) && !state.eepromBusy)
+  {
+    return 22;
+  }
+  return 0;
+}
+
+// Clears the flags that the AVR clears when it runs the vector
+void clearOnEntry(int vector)
+{
+  switch (vector)
+  {
+  case 3:
+  case 4:
+  case 5:
+    PCIFR &= ~(1 << (vector - 3));
+    break;
+  case 17:
+    state.spsr &= ~(1 << SPIF);
+    break;
+  case 20:
+    state.ucsr0a &= ~(1 << TXC0);
+    break;
+  case 21:
+    state.adcsra &= ~(1 << ADIF);
+    break;
+  }
+}
+
+void runInterrupts()
+{
+  while (state.interruptFlag && !state.inInterrupt && !state.poweredOff)
+  {
+    int vector = pendingVector();
+    if (vector == 0)
+    {
+      return;
+    }
+    if (vectors[vector] == NULL)
+    {
+      fail("interrupt %d is enabled but the sketch has no handler for it, the AVR would reset", vector);
+    }
+    clearOnEntry(vector);
+    state.inInterrupt = true;
+    state.interruptFlag = false;
+    state.epoch++;
+    advance(INTERRUPT_CYCLES);
+    vectors[vector]();
+    state.interruptFlag = true;
+    state.inInterrupt = false;
+  }
+}
+
+/* ---- USART0 ---- */
+
+void transmit(byte value)
+{
+  if (!(state.ucsr0b & (1 << TXEN0)))
+  {
+    return;
+  }
+  if (!state.shifting)
+  {
+    state.shifting = true;
+    state.shiftValue = value;
+    scheduleEvent(state.now + uartByteCycles(), EVENT_TRANSMIT);
+  }
+  else if (!state.txFull)
+  {
+    state.txFull = true;
+    state.txValue = value;
+  }
+  // Otherwise UDRE0 was clear and the AVR ignores the write
+}
+
+void transmitted()
+{
+  sentLog().push_back({state.now, state.shiftValue});
+  if (state.txFull)
+  {
+    state.shiftValue = state.txValue;
+    state.txFull = false;
+    scheduleEvent(state.now + uartByteCycles(), EVENT_TRANSMIT);
+  }
+  else
+  {
+    state.shifting = false;
+    state.ucsr0a |= 1 << TXC0;
+  }
+}
+
+void received(byte value)
+{
+  if (!(state.ucsr0b & (1 << RXEN0)))
+  {
+    return;
+  }
+  if (state.rxCount == RX_FIFO_SIZE)
+  {
+    state.rxOverruns++;
+    state.ucsr0a |= 1 << DOR0;
+    return;
+  }
+  state.rxFifo[state.rxCount++] = value;
+}
+
+byte readUdr()
+{
+  if (state.rxCount > 0)
+  {
+    state.rxLast = state.rxFifo[0];
+    state.rxFifo[0] = state.rxFifo[1];
+    state.rxCount--;
+    state.ucsr0a &= ~(1 << DOR0);
+  }
+  return state.rxLast;
+}
+
+/* ---- EEPROM ---- */
+
+void startEepromWrite()
+{
+  if (state.eepromBusy)
+  {
+    state.eepromViolations++;
+    return;
+  }
+  if (state.cutArmed && state.eepromWrites == state.cutBefore)
+  {
+    state.poweredOff = true;
+    throw PowerCut();
+  }
+  state.eepromWrites++;
+  state.eepromBusy = true;
+  state.writeAddr = state.eear;
+  switch ((state.eecr >> EEPM0) & 3)
+  {
+  case 0:
+    state.writeValue = state.eedr; // erase and write
+    break;
+  case 1:
+    state.writeValue = 0xFF; // erase only
+    break;
+  default:
+    state.writeValue = cells()[state.eear] & state.eedr; // write only
+    break;
+  }
+  scheduleEvent(state.now + EEPROM_WRITE_CYCLES, EVENT_EEPROM);
+  advance(2); // The CPU is halted while the write starts
+}
+
+void writeEecr(byte value)
+{
+  state.eecr = value & ((1 << EERIE) | (1 << EEPM0) | (1 << EEPM1));
+  if (value & (1 << EERE))
+  {
+    if (state.eepromBusy)
+    {
+      state.eepromViolations++; // The AVR ignores the read
+    }
+    else
+    {
+      state.eedr = cells()[state.eear];
+      advance(4);
+    }
+  }
+  if (value & (1 << EEPE))
+  {
+    // Only starts within four cycles of setting EEMPE
+    if (state.masterEnabled && state.now <= state.masterEnableUntil)
+    {
+      state.masterEnabled = false;
+      startEepromWrite();
+    }
+  }
+  else if (value & (1 << EEMPE))
+  {
+    state.masterEnabled = true;
+    state.masterEnableUntil = state.now + 4;
+  }
+}
+
+/* ---- ADC ---- */
+
+bool autoTriggered()
+{
+  const byte enabled = (1 << ADEN) | (1 << ADATE);
+  return (state.adcsra & enabled) == enabled && (state.adcsrb & 0x07) == (1 << ADTS2);
+}
+
+// Auto triggering is only emulated from Timer0 overflow, the one the keypad uses
+void scheduleConversion()
+{
+  if (autoTriggered())
+  {
+    Cycles overflow = (state.now / TIMER0_OVERFLOW_CYCLES + 1) * TIMER0_OVERFLOW_CYCLES;
+    scheduleEvent(overflow + ADC_CONVERSION_CYCLES, EVENT_ADC, 0, state.adcGeneration);
+  }
+}
+
+void writeAdcsra(byte value)
+{
+  byte flag = (value & (1 << ADIF)) ? 0 : (state.adcsra & (1 << ADIF)); // Writing a one clears it
+  state.adcsra = (value & ~(1 << ADIF)) | flag;
+  state.adcGeneration++;
+  if ((value & (1 << ADSC)) && (value & (1 << ADEN)))
+  {
+    scheduleEvent(state.now + ADC_CONVERSION_CYCLES, EVENT_ADC, 0, state.adcGeneration);
+  }
+  else
+  {
+    state.adcsra &= ~(1 << ADSC);
+    scheduleConversion();
+  }
+}
+
+void converted(unsigned long generation)
+{
+  if (generation != state.adcGeneration)
+  {
+    return; // The ADC has been set up again since this was scheduled
+  }
+  state.adc = analogValues()[state.admux & 0x07];
+  state.adcsra = (state.adcsra & ~(1 << ADSC)) | (1 << ADIF);
+  scheduleConversion();
+}
+
+/* ---- SPI ---- */
+
+void writeSpdr(byte value)
+{
+  if (!(state.spcr & (1 << SPE)))
+  {
+    return;
+  }
+  if (state.spiBusy)
+  {
+    state.spiCollisions++;
+    state.spsr |= 1 << WCOL;
+    return;
+  }
+  state.spsr &= ~((1 << SPIF) | (1 << WCOL));
+  state.spiBusy = true;
+  spiLog().push_back(value);
+  static const byte dividers[4] = {4, 16, 64, 128};
+  Cycles divider = dividers[state.spcr & 0x03];
+  if (state.spsr & (1 << SPI2X))
+  {
+    divider /= 2;
+  }
+  scheduleEvent(state.now + 8 * divider, EVENT_SPI);
+}
+
+/* ---- TIMER1 ---- */
+
+uint16_t timer1Count()
+{
+  Cycles prescale = TIMER1_PRESCALE[state.tccr1b & 0x07];
+  if (prescale == 0)
+  {
+    return state.timer1Count;
+  }
+  return (uint16_t)(state.timer1Count + (state.now - state.timer1Since) / prescale);
+}
+
+void setTimer1Count(uint16_t count)
+{
+  state.timer1Count = count;
+  state.timer1Since = state.now;
+}
+
+/* ---- PINS ---- */
+
+struct Port
+{
+  byte index;
+  volatile uint8_t *pin;
+  volatile uint8_t *ddr;
+  volatile uint8_t *port;
+  volatile uint8_t *pcmsk;
+};
+
+bool portOf(uint8_t pin, Port &port, byte &mask)
+{
+  if (pin < 8)
+  {
+    port = {2, &PIND, &DDRD, &PORTD, &PCMSK2};
+    mask = 1 << pin;
+  }
+  else if (pin < 14)
+  {
+    port = {0, &PINB, &DDRB, &PORTB, &PCMSK0};
+    mask = 1 << (pin - 8);
+  }
+  else if (pin < 20)
+  {
+    port = {1, &PINC, &DDRC, &PORTC, &PCMSK1};
+    mask = 1 << (pin - 14);
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+// Works out the level of a pin: driven by the test, otherwise the output or pull-up
+void updatePin(const Port &port, byte mask)
+{
+  bool high = (state.driven[port.index] & mask) ? (state.drivenHigh[port.index] & mask) : (*port.port & mask);
+  bool was = *port.pin & mask;
+  if (high == was)
+  {
+    return;
+  }
+  if (high)
+  {
+    *port.pin |= mask;
+  }
+  else
+  {
+    *port.pin &= ~mask;
+  }
+  if (*port.pcmsk & mask)
+  {
+    PCIFR |= 1 << port.index;
+  }
+  state.epoch++;
+}
+
+void handle(const Event &event)
+{
+  switch (event.kind)
+  {
+  case EVENT_RECEIVE:
+    received(event.value);
+    break;
+  case EVENT_TRANSMIT:
+    transmitted();
+    break;
+  case EVENT_EEPROM:
+    cells()[state.writeAddr] = state.writeValue;
+    state.eepromBusy = false;
+    break;
+  case EVENT_ADC:
+    converted(event.generation);
+    break;
+  case EVENT_SPI:
+    state.spiBusy = false;
+    state.spsr |= 1 << SPIF;
+    state.spdr = 0; // Nothing is connected to MISO
+    break;
+  case EVENT_CALLBACK:
+    event.callback(event.context);
+    break;
+  }
+}
+
+// Moves on to the next thing that can happen. The sketch is waiting for it.
+void waitForEvent()
+{
+  if (events().empty())
+  {
+    fail("the sketch is waiting but nothing is left that can happen");
+  }
+  advanceTo(events().top().at);
+}
+
+bool isStatusRegister(RegisterId id)
+{
+  switch (id)
+  {
+  case REG_SREG:
+  case REG_UCSR0A:
+  case REG_UCSR0B:
+  case REG_EECR:
+  case REG_ADCSRA:
+  case REG_SPSR:
+    return true;
+  default:
+    return false;
+  }
+}
+
+uint16_t registerValue(RegisterId id)
+{
+  switch (id)
+  {
+  case REG_SREG:
+    return (state.interruptFlag ? 0x80 : 0) | state.sreg;
+  case REG_UDR0:
+    return (state.rxCount > 0) ? state.rxFifo[0] : state.rxLast;
+  case REG_UCSR0A:
+    return state.ucsr0a | ((state.rxCount > 0) ? (1 << RXC0) : 0) | (state.txFull ? 0 : (1 << UDRE0));
+  case REG_UCSR0B:
+    return state.ucsr0b;
+  case REG_UCSR0C:
+    return state.ucsr0c;
+  case REG_UBRR0H:
+    return state.ubrr0h;
+  case REG_UBRR0L:
+    return state.ubrr0l;
+  case REG_EECR:
+    return state.eecr | (state.eepromBusy ? (1 << EEPE) : 0) |
+           ((state.masterEnabled && state.now <= state.masterEnableUntil) ? (1 << EEMPE) : 0);
+  case REG_EEDR:
+    return state.eedr;
+  case REG_EEAR:
+    return state.eear;
+  case REG_ADMUX:
+    return state.admux;
+  case REG_ADCSRA:
+    return state.adcsra;
+  case REG_ADCSRB:
+    return state.adcsrb;
+  case REG_ADC:
+    return state.adc;
+  case REG_SPCR:
+    return state.spcr;
+  case REG_SPSR:
+    return state.spsr;
+  case REG_SPDR:
+    return state.spdr;
+  case REG_TCCR1A:
+    return state.tccr1a;
+  case REG_TCCR1B:
+    return state.tccr1b;
+  case REG_TCNT1:
+    return timer1Count();
+  default:
+    return 0;
+  }
+}
+}
+
+/* ---- REGISTERS ---- */
+
+uint16_t NativeAvr::readRegister(RegisterId id)
+{
+  if (state.poweredOff)
+  {
+    return 0;
+  }
+  advance(1);
+  uint16_t value = registerValue(id);
+  if (isStatusRegister(id))
+  {
+    // Reading the same value twice with nothing happening in between means the
+    // sketch is polling, so skip to the next thing that can change it
+    if (state.readSeen[id] && state.readEpoch[id] == state.epoch && state.readValue[id] == value)
+    {
+      waitForEvent();
+      value = registerValue(id);
+    }
+    state.readSeen[id] = true;
+    state.readEpoch[id] = state.epoch;
+    state.readValue[id] = value;
+  }
+  if (id == REG_UDR0)
+  {
+    value = readUdr();
+    state.epoch++;
+  }
+  return value;
+}
+
+void NativeAvr::writeRegister(RegisterId id, uint16_t value)
+{
+  if (state.poweredOff)
+  {
+    return;
+  }
+  advance(1);
+  state.epoch++;
+  switch (id)
+  {
+  case REG_SREG:
+    state.sreg = value & 0x7F;
+    state.interruptFlag = value & 0x80;
+    break;
+  case REG_UDR0:
+    transmit(value);
+    break;
+  case REG_UCSR0A:
+  {
+    const byte writable = (1 << U2X0) | (1 << MPCM0);
+    state.ucsr0a = (state.ucsr0a & ~writable) | (value & writable);
+    if (value & (1 << TXC0))
+    {
+      state.ucsr0a &= ~(1 << TXC0); // Cleared by writing a one
+    }
+    break;
+  }
+  case REG_UCSR0B:
+    state.ucsr0b = value;
+    if (!(value & (1 << RXEN0)))
+    {
+      state.rxCount = 0;
+    }
+    break;
+  case REG_UCSR0C:
+    state.ucsr0c = value;
+    break;
+  case REG_UBRR0H:
+    state.ubrr0h = value;
+    break;
+  case REG_UBRR0L:
+    state.ubrr0l = value;
+    break;
+  case REG_EECR:
+    writeEecr(value);
+    break;
+  case REG_EEDR:
+    state.eedr = value;
+    break;
+  case REG_EEAR:
+    if (state.eepromBusy)
+    {
+      state.eepromViolations++; // The AVR ignores the change
+    }
+    else
+    {
+      state.eear = value & E2END;
+    }
+    break;
+  case REG_ADMUX:
+    state.admux = value;
+    break;
+  case REG_ADCSRA:
+    writeAdcsra(value);
+    break;
+  case REG_ADCSRB:
+    state.adcsrb = value;
+    state.adcGeneration++;
+    scheduleConversion();
+    break;
+  case REG_SPCR:
+    state.spcr = value;
+    break;
+  case REG_SPSR:
+    state.spsr = (state.spsr & ~(1 << SPI2X)) | (value & (1 << SPI2X));
+    break;
+  case REG_SPDR:
+    writeSpdr(value);
+    break;
+  case REG_TCCR1A:
+    state.tccr1a = value;
+    break;
+  case REG_TCCR1B:
+    setTimer1Count(timer1Count());
+    state.tccr1b = value;
+    break;
+  case REG_TCNT1:
+    setTimer1Count(value);
+    break;
+  default:
+    break; // Read only
+  }
+  runInterrupts();
+}
+
+void NativeAvr::setInterruptFlag(bool enabled)
+{
+  if (state.poweredOff)
+  {
+    return;
+  }
+  advance(1);
+  state.epoch++;
+  state.interruptFlag = enabled;
+  runInterrupts();
+}
+
+/* ---- TIME ---- */
+
+NativeAvr::Cycles NativeAvr::now()
+{
+  return state.now;
+}
+
+void NativeAvr::advance(Cycles cycles)
+{
+  advanceTo(state.now + cycles);
+}
+
+/**
+ * Runs the peripherals and any interrupts they raise up to the given cycle
+ */
+void NativeAvr::advanceTo(Cycles at)
+{
+  if (state.poweredOff)
+  {
+    return;
+  }
+  for (;;)
+  {
+    runInterrupts();
+    EventQueue &queue = events();
+    if (queue.empty() || queue.top().at > at)
+    {
+      break;
+    }
+    Event event = queue.top();
+    queue.pop();
+    if (event.at > state.now)
+    {
+      state.now = event.at;
+    }
+    state.epoch++;
+    handle(event);
+  }
+  if (state.now < at)
+  {
+    state.now = at;
+  }
+  if (state.now > timeLimit)
+  {
+    fail("the time limit was reached");
+  }
+}
+
+/**
+ * Calls callback(context) at the given cycle, from whatever the sketch is doing then
+ */
+void NativeAvr::schedule(Cycles at, Callback callback, void *context)
+{
+  Event event = {at, state.order++, EVENT_CALLBACK, 0, 0, callback, context};
+  events().push(event);
+}
+
+/* ---- SKETCH ---- */
+
+/**
+ * Starts the sketch as the Arduino core does: init() and then setup()
+ */
+void NativeAvr::boot()
+{
+  init();
+  setup();
+}
+
+/**
+ * Runs one pass of loop()
+ */
+void NativeAvr::runLoop()
+{
+  Cycles start = state.now;
+  advance(loopPassCycles);
+  loop();
+  Cycles took = state.now - start;
+  if (took > state.longestLoop)
+  {
+    state.longestLoop = took;
+  }
+  state.loops++;
+}
+
+void NativeAvr::runUntil(Cycles at)
+{
+  while (state.now < at)
+  {
+    runLoop();
+  }
+}
+
+void NativeAvr::runFor(Cycles cycles)
+{
+  runUntil(state.now + cycles);
+}
+
+unsigned long NativeAvr::loopCount()
+{
+  return state.loops;
+}
+
+NativeAvr::Cycles NativeAvr::longestLoop()
+{
+  return state.longestLoop;
+}
+
+void NativeAvr::resetLongestLoop()
+{
+  state.longestLoop = 0;
+}
+
+/* ---- USART0 ---- */
+
+/**
+ * Cycles to send or receive a byte at the baud rate set by the sketch, with 8N1 framing
+ */
+NativeAvr::Cycles NativeAvr::uartByteCycles()
+{
+  Cycles ubrr = ((state.ubrr0h & 0x0F) << 8) | state.ubrr0l;
+  Cycles bitCycles = ((state.ucsr0a & (1 << U2X0)) ? 8 : 16) * (ubrr + 1);
+  return 10 * bitCycles;
+}
+
+/**
+ * Sends bytes to RXD back to back at line rate, following anything already queued.
+ * Returns the cycle the last one arrives.
+ */
+NativeAvr::Cycles NativeAvr::receive(const uint8_t *data, size_t length)
+{
+  return receiveAt(state.now, data, length);
+}
+
+/**
+ * As receive(), starting no earlier than the given cycle
+ */
+NativeAvr::Cycles NativeAvr::receiveAt(Cycles at, const uint8_t *data, size_t length)
+{
+  if (state.rxIdleAt > at)
+  {
+    at = state.rxIdleAt;
+  }
+  Cycles byteCycles = uartByteCycles();
+  for (size_t i = 0; i < length; i++)
+  {
+    at += byteCycles;
+    scheduleEvent(at, EVENT_RECEIVE, data[i]);
+  }
+  state.rxIdleAt = at;
+  return at;
+}
+
+NativeAvr::Cycles NativeAvr::receiveIdleAt()
+{
+  return state.rxIdleAt;
+}
+
+/**
+ * Bytes lost because the USART's own two byte buffer was full
+ */
+unsigned long NativeAvr::receiveOverruns()
+{
+  return state.rxOverruns;
+}
+
+const std::vector<SentByte> &NativeAvr::sent()
+{
+  return sentLog();
+}
+
+std::vector<uint8_t> NativeAvr::sentBytes()
+{
+  std::vector<uint8_t> bytes;
+  for (size_t i = 0; i < sentLog().size(); i++)
+  {
+    bytes.push_back(sentLog()[i].value);
+  }
+  return bytes;
+}
+
+void NativeAvr::clearSent()
+{
+  sentLog().clear();
+}
+
+/* ---- EEPROM ---- */
+
+uint8_t *NativeAvr::eeprom()
+{
+  return cells();
+}
+
+unsigned long NativeAvr::eepromWrites()
+{
+  return state.eepromWrites;
+}
+
+/**
+ * Accesses the AVR ignores because a write is in progress
+ */
+unsigned long NativeAvr::eepromViolations()
+{
+  return state.eepromViolations;
+}
+
+/**
+ * Cuts the power as the given EEPROM write (counting from 0) is about to start,
+ * so that byte keeps its old value. PowerCut is thrown from the sketch.
+ */
+void NativeAvr::cutPowerBeforeWrite(unsigned long write)
+{
+  state.cutArmed = true;
+  state.cutBefore = write;
+}
+
+/* ---- ADC ---- */
+
+/**
+ * Sets the 10 bit reading of an analog channel, 1023 until set
+ */
+void NativeAvr::setAnalog(uint8_t channel, uint16_t value)
+{
+  analogValues()[channel & 0x07] = value;
+  state.epoch++;
+}
+
+/* ---- PINS ---- */
+
+/**
+ * Drives an input pin from outside, which raises the pin change interrupt if it is enabled
+ */
+void NativeAvr::setPin(uint8_t pin, bool high)
+{
+  Port port;
+  byte mask;
+  if (!portOf(pin, port, mask))
+  {
+    return;
+  }
+  state.driven[port.index] |= mask;
+  if (high)
+  {
+    state.drivenHigh[port.index] |= mask;
+  }
+  else
+  {
+    state.drivenHigh[port.index] &= ~mask;
+  }
+  updatePin(port, mask);
+  runInterrupts();
+}
+
+bool NativeAvr::pinLevel(uint8_t pin)
+{
+  Port port;
+  byte mask;
+  return portOf(pin, port, mask) && (*port.pin & mask);
+}
+
+/* ---- SPI ---- */
+
+const std::vector<uint8_t> &NativeAvr::spiSent()
+{
+  return spiLog();
+}
+
+void NativeAvr::clearSpiSent()
+{
+  spiLog().clear();
+}
+
+/**
+ * Writes to SPDR while a transfer was in progress, which the AVR ignores
+ */
+unsigned long NativeAvr::spiCollisions()
+{
+  return state.spiCollisions;
+}
+
+/*
+   --------------------------------------------------------------------------------------
+   ARDUINO CORE
+   --------------------------------------------------------------------------------------
+*/
+void init()
+{
+  // The core enables the ADC for analogRead() and turns interrupts on before setup()
+  state.adcsra = (1 << ADEN) | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0);
+  NativeAvr::setInterruptFlag(true);
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+  Port port;
+  byte mask;
+  advance(DIGITAL_IO_CYCLES);
+  if (!portOf(pin, port, mask))
+  {
+    return;
+  }
+  if (mode == OUTPUT)
+  {
+    *port.ddr |= mask;
+  }
+  else
+  {
+    *port.ddr &= ~mask;
+    if (mode == INPUT_PULLUP)
+    {
+      *port.port |= mask;
+    }
+    else
+    {
+      *port.port &= ~mask;
+    }
+  }
+  updatePin(port, mask);
+  runInterrupts();
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+  Port port;
+  byte mask;
+  advance(DIGITAL_IO_CYCLES);
+  if (!portOf(pin, port, mask))
+  {
+    return;
+  }
+  if (val == LOW)
+  {
+    *port.port &= ~mask;
+  }
+  else
+  {
+    *port.port |= mask;
+  }
+  updatePin(port, mask);
+  runInterrupts();
+}
+
+int digitalRead(uint8_t pin)
+{
+  Port port;
+  byte mask;
+  advance(DIGITAL_IO_CYCLES);
+  if (!portOf(pin, port, mask))
+  {
+    return LOW;
+  }
+  return (*port.pin & mask) ? HIGH : LOW;
+}
+
+int analogRead(uint8_t pin)
+{
+  advance(ANALOG_READ_CYCLES);
+  return analogValues()[((pin >= 14) ? pin - 14 : pin) & 0x07];
+}
+
+void analogReference(uint8_t mode)
+{
+  (void)mode;
+}
+
+volatile uint8_t *portOutputRegister(uint8_t port)
+{
+  return (port == PB) ? &PORTB : (port == PC) ? &PORTC : (port == PD) ? &PORTD : NULL;
+}
+
+volatile uint8_t *portInputRegister(uint8_t port)
+{
+  return (port == PB) ? &PINB : (port == PC) ? &PINC : (port == PD) ? &PIND : NULL;
+}
+
+volatile uint8_t *portModeRegister(uint8_t port)
+{
+  return (port == PB) ? &DDRB : (port == PC) ? &DDRC : (port == PD) ? &DDRD : NULL;
+}
+
+unsigned long millis()
+{
+  advance(MILLIS_CYCLES);
+  return state.now / CYCLES_PER_MS;
+}
+
+unsigned long micros()
+{
+  advance(MICROS_CYCLES);
+  return state.now / 64 * 4; // Timer0 counts in steps of 4us
+}
+
+void delay(unsigned long ms)
+{
+  advance(ms * CYCLES_PER_MS);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  advance(us * CYCLES_PER_US);
+}
+
+/**
+ * Called by code that is waiting on something an interrupt will change. Moves
+ * on to the next thing that can happen rather than spinning.
+ */
+void yield()
+{
+  if (!state.poweredOff)
+  {
+    waitForEvent();
+  }
+}
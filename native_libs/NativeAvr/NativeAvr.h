@@ -0,0 +1,114 @@
+/*
+ * ATmega328P emulation for the native tests.
+ *
+ * Time is counted in CPU cycles of a 16MHz UNO. The sketch runs at host
+ * speed, and is charged for each register access, interrupt, Arduino call
+ * and pass of loop(). Peripherals run against that clock: bytes arrive on
+ * the USART at the baud rate the sketch set, EEPROM writes take 3.4ms, the
+ * ADC converts on each Timer0 overflow and SPI bytes take 8 SPI clocks.
+ * Interrupts are dispatched in vector order whenever they are pending,
+ * enabled and the I flag in SREG is set.
+ *
+ * A sketch that waits on a status register, or calls yield() while it waits,
+ * skips straight to the next thing that can change it, so tests that run for
+ * seconds of device time take milliseconds.
+ *
+ * The figures are a model, not a cycle count of the generated code: use them
+ * to compare passes, find what waits and prove nothing is lost, and measure
+ * on the device (or under simavr) for real timings.
+ *
+ * Tests drive the emulation with the functions below, for example
+ *     NativeAvr::boot();                  // setup()
+ *     NativeAvr::receive(noteOn, 3);      // MIDI in at line rate
+ *     NativeAvr::runFor(10 * NativeAvr::CYCLES_PER_MS); // loop() for 10ms
+ *     NativeAvr::sent();                  // MIDI out, with the time of each byte
+ */
+
+#ifndef NATIVEAVR_H
+#define NATIVEAVR_H
+
+#include <Arduino.h>
+#include <vector>
+
+namespace NativeAvr
+{
+typedef unsigned long long Cycles;
+
+const Cycles CYCLES_PER_US = F_CPU / 1000000UL;
+const Cycles CYCLES_PER_MS = F_CPU / 1000UL;
+
+// Thrown when the power is cut by cutPowerBeforeWrite(). The emulated device
+// is dead afterwards: register accesses do nothing and no interrupts run.
+struct PowerCut
+{
+};
+
+// A byte sent on the USART and the cycle its stop bit finished
+struct SentByte
+{
+  Cycles at;
+  uint8_t value;
+};
+
+typedef void (*Callback)(void *context);
+
+/* ---- TIME ---- */
+
+// Cycles charged for the work of each pass of loop() that isn't register
+// access, on top of anything loop() does that is charged. 10us by default.
+extern Cycles loopPassCycles;
+// The run is aborted if device time passes this, so a sketch stuck in a loop
+// fails the test instead of hanging it. 10 minutes by default.
+extern Cycles timeLimit;
+
+Cycles now();
+void advance(Cycles cycles);
+void advanceTo(Cycles at);
+void schedule(Cycles at, Callback callback, void *context = NULL);
+
+/* ---- SKETCH ---- */
+
+void boot();
+void runLoop();
+void runUntil(Cycles at);
+void runFor(Cycles cycles);
+unsigned long loopCount();
+Cycles longestLoop();
+void resetLongestLoop();
+
+/* ---- USART0 ---- */
+
+Cycles uartByteCycles();
+Cycles receive(const uint8_t *data, size_t length);
+Cycles receiveAt(Cycles at, const uint8_t *data, size_t length);
+Cycles receiveIdleAt();
+unsigned long receiveOverruns();
+const std::vector<SentByte> &sent();
+std::vector<uint8_t> sentBytes();
+void clearSent();
+
+/* ---- EEPROM ---- */
+
+const int EEPROM_SIZE = E2END + 1;
+uint8_t *eeprom();
+unsigned long eepromWrites();
+unsigned long eepromViolations();
+void cutPowerBeforeWrite(unsigned long write);
+
+/* ---- ADC ---- */
+
+void setAnalog(uint8_t channel, uint16_t value);
+
+/* ---- PINS ---- */
+
+void setPin(uint8_t pin, bool high);
+bool pinLevel(uint8_t pin);
+
+/* ---- SPI ---- */
+
+const std::vector<uint8_t> &spiSent();
+void clearSpiSent();
+unsigned long spiCollisions();
+}
+
+#endif
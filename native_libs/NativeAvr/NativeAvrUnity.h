@@ -0,0 +1,132 @@
+/*
+ * Unity helpers for the native tests.
+ *
+ * RUN_ISOLATED_TEST() runs a test in a forked child process, so that every
+ * test starts from a freshly powered up device: the sketch's globals, the
+ * emulated peripherals and the erased EEPROM are as they were before setup().
+ * runInChild() does the same for part of a test and hands a result back, for
+ * a test that powers the device up more than once.
+ *
+ * These need fork(), so the native tests run on Linux or macOS (or WSL).
+ */
+
+#ifndef NATIVEAVRUNITY_H
+#define NATIVEAVRUNITY_H
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unity.h>
+
+namespace NativeAvr
+{
+/**
+ * Waits for a child and fails the current test if it failed. The child has
+ * already printed why, unless it crashed.
+ */
+inline bool waitForChild(pid_t pid)
+{
+  int status = 0;
+  waitpid(pid, &status, 0);
+  if (WIFSIGNALED(status))
+  {
+    char message[48];
+    snprintf(message, sizeof(message), "crashed with signal %d", WTERMSIG(status));
+    TEST_FAIL_MESSAGE(message);
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    Unity.CurrentTestFailed = 1;
+    return false;
+  }
+  return true;
+}
+
+inline void runIsolated(void (*test)(void))
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    if (TEST_PROTECT())
+    {
+      test();
+    }
+    fflush(stdout);
+    _exit(Unity.CurrentTestFailed ? 1 : 0);
+  }
+  waitForChild(pid);
+}
+
+/**
+ * Calls run(context, result) in a child process and copies size bytes of result
+ * back. Returns false, and fails the test, if the child failed.
+ */
+inline bool runInChild(void (*run)(void *context, void *result), void *context, void *result, size_t size)
+{
+  int pipeEnds[2];
+  if (pipe(pipeEnds) != 0)
+  {
+    TEST_FAIL_MESSAGE("pipe() failed");
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    close(pipeEnds[0]);
+    if (TEST_PROTECT())
+    {
+      run(context, result);
+    }
+    if (!Unity.CurrentTestFailed)
+    {
+      const char *data = (const char *)result;
+      for (size_t done = 0; done < size;)
+      {
+        ssize_t count = write(pipeEnds[1], data + done, size - done);
+        if (count <= 0)
+        {
+          break;
+        }
+        done += count;
+      }
+    }
+    fflush(stdout);
+    _exit(Unity.CurrentTestFailed ? 1 : 0);
+  }
+  close(pipeEnds[1]);
+  size_t done = 0;
+  while (done < size)
+  {
+    ssize_t count = read(pipeEnds[0], (char *)result + done, size - done);
+    if (count <= 0)
+    {
+      break;
+    }
+    done += count;
+  }
+  close(pipeEnds[0]);
+  if (!waitForChild(pid))
+  {
+    return false;
+  }
+  if (done != size)
+  {
+    TEST_FAIL_MESSAGE("the child process did not send its result");
+  }
+  return true;
+}
+}
+
+#define RUN_ISOLATED_TEST(func)                                        \
+  do                                                                   \
+  {                                                                    \
+    struct Isolated                                                    \
+    {                                                                  \
+      static void run() { NativeAvr::runIsolated(func); }              \
+    };                                                                 \
+    UnityDefaultTestRun(Isolated::run, #func, __LINE__);               \
+  } while (0)
+
+#endif
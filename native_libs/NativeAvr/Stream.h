@@ -0,0 +1,27 @@
+/*
+ * Stream from the Arduino core for the native test environment. Only the
+ * byte level calls are here, the parsing helpers are not used by the projects.
+ */
+
+#ifndef Stream_h
+#define Stream_h
+
+#include "Print.h"
+
+class Stream : public Print
+{
+protected:
+  unsigned long _timeout;
+
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+
+  Stream() : _timeout(1000) {}
+
+  void setTimeout(unsigned long timeout) { _timeout = timeout; }
+  unsigned long getTimeout(void) { return _timeout; }
+};
+
+#endif
@@ -0,0 +1,73 @@
+#include "WString.h"
+
+String::String(const char *cstr) : buffer(NULL), len(0)
+{
+  if (cstr == NULL)
+  {
+    cstr = "";
+  }
+  copy(cstr, strlen(cstr));
+}
+
+String::String(const String &value) : buffer(NULL), len(0)
+{
+  copy(value.buffer, value.len);
+}
+
+String::String(const __FlashStringHelper *pstr) : buffer(NULL), len(0)
+{
+  const char *cstr = reinterpret_cast<const char *>(pstr);
+  copy(cstr, strlen(cstr));
+}
+
+String::~String()
+{
+  free(buffer);
+}
+
+String &String::operator=(const String &rhs)
+{
+  if (this != &rhs)
+  {
+    copy(rhs.buffer, rhs.len);
+  }
+  return *this;
+}
+
+String &String::operator=(const char *cstr)
+{
+  if (cstr == NULL)
+  {
+    cstr = "";
+  }
+  copy(cstr, strlen(cstr));
+  return *this;
+}
+
+bool String::concat(const char *cstr)
+{
+  if (cstr == NULL)
+  {
+    return false;
+  }
+  unsigned int more = strlen(cstr);
+  char *grown = (char *)realloc(buffer, len + more + 1);
+  if (grown == NULL)
+  {
+    return false;
+  }
+  buffer = grown;
+  memcpy(buffer + len, cstr, more + 1);
+  len += more;
+  return true;
+}
+
+void String::copy(const char *cstr, unsigned int length)
+{
+  char *copied = (char *)malloc(length + 1);
+  memcpy(copied, cstr, length);
+  copied[length] = '\0';
+  free(buffer);
+  buffer = copied;
+  len = length;
+}
@@ -0,0 +1,60 @@
+/*
+ * String from the Arduino core for the native test environment, cut down to
+ * what the projects use, and the F() macro.
+ */
+
+#ifndef String_class_h
+#define String_class_h
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <avr/pgmspace.h>
+
+class __FlashStringHelper;
+#define FPSTR(pstr_pointer) (reinterpret_cast<const __FlashStringHelper *>(pstr_pointer))
+#define F(string_literal) (FPSTR(PSTR(string_literal)))
+
+class String
+{
+public:
+  String(const char *cstr = "");
+  String(const String &str);
+  String(const __FlashStringHelper *str);
+  ~String();
+
+  String &operator=(const String &rhs);
+  String &operator=(const char *cstr);
+
+  unsigned int length() const { return len; }
+  const char *c_str() const { return buffer; }
+  char charAt(unsigned int index) const { return index < len ? buffer[index] : 0; }
+  char operator[](unsigned int index) const { return charAt(index); }
+
+  bool equals(const String &s) const { return len == s.len && strcmp(buffer, s.buffer) == 0; }
+  bool equals(const char *cstr) const { return strcmp(buffer, cstr ? cstr : "") == 0; }
+  bool operator==(const String &rhs) const { return equals(rhs); }
+  bool operator==(const char *cstr) const { return equals(cstr); }
+  bool operator!=(const String &rhs) const { return !equals(rhs); }
+  bool operator!=(const char *cstr) const { return !equals(cstr); }
+
+  bool concat(const String &str) { return concat(str.buffer); }
+  bool concat(const char *cstr);
+  String &operator+=(const String &rhs)
+  {
+    concat(rhs);
+    return *this;
+  }
+  String &operator+=(const char *cstr)
+  {
+    concat(cstr);
+    return *this;
+  }
+
+private:
+  char *buffer;
+  unsigned int len;
+  void copy(const char *cstr, unsigned int length);
+};
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * Interrupts for the native test environment.
+ *
+ * ISR() defines the handler under its avr-libc vector name. The NativeAvr
+ * emulator calls it whenever its interrupt is pending and enabled, and the
+ * global interrupt flag in SREG is set, the same as the AVR does.
+ */
+
+#ifndef _AVR_INTERRUPT_H_
+#define _AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+namespace NativeAvr
+{
+void setInterruptFlag(bool enabled);
+}
+
+#define sei() NativeAvr::setInterruptFlag(true)
+#define cli() NativeAvr::setInterruptFlag(false)
+#define reti()
+
+#define ISR_BLOCK
+#define ISR_NOBLOCK
+#define ISR_NAKED
+#define ISR_ALIASOF(vector)
+
+#define ISR(vector, ...)          \
+  extern "C" void vector(void);   \
+  void vector(void)
+
+#define EMPTY_INTERRUPT(vector) \
+  extern "C" void vector(void); \
+  void vector(void) {}
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * ATmega328P registers for the native test environment.
+ *
+ * Registers whose reads or writes have side effects (USART0, EEPROM, ADC,
+ * SPI, Timer1 and SREG) are objects that hand each access to the NativeAvr
+ * emulator, which charges a cycle for it. Port and pin change registers are
+ * plain variables, as the sketches take their address; the emulator reads
+ * them when it needs to.
+ *
+ * Bit names and interrupt vector numbers are those of avr-libc.
+ */
+
+#ifndef _AVR_IO_H_
+#define _AVR_IO_H_
+
+#include <stdint.h>
+
+namespace NativeAvr
+{
+enum RegisterId
+{
+  REG_SREG,
+  REG_UDR0,
+  REG_UCSR0A,
+  REG_UCSR0B,
+  REG_UCSR0C,
+  REG_UBRR0H,
+  REG_UBRR0L,
+  REG_EECR,
+  REG_EEDR,
+  REG_EEAR,
+  REG_ADMUX,
+  REG_ADCSRA,
+  REG_ADCSRB,
+  REG_ADC,
+  REG_SPCR,
+  REG_SPSR,
+  REG_SPDR,
+  REG_TCCR1A,
+  REG_TCCR1B,
+  REG_TCNT1,
+  REGISTER_COUNT
+};
+
+uint16_t readRegister(RegisterId id);
+void writeRegister(RegisterId id, uint16_t value);
+
+/**
+ * An I/O register of type T. Every read and write goes to the emulator.
+ */
+template <RegisterId ID, typename T>
+class Register
+{
+public:
+  constexpr Register() {}
+  operator T() const { return (T)readRegister(ID); }
+  const Register &operator=(T value) const
+  {
+    writeRegister(ID, value);
+    return *this;
+  }
+  const Register &operator|=(int value) const { return *this = (T)(*this | value); }
+  const Register &operator&=(int value) const { return *this = (T)(*this & value); }
+  const Register &operator^=(int value) const { return *this = (T)(*this ^ value); }
+};
+}
+
+#define NATIVE_AVR_REGISTER(name, type) static constexpr NativeAvr::Register<NativeAvr::REG_##name, type> name;
+
+NATIVE_AVR_REGISTER(SREG, uint8_t)
+NATIVE_AVR_REGISTER(UDR0, uint8_t)
+NATIVE_AVR_REGISTER(UCSR0A, uint8_t)
+NATIVE_AVR_REGISTER(UCSR0B, uint8_t)
+NATIVE_AVR_REGISTER(UCSR0C, uint8_t)
+NATIVE_AVR_REGISTER(UBRR0H, uint8_t)
+NATIVE_AVR_REGISTER(UBRR0L, uint8_t)
+NATIVE_AVR_REGISTER(EECR, uint8_t)
+NATIVE_AVR_REGISTER(EEDR, uint8_t)
+NATIVE_AVR_REGISTER(EEAR, uint16_t)
+NATIVE_AVR_REGISTER(ADMUX, uint8_t)
+NATIVE_AVR_REGISTER(ADCSRA, uint8_t)
+NATIVE_AVR_REGISTER(ADCSRB, uint8_t)
+NATIVE_AVR_REGISTER(ADC, uint16_t)
+NATIVE_AVR_REGISTER(SPCR, uint8_t)
+NATIVE_AVR_REGISTER(SPSR, uint8_t)
+NATIVE_AVR_REGISTER(SPDR, uint8_t)
+NATIVE_AVR_REGISTER(TCCR1A, uint8_t)
+NATIVE_AVR_REGISTER(TCCR1B, uint8_t)
+NATIVE_AVR_REGISTER(TCNT1, uint16_t)
+
+#undef NATIVE_AVR_REGISTER
+
+extern volatile uint8_t PINB, DDRB, PORTB;
+extern volatile uint8_t PINC, DDRC, PORTC;
+extern volatile uint8_t PIND, DDRD, PORTD;
+extern volatile uint8_t PCICR, PCIFR, PCMSK0, PCMSK1, PCMSK2;
+
+#define RAMSTART 0x100
+#define RAMEND 0x8FF
+#define E2END 0x3FF
+#define E2PAGESIZE 4
+
+/* SREG */
+#define SREG_I 7
+
+/* UCSR0A */
+#define MPCM0 0
+#define U2X0 1
+#define UPE0 2
+#define DOR0 3
+#define FE0 4
+#define UDRE0 5
+#define TXC0 6
+#define RXC0 7
+
+/* UCSR0B */
+#define TXB80 0
+#define RXB80 1
+#define UCSZ02 2
+#define TXEN0 3
+#define RXEN0 4
+#define UDRIE0 5
+#define TXCIE0 6
+#define RXCIE0 7
+
+/* UCSR0C */
+#define UCPOL0 0
+#define UCSZ00 1
+#define UCSZ01 2
+#define USBS0 3
+#define UPM00 4
+#define UPM01 5
+#define UMSEL00 6
+#define UMSEL01 7
+
+/* EECR */
+#define EERE 0
+#define EEPE 1
+#define EEMPE 2
+#define EERIE 3
+#define EEPM0 4
+#define EEPM1 5
+
+/* ADMUX */
+#define MUX0 0
+#define MUX1 1
+#define MUX2 2
+#define MUX3 3
+#define ADLAR 5
+#define REFS0 6
+#define REFS1 7
+
+/* ADCSRA */
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADIE 3
+#define ADIF 4
+#define ADATE 5
+#define ADSC 6
+#define ADEN 7
+
+/* ADCSRB */
+#define ADTS0 0
+#define ADTS1 1
+#define ADTS2 2
+#define ACME 6
+
+/* SPCR */
+#define SPR0 0
+#define SPR1 1
+#define CPHA 2
+#define CPOL 3
+#define MSTR 4
+#define DORD 5
+#define SPE 6
+#define SPIE 7
+
+/* SPSR */
+#define SPI2X 0
+#define WCOL 6
+#define SPIF 7
+
+/* TCCR1A */
+#define WGM10 0
+#define WGM11 1
+#define COM1B0 4
+#define COM1B1 5
+#define COM1A0 6
+#define COM1A1 7
+
+/* TCCR1B */
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define WGM13 4
+#define ICES1 6
+#define ICNC1 7
+
+/* PCICR, PCIFR */
+#define PCIE0 0
+#define PCIE1 1
+#define PCIE2 2
+#define PCIF0 0
+#define PCIF1 1
+#define PCIF2 2
+
+/* Port bits */
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PC6 6
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+
+/* Interrupt vectors */
+#define _VECTOR(N) __vector_##N
+#define INT0_vect _VECTOR(1)
+#define INT1_vect _VECTOR(2)
+#define PCINT0_vect _VECTOR(3)
+#define PCINT1_vect _VECTOR(4)
+#define PCINT2_vect _VECTOR(5)
+#define WDT_vect _VECTOR(6)
+#define TIMER2_COMPA_vect _VECTOR(7)
+#define TIMER2_COMPB_vect _VECTOR(8)
+#define TIMER2_OVF_vect _VECTOR(9)
+#define TIMER1_CAPT_vect _VECTOR(10)
+#define TIMER1_COMPA_vect _VECTOR(11)
+#define TIMER1_COMPB_vect _VECTOR(12)
+#define TIMER1_OVF_vect _VECTOR(13)
+#define TIMER0_COMPA_vect _VECTOR(14)
+#define TIMER0_COMPB_vect _VECTOR(15)
+#define TIMER0_OVF_vect _VECTOR(16)
+#define SPI_STC_vect _VECTOR(17)
+#define USART_RX_vect _VECTOR(18)
+#define USART_UDRE_vect _VECTOR(19)
+#define USART_TX_vect _VECTOR(20)
+#define ADC_vect _VECTOR(21)
+#define EE_READY_vect _VECTOR(22)
+#define ANALOG_COMP_vect _VECTOR(23)
+#define TWI_vect _VECTOR(24)
+#define SPM_READY_vect _VECTOR(25)
+#define _VECTORS_SIZE 104
+
+#define _BV(bit) (1 << (bit))
+#define bit_is_set(sfr, bit) ((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!((sfr) & _BV(bit)))
+
+#endif
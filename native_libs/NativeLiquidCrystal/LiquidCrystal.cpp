@@ -0,0 +1,260 @@
+#include "LiquidCrystal.h"
+
+#include <Arduino.h>
+#include <NativeAvr.h>
+
+// As the Arduino library in 4 bit mode: each nibble is followed by a 100us wait
+static const unsigned long TRANSFER_MICROS = 265;
+static const unsigned long CLEAR_MICROS = 2000;
+
+LiquidCrystal::LiquidCrystal(uint8_t rs, uint8_t enable, uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3)
+    : _displayfunction(LCD_4BITMODE | LCD_1LINE | LCD_5x8DOTS), _displaycontrol(0), _displaymode(0),
+      _numlines(1), _address(0), _shift(0), _transfers(0)
+{
+  (void)rs;
+  (void)enable;
+  (void)d0;
+  (void)d1;
+  (void)d2;
+  (void)d3;
+  memset(_ddram, ' ', sizeof(_ddram));
+  setRowOffsets(0x00, 0x40, 0x00, 0x40);
+}
+
+void LiquidCrystal::begin(uint8_t cols, uint8_t lines, uint8_t dotsize)
+{
+  if (lines > 1)
+  {
+    _displayfunction |= LCD_2LINE;
+  }
+  _numlines = lines;
+
+  setRowOffsets(0x00, 0x40, 0x00 + cols, 0x40 + cols);
+  (void)dotsize;
+
+  // The power on wait and the function set sequence of the library
+  delay(50);
+  delayMicroseconds(4500 + 4500 + 150);
+
+  command(LCD_FUNCTIONSET | _displayfunction);
+
+  _displaycontrol = LCD_DISPLAYON | LCD_CURSOROFF | LCD_BLINKOFF;
+  display();
+
+  clear();
+
+  _displaymode = LCD_ENTRYLEFT | LCD_ENTRYSHIFTDECREMENT;
+  command(LCD_ENTRYMODESET | _displaymode);
+  _transfers = 0;
+}
+
+void LiquidCrystal::setRowOffsets(int row0, int row1, int row2, int row3)
+{
+  _row_offsets[0] = row0;
+  _row_offsets[1] = row1;
+  _row_offsets[2] = row2;
+  _row_offsets[3] = row3;
+}
+
+void LiquidCrystal::clear()
+{
+  command(LCD_CLEARDISPLAY);
+  delayMicroseconds(CLEAR_MICROS);
+}
+
+void LiquidCrystal::home()
+{
+  command(LCD_RETURNHOME);
+  delayMicroseconds(CLEAR_MICROS);
+}
+
+void LiquidCrystal::setCursor(uint8_t col, uint8_t row)
+{
+  const size_t max_lines = sizeof(_row_offsets) / sizeof(*_row_offsets);
+  if (row >= max_lines)
+  {
+    row = max_lines - 1; // we count rows starting w/0
+  }
+  if (row >= _numlines)
+  {
+    row = _numlines - 1; // we count rows starting w/0
+  }
+
+  command(LCD_SETDDRAMADDR | (col + _row_offsets[row]));
+}
+
+void LiquidCrystal::noDisplay()
+{
+  _displaycontrol &= ~LCD_DISPLAYON;
+  command(LCD_DISPLAYCONTROL | _displaycontrol);
+}
+
+void LiquidCrystal::display()
+{
+  _displaycontrol |= LCD_DISPLAYON;
+  command(LCD_DISPLAYCONTROL | _displaycontrol);
+}
+
+void LiquidCrystal::noCursor()
+{
+  _displaycontrol &= ~LCD_CURSORON;
+  command(LCD_DISPLAYCONTROL | _displaycontrol);
+}
+
+void LiquidCrystal::cursor()
+{
+  _displaycontrol |= LCD_CURSORON;
+  command(LCD_DISPLAYCONTROL | _displaycontrol);
+}
+
+void LiquidCrystal::noBlink()
+{
+  _displaycontrol &= ~LCD_BLINKON;
+  command(LCD_DISPLAYCONTROL | _displaycontrol);
+}
+
+void LiquidCrystal::blink()
+{
+  _displaycontrol |= LCD_BLINKON;
+  command(LCD_DISPLAYCONTROL | _displaycontrol);
+}
+
+void LiquidCrystal::scrollDisplayLeft(void)
+{
+  command(LCD_CURSORSHIFT | LCD_DISPLAYMOVE | LCD_MOVELEFT);
+}
+
+void LiquidCrystal::scrollDisplayRight(void)
+{
+  command(LCD_CURSORSHIFT | LCD_DISPLAYMOVE | LCD_MOVERIGHT);
+}
+
+void LiquidCrystal::leftToRight(void)
+{
+  _displaymode |= LCD_ENTRYLEFT;
+  command(LCD_ENTRYMODESET | _displaymode);
+}
+
+void LiquidCrystal::rightToLeft(void)
+{
+  _displaymode &= ~LCD_ENTRYLEFT;
+  command(LCD_ENTRYMODESET | _displaymode);
+}
+
+void LiquidCrystal::autoscroll(void)
+{
+  _displaymode |= LCD_ENTRYSHIFTINCREMENT;
+  command(LCD_ENTRYMODESET | _displaymode);
+}
+
+void LiquidCrystal::noAutoscroll(void)
+{
+  _displaymode &= ~LCD_ENTRYSHIFTINCREMENT;
+  command(LCD_ENTRYMODESET | _displaymode);
+}
+
+void LiquidCrystal::createChar(uint8_t location, uint8_t charmap[])
+{
+  location &= 0x7; // we only have 8 locations 0-7
+  command(LCD_SETCGRAMADDR | (location << 3));
+  for (int i = 0; i < 8; i++)
+  {
+    write(charmap[i]);
+  }
+}
+
+void LiquidCrystal::command(uint8_t value)
+{
+  send(value, LOW);
+}
+
+size_t LiquidCrystal::write(uint8_t value)
+{
+  send(value, HIGH);
+  return 1; // assume sucess
+}
+
+/**
+ * The controller's side of a transfer. Only 2 line mode is emulated. Commands
+ * are told apart by their highest set bit.
+ */
+void LiquidCrystal::send(uint8_t value, uint8_t mode)
+{
+  NativeAvr::advance(TRANSFER_MICROS * NativeAvr::CYCLES_PER_US);
+  _transfers++;
+
+  byte line = (_address >= 0x40) ? 1 : 0;
+  byte column = _address - line * 0x40;
+  bool increment = _displaymode & LCD_ENTRYLEFT;
+
+  if (mode == HIGH)
+  {
+    if (column < LINE_LENGTH)
+    {
+      _ddram[line][column] = value;
+    }
+  }
+  else if (value & LCD_SETDDRAMADDR)
+  {
+    _address = value & 0x7F;
+    return;
+  }
+  else if (value & LCD_SETCGRAMADDR)
+  {
+    return; // Custom characters aren't shown
+  }
+  else if (value & LCD_FUNCTIONSET)
+  {
+    return;
+  }
+  else if (value & LCD_CURSORSHIFT)
+  {
+    if (value & LCD_DISPLAYMOVE)
+    {
+      _shift = (value & LCD_MOVERIGHT) ? (_shift + LINE_LENGTH - 1) % LINE_LENGTH : (_shift + 1) % LINE_LENGTH;
+      return;
+    }
+    increment = value & LCD_MOVERIGHT;
+  }
+  else if (value & (LCD_DISPLAYCONTROL | LCD_ENTRYMODESET))
+  {
+    return;
+  }
+  else if (value & LCD_RETURNHOME)
+  {
+    _address = 0;
+    _shift = 0;
+    return;
+  }
+  else if (value & LCD_CLEARDISPLAY)
+  {
+    memset(_ddram, ' ', sizeof(_ddram));
+    _address = 0;
+    _shift = 0;
+    _displaymode |= LCD_ENTRYLEFT;
+    return;
+  }
+
+  // Move the address counter on, wrapping from the end of one line to the other
+  if (increment)
+  {
+    column = (column + 1) % LINE_LENGTH;
+    line = (column == 0) ? !line : line;
+  }
+  else
+  {
+    line = (column == 0) ? !line : line;
+    column = (column + LINE_LENGTH - 1) % LINE_LENGTH;
+  }
+  _address = line * 0x40 + column;
+}
+
+const char *LiquidCrystal::line(uint8_t row)
+{
+  for (byte c = 0; c < 16; c++)
+  {
+    _line[c] = _ddram[row & 1][(c + _shift) % LINE_LENGTH];
+  }
+  _line[16] = '\0';
+  return _line;
+}
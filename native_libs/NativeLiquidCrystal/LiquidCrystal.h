@@ -0,0 +1,114 @@
+/*
+ * LiquidCrystal for the native tests.
+ *
+ * The same calls as the Arduino library, driving an emulated HD44780 instead
+ * of the pins: a 2 line display memory of 40 characters a line, the address
+ * counter and the display shift. Each call takes the time the library takes
+ * in 4 bit mode, about 265us for a character or command and 2ms more to
+ * clear, so a sketch that writes too much to the display is slow here too.
+ * Interrupts keep running meanwhile.
+ *
+ * line() returns the 16 characters showing on a line, for the tests.
+ */
+
+#ifndef LiquidCrystal_h
+#define LiquidCrystal_h
+
+#include <inttypes.h>
+#include "Print.h"
+
+// commands
+#define LCD_CLEARDISPLAY 0x01
+#define LCD_RETURNHOME 0x02
+#define LCD_ENTRYMODESET 0x04
+#define LCD_DISPLAYCONTROL 0x08
+#define LCD_CURSORSHIFT 0x10
+#define LCD_FUNCTIONSET 0x20
+#define LCD_SETCGRAMADDR 0x40
+#define LCD_SETDDRAMADDR 0x80
+
+// flags for display entry mode
+#define LCD_ENTRYRIGHT 0x00
+#define LCD_ENTRYLEFT 0x02
+#define LCD_ENTRYSHIFTINCREMENT 0x01
+#define LCD_ENTRYSHIFTDECREMENT 0x00
+
+// flags for display on/off control
+#define LCD_DISPLAYON 0x04
+#define LCD_DISPLAYOFF 0x00
+#define LCD_CURSORON 0x02
+#define LCD_CURSOROFF 0x00
+#define LCD_BLINKON 0x01
+#define LCD_BLINKOFF 0x00
+
+// flags for display/cursor shift
+#define LCD_DISPLAYMOVE 0x08
+#define LCD_CURSORMOVE 0x00
+#define LCD_MOVERIGHT 0x04
+#define LCD_MOVELEFT 0x00
+
+// flags for function set
+#define LCD_8BITMODE 0x10
+#define LCD_4BITMODE 0x00
+#define LCD_2LINE 0x08
+#define LCD_1LINE 0x00
+#define LCD_5x10DOTS 0x04
+#define LCD_5x8DOTS 0x00
+
+class LiquidCrystal : public Print
+{
+public:
+  LiquidCrystal(uint8_t rs, uint8_t enable, uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3);
+
+  void begin(uint8_t cols, uint8_t rows, uint8_t charsize = LCD_5x8DOTS);
+
+  void clear();
+  void home();
+
+  void noDisplay();
+  void display();
+  void noBlink();
+  void blink();
+  void noCursor();
+  void cursor();
+  void scrollDisplayLeft();
+  void scrollDisplayRight();
+  void leftToRight();
+  void rightToLeft();
+  void autoscroll();
+  void noAutoscroll();
+
+  void setRowOffsets(int row1, int row2, int row3, int row4);
+  void createChar(uint8_t, uint8_t[]);
+  void setCursor(uint8_t, uint8_t);
+  virtual size_t write(uint8_t);
+  void command(uint8_t);
+
+  using Print::write;
+
+  // The characters showing on a line of a 16 column display
+  const char *line(uint8_t row);
+  // Characters and commands sent since begin()
+  unsigned long transfers() const { return _transfers; }
+
+private:
+  static const uint8_t LINE_LENGTH = 40;
+
+  void send(uint8_t, uint8_t);
+
+  uint8_t _displayfunction;
+  uint8_t _displaycontrol;
+  uint8_t _displaymode;
+
+  uint8_t _numlines;
+  uint8_t _row_offsets[4];
+
+  // The emulated controller
+  char _ddram[2][LINE_LENGTH];
+  uint8_t _address; // The address counter, a display memory address
+  uint8_t _shift;   // Characters the display has been shifted left
+  char _line[17];
+  unsigned long _transfers;
+};
+
+#endif
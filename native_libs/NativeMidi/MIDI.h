@@ -0,0 +1,111 @@
+/*
+ * The parts of the Arduino MIDI Library 4.3.1 that the sketches use, for the
+ * native tests: begin(), read() with thru, the getters and send(). The parser
+ * and the senders follow the library's code, so that the host sees the same
+ * messages, and the same quirks, as the device.
+ *
+ * Callbacks, RPN/NRPN and the helper senders (sendNoteOn() etc.) are left out.
+ */
+
+#pragma once
+
+#include "midi_Defs.h"
+#include "midi_Settings.h"
+#include "midi_Message.h"
+
+BEGIN_MIDI_NAMESPACE
+
+template <class SerialPort, class _Settings = DefaultSettings>
+class MidiInterface
+{
+public:
+  typedef _Settings Settings;
+
+public:
+  inline MidiInterface(SerialPort &inSerial);
+  inline ~MidiInterface();
+
+public:
+  void begin(Channel inChannel = 1);
+
+  // MIDI Output
+public:
+  inline void send(MidiType inType, DataByte inData1, DataByte inData2, Channel inChannel);
+  inline void sendSysEx(unsigned inLength, const byte *inArray, bool inArrayContainsBoundaries = false);
+  inline void sendTimeCodeQuarterFrame(DataByte inData);
+  inline void sendSongPosition(unsigned inBeats);
+  inline void sendSongSelect(DataByte inSongNumber);
+  inline void sendTuneRequest();
+  inline void sendRealTime(MidiType inType);
+
+  // MIDI Input
+public:
+  inline bool read();
+  inline bool read(Channel inChannel);
+
+public:
+  inline MidiType getType() const;
+  inline Channel getChannel() const;
+  inline DataByte getData1() const;
+  inline DataByte getData2() const;
+  inline const byte *getSysExArray() const;
+  inline unsigned getSysExArrayLength() const;
+  inline bool check() const;
+
+public:
+  inline Channel getInputChannel() const;
+  inline void setInputChannel(Channel inChannel);
+
+public:
+  static inline MidiType getTypeFromStatusByte(byte inStatus);
+  static inline Channel getChannelFromStatusByte(byte inStatus);
+  static inline bool isChannelMessage(MidiType inType);
+
+  // MIDI Soft Thru
+public:
+  inline Thru::Mode getFilterMode() const;
+  inline bool getThruState() const;
+
+  inline void turnThruOn(Thru::Mode inThruFilterMode = Thru::Full);
+  inline void turnThruOff();
+  inline void setThruFilterMode(Thru::Mode inThruFilterMode);
+
+private:
+  void thruFilter(byte inChannel);
+
+private:
+  bool parse();
+  inline void handleNullVelocityNoteOnAsNoteOff();
+  inline bool inputFilter(Channel inChannel);
+  inline void resetInput();
+
+private:
+  typedef Message<Settings::SysExMaxSize> MidiMessage;
+
+private:
+  SerialPort &mSerial;
+
+private:
+  Channel mInputChannel;
+  StatusByte mRunningStatus_RX;
+  StatusByte mRunningStatus_TX;
+  byte mPendingMessage[3];
+  unsigned mPendingMessageExpectedLenght;
+  unsigned mPendingMessageIndex;
+  MidiMessage mMessage;
+  Thru::Mode mThruFilterMode;
+  bool mThruActivated;
+
+private:
+  inline StatusByte getStatus(MidiType inType, Channel inChannel) const;
+};
+
+END_MIDI_NAMESPACE
+
+#include "MIDI.hpp"
+
+#define MIDI_CREATE_INSTANCE(Type, SerialPort, Name) \
+  midi::MidiInterface<Type> Name((Type &)SerialPort);
+
+#define MIDI_CREATE_CUSTOM_INSTANCE(Type, SerialPort, Name, Settings) \
+  midi::MidiInterface<Type, Settings> Name((Type &)SerialPort);
@@ -0,0 +1,740 @@
+/*
+ * Implementation of the native MIDI Library, following 4.3.1
+ */
+
+#pragma once
+
+BEGIN_MIDI_NAMESPACE
+
+template <class SerialPort, class Settings>
+inline MidiInterface<SerialPort, Settings>::MidiInterface(SerialPort &inSerial)
+    : mSerial(inSerial), mInputChannel(0), mRunningStatus_RX(InvalidType), mRunningStatus_TX(InvalidType),
+      mPendingMessageExpectedLenght(0), mPendingMessageIndex(0), mThruFilterMode(Thru::Full), mThruActivated(false)
+{
+}
+
+template <class SerialPort, class Settings>
+inline MidiInterface<SerialPort, Settings>::~MidiInterface()
+{
+}
+
+/*! Opens the serial port at 31250 baud, listens on inChannel and turns thru on */
+template <class SerialPort, class Settings>
+void MidiInterface<SerialPort, Settings>::begin(Channel inChannel)
+{
+  mSerial.begin(Settings::BaudRate);
+
+  mInputChannel = inChannel;
+  mRunningStatus_TX = InvalidType;
+  mRunningStatus_RX = InvalidType;
+
+  mPendingMessageIndex = 0;
+  mPendingMessageExpectedLenght = 0;
+
+  mMessage.valid = false;
+  mMessage.type = InvalidType;
+  mMessage.channel = 0;
+  mMessage.data1 = 0;
+  mMessage.data2 = 0;
+
+  mThruFilterMode = Thru::Full;
+  mThruActivated = true;
+}
+
+/* ---- OUTPUT ---- */
+
+template <class SerialPort, class Settings>
+void MidiInterface<SerialPort, Settings>::send(MidiType inType, DataByte inData1, DataByte inData2, Channel inChannel)
+{
+  // Then test if channel is valid
+  if (inChannel >= MIDI_CHANNEL_OFF || inChannel == MIDI_CHANNEL_OMNI || inType < 0x80)
+  {
+    return; // Don't send anything
+  }
+
+  if (inType <= PitchBend) // Channel messages
+  {
+    // Protection: remove MSBs on data
+    inData1 &= 0x7f;
+    inData2 &= 0x7f;
+
+    const StatusByte status = getStatus(inType, inChannel);
+
+    if (Settings::UseRunningStatus)
+    {
+      if (mRunningStatus_TX != status)
+      {
+        // New message, memorise and send header
+        mRunningStatus_TX = status;
+        mSerial.write(mRunningStatus_TX);
+      }
+    }
+    else
+    {
+      // Don't care about running status, send the status byte.
+      mSerial.write(status);
+    }
+
+    // Then send data
+    mSerial.write(inData1);
+    if (inType != ProgramChange && inType != AfterTouchChannel)
+    {
+      mSerial.write(inData2);
+    }
+  }
+  else if (inType >= Clock && inType <= SystemReset)
+  {
+    sendRealTime(inType); // System Real-time and 1 byte.
+  }
+}
+
+template <class SerialPort, class Settings>
+void MidiInterface<SerialPort, Settings>::sendSysEx(unsigned inLength, const byte *inArray, bool inArrayContainsBoundaries)
+{
+  if (!inArrayContainsBoundaries)
+  {
+    mSerial.write(0xf0);
+  }
+  for (unsigned i = 0; i < inLength; ++i)
+  {
+    mSerial.write(inArray[i]);
+  }
+  if (!inArrayContainsBoundaries)
+  {
+    mSerial.write(0xf7);
+  }
+  if (Settings::UseRunningStatus)
+  {
+    mRunningStatus_TX = InvalidType;
+  }
+}
+
+template <class SerialPort, class Settings>
+void MidiInterface<SerialPort, Settings>::sendTimeCodeQuarterFrame(DataByte inData)
+{
+  mSerial.write((byte)TimeCodeQuarterFrame);
+  mSerial.write(inData);
+  if (Settings::UseRunningStatus)
+  {
+    mRunningStatus_TX = InvalidType;
+  }
+}
+
+template <class SerialPort, class Settings>
+void MidiInterface<SerialPort, Settings>::sendSongPosition(unsigned inBeats)
+{
+  mSerial.write((byte)SongPosition);
+  mSerial.write(inBeats & 0x7f);
+  mSerial.write((inBeats >> 7) & 0x7f);
+  if (Settings::UseRunningStatus)
+  {
+    mRunningStatus_TX = InvalidType;
+  }
+}
+
+template <class SerialPort, class Settings>
+void MidiInterface<SerialPort, Settings>::sendSongSelect(DataByte inSongNumber)
+{
+  mSerial.write((byte)SongSelect);
+  mSerial.write(inSongNumber & 0x7f);
+  if (Settings::UseRunningStatus)
+  {
+    mRunningStatus_TX = InvalidType;
+  }
+}
+
+template <class SerialPort, class Settings>
+void MidiInterface<SerialPort, Settings>::sendTuneRequest()
+{
+  mSerial.write((byte)TuneRequest);
+  if (Settings::UseRunningStatus)
+  {
+    mRunningStatus_TX = InvalidType;
+  }
+}
+
+template <class SerialPort, class Settings>
+void MidiInterface<SerialPort, Settings>::sendRealTime(MidiType inType)
+{
+  switch (inType)
+  {
+  case Clock:
+  case Start:
+  case Stop:
+  case Continue:
+  case ActiveSensing:
+  case SystemReset:
+    mSerial.write((byte)inType);
+    break;
+  default:
+    // Invalid Real Time marker
+    break;
+  }
+
+  // Do not cancel Running Status for real-time messages as they can be
+  // interleaved within any message. Though, TuneRequest can be sent here,
+  // and as it is a System Common message, it must reset Running Status.
+  if (Settings::UseRunningStatus && inType == TuneRequest)
+  {
+    mRunningStatus_TX = InvalidType;
+  }
+}
+
+template <class SerialPort, class Settings>
+inline StatusByte MidiInterface<SerialPort, Settings>::getStatus(MidiType inType, Channel inChannel) const
+{
+  return ((byte)inType | ((inChannel - 1) & 0x0f));
+}
+
+/* ---- INPUT ---- */
+
+template <class SerialPort, class Settings>
+inline bool MidiInterface<SerialPort, Settings>::read()
+{
+  return read(mInputChannel);
+}
+
+/*! Reads a message from the serial port if one is available, and passes it
+ * through if thru is on. Returns true for a message on inChannel.
+ */
+template <class SerialPort, class Settings>
+inline bool MidiInterface<SerialPort, Settings>::read(Channel inChannel)
+{
+  if (inChannel >= MIDI_CHANNEL_OFF)
+  {
+    return false; // MIDI Input disabled.
+  }
+
+  if (!parse())
+  {
+    return false;
+  }
+
+  handleNullVelocityNoteOnAsNoteOff();
+  const bool channelMatch = inputFilter(inChannel);
+
+  thruFilter(inChannel);
+
+  return channelMatch;
+}
+
+// Private method: MIDI parser
+template <class SerialPort, class Settings>
+bool MidiInterface<SerialPort, Settings>::parse()
+{
+  if (mSerial.available() == 0)
+  {
+    // No data available.
+    return false;
+  }
+
+  const byte extracted = mSerial.read();
+
+  // Ignore Undefined
+  if (extracted == 0xf9 || extracted == 0xfd)
+  {
+    if (Settings::Use1ByteParsing)
+    {
+      return false;
+    }
+    else
+    {
+      return parse();
+    }
+  }
+
+  if (mPendingMessageIndex == 0)
+  {
+    // Start a new pending message
+    mPendingMessage[0] = extracted;
+
+    // Check for running status first
+    if (isChannelMessage(getTypeFromStatusByte(mRunningStatus_RX)))
+    {
+      // Only these types allow Running Status
+
+      // If the status byte is not received, prepend it
+      // to the pending message
+      if (extracted < 0x80)
+      {
+        mPendingMessage[0] = mRunningStatus_RX;
+        mPendingMessage[1] = extracted;
+        mPendingMessageIndex = 1;
+      }
+      // Else: well, we received another status byte,
+      // so the running status does not apply here.
+      // It will be updated upon completion of this message.
+    }
+
+    switch (getTypeFromStatusByte(mPendingMessage[0]))
+    {
+    // 1 byte messages
+    case Start:
+    case Continue:
+    case Stop:
+    case Clock:
+    case ActiveSensing:
+    case SystemReset:
+    case TuneRequest:
+      // Handle the message type directly here.
+      mMessage.type = getTypeFromStatusByte(mPendingMessage[0]);
+      mMessage.channel = 0;
+      mMessage.data1 = 0;
+      mMessage.data2 = 0;
+      mMessage.valid = true;
+
+      // Do not reset all input attributes, Running Status must remain unchanged.
+      // We still need to reset these
+      mPendingMessageIndex = 0;
+      mPendingMessageExpectedLenght = 0;
+
+      return true;
+
+    // 2 bytes messages
+    case ProgramChange:
+    case AfterTouchChannel:
+    case TimeCodeQuarterFrame:
+    case SongSelect:
+      mPendingMessageExpectedLenght = 2;
+      break;
+
+    // 3 bytes messages
+    case NoteOn:
+    case NoteOff:
+    case ControlChange:
+    case PitchBend:
+    case AfterTouchPoly:
+    case SongPosition:
+      mPendingMessageExpectedLenght = 3;
+      break;
+
+    case SystemExclusive:
+      // The message can be any lenght
+      // between 3 and MidiMessage::sSysExMaxSize bytes
+      mPendingMessageExpectedLenght = MidiMessage::sSysExMaxSize;
+      mRunningStatus_RX = InvalidType;
+      mMessage.sysexArray[0] = SystemExclusive;
+      break;
+
+    case InvalidType:
+    default:
+      // This is obviously wrong. Let's get the hell out'a here.
+      resetInput();
+      return false;
+    }
+
+    if (mPendingMessageIndex >= (mPendingMessageExpectedLenght - 1))
+    {
+      // Reception complete
+      mMessage.type = getTypeFromStatusByte(mPendingMessage[0]);
+      mMessage.channel = getChannelFromStatusByte(mPendingMessage[0]);
+      mMessage.data1 = mPendingMessage[1];
+      mMessage.data2 = 0; // Completed new message has 1 data byte
+
+      mPendingMessageIndex = 0;
+      mPendingMessageExpectedLenght = 0;
+      mMessage.valid = true;
+      return true;
+    }
+    else
+    {
+      // Waiting for more data
+      mPendingMessageIndex++;
+    }
+
+    if (Settings::Use1ByteParsing)
+    {
+      // Message is not complete.
+      return false;
+    }
+    else
+    {
+      // Call the parser recursively
+      // to parse the rest of the message.
+      return parse();
+    }
+  }
+  else
+  {
+    // First, test if this is a status byte
+    if (extracted >= 0x80)
+    {
+      // Reception of status bytes in the middle of an uncompleted message
+      // are allowed only for interleaved Real Time message or EOX
+      switch (extracted)
+      {
+      case Clock:
+      case Start:
+      case Continue:
+      case Stop:
+      case ActiveSensing:
+      case SystemReset:
+        // Here we will have to extract the one-byte message,
+        // pass it to the structure for being read outside
+        // the MIDI class, and recompose the message it was
+        // interleaved into. Oh, and without killing the running status..
+        // This is done by leaving the pending message as is,
+        // it will be completed on next calls.
+
+        mMessage.type = (MidiType)extracted;
+        mMessage.data1 = 0;
+        mMessage.data2 = 0;
+        mMessage.channel = 0;
+        mMessage.valid = true;
+        return true;
+
+        // End of Exclusive
+      case 0xf7:
+        if (mMessage.sysexArray[0] == SystemExclusive)
+        {
+          // Store the last byte (EOX)
+          mMessage.sysexArray[mPendingMessageIndex++] = 0xf7;
+          mMessage.type = SystemExclusive;
+
+          // Get length
+          mMessage.data1 = mPendingMessageIndex & 0xff;    // LSB
+          mMessage.data2 = byte(mPendingMessageIndex >> 8); // MSB
+          mMessage.channel = 0;
+          mMessage.valid = true;
+
+          resetInput();
+          return true;
+        }
+        else
+        {
+          // Well well well.. error.
+          resetInput();
+          return false;
+        }
+
+      default:
+        break;
+      }
+    }
+
+    // Add extracted data byte to pending message
+    if (mPendingMessage[0] == SystemExclusive)
+    {
+      mMessage.sysexArray[mPendingMessageIndex] = extracted;
+    }
+    else
+    {
+      mPendingMessage[mPendingMessageIndex] = extracted;
+    }
+
+    // Now we are going to check if we have reached the end of the message
+    if (mPendingMessageIndex >= (mPendingMessageExpectedLenght - 1))
+    {
+      // "FML" case: fall down here with an overflown SysEx..
+      // This means we received the last possible data byte that can fit
+      // the buffer. If this happens, try increasing MidiMessage::sSysExMaxSize.
+      if (mPendingMessage[0] == SystemExclusive)
+      {
+        resetInput();
+        return false;
+      }
+
+      mMessage.type = getTypeFromStatusByte(mPendingMessage[0]);
+
+      if (isChannelMessage(mMessage.type))
+      {
+        mMessage.channel = getChannelFromStatusByte(mPendingMessage[0]);
+      }
+      else
+      {
+        mMessage.channel = 0;
+      }
+
+      mMessage.data1 = mPendingMessage[1];
+
+      // Save data2 only if applicable
+      mMessage.data2 = mPendingMessageExpectedLenght == 3 ? mPendingMessage[2] : 0;
+
+      // Reset local variables
+      mPendingMessageIndex = 0;
+      mPendingMessageExpectedLenght = 0;
+
+      mMessage.valid = true;
+
+      // Activate running status (if enabled for the received type)
+      switch (mMessage.type)
+      {
+      case NoteOff:
+      case NoteOn:
+      case AfterTouchPoly:
+      case ControlChange:
+      case ProgramChange:
+      case AfterTouchChannel:
+      case PitchBend:
+        // Running status enabled: store it from received message
+        mRunningStatus_RX = mPendingMessage[0];
+        break;
+
+      default:
+        // No running status
+        mRunningStatus_RX = InvalidType;
+        break;
+      }
+      return true;
+    }
+    else
+    {
+      // Update the index of the pending message.
+      mPendingMessageIndex++;
+
+      if (Settings::Use1ByteParsing)
+      {
+        // Message is not complete.
+        return false;
+      }
+      else
+      {
+        // Call the parser recursively to parse the rest of the message.
+        return parse();
+      }
+    }
+  }
+}
+
+template <class SerialPort, class Settings>
+inline void MidiInterface<SerialPort, Settings>::handleNullVelocityNoteOnAsNoteOff()
+{
+  if (Settings::HandleNullVelocityNoteOnAsNoteOff && getType() == NoteOn && getData2() == 0)
+  {
+    mMessage.type = NoteOff;
+  }
+}
+
+// Private method: check if the received message is on the listened channel
+template <class SerialPort, class Settings>
+inline bool MidiInterface<SerialPort, Settings>::inputFilter(Channel inChannel)
+{
+  // This method handles recognition of channel
+  // (to know if the message is destinated to the Arduino)
+
+  if (mMessage.type == InvalidType)
+  {
+    return false;
+  }
+
+  // First, check if the received message is Channel
+  if (mMessage.type >= NoteOff && mMessage.type <= PitchBend)
+  {
+    // Then we need to know if we listen to it
+    return (mMessage.channel == inChannel) || (inChannel == MIDI_CHANNEL_OMNI);
+  }
+  else
+  {
+    // System messages are always received
+    return true;
+  }
+}
+
+// Private method: reset input attributes
+template <class SerialPort, class Settings>
+inline void MidiInterface<SerialPort, Settings>::resetInput()
+{
+  mPendingMessageIndex = 0;
+  mPendingMessageExpectedLenght = 0;
+  mRunningStatus_RX = InvalidType;
+}
+
+template <class SerialPort, class Settings>
+inline MidiType MidiInterface<SerialPort, Settings>::getType() const
+{
+  return mMessage.type;
+}
+
+template <class SerialPort, class Settings>
+inline Channel MidiInterface<SerialPort, Settings>::getChannel() const
+{
+  return mMessage.channel;
+}
+
+template <class SerialPort, class Settings>
+inline DataByte MidiInterface<SerialPort, Settings>::getData1() const
+{
+  return mMessage.data1;
+}
+
+template <class SerialPort, class Settings>
+inline DataByte MidiInterface<SerialPort, Settings>::getData2() const
+{
+  return mMessage.data2;
+}
+
+template <class SerialPort, class Settings>
+inline const byte *MidiInterface<SerialPort, Settings>::getSysExArray() const
+{
+  return mMessage.sysexArray;
+}
+
+template <class SerialPort, class Settings>
+inline unsigned MidiInterface<SerialPort, Settings>::getSysExArrayLength() const
+{
+  return mMessage.getSysExSize();
+}
+
+template <class SerialPort, class Settings>
+inline bool MidiInterface<SerialPort, Settings>::check() const
+{
+  return mMessage.valid;
+}
+
+template <class SerialPort, class Settings>
+inline Channel MidiInterface<SerialPort, Settings>::getInputChannel() const
+{
+  return mInputChannel;
+}
+
+template <class SerialPort, class Settings>
+inline void MidiInterface<SerialPort, Settings>::setInputChannel(Channel inChannel)
+{
+  mInputChannel = inChannel;
+}
+
+template <class SerialPort, class Settings>
+inline MidiType MidiInterface<SerialPort, Settings>::getTypeFromStatusByte(byte inStatus)
+{
+  if ((inStatus < 0x80) || (inStatus == 0xf4) || (inStatus == 0xf5) || (inStatus == 0xf9) || (inStatus == 0xfD))
+  {
+    // Data bytes and undefined.
+    return InvalidType;
+  }
+  if (inStatus < 0xf0)
+  {
+    // Channel message, remove channel nibble.
+    return MidiType(inStatus & 0xf0);
+  }
+
+  return MidiType(inStatus);
+}
+
+template <class SerialPort, class Settings>
+inline Channel MidiInterface<SerialPort, Settings>::getChannelFromStatusByte(byte inStatus)
+{
+  return (inStatus & 0x0f) + 1;
+}
+
+template <class SerialPort, class Settings>
+inline bool MidiInterface<SerialPort, Settings>::isChannelMessage(MidiType inType)
+{
+  return (inType == NoteOff || inType == NoteOn || inType == ControlChange || inType == AfterTouchPoly ||
+          inType == AfterTouchChannel || inType == PitchBend || inType == ProgramChange);
+}
+
+/* ---- THRU ---- */
+
+template <class SerialPort, class Settings>
+inline void MidiInterface<SerialPort, Settings>::setThruFilterMode(Thru::Mode inThruFilterMode)
+{
+  mThruFilterMode = inThruFilterMode;
+  mThruActivated = mThruFilterMode != Thru::Off;
+}
+
+template <class SerialPort, class Settings>
+inline Thru::Mode MidiInterface<SerialPort, Settings>::getFilterMode() const
+{
+  return mThruFilterMode;
+}
+
+template <class SerialPort, class Settings>
+inline bool MidiInterface<SerialPort, Settings>::getThruState() const
+{
+  return mThruActivated;
+}
+
+template <class SerialPort, class Settings>
+inline void MidiInterface<SerialPort, Settings>::turnThruOn(Thru::Mode inThruFilterMode)
+{
+  mThruActivated = true;
+  mThruFilterMode = inThruFilterMode;
+}
+
+template <class SerialPort, class Settings>
+inline void MidiInterface<SerialPort, Settings>::turnThruOff()
+{
+  mThruActivated = false;
+  mThruFilterMode = Thru::Off;
+}
+
+// Private method: sends the received message back out as the thru mode asks
+template <class SerialPort, class Settings>
+void MidiInterface<SerialPort, Settings>::thruFilter(Channel inChannel)
+{
+  // If the feature is disabled, don't do anything.
+  if (!mThruActivated || (mThruFilterMode == Thru::Off))
+  {
+    return;
+  }
+
+  // First, check if the received message is Channel
+  if (mMessage.type >= NoteOff && mMessage.type <= PitchBend)
+  {
+    const bool filter_condition = ((mMessage.channel == inChannel) || (inChannel == MIDI_CHANNEL_OMNI));
+
+    // Now let's pass it to the output
+    switch (mThruFilterMode)
+    {
+    case Thru::Full:
+      send(mMessage.type, mMessage.data1, mMessage.data2, mMessage.channel);
+      break;
+
+    case Thru::SameChannel:
+      if (filter_condition)
+      {
+        send(mMessage.type, mMessage.data1, mMessage.data2, mMessage.channel);
+      }
+      break;
+
+    case Thru::DifferentChannel:
+      if (!filter_condition)
+      {
+        send(mMessage.type, mMessage.data1, mMessage.data2, mMessage.channel);
+      }
+      break;
+
+    default:
+      break;
+    }
+  }
+  else
+  {
+    // Send the message to the output
+    switch (mMessage.type)
+    {
+    // Real Time and 1 byte
+    case Clock:
+    case Start:
+    case Stop:
+    case Continue:
+    case ActiveSensing:
+    case SystemReset:
+    case TuneRequest:
+      sendRealTime(mMessage.type);
+      break;
+
+    case SystemExclusive:
+      // Send SysEx (0xf0 and 0xf7 are included in the buffer)
+      sendSysEx(getSysExArrayLength(), getSysExArray(), true);
+      break;
+
+    case SongSelect:
+      sendSongSelect(mMessage.data1);
+      break;
+
+    case SongPosition:
+      sendSongPosition(mMessage.data1 | ((unsigned)mMessage.data2 << 7));
+      break;
+
+    case TimeCodeQuarterFrame:
+      sendTimeCodeQuarterFrame(mMessage.data1);
+      break;
+
+    default:
+      break;
+    }
+  }
+}
+
+END_MIDI_NAMESPACE
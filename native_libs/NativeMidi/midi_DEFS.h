@@ -0,0 +1,8 @@
+/*
+ * The sketches include the definitions under this name, which only resolves
+ * on a case insensitive file system. Forward it for the native tests.
+ */
+
+#pragma once
+
+#include "midi_Defs.h"
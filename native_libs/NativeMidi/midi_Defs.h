@@ -0,0 +1,59 @@
+/*
+ * Definitions of the Arduino MIDI Library 4.3.1, for the native tests.
+ */
+
+#pragma once
+
+#include "midi_Namespace.h"
+
+#include <Arduino.h>
+
+BEGIN_MIDI_NAMESPACE
+
+#define MIDI_CHANNEL_OMNI 0
+#define MIDI_CHANNEL_OFF 17 // and over
+
+#define MIDI_PITCHBEND_MIN -8192
+#define MIDI_PITCHBEND_MAX 8191
+
+typedef byte StatusByte;
+typedef byte DataByte;
+typedef byte Channel;
+
+/*! Enumeration of MIDI types */
+enum MidiType
+{
+  InvalidType = 0x00,          ///< For notifying errors
+  NoteOff = 0x80,              ///< Note Off
+  NoteOn = 0x90,               ///< Note On
+  AfterTouchPoly = 0xA0,       ///< Polyphonic AfterTouch
+  ControlChange = 0xB0,        ///< Control Change / Channel Mode
+  ProgramChange = 0xC0,        ///< Program Change
+  AfterTouchChannel = 0xD0,    ///< Channel (monophonic) AfterTouch
+  PitchBend = 0xE0,            ///< Pitch Bend
+  SystemExclusive = 0xF0,      ///< System Exclusive
+  TimeCodeQuarterFrame = 0xF1, ///< System Common - MIDI Time Code Quarter Frame
+  SongPosition = 0xF2,         ///< System Common - Song Position Pointer
+  SongSelect = 0xF3,           ///< System Common - Song Select
+  TuneRequest = 0xF6,          ///< System Common - Tune Request
+  Clock = 0xF8,                ///< System Real Time - Timing Clock
+  Start = 0xFA,                ///< System Real Time - Start
+  Continue = 0xFB,             ///< System Real Time - Continue
+  Stop = 0xFC,                 ///< System Real Time - Stop
+  ActiveSensing = 0xFE,        ///< System Real Time - Active Sensing
+  SystemReset = 0xFF,          ///< System Real Time - System Reset
+};
+
+/*! Enumeration of Thru filter modes */
+struct Thru
+{
+  enum Mode
+  {
+    Off = 0,              ///< Thru disabled (nothing passes through).
+    Full = 1,             ///< Fully enabled Thru (every incoming message is sent back).
+    SameChannel = 2,      ///< Only the messages on the Input Channel will be sent back.
+    DifferentChannel = 3, ///< All the messages but the ones on the Input Channel will be sent back.
+  };
+};
+
+END_MIDI_NAMESPACE
@@ -0,0 +1,37 @@
+/*
+ * The message of the Arduino MIDI Library 4.3.1, for the native tests.
+ */
+
+#pragma once
+
+#include "midi_Defs.h"
+
+BEGIN_MIDI_NAMESPACE
+
+template <unsigned SysExMaxSize>
+struct Message
+{
+  inline Message()
+      : channel(0), type(InvalidType), data1(0), data2(0), valid(false)
+  {
+    memset(sysexArray, 0, sSysExMaxSize * sizeof(DataByte));
+  }
+
+  static const unsigned sSysExMaxSize = SysExMaxSize;
+
+  Channel channel;
+  MidiType type;
+  DataByte data1;
+  DataByte data2;
+  // The whole System Exclusive message, including the F0 and F7 bytes
+  DataByte sysexArray[sSysExMaxSize];
+  bool valid;
+
+  inline unsigned getSysExSize() const
+  {
+    const unsigned size = unsigned(data2) << 8 | data1;
+    return size > sSysExMaxSize ? sSysExMaxSize : size;
+  }
+};
+
+END_MIDI_NAMESPACE
@@ -0,0 +1,17 @@
+/*
+ * Namespace macros of the Arduino MIDI Library, for the native tests.
+ */
+
+#pragma once
+
+#define MIDI_NAMESPACE midi
+#define BEGIN_MIDI_NAMESPACE \
+  namespace MIDI_NAMESPACE   \
+  {
+#define END_MIDI_NAMESPACE }
+
+#define USING_NAMESPACE_MIDI using namespace MIDI_NAMESPACE;
+
+BEGIN_MIDI_NAMESPACE
+
+END_MIDI_NAMESPACE
@@ -0,0 +1,21 @@
+/*
+ * Settings of the Arduino MIDI Library 4.3.1, for the native tests.
+ */
+
+#pragma once
+
+#include "midi_Defs.h"
+
+BEGIN_MIDI_NAMESPACE
+
+/*! Default settings for the MIDI Library, as in 4.3.1 */
+struct DefaultSettings
+{
+  static const bool UseRunningStatus = false;
+  static const bool HandleNullVelocityNoteOnAsNoteOff = true;
+  static const bool Use1ByteParsing = true;
+  static const long BaudRate = 31250;
+  static const unsigned SysExMaxSize = 128;
+};
+
+END_MIDI_NAMESPACE
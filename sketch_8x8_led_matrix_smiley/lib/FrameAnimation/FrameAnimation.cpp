@@ -0,0 +1,92 @@
+#include "FrameAnimation.h"
+
+FrameAnimation *FrameAnimation::active = NULL;
+
+FrameAnimation::FrameAnimation(Max7219 &display, byte addr)
+    : rowsSent(0), rowsSkipped(0), display(display), addr(addr), frames(NULL), count(0), current(0), remaining(0), due(false)
+{
+  // The display is cleared by Max7219::begin()
+  memset(shown, 0, sizeof(shown));
+}
+
+/**
+ * Starts the 1ms tick: Timer2 in CTC mode, 16MHz / 64 / 250
+ */
+void FrameAnimation::begin()
+{
+  active = this;
+  TCCR2A = 1 << WGM21;
+  TCCR2B = 1 << CS22;
+  OCR2A = F_CPU / 64 / 1000 - 1;
+  TCNT2 = 0;
+  TIMSK2 = 1 << OCIE2A;
+}
+
+/**
+ * Shows the first of count frames straight away, then each one after the other for its
+ * duration, starting again after the last
+ */
+void FrameAnimation::play(const AnimationFrame *frames, byte count)
+{
+  byte oldSREG = SREG;
+  cli();
+  this->frames = frames;
+  this->count = count;
+  remaining = 0;
+  due = false;
+  SREG = oldSREG;
+
+  current = 0;
+  draw(0);
+}
+
+/**
+ * Draws the next frame if it is due. Returns true if it drew anything.
+ */
+bool FrameAnimation::update()
+{
+  if (!due)
+  {
+    return false;
+  }
+  due = false;
+  current = (current + 1 < count) ? current + 1 : 0;
+  draw(current);
+  return true;
+}
+
+void FrameAnimation::draw(byte index)
+{
+  const AnimationFrame *frame = &frames[index];
+  for (byte r = 0; r < 8; r++)
+  {
+    byte row = pgm_read_byte(&frame->rows[r]);
+    if (row == shown[r])
+    {
+      rowsSkipped++;
+      continue;
+    }
+    display.setRow(addr, r, row);
+    shown[r] = row;
+    rowsSent++;
+  }
+
+  word duration = pgm_read_word(&frame->duration);
+  byte oldSREG = SREG;
+  cli();
+  remaining = duration ? duration : 1; // tick() never counts down from 0, which would stop the animation
+  SREG = oldSREG;
+}
+
+inline void FrameAnimation::tick()
+{
+  if (remaining != 0 && --remaining == 0)
+  {
+    due = true;
+  }
+}
+
+ISR(TIMER2_COMPA_vect)
+{
+  FrameAnimation::active->tick();
+}
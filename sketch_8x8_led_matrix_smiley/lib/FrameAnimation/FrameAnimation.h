@@ -0,0 +1,55 @@
+/*
+ * Frame animation for an 8x8 led matrix on a MAX7219.
+ *
+ * An animation is a table of frames in flash, each with its 8 rows and how
+ * long it is shown for. Timer2 ticks every millisecond and counts down the
+ * current frame, so nothing has to be polled or delayed. update() draws the
+ * next frame once it is due, sending only the rows that differ from the frame
+ * before, and otherwise returns at once so loop() is free or can sleep.
+ *
+ * FrameAnimation uses Timer2 and its compare match interrupt, so they can't
+ * be used for anything else (e.g. tone()). Only one FrameAnimation can run.
+ */
+
+#ifndef FRAMEANIMATION_H
+#define FRAMEANIMATION_H
+
+#include <Arduino.h>
+#include "Max7219.h"
+
+struct AnimationFrame
+{
+  byte rows[8];
+  word duration; // ms, and a frame of 0 is shown for 1
+};
+
+class FrameAnimation
+{
+public:
+  // Rows sent to the display and rows that didn't need sending because they were already showing
+  unsigned long rowsSent;
+  unsigned long rowsSkipped;
+
+  FrameAnimation(Max7219 &display, byte addr = 0);
+  void begin();
+  void play(const AnimationFrame *frames, byte count);
+  bool update();
+
+  // Only to be called from the timer interrupt handler
+  inline void tick();
+  static FrameAnimation *active;
+
+private:
+  Max7219 &display;
+  byte addr;
+  const AnimationFrame *frames; // In PROGMEM
+  byte count;
+  byte current;
+  byte shown[8]; // The rows on the display
+  volatile word remaining; // ms until the next frame
+  volatile bool due;
+
+  void draw(byte index);
+};
+
+#endif
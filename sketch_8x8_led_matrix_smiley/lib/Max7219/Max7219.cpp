@@ -0,0 +1,207 @@
+#include "Max7219.h"
+
+#if MAX7219_QUEUE_SIZE & (MAX7219_QUEUE_SIZE - 1)
+#error "MAX7219_QUEUE_SIZE must be a power of two"
+#endif
+
+#define QUEUE_MASK (MAX7219_QUEUE_SIZE - 1)
+
+// Register addresses
+#define OP_NOOP 0
+#define OP_DIGIT0 1
+#define OP_DECODEMODE 9
+#define OP_INTENSITY 10
+#define OP_SCANLIMIT 11
+#define OP_SHUTDOWN 12
+#define OP_DISPLAYTEST 15
+
+#if MAX7219_QUEUE_SIZE > 0
+Max7219 *Max7219::queued = NULL;
+#endif
+
+Max7219::Max7219(byte csPin, byte numDevices) : csPin(csPin), numDevices(numDevices)
+{
+#if MAX7219_QUEUE_SIZE > 0
+  head = tail = 0;
+  sending = false;
+#endif
+}
+
+/**
+ * Sets up the SPI peripheral and puts each device into the same state as LedControl does:
+ * all rows scanned, no decoding, cleared and shut down
+ */
+void Max7219::begin()
+{
+  pinMode(csPin, OUTPUT);
+  digitalWrite(csPin, HIGH);
+  csPort = portOutputRegister(digitalPinToPort(csPin));
+  csMask = digitalPinToBitMask(csPin);
+
+  pinMode(SS, OUTPUT);
+  pinMode(MOSI, OUTPUT);
+  pinMode(SCK, OUTPUT);
+  SPSR = 1 << SPI2X;                 // F_CPU / 2
+  SPCR = (1 << SPE) | (1 << MSTR);   // mode 0, most significant bit first
+#if MAX7219_QUEUE_SIZE > 0
+  queued = this;
+  SPCR |= 1 << SPIE;
+#endif
+
+  for (byte addr = 0; addr < numDevices; addr++)
+  {
+    send(addr, OP_DISPLAYTEST, 0);
+    setScanLimit(addr, 7);
+    send(addr, OP_DECODEMODE, 0);
+    clearDisplay(addr);
+    shutdown(addr, true);
+  }
+}
+
+void Max7219::shutdown(byte addr, bool status)
+{
+  if (addr < numDevices)
+  {
+    send(addr, OP_SHUTDOWN, status ? 0 : 1);
+  }
+}
+
+void Max7219::setScanLimit(byte addr, byte limit)
+{
+  if (addr < numDevices && limit < 8)
+  {
+    send(addr, OP_SCANLIMIT, limit);
+  }
+}
+
+void Max7219::setIntensity(byte addr, byte intensity)
+{
+  if (addr < numDevices && intensity < 16)
+  {
+    send(addr, OP_INTENSITY, intensity);
+  }
+}
+
+void Max7219::clearDisplay(byte addr)
+{
+  for (byte row = 0; row < 8; row++)
+  {
+    setRow(addr, row, 0);
+  }
+}
+
+void Max7219::setRow(byte addr, byte row, byte value)
+{
+  if (addr < numDevices && row < 8)
+  {
+    send(addr, OP_DIGIT0 + row, value);
+  }
+}
+
+/**
+ * Returns the byte at position in the chain of devices for a write. The last
+ * device's bytes are sent first and the other devices get a no-op.
+ */
+byte Max7219::chainByte(const Write &write, byte position) const
+{
+  byte addr = numDevices - 1 - (position >> 1);
+  if (addr != write.addr)
+  {
+    return OP_NOOP;
+  }
+  return (position & 1) ? write.data : write.opcode;
+}
+
+#if MAX7219_QUEUE_SIZE > 0
+
+void Max7219::send(byte addr, byte opcode, byte data)
+{
+  byte next = (head + 1) & QUEUE_MASK;
+  while (next == tail)
+  {
+    // Queue is full. If interrupts are off the ISR can't drain it so do it here.
+    if (!(SREG & 0x80) && (SPSR & (1 << SPIF)))
+    {
+      (void)SPDR; // clears SPIF
+      transferComplete();
+    }
+  }
+  Write &write = queue[head];
+  write.addr = addr;
+  write.opcode = opcode;
+  write.data = data;
+
+  byte oldSREG = SREG;
+  cli();
+  head = next;
+  if (!sending)
+  {
+    sending = true;
+    startWrite();
+  }
+  SREG = oldSREG;
+}
+
+void Max7219::flush()
+{
+  while (sending)
+  {
+    yield(); // does nothing on the UNO, the native tests move time on
+  }
+}
+
+void Max7219::startWrite()
+{
+  position = 0;
+  *csPort &= ~csMask;
+  SPDR = chainByte(queue[tail], 0);
+}
+
+inline void Max7219::transferComplete()
+{
+  position++;
+  if (position < numDevices * 2)
+  {
+    SPDR = chainByte(queue[tail], position);
+    return;
+  }
+
+  *csPort |= csMask; // the devices latch the write when CS goes high
+  byte next = (tail + 1) & QUEUE_MASK;
+  tail = next;
+  if (next != head)
+  {
+    startWrite();
+  }
+  else
+  {
+    sending = false;
+  }
+}
+
+ISR(SPI_STC_vect)
+{
+  Max7219::queued->transferComplete();
+}
+
+#else
+
+void Max7219::send(byte addr, byte opcode, byte data)
+{
+  Write write = {addr, opcode, data};
+  *csPort &= ~csMask;
+  for (byte position = 0; position < numDevices * 2; position++)
+  {
+    SPDR = chainByte(write, position);
+    while (!(SPSR & (1 << SPIF)))
+    {
+    }
+  }
+  *csPort |= csMask; // the devices latch the write when CS goes high
+}
+
+void Max7219::flush()
+{
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * MAX7219 led driver on the hardware SPI pins.
+ *
+ * A replacement for LedControl with the same shutdown, setScanLimit,
+ * setIntensity, clearDisplay and setRow calls. It sends with the SPI
+ * peripheral at 8MHz instead of shiftOut() and digitalWrite(), so the display
+ * must be wired to the SPI pins: DIN to MOSI (11 on an UNO) and CLK to SCK
+ * (13). CS can be any pin. MISO (12) is taken by the SPI peripheral and SS
+ * (10) is made an output so that it stays the SPI master.
+ *
+ * With MAX7219_QUEUE_SIZE set, writes are queued and sent from the SPI
+ * interrupt, so a whole frame doesn't hold up loop(). flush() waits for the
+ * queue to empty. Only one Max7219 can use the queue.
+ *
+ * Time to send all 8 rows to one device on a 16MHz UNO, estimated from the
+ * code rather than measured:
+ *   LedControl, shiftOut() on any pins   ~1.8ms
+ *   Max7219                              ~30us
+ *   Max7219 with the queue               ~10us in setRow(), then the interrupt
+ * At 8MHz each byte takes 1us, not much longer than the interrupt itself, so
+ * the queue is about not blocking rather than saving time. Build the simple
+ * rechannelizer with -D MAX7219_BENCHMARK=1 to time frames on the device.
+ */
+
+#ifndef MAX7219_H
+#define MAX7219_H
+
+#include <Arduino.h>
+
+// Number of register writes that can be waiting to be sent. 0 sends each write
+// before returning. Must be a power of two. Override with a build flag.
+#ifndef MAX7219_QUEUE_SIZE
+#define MAX7219_QUEUE_SIZE 0
+#endif
+
+class Max7219
+{
+public:
+  Max7219(byte csPin, byte numDevices = 1);
+  void begin();
+  byte getDeviceCount() const { return numDevices; }
+
+  void shutdown(byte addr, bool status);
+  void setScanLimit(byte addr, byte limit);
+  void setIntensity(byte addr, byte intensity);
+  void clearDisplay(byte addr);
+  void setRow(byte addr, byte row, byte value);
+  void flush();
+
+#if MAX7219_QUEUE_SIZE > 0
+  // Only to be called from the SPI interrupt handler
+  inline void transferComplete();
+  static Max7219 *queued;
+#endif
+
+private:
+  byte csPin;
+  byte numDevices;
+  volatile uint8_t *csPort;
+  byte csMask;
+
+  struct Write
+  {
+    byte addr;
+    byte opcode;
+    byte data;
+  };
+
+  void send(byte addr, byte opcode, byte data);
+  byte chainByte(const Write &write, byte position) const;
+
+#if MAX7219_QUEUE_SIZE > 0
+  Write queue[MAX7219_QUEUE_SIZE];
+  volatile byte head;
+  volatile byte tail;
+  byte position;         // Bytes of the write at tail sent so far
+  volatile bool sending; // Whether the interrupt is working through the queue
+  void startWrite();
+#endif
+};
+
+#endif
@@ -3,39 +3,56 @@
  https://randomnerdtutorials.com/
 */
 
-#include "LedControl.h"
+#include <avr/sleep.h>
+#include "Max7219.h"
+#include "FrameAnimation.h"
 #include "binary.h"
 
 /*
- DIN connects to pin 12
- CLK connects to pin 11
- CS connects to pin 10 
+ The matrix is driven by the hardware SPI
+ DIN connects to pin 11 (MOSI)
+ CLK connects to pin 13 (SCK)
+ CS connects to pin 10
 */
-LedControl lc=LedControl(12,11,10,1);
+Max7219 lc=Max7219(10,1);
 
-// delay time between faces
-unsigned long delaytime=1000;
+// time each face is shown for (ms)
+const word delaytime=1000;
 
-// happy face
-byte hf[8]= {B00111100,
-             B01000010,
-             B10100101,
-             B10000001,
-             B10100101,
-             B10011001,
-             B01000010,
-             B00111100};
-// neutral face
-byte nf[8]={B00111100, B01000010,B10100101,B10000001,B10111101,B10000001,B01000010,B00111100};
-// sad face
-byte sf[8]= {B00111100,B01000010,B10100101,B10000001,B10011001,B10100101,B01000010,B00111100};
+// The faces shown one after the other, from sad to happy
+const AnimationFrame faces[] PROGMEM = {
+  // sad face
+  {{B00111100,B01000010,B10100101,B10000001,B10011001,B10100101,B01000010,B00111100}, delaytime},
+  // neutral face
+  {{B00111100,B01000010,B10100101,B10000001,B10111101,B10000001,B01000010,B00111100}, delaytime},
+  // happy face
+  {{B00111100,
+    B01000010,
+    B10100101,
+    B10000001,
+    B10100101,
+    B10011001,
+    B01000010,
+    B00111100}, delaytime}};
+
+FrameAnimation animation=FrameAnimation(lc);
+
+// Time spent asleep, reported over serial every IDLE_REPORT_TIME ms
+const unsigned long IDLE_REPORT_TIME=10000;
+unsigned long idleMicros=0;
+unsigned long idleReportStart=0;
 
 void setup() {
+  lc.begin();
   lc.shutdown(0,false);
   // Set brightness to a medium value
   lc.setIntensity(0,2);
   // Clear the display
   lc.clearDisplay(0);  
+
+  Serial.begin(9600);
+  animation.begin();
+  animation.play(faces,sizeof(faces)/sizeof(faces[0]));
 }
 
 void display(unsigned char dat[8][8])    
@@ -54,41 +71,32 @@ void display(unsigned char dat[8][8])
 }  
 
 
-void drawFaces(){
-  // Display sad face
-  lc.setRow(0,0,sf[0]);
-  lc.setRow(0,1,sf[1]);
-  lc.setRow(0,2,sf[2]);
-  lc.setRow(0,3,sf[3]);
-  lc.setRow(0,4,sf[4]);
-  lc.setRow(0,5,sf[5]);
-  lc.setRow(0,6,sf[6]);
-  lc.setRow(0,7,sf[7]);
-  delay(delaytime);
-  
-  // Display neutral face
-  lc.setRow(0,0,nf[0]);
-  lc.setRow(0,1,nf[1]);
-  lc.setRow(0,2,nf[2]);
-  lc.setRow(0,3,nf[3]);
-  lc.setRow(0,4,nf[4]);
-  lc.setRow(0,5,nf[5]);
-  lc.setRow(0,6,nf[6]);
-  lc.setRow(0,7,nf[7]);
-  delay(delaytime);
-  
-  // Display happy face
-  lc.setRow(0,0,hf[0]);
-  lc.setRow(0,1,hf[1]);
-  lc.setRow(0,2,hf[2]);
-  lc.setRow(0,3,hf[3]);
-  lc.setRow(0,4,hf[4]);
-  lc.setRow(0,5,hf[5]);
-  lc.setRow(0,6,hf[6]);
-  lc.setRow(0,7,hf[7]);
-  delay(delaytime);
+/**
+ * Prints the share of the time the CPU was asleep, e.g. "idle 99.8%"
+ */
+void reportIdle(){
+  unsigned long now=micros();
+  unsigned long elapsed=now-idleReportStart;
+  if (elapsed<IDLE_REPORT_TIME*1000) {
+    return;
+  }
+  unsigned long permille=idleMicros/(elapsed/1000);
+  Serial.print("idle ");
+  Serial.print(permille/10);
+  Serial.print(".");
+  Serial.print(permille%10);
+  Serial.println("%");
+  idleMicros=0;
+  idleReportStart=now;
 }
 
 void loop(){
-  drawFaces();
+  if (!animation.update()) {
+    // Nothing to do until the next interrupt, the 1ms tick at the latest
+    unsigned long start=micros();
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_mode();
+    idleMicros+=micros()-start;
+  }
+  reportIdle();
 }
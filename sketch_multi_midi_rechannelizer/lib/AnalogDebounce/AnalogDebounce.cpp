@@ -1,5 +1,12 @@
 #include "AnalogDebounce.h"
 
+#if ANALOGDEBOUNCE_QUEUE_SIZE & (ANALOGDEBOUNCE_QUEUE_SIZE - 1)
+#error "ANALOGDEBOUNCE_QUEUE_SIZE must be a power of two"
+#endif
+#define EVENT_MASK (ANALOGDEBOUNCE_QUEUE_SIZE - 1)
+
+AnalogDebounce *AnalogDebounce::sampler = NULL;
+
 AnalogDebounce::AnalogDebounce(byte pin,button_callback f) {
     Pin = pin;
     adc_key_old = -1;
@@ -14,6 +21,7 @@ AnalogDebounce::AnalogDebounce(byte pin,button_callback f) {
     minPressTime = 70;
     repeatDelay = 150;
     callback = f;
+    sampling = false;
     for (int a = 0; a < 5; a++) {buttoncount[a] = 0;}
     time_detected = millis();
     adc_key_old = analogRead(Pin);
@@ -21,6 +29,18 @@ AnalogDebounce::AnalogDebounce(byte pin,button_callback f) {
 AnalogDebounce::~AnalogDebounce() {}
 
 void AnalogDebounce::loopCheck() {
+    if (sampling) {
+      // The ADC interrupt has done the work, just hand over its events
+      while (eventTail != eventHead) {
+        byte k = events[eventTail];
+        eventTail = (eventTail + 1) & EVENT_MASK;
+        (*callback)(k);
+        if (k != 255) {
+          buttoncount[k]+=1;
+        }
+      }
+      return;
+    }
     adc_key_reading = analogRead(Pin);         // Read for keypress
     adc_key_reading = get_Key(adc_key_reading);
     if (adc_key_reading != adc_key_old) {         // Debounce routine
@@ -47,3 +67,55 @@ int AnalogDebounce::get_Key(unsigned int input) {
       k = 255;
     return k;
   }
+
+/*
+ * Samples the keypad from the ADC interrupt instead of calling analogRead()
+ * in loopCheck(). A conversion is started by each Timer0 overflow, the same
+ * 1.024ms tick as millis(), so no timer is used up. The debounce is counted
+ * in samples and button events are queued for loopCheck(). No key (255) is
+ * only sent once when a button is released. analogRead() must not be used
+ * once this has been called.
+ */
+void AnalogDebounce::beginSampling() {
+    long sampleMicros = 64L * 256 * 1000 / (F_CPU / 1000);
+    minPressSamples = (long)minPressTime * 1000 / sampleMicros;
+    repeatSamples = (long)repeatDelay * 1000 / sampleMicros;
+    sampleCount = 0;
+    eventHead = eventTail = 0;
+    sampler = this;
+    sampling = true;
+
+    byte channel = (Pin >= 14) ? Pin - 14 : Pin;
+    ADMUX = (1 << REFS0) | (channel & 0x07);  // AVcc reference
+    ADCSRB = (1 << ADTS2);                    // Auto trigger on Timer0 overflow
+    ADCSRA = (1 << ADEN) | (1 << ADATE) | (1 << ADIE) | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0);
+}
+
+// Only called from the ADC interrupt
+void AnalogDebounce::sample(unsigned int reading) {
+    int k = get_Key(reading);
+    if (k != adc_key_old) {         // Debounce routine
+      adc_key_old = k;
+      sampleCount = 0;
+      return;
+    }
+    if (++sampleCount <= minPressSamples) {
+      return;
+    }
+    sampleCount = -repeatSamples;  // This makes sure if button is held it doesn't go crazy fast
+    if (k == 255 && adc_key_in == 255) {
+      return;
+    }
+    adc_key_in = k;
+    byte next = (eventHead + 1) & EVENT_MASK;
+    if (next != eventTail) {
+      events[eventHead] = k;
+      eventHead = next;
+    }
+}
+
+ISR(ADC_vect) {
+    if (AnalogDebounce::sampler != NULL) {
+      AnalogDebounce::sampler->sample(ADC);
+    }
+}
@@ -7,6 +7,12 @@
     #include <WProgram.h>
     #endif
 
+    // Button events waiting for loopCheck() when sampling from the ADC
+    // interrupt. Must be a power of two.
+    #ifndef ANALOGDEBOUNCE_QUEUE_SIZE
+    #define ANALOGDEBOUNCE_QUEUE_SIZE 4
+    #endif
+
     typedef void (*button_callback)(byte);
     class AnalogDebounce {
     public:
@@ -24,9 +30,19 @@
         ~AnalogDebounce();
         void loopCheck(void);
         int get_Key(unsigned int input);
+        void beginSampling(void);
+        void sample(unsigned int reading);
+        static AnalogDebounce *sampler;
     private:
         byte Pin;
         button_callback callback;
+        bool sampling;
+        int sampleCount;
+        int minPressSamples;
+        int repeatSamples;
+        byte events[ANALOGDEBOUNCE_QUEUE_SIZE];
+        volatile byte eventHead;
+        volatile byte eventTail;
 
     };
 
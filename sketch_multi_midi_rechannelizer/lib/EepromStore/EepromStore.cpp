@@ -0,0 +1,309 @@
+#include "EepromStore.h"
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+
+EepromStore EepromStorage;
+
+// Reads the EEPROM directly. The caller makes sure no write is in progress.
+static inline byte readCell(int addr)
+{
+  EEAR = addr;
+  EECR |= 1 << EERE;
+  return EEDR;
+}
+
+/**
+ * Stops the next queued write from starting and waits for the one in progress,
+ * so the EEPROM can be read directly. That is at most one write (3.3ms), with
+ * interrupts still running.
+ */
+void EepromStore::holdWrites()
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    EECR &= ~(1 << EERIE);
+  }
+  while (EECR & (1 << EEPE))
+  {
+  }
+}
+
+void EepromStore::resumeWrites()
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    if (rangeCount != 0)
+    {
+      EECR |= 1 << EERIE;
+    }
+  }
+}
+
+/**
+ * Returns the byte at addr, including bytes that are still waiting to be written.
+ */
+byte EepromStore::read(int addr)
+{
+  byte value;
+  readBytes(addr, &value, 1);
+  return value;
+}
+
+/**
+ * Reads bytes, including bytes that are still waiting to be written. However many
+ * bytes are read, at most one write in progress is waited for.
+ */
+void EepromStore::readBytes(int addr, byte *values, int length)
+{
+  bool held = false;
+  for (int i = 0; i < length; i++)
+  {
+    bool queued;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      queued = findQueued(addr + i, values[i]);
+    }
+    if (!queued)
+    {
+      if (!held)
+      {
+        holdWrites();
+        held = true;
+      }
+      values[i] = readCell(addr + i);
+    }
+  }
+  if (held)
+  {
+    resumeWrites();
+  }
+}
+
+/**
+ * Looks for the newest queued value for addr. Call with interrupts off.
+ */
+bool EepromStore::findQueued(int addr, byte &value)
+{
+  for (byte n = rangeCount; n-- > 0;)
+  {
+    const Range &r = ranges[rangeIndex(range + n)];
+    int index = addr - r.addr;
+    if (index >= 0 && index < r.length)
+    {
+      value = data[dataIndex(r.start + index)];
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Returns true if the given number of ranges holding length bytes in total can be
+ * queued without waiting
+ */
+bool EepromStore::hasRoom(byte rangesNeeded, int length) const
+{
+  return rangeCount + rangesNeeded <= EEPROM_QUEUE_RANGES && dataUsed + length <= EEPROM_QUEUE_SIZE;
+}
+
+/**
+ * Queues a byte to be written if it is different to what is stored.
+ */
+void EepromStore::update(int addr, byte value)
+{
+  updateBytes(addr, &value, 1);
+}
+
+/**
+ * Queues bytes to be written and returns straight away. Only waits if the
+ * queue is full. Ranges are written in the order they were queued.
+ */
+void EepromStore::updateBytes(int addr, const byte *values, int length)
+{
+  while (length > 0)
+  {
+    byte chunk = length < EEPROM_QUEUE_SIZE ? length : EEPROM_QUEUE_SIZE;
+    // Space is given back as each range finishes being written
+    while (!hasRoom(1, chunk))
+    {
+      yield(); // does nothing on the UNO, the native tests move time on
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      Range &r = ranges[rangeIndex(range + rangeCount)];
+      r.addr = addr;
+      r.start = dataIndex(dataStart + dataUsed);
+      r.length = chunk;
+      for (byte i = 0; i < chunk; i++)
+      {
+        data[dataIndex(r.start + i)] = values[i];
+      }
+      dataUsed += chunk;
+      rangeCount++;
+      EECR |= 1 << EERIE;
+    }
+    addr += chunk;
+    values += chunk;
+    length -= chunk;
+  }
+}
+
+void EepromStore::fill(int addr, byte value, int length)
+{
+  byte values[EEPROM_QUEUE_SIZE];
+  memset(values, value, sizeof(values));
+  while (length > 0)
+  {
+    byte chunk = length < EEPROM_QUEUE_SIZE ? length : EEPROM_QUEUE_SIZE;
+    updateBytes(addr, values, chunk);
+    addr += chunk;
+    length -= chunk;
+  }
+}
+
+void EepromStore::waitUntilWritten()
+{
+  while (busy())
+  {
+    yield();
+  }
+}
+
+void EepromStore::resetCounts()
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    writeCount = 0;
+    skipCount = 0;
+    failureCount = 0;
+  }
+}
+
+/**
+ * Checks the byte written last, then starts writing the next queued byte that
+ * differs from what is stored. Unchanged bytes are skipped here without waiting
+ * for another interrupt.
+ */
+inline void EepromStore::writeNext()
+{
+  if (verifyPending)
+  {
+    verifyPending = false;
+    if (readCell(verifyAddr) != verifyValue)
+    {
+      failureCount++;
+    }
+  }
+
+  while (rangeCount != 0)
+  {
+    Range &r = ranges[range];
+    while (offset < r.length)
+    {
+      int addr = r.addr + offset;
+      byte value = data[dataIndex(r.start + offset)];
+      offset++;
+      if (readCell(addr) == value)
+      {
+        skipCount++;
+        continue;
+      }
+      EEDR = value;
+      EECR = (EECR & (1 << EERIE)) | (1 << EEMPE);
+      EECR |= 1 << EEPE;
+      writeCount++;
+      verifyAddr = addr;
+      verifyValue = value;
+      verifyPending = true;
+      return;
+    }
+
+    // The range is written, give its space back
+    dataStart = dataIndex(dataStart + r.length);
+    dataUsed -= r.length;
+    range = rangeIndex(range + 1);
+    rangeCount--;
+    offset = 0;
+  }
+
+  EECR &= ~(1 << EERIE);
+}
+
+ISR(EE_READY_vect)
+{
+  EepromStorage.writeNext();
+}
+
+/**
+ * Continues a CRC-8 (CCITT) over more data. Start with a crc of 0.
+ */
+byte EepromStore::crc8(byte crc, const byte *data, int length)
+{
+  for (int i = 0; i < length; i++)
+  {
+    crc = _crc8_ccitt_update(crc, data[i]);
+  }
+  return crc;
+}
+
+/*
+   --------------------------------------------------------------------------------------
+   WEAR LEVELLED BYTE
+   Each slot holds a sequence number and a value. Every write goes to the slot after
+   the latest one with the next sequence number, so the latest slot is the one whose
+   following slot does not continue the sequence.
+   --------------------------------------------------------------------------------------
+*/
+WearLevelledByte::WearLevelledByte(EepromStore &store, int addr, byte slots)
+    : store(store), addr(addr), slots(slots), slot(255)
+{
+}
+
+/**
+ * Finds the latest slot. Only the first call reads the EEPROM, after that write() keeps track of it.
+ */
+void WearLevelledByte::findLatestSlot()
+{
+  if (slot != 255)
+  {
+    return;
+  }
+  slot = 0;
+  while (slot < slots - 1)
+  {
+    byte next = store.read(addr + (slot + 1) * 2);
+    if (next != (byte)(store.read(addr + slot * 2) + 1))
+    {
+      break;
+    }
+    slot++;
+  }
+  sequence = store.read(addr + slot * 2);
+  value = store.read(addr + slot * 2 + 1);
+}
+
+/**
+ * Returns the value last written, or 255 if nothing has been written
+ */
+byte WearLevelledByte::read()
+{
+  findLatestSlot();
+  return value;
+}
+
+void WearLevelledByte::write(byte newValue)
+{
+  findLatestSlot();
+  if (value == newValue)
+  {
+    return; // unchanged
+  }
+  slot = (slot + 1) % slots;
+  sequence++;
+  value = newValue;
+  int slotAddr = addr + slot * 2;
+  // Write the value before the sequence number so a power cut leaves the previous slot as the latest
+  store.update(slotAddr + 1, value);
+  store.update(slotAddr, sequence);
+}
@@ -0,0 +1,106 @@
+/*
+ * EEPROM storage helpers.
+ *
+ * Each EEPROM write takes about 3.3ms and wears the cell. EepromStore queues
+ * writes and programs them one byte at a time from the EEPROM ready interrupt,
+ * so saving returns immediately and loop() keeps running while the bytes are
+ * written. Each queued byte is compared with what is stored first and only
+ * written if it has changed. Reads of queued bytes are served from the queue.
+ *
+ * The queue is a ring and the space of each range is given back as soon as it
+ * has been written. Queuing only waits when there is no room, so code that must
+ * not wait checks hasRoom() first and tries again later.
+ *
+ * WearLevelledByte keeps a value that is rewritten often in a ring of slots,
+ * writing each new value to the next slot, so that no single cell wears out.
+ */
+
+#ifndef EEPROMSTORE_H
+#define EEPROMSTORE_H
+
+#include <Arduino.h>
+
+// Bytes that can be waiting to be written. Override with a build flag.
+#ifndef EEPROM_QUEUE_SIZE
+#define EEPROM_QUEUE_SIZE 48
+#endif
+
+// Separate address ranges that can be waiting to be written
+#ifndef EEPROM_QUEUE_RANGES
+#define EEPROM_QUEUE_RANGES 6
+#endif
+
+#if EEPROM_QUEUE_SIZE > 127 || EEPROM_QUEUE_RANGES > 127
+#error "The EEPROM queue is indexed with bytes"
+#endif
+
+class EepromStore
+{
+public:
+  volatile unsigned int writeCount;    // Bytes written
+  volatile unsigned int skipCount;     // Bytes not written because they were unchanged
+  volatile unsigned int failureCount;  // Bytes that did not read back as written
+
+  byte read(int addr);
+  void readBytes(int addr, byte *values, int length);
+  void update(int addr, byte value);
+  void updateBytes(int addr, const byte *data, int length);
+  void fill(int addr, byte value, int length);
+  bool busy() const { return rangeCount != 0; }
+  bool hasRoom(byte rangesNeeded, int length) const;
+  void waitUntilWritten();
+  void resetCounts();
+  static byte crc8(byte crc, const byte *data, int length);
+
+  // Only to be called from the EEPROM ready interrupt handler
+  inline void writeNext();
+
+private:
+  struct Range
+  {
+    int addr;
+    byte start; // Index of the first byte in data
+    byte length;
+  };
+
+  byte data[EEPROM_QUEUE_SIZE];      // A ring of the queued bytes
+  Range ranges[EEPROM_QUEUE_RANGES]; // A ring of the queued ranges, oldest first
+  volatile byte rangeCount; // Ranges queued, including the one being written
+  volatile byte dataUsed;
+  byte range;               // The range being written, the oldest one
+  byte dataStart;           // The first byte of that range in data
+  byte offset;              // The next byte of that range to write
+  int verifyAddr;           // The byte being written, checked once it has finished
+  byte verifyValue;
+  bool verifyPending;
+
+  bool findQueued(int addr, byte &value);
+  void holdWrites();
+  void resumeWrites();
+  static byte dataIndex(int index) { return (index < EEPROM_QUEUE_SIZE) ? index : index - EEPROM_QUEUE_SIZE; }
+  static byte rangeIndex(int index) { return (index < EEPROM_QUEUE_RANGES) ? index : index - EEPROM_QUEUE_RANGES; }
+};
+
+extern EepromStore EepromStorage;
+
+class WearLevelledByte
+{
+public:
+  static const byte WRITE_RANGES = 2; // Ranges queued by write()
+
+  WearLevelledByte(EepromStore &store, int addr, byte slots);
+  byte read();
+  void write(byte value);
+  static constexpr int size(byte slots) { return slots * 2; }
+
+private:
+  EepromStore &store;
+  int addr;
+  byte slots;
+  byte slot;     // The latest slot, found by the first read() or write()
+  byte sequence; // and its sequence number and value
+  byte value;
+  void findLatestSlot();
+};
+
+#endif
@@ -0,0 +1,357 @@
+#include "JsonStream.h"
+
+#if JSON_MAX_DEPTH > 8
+#error "JSON_MAX_DEPTH must be no larger than 8"
+#endif
+
+/*
+   --------------------------------------------------------------------------------------
+   WRITER
+   --------------------------------------------------------------------------------------
+*/
+JsonWriter::JsonWriter(Print &out) : out(out)
+{
+  reset();
+}
+
+void JsonWriter::reset()
+{
+  depth = 0;
+  hasItems = 0;
+  afterKey = false;
+  pendingBreak = false;
+}
+
+/**
+ * Writes the comma before every item of a container but the first
+ */
+void JsonWriter::separate()
+{
+  if (afterKey)
+  {
+    afterKey = false; // the key is the start of this item
+    return;
+  }
+  if (depth > 0)
+  {
+    byte mask = 1 << (depth - 1);
+    if (hasItems & mask)
+    {
+      out.write(',');
+    }
+    hasItems |= mask;
+  }
+  if (pendingBreak)
+  {
+    pendingBreak = false;
+    out.println();
+  }
+}
+
+void JsonWriter::beginObject()
+{
+  separate();
+  out.write('{');
+  depth++;
+  hasItems &= ~(1 << (depth - 1));
+}
+
+void JsonWriter::endObject()
+{
+  depth--;
+  out.write('}');
+}
+
+void JsonWriter::beginArray()
+{
+  separate();
+  out.write('[');
+  depth++;
+  hasItems &= ~(1 << (depth - 1));
+}
+
+void JsonWriter::endArray()
+{
+  depth--;
+  out.write(']');
+}
+
+void JsonWriter::key(const __FlashStringHelper *name)
+{
+  separate();
+  out.write('"');
+  out.print(name);
+  out.write('"');
+  out.write(':');
+  afterKey = true;
+}
+
+void JsonWriter::value(long number)
+{
+  separate();
+  out.print(number);
+}
+
+void JsonWriter::null()
+{
+  separate();
+  out.print(F("null"));
+}
+
+void JsonWriter::breakLine()
+{
+  pendingBreak = true;
+}
+
+/*
+   --------------------------------------------------------------------------------------
+   READER
+   --------------------------------------------------------------------------------------
+*/
+static const char literalNull[] PROGMEM = "null";
+static const char literalTrue[] PROGMEM = "true";
+static const char literalFalse[] PROGMEM = "false";
+
+JsonReader::JsonReader(Handler handler) : handler(handler)
+{
+  reset();
+}
+
+void JsonReader::reset()
+{
+  state = S_VALUE;
+  level = 0;
+  arrays = 0;
+  keyBuffer[0] = 0;
+  keyLength = 0;
+}
+
+bool JsonReader::keyIs(const __FlashStringHelper *name) const
+{
+  return strcmp_P(keyBuffer, (PGM_P)name) == 0;
+}
+
+bool JsonReader::fail()
+{
+  state = S_ERROR;
+  return false;
+}
+
+bool JsonReader::beginContainer(bool isArray)
+{
+  if (level == JSON_MAX_DEPTH)
+  {
+    return fail();
+  }
+  handler(*this, isArray ? BEGIN_ARRAY : BEGIN_OBJECT);
+  if (isArray)
+  {
+    arrays |= 1 << level;
+  }
+  else
+  {
+    arrays &= ~(1 << level);
+  }
+  indices[level] = 0;
+  level++;
+  state = isArray ? S_VALUE_OR_END : S_KEY_OR_END;
+  return true;
+}
+
+bool JsonReader::endContainer(bool isArray)
+{
+  bool topIsArray = arrays & (1 << (level - 1));
+  if (topIsArray != isArray)
+  {
+    return fail();
+  }
+  level--;
+  handler(*this, isArray ? END_ARRAY : END_OBJECT);
+  valueComplete();
+  return true;
+}
+
+void JsonReader::valueComplete()
+{
+  state = (level == 0) ? S_DONE : S_NEXT;
+}
+
+/**
+ * Reads the next character of the document.
+ * Returns false once the document is not valid JSON.
+ */
+bool JsonReader::feed(char c)
+{
+  // Numbers have no terminator so the character after one is read again as what follows it
+  if (state == S_NUMBER)
+  {
+    if (c >= '0' && c <= '9')
+    {
+      numberValue = numberValue * 10 + (c - '0');
+      hasDigits = true;
+      return true;
+    }
+    if (!hasDigits)
+    {
+      return fail();
+    }
+    if (negative)
+    {
+      numberValue = -numberValue;
+    }
+    handler(*this, NUMBER);
+    valueComplete();
+  }
+
+  bool space = (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+
+  switch (state)
+  {
+  case S_VALUE_OR_END:
+    if (c == ']')
+    {
+      return endContainer(true);
+    }
+    // fall through
+  case S_VALUE:
+    if (space)
+    {
+      return true;
+    }
+    if (c == '{' || c == '[')
+    {
+      return beginContainer(c == '[');
+    }
+    if (c == '"')
+    {
+      state = S_STRING;
+      return true;
+    }
+    if (c == '-' || (c >= '0' && c <= '9'))
+    {
+      negative = (c == '-');
+      hasDigits = !negative;
+      numberValue = negative ? 0 : c - '0';
+      state = S_NUMBER;
+      return true;
+    }
+    literal = (c == 'n') ? literalNull : (c == 't') ? literalTrue : (c == 'f') ? literalFalse : NULL;
+    if (literal == NULL)
+    {
+      return fail();
+    }
+    literalLength = 1;
+    state = S_LITERAL;
+    return true;
+
+  case S_LITERAL:
+    if (c != (char)pgm_read_byte(literal + literalLength))
+    {
+      return fail();
+    }
+    literalLength++;
+    if (pgm_read_byte(literal + literalLength) == 0)
+    {
+      numberValue = (literal == literalTrue);
+      handler(*this, (literal == literalNull) ? NULL_VALUE : BOOLEAN);
+      valueComplete();
+    }
+    return true;
+
+  case S_STRING:
+    if (c == '\\')
+    {
+      state = S_STRING_ESCAPE;
+    }
+    else if (c == '"')
+    {
+      handler(*this, STRING);
+      valueComplete();
+    }
+    return true;
+
+  case S_STRING_ESCAPE:
+    // The escaped character can't end the string. \uXXXX is left to be read as plain characters.
+    state = S_STRING;
+    return true;
+
+  case S_KEY_OR_END:
+    if (c == '}')
+    {
+      return endContainer(false);
+    }
+    // fall through
+  case S_KEY_START:
+    if (space)
+    {
+      return true;
+    }
+    if (c != '"')
+    {
+      return fail();
+    }
+    keyLength = 0;
+    keyBuffer[0] = 0;
+    state = S_KEY;
+    return true;
+
+  case S_KEY:
+    if (c == '\\')
+    {
+      state = S_KEY_ESCAPE;
+      return true;
+    }
+    if (c == '"')
+    {
+      state = S_COLON;
+      return true;
+    }
+    // fall through
+  case S_KEY_ESCAPE:
+    if (state == S_KEY_ESCAPE)
+    {
+      state = S_KEY;
+    }
+    if (keyLength < JSON_READER_KEY_SIZE - 1)
+    {
+      keyBuffer[keyLength++] = c;
+      keyBuffer[keyLength] = 0;
+    }
+    return true;
+
+  case S_COLON:
+    if (space)
+    {
+      return true;
+    }
+    if (c != ':')
+    {
+      return fail();
+    }
+    state = S_VALUE;
+    return true;
+
+  case S_NEXT:
+    if (space)
+    {
+      return true;
+    }
+    if (c == ',')
+    {
+      indices[level - 1]++;
+      state = (arrays & (1 << (level - 1))) ? S_VALUE : S_KEY_START;
+      return true;
+    }
+    if (c == ']' || c == '}')
+    {
+      return endContainer(c == ']');
+    }
+    return fail();
+
+  case S_DONE:
+    return space || fail();
+
+  default:
+    return false;
+  }
+}
@@ -0,0 +1,125 @@
+/*
+ * Streaming JSON writer and reader that use a fixed amount of RAM.
+ *
+ * JsonWriter sends each token to a Print as it is written, so a document of
+ * any length can be produced without building it in memory.
+ *
+ * JsonReader is a push parser. Characters are fed in one at a time as they
+ * arrive and a handler is called for each value, so a document of any length
+ * can be read with only the reader's own state. Only integer numbers are
+ * supported. String values are reported but their contents are not kept, and
+ * object keys are kept up to JSON_READER_KEY_SIZE - 1 characters.
+ */
+
+#ifndef JSONSTREAM_H
+#define JSONSTREAM_H
+
+#include <Arduino.h>
+
+// The deepest nesting of objects and arrays. Override with a build flag.
+#ifndef JSON_MAX_DEPTH
+#define JSON_MAX_DEPTH 8
+#endif
+
+// Room for an object key including its terminator
+#ifndef JSON_READER_KEY_SIZE
+#define JSON_READER_KEY_SIZE 10
+#endif
+
+class JsonWriter
+{
+public:
+  JsonWriter(Print &out);
+  void reset();
+  void beginObject();
+  void endObject();
+  void beginArray();
+  void endArray();
+  void key(const __FlashStringHelper *name); // The name is sent as it is, without escaping
+  void value(long number);
+  void null();
+  void breakLine(); // Starts the next item on a new line
+
+private:
+  Print &out;
+  byte depth;
+  byte hasItems; // Bit n is set once the container at depth n has an item
+  bool afterKey;
+  bool pendingBreak;
+  void separate();
+};
+
+class JsonReader
+{
+public:
+  enum Event
+  {
+    BEGIN_OBJECT,
+    END_OBJECT,
+    BEGIN_ARRAY,
+    END_ARRAY,
+    NUMBER,
+    STRING,
+    BOOLEAN,
+    NULL_VALUE
+  };
+
+  typedef void (*Handler)(JsonReader &reader, byte event);
+
+  JsonReader(Handler handler);
+  void reset();
+  bool feed(char c);
+  bool done() const { return state == S_DONE; }
+  bool failed() const { return state == S_ERROR; }
+
+  // The containers around the value being reported. For BEGIN and END events
+  // this does not include the container that begins or ends.
+  byte depth() const { return level; }
+  // The position of the value in the container at the given depth (0 is the outermost)
+  byte index(byte atDepth) const { return indices[atDepth]; }
+  byte index() const { return indices[level - 1]; }
+  // The last object key that was read
+  const char *key() const { return keyBuffer; }
+  bool keyIs(const __FlashStringHelper *name) const;
+  // The value of a NUMBER or BOOLEAN event
+  long number() const { return numberValue; }
+
+private:
+  enum State
+  {
+    S_VALUE,
+    S_VALUE_OR_END, // After '['
+    S_KEY_OR_END,   // After '{'
+    S_KEY_START,    // After ',' in an object
+    S_KEY,
+    S_KEY_ESCAPE,
+    S_COLON,
+    S_STRING,
+    S_STRING_ESCAPE,
+    S_NUMBER,
+    S_LITERAL,
+    S_NEXT, // After a value, expecting ',' or the end of the container
+    S_DONE,
+    S_ERROR
+  };
+
+  Handler handler;
+  byte state;
+  byte level;
+  byte arrays; // Bit n is set if the container at depth n is an array
+  byte indices[JSON_MAX_DEPTH];
+  char keyBuffer[JSON_READER_KEY_SIZE];
+  byte keyLength;
+  long numberValue;
+  bool negative;
+  bool hasDigits;
+  const char *literal; // The literal being matched, in PROGMEM
+  byte literalLength;
+
+  bool beginContainer(bool isArray);
+  bool endContainer(bool isArray);
+  void valueComplete();
+  bool fail();
+};
+
+#endif
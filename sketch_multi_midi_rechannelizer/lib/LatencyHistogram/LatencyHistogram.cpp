@@ -0,0 +1,98 @@
+#include "LatencyHistogram.h"
+
+LatencyHistogram::LatencyHistogram()
+{
+  reset();
+}
+
+void LatencyHistogram::reset()
+{
+  memset(bins, 0, sizeof(bins));
+  samples = 0;
+  minimum = 0xFFFF;
+  maximum = 0;
+}
+
+/**
+ * Returns the bin that holds value: the position of its highest bit and the bit below it
+ */
+byte LatencyHistogram::binOf(word value)
+{
+  if (value < 4)
+  {
+    return value;
+  }
+  byte top = 15;
+  while (!(value & 0x8000))
+  {
+    value <<= 1;
+    top--;
+  }
+  return (top << 1) | ((value >> 14) & 1);
+}
+
+/**
+ * Returns the largest value that goes in bin
+ */
+word LatencyHistogram::binLimit(byte bin)
+{
+  if (bin < 4)
+  {
+    return bin;
+  }
+  byte top = bin >> 1;
+  word half = 1 << (top - 1);
+  word lower = (1 << top) | ((bin & 1) ? half : 0);
+  return lower + (half - 1);
+}
+
+void LatencyHistogram::add(word value)
+{
+  byte bin = binOf(value);
+  if (bins[bin] == 0xFFFF)
+  {
+    for (byte b = 0; b < BINS; b++)
+    {
+      bins[b] >>= 1;
+    }
+  }
+  bins[bin]++;
+  samples++;
+  if (value < minimum)
+  {
+    minimum = value;
+  }
+  if (value > maximum)
+  {
+    maximum = value;
+  }
+}
+
+/**
+ * Returns the value that percent of the values are no larger than, or 0 if there are none
+ */
+word LatencyHistogram::percentile(byte percent) const
+{
+  unsigned long total = 0;
+  for (byte b = 0; b < BINS; b++)
+  {
+    total += bins[b];
+  }
+  if (total == 0)
+  {
+    return 0;
+  }
+
+  unsigned long target = (total * percent + 99) / 100;
+  unsigned long seen = 0;
+  for (byte b = 0; b < BINS; b++)
+  {
+    seen += bins[b];
+    if (seen >= target && seen > 0)
+    {
+      word limit = binLimit(b);
+      return (limit < maximum) ? limit : maximum;
+    }
+  }
+  return maximum;
+}
@@ -0,0 +1,38 @@
+/*
+ * Log scale histogram of latencies.
+ *
+ * Each power of two is split into two bins, so 32 bins cover every 16 bit
+ * value with no more than 50% error in the top of the range and exact counts
+ * for values below 4. Adding a value is a bit scan and one increment, so it is
+ * cheap enough to do for every message.
+ *
+ * A bin that is about to overflow halves every bin, which keeps the shape of
+ * the distribution. Percentiles are the upper limit of the bin they fall in,
+ * clamped to the largest value seen.
+ */
+
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <Arduino.h>
+
+class LatencyHistogram
+{
+public:
+  static const byte BINS = 32;
+
+  unsigned int bins[BINS];
+  unsigned long samples; // Number of values added since the last reset
+  word minimum;
+  word maximum;
+
+  LatencyHistogram();
+  void reset();
+  void add(word value);
+  word percentile(byte percent) const;
+
+  static byte binOf(word value);
+  static word binLimit(byte bin);
+};
+
+#endif
@@ -0,0 +1,75 @@
+#include "LcdFrameBuffer.h"
+
+LcdFrameBuffer::LcdFrameBuffer(LiquidCrystal &display) : display(display)
+{
+  clear();
+}
+
+/**
+ * Call after the display has been initialised or cleared, so that it is known to be blank
+ */
+void LcdFrameBuffer::begin()
+{
+  memset(sent, ' ', sizeof(sent));
+  displayCol = 0;
+  displayRow = 0;
+}
+
+void LcdFrameBuffer::clear()
+{
+  memset(cells, ' ', sizeof(cells));
+  col = 0;
+  row = 0;
+}
+
+void LcdFrameBuffer::setCursor(byte col, byte row)
+{
+  this->col = col;
+  this->row = (row < ROWS) ? row : ROWS - 1;
+}
+
+size_t LcdFrameBuffer::write(uint8_t value)
+{
+  if (col >= COLS)
+  {
+    return 0; // off the end of the line
+  }
+  cells[row][col++] = value;
+  return 1;
+}
+
+/**
+ * Send changed cells to the display until the budget (in microseconds) is used up.
+ * Returns the number of cells sent.
+ */
+byte LcdFrameBuffer::flushChanges(unsigned int budgetMicros)
+{
+  unsigned long start = micros();
+  byte count = 0;
+  for (byte r = 0; r < ROWS; r++)
+  {
+    for (byte c = 0; c < COLS; c++)
+    {
+      if (cells[r][c] == sent[r][c])
+      {
+        continue;
+      }
+      if (count > 0 && micros() - start >= budgetMicros)
+      {
+        return count;
+      }
+      if (c != displayCol || r != displayRow)
+      {
+        display.setCursor(c, r);
+      }
+      display.write(cells[r][c]);
+      sent[r][c] = cells[r][c];
+      count++;
+
+      // The display moves its cursor on by itself, but not onto the next row
+      displayCol = c + 1;
+      displayRow = r;
+    }
+  }
+  return count;
+}
@@ -0,0 +1,42 @@
+/*
+ * Shadow frame buffer for a 16x2 HD44780 LCD.
+ *
+ * The UI prints into the frame buffer instead of the display. flushChanges()
+ * compares it with what has already been sent and only writes the cells that
+ * differ, moving the display cursor only when the next changed cell is not
+ * where the display's auto increment would put it. Each call stops once its
+ * time budget is used up and carries on from there on the next call, so LCD
+ * traffic per pass of loop() is bounded no matter how often the UI redraws.
+ */
+
+#ifndef LCDFRAMEBUFFER_H
+#define LCDFRAMEBUFFER_H
+
+#include <Arduino.h>
+#include <LiquidCrystal.h>
+
+class LcdFrameBuffer : public Print
+{
+public:
+  static const byte COLS = 16;
+  static const byte ROWS = 2;
+
+  LcdFrameBuffer(LiquidCrystal &display);
+  void begin();
+  void clear();
+  void setCursor(byte col, byte row);
+  size_t write(uint8_t value);
+  using Print::write;
+  byte flushChanges(unsigned int budgetMicros);
+
+private:
+  LiquidCrystal &display;
+  char cells[ROWS][COLS]; // What the UI wants shown
+  char sent[ROWS][COLS];  // What the display is showing
+  byte col;
+  byte row;
+  byte displayCol; // Where the display will write the next character,
+  byte displayRow; // displayCol is COLS when unknown
+};
+
+#endif
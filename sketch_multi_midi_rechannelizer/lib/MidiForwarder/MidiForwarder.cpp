@@ -0,0 +1,273 @@
+#include "MidiForwarder.h"
+
+/*
+ * Returns the number of data bytes that follow the given status byte.
+ * System exclusive is variable length and returns 0.
+ */
+static byte dataLength(byte status)
+{
+  switch (status & 0xF0)
+  {
+  case 0xC0: // Program Change
+  case 0xD0: // Channel Aftertouch
+    return 1;
+  case 0xF0:
+    break;
+  default:
+    return 2;
+  }
+
+  switch (status)
+  {
+  case 0xF1: // Time Code Quarter Frame
+  case 0xF3: // Song Select
+    return 1;
+  case 0xF2: // Song Position
+    return 2;
+  default:
+    return 0;
+  }
+}
+
+/*
+   --------------------------------------------------------------------------------------
+   ROUTING TABLE
+   --------------------------------------------------------------------------------------
+*/
+MidiRoutingTable::MidiRoutingTable()
+{
+  // Each channel maps to itself
+  beginBuild();
+  for (byte i = 0; i < 16; i++)
+  {
+    addInputChannel(i, 0);
+  }
+  // Forward everything
+  memset(allowed, 0xFF, FILTER_SIZE);
+}
+
+/**
+ * Sets which messages are forwarded. allowed is FILTER_SIZE bytes with bit
+ * (status & 0x7F) set for each status byte that is forwarded.
+ */
+void MidiRoutingTable::setFilter(const byte *allowed)
+{
+  memcpy(this->allowed, allowed, FILTER_SIZE);
+}
+
+/**
+ * Start building the table. addInputChannel() must then be called for each
+ * of the 16 input channels in order.
+ */
+void MidiRoutingTable::beginBuild()
+{
+  count = 0;
+  inputs = 0;
+  start[0] = 0;
+}
+
+/**
+ * Adds the outputs for the next input channel. layers has a bit set for each
+ * extra output channel (bit 0 is channel 0).
+ * Returns false if there was no room for all of the layers.
+ */
+bool MidiRoutingTable::addInputChannel(byte firstOutput, word layers)
+{
+  bool fits = true;
+  outputs[count++] = firstOutput;
+  for (byte channel = 0; channel < 16; channel++)
+  {
+    if ((layers & (1 << channel)) && channel != firstOutput)
+    {
+      if (count < MAX_DESTINATIONS)
+      {
+        outputs[count++] = channel;
+      }
+      else
+      {
+        fits = false;
+      }
+    }
+  }
+  start[++inputs] = count;
+  return fits;
+}
+
+/*
+   --------------------------------------------------------------------------------------
+   FORWARDER
+   --------------------------------------------------------------------------------------
+*/
+MidiForwarder::MidiForwarder(Print &out, const MidiRoutingTable &routing) : out(out), routing(&routing)
+{
+  reset();
+}
+
+void MidiForwarder::setRoutingTable(const MidiRoutingTable &routing)
+{
+  this->routing = &routing;
+}
+
+/**
+ * Forget any partially received message
+ */
+void MidiForwarder::reset()
+{
+  runningStatus = 0;
+  statusSent = false;
+  dropping = false;
+  dataExpected = 0;
+  dataCount = 0;
+}
+
+/**
+ * Send the message that has just been completed to the layered outputs
+ */
+void MidiForwarder::sendCopies()
+{
+  byte channel = runningStatus & 0x0F;
+  byte count = routing->destinationCount(channel);
+  const byte *destinations = routing->destinations(channel);
+  for (byte i = 1; i < count; i++)
+  {
+    out.write((runningStatus & 0xF0) | destinations[i]);
+    out.write(data[0]);
+    if (dataExpected > 1)
+    {
+      out.write(data[1]);
+    }
+  }
+}
+
+/**
+ * Forwards a single received byte to the output.
+ * Returns true when the byte completes a message, which is then available in
+ * status, data1 and data2.
+ */
+bool MidiForwarder::forward(byte value)
+{
+  if (value >= 0xF8)
+  {
+    // Realtime messages can appear anywhere, even in the middle of another message
+    if (routing->allows(value))
+    {
+      out.write(value);
+    }
+    status = value;
+    data1 = data2 = 0;
+    return true;
+  }
+
+  if (value & 0x80)
+  {
+    if (value == 0xF7 && runningStatus == 0xF0)
+    {
+      // End of system exclusive, which is dropped along with the rest of the message
+      if (!dropping)
+      {
+        out.write(value);
+      }
+      runningStatus = 0;
+      status = 0xF0;
+      data1 = data2 = 0;
+      return true;
+    }
+
+    dropping = !routing->allows(value);
+    if (dropping)
+    {
+      // Nothing is sent for a filtered message
+    }
+    else if (value < 0xF0)
+    {
+      // Channel message, rewrite the channel nibble for the first output
+      out.write((value & 0xF0) | routing->destinations(value & 0x0F)[0]);
+      statusSent = true;
+    }
+    else
+    {
+      out.write(value);
+    }
+
+    runningStatus = value;
+    dataExpected = dataLength(value);
+    dataCount = 0;
+
+    if (value >= 0xF0 && value != 0xF0 && dataExpected == 0)
+    {
+      // Single byte system common message e.g. Tune Request
+      runningStatus = 0;
+      status = value;
+      data1 = data2 = 0;
+      return true;
+    }
+    return false;
+  }
+
+  if (runningStatus == 0 || runningStatus == 0xF0)
+  {
+    // System exclusive payload or a stray data byte
+    if (runningStatus == 0 || !dropping)
+    {
+      out.write(value);
+    }
+    return false;
+  }
+
+  if (dataCount == 0 && runningStatus < 0xF0)
+  {
+    // Each message under running status is filtered by the table in use when
+    // it starts, which may have been swapped since the status byte arrived
+    dropping = !routing->allows(runningStatus);
+  }
+
+  // The data of a filtered message is not sent, but the message is still
+  // followed so the monitor sees it
+  if (!dropping)
+  {
+    if (runningStatus < 0xF0 && !statusSent)
+    {
+      // The input is using running status but the output may have sent other
+      // statuses since, so send it again. MidiOutput drops it if it is not needed.
+      out.write((runningStatus & 0xF0) | routing->destinations(runningStatus & 0x0F)[0]);
+      statusSent = true;
+    }
+
+    // Data bytes are passed straight through
+    out.write(value);
+  }
+
+  data[dataCount++] = value;
+  if (dataCount < dataExpected)
+  {
+    return false;
+  }
+
+  status = runningStatus;
+  data1 = data[0];
+  data2 = (dataExpected > 1) ? data[1] : 0;
+  dataCount = 0;
+  if (runningStatus >= 0xF0)
+  {
+    runningStatus = 0; // only channel messages use running status
+  }
+  else if (!dropping)
+  {
+    sendCopies();
+    statusSent = false;
+  }
+  return true;
+}
+
+/**
+ * Returns true if no message is part way through being sent, so that another
+ * message can be sent to the same output without breaking one up
+ */
+bool MidiForwarder::atMessageBoundary() const
+{
+  if (dropping || runningStatus == 0)
+  {
+    return true;
+  }
+  return runningStatus < 0xF0 && dataCount == 0 && !statusSent;
+}
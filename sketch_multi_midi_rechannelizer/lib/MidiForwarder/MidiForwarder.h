@@ -0,0 +1,85 @@
+/*
+ * Cut-through MIDI forwarder.
+ *
+ * Bytes are forwarded as soon as they are received instead of waiting for a
+ * whole message. The channel nibble of each channel status byte is rewritten
+ * through the routing table and data bytes are passed straight through, so the
+ * output is never more than one byte behind the input.
+ *
+ * When an input channel is layered onto more than one output channel the
+ * first output gets the message byte by byte and the copies for the other
+ * outputs are sent as soon as the message is complete.
+ *
+ * The forwarder also follows message boundaries so that the last complete
+ * message can be shown on the midi monitor.
+ */
+
+#ifndef MIDIFORWARDER_H
+#define MIDIFORWARDER_H
+
+#include <Arduino.h>
+
+/*
+ * The output channels for each input channel, precomputed from the midi map so
+ * that forwarding a message never has to scan a channel mask. The outputs of
+ * all input channels are packed into one list and start[] holds where each
+ * input channel's outputs begin. Channels are 0-15 as in the status byte.
+ *
+ * The table also holds which messages are forwarded at all, as one bit for
+ * each status byte from 0x80 to 0xFF, so filtering a message is a single
+ * lookup whatever its type and channel.
+ */
+class MidiRoutingTable
+{
+public:
+  // Outputs in total on top of the first output of each input channel. This is for all 16
+  // input channels together, not each one, so that a patch still fits in 32 bytes of EEPROM.
+  static const byte MAX_LAYERS = 5;
+  static const byte MAX_DESTINATIONS = 16 + MAX_LAYERS;
+
+  MidiRoutingTable();
+  void beginBuild();
+  bool addInputChannel(byte firstOutput, word layers);
+  byte destinationCount(byte inputChannel) const { return start[inputChannel + 1] - start[inputChannel]; }
+  const byte *destinations(byte inputChannel) const { return &outputs[start[inputChannel]]; }
+
+  static const byte FILTER_SIZE = 16;
+  void setFilter(const byte *allowed);
+  bool allows(byte status) const { return allowed[(status >> 3) & 0x0F] & (1 << (status & 0x07)); }
+
+private:
+  byte start[17];
+  byte outputs[MAX_DESTINATIONS];
+  byte count;  // Number of outputs added so far
+  byte inputs; // Number of input channels added so far
+  byte allowed[FILTER_SIZE]; // Bit (status & 0x7F) is set if messages with that status are forwarded
+};
+
+class MidiForwarder
+{
+public:
+  // The last complete message (input status and data bytes)
+  byte status;
+  byte data1;
+  byte data2;
+
+  MidiForwarder(Print &out, const MidiRoutingTable &routing);
+  void setRoutingTable(const MidiRoutingTable &routing);
+  bool forward(byte value);
+  void reset();
+  bool atMessageBoundary() const;
+
+private:
+  Print &out;
+  const MidiRoutingTable *routing;
+  byte runningStatus; // Status of the message currently being received, 0 if none
+  bool statusSent;    // Whether the status of the current message has been sent
+  bool dropping;      // Whether the current message is filtered out
+  byte dataExpected;  // Number of data bytes in the current message
+  byte dataCount;     // Number of data bytes received so far
+  byte data[2];
+
+  void sendCopies();
+};
+
+#endif
@@ -0,0 +1,48 @@
+#include "MidiOutput.h"
+
+MidiOutput::MidiOutput(Print &out) : out(out)
+{
+  runningStatusEnabled = true;
+  runningStatus = 0;
+  resetStats();
+}
+
+size_t MidiOutput::write(uint8_t value)
+{
+  offered++;
+
+  if (value >= 0x80 && value < 0xF8)
+  {
+    if (value >= 0xF0)
+    {
+      // System common and system exclusive cancel running status
+      runningStatus = 0;
+    }
+    else if (value == runningStatus && runningStatusEnabled)
+    {
+      return 1; // the receiver already has this status
+    }
+    else
+    {
+      runningStatus = value;
+    }
+  }
+
+  sent++;
+  return out.write(value);
+}
+
+/**
+ * Make sure the next channel message is sent with its status byte, e.g. after
+ * writing to the underlying port directly.
+ */
+void MidiOutput::cancelRunningStatus()
+{
+  runningStatus = 0;
+}
+
+void MidiOutput::resetStats()
+{
+  offered = 0;
+  sent = 0;
+}
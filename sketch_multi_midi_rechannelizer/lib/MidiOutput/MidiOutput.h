@@ -0,0 +1,41 @@
+/*
+ * Running status aware midi output.
+ *
+ * Bytes written to a MidiOutput are passed on to the underlying port, except
+ * for channel status bytes that repeat the status of the previous channel
+ * message. MIDI receivers reuse the last status (running status) so those
+ * bytes do not need to be sent. After channels are remapped several inputs can
+ * merge onto one output channel, so long runs of the same status are common.
+ *
+ * Realtime bytes do not affect running status. System common and system
+ * exclusive messages cancel it, as required by the MIDI specification.
+ */
+
+#ifndef MIDIOUTPUT_H
+#define MIDIOUTPUT_H
+
+#include <Arduino.h>
+
+class MidiOutput : public Print
+{
+public:
+  bool runningStatusEnabled;
+
+  MidiOutput(Print &out);
+  size_t write(uint8_t value);
+  using Print::write;
+  void cancelRunningStatus();
+
+  // Byte counts for comparing against sending every status byte
+  unsigned long bytesOffered() const { return offered; }
+  unsigned long bytesSent() const { return sent; }
+  void resetStats();
+
+private:
+  Print &out;
+  byte runningStatus; // The last channel status byte sent, 0 if none
+  unsigned long offered;
+  unsigned long sent;
+};
+
+#endif
@@ -0,0 +1,267 @@
+#include "MidiUart.h"
+
+#if (MIDI_UART_RX_BUFFER_SIZE & (MIDI_UART_RX_BUFFER_SIZE - 1)) || (MIDI_UART_RX_BUFFER_SIZE > 256)
+#error "MIDI_UART_RX_BUFFER_SIZE must be a power of two no larger than 256"
+#endif
+#if (MIDI_UART_TX_BUFFER_SIZE & (MIDI_UART_TX_BUFFER_SIZE - 1)) || (MIDI_UART_TX_BUFFER_SIZE > 256)
+#error "MIDI_UART_TX_BUFFER_SIZE must be a power of two no larger than 256"
+#endif
+
+#if MIDI_LATENCY_STATS && (MIDI_UART_LATENCY_QUEUE_SIZE & (MIDI_UART_LATENCY_QUEUE_SIZE - 1))
+#error "MIDI_UART_LATENCY_QUEUE_SIZE must be a power of two"
+#endif
+
+#define RX_MASK (MIDI_UART_RX_BUFFER_SIZE - 1)
+#define TX_MASK (MIDI_UART_TX_BUFFER_SIZE - 1)
+#define MARK_MASK (MIDI_UART_LATENCY_QUEUE_SIZE - 1)
+
+MidiUart MidiSerial;
+
+void MidiUart::begin(unsigned long baud)
+{
+  rxHead = rxTail = 0;
+  txHead = txTail = 0;
+  resetStats();
+
+  // Double speed mode gives an exact 31250 baud divisor on a 16MHz clock
+  uint16_t baudSetting = (F_CPU / 4 / baud - 1) / 2;
+  UCSR0A = 1 << U2X0;
+  UBRR0H = baudSetting >> 8;
+  UBRR0L = baudSetting;
+  UCSR0C = (1 << UCSZ01) | (1 << UCSZ00); // 8N1
+  UCSR0B = (1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0);
+
+#if MIDI_LATENCY_STATS
+  markHead = markSent = markTail = 0;
+  latencyOverflows = 0;
+  TCCR1A = 0;
+  TCCR1B = (1 << CS11) | (1 << CS10); // normal mode, clock / 64
+#endif
+}
+
+int MidiUart::available()
+{
+  return (byte)(rxHead - rxTail) & RX_MASK;
+}
+
+int MidiUart::peek()
+{
+  if (rxHead == rxTail)
+  {
+    return -1;
+  }
+  return rxBuffer[rxTail];
+}
+
+int MidiUart::read()
+{
+  byte tail = rxTail;
+  if (rxHead == tail)
+  {
+    return -1;
+  }
+  byte value = rxBuffer[tail];
+#if MIDI_LATENCY_STATS
+  readStamp = rxStamps[tail];
+#endif
+  rxTail = (tail + 1) & RX_MASK;
+  return value;
+}
+
+/**
+ * Copies up to maxBytes waiting bytes into buffer.
+ * Returns the number of bytes copied.
+ */
+byte MidiUart::readBatch(byte *buffer, byte maxBytes)
+{
+  byte tail = rxTail;
+  byte head = rxHead; // snapshot, the ISR may keep adding behind it
+  byte count = 0;
+  while (tail != head && count < maxBytes)
+  {
+    buffer[count++] = rxBuffer[tail];
+    tail = (tail + 1) & RX_MASK;
+  }
+  rxTail = tail;
+  return count;
+}
+
+#if MIDI_LATENCY_STATS
+/**
+ * As above, also copying the time each byte arrived into stamps
+ */
+byte MidiUart::readBatch(byte *buffer, byte maxBytes, word *stamps)
+{
+  byte tail = rxTail;
+  byte head = rxHead;
+  byte count = 0;
+  while (tail != head && count < maxBytes)
+  {
+    stamps[count] = rxStamps[tail];
+    buffer[count++] = rxBuffer[tail];
+    tail = (tail + 1) & RX_MASK;
+  }
+  rxTail = tail;
+  return count;
+}
+
+/**
+ * Marks the last byte written as the end of a message that started to arrive at startStamp.
+ * Its latency can be read with nextLatency() once that byte has gone to the transmitter.
+ */
+void MidiUart::markMessageSent(word startStamp)
+{
+  byte next = (markHead + 1) & MARK_MASK;
+  if (next == markTail)
+  {
+    latencyOverflows++;
+    return;
+  }
+  markPosition[markHead] = (txHead - 1) & TX_MASK;
+  markTicks[markHead] = startStamp;
+
+  byte oldSREG = SREG;
+  cli();
+  if (txTail == txHead)
+  {
+    // Already sent, and so has every message marked before it
+    markTicks[markHead] = TCNT1 - startStamp;
+    markSent = next;
+  }
+  markHead = next;
+  SREG = oldSREG;
+}
+
+/**
+ * Gets the latency in Timer1 ticks of the next marked message that has been sent.
+ * Returns false if there isn't one.
+ */
+bool MidiUart::nextLatency(word &ticks)
+{
+  if (markTail == markSent)
+  {
+    return false;
+  }
+  ticks = markTicks[markTail];
+  markTail = (markTail + 1) & MARK_MASK;
+  return true;
+}
+#endif
+
+size_t MidiUart::write(uint8_t value)
+{
+  byte next = (txHead + 1) & TX_MASK;
+  while (next == txTail)
+  {
+    // Buffer is full. If interrupts are off the ISR can't drain it so do it here.
+    if (!(SREG & 0x80) && (UCSR0A & (1 << UDRE0)))
+    {
+      txRegisterEmpty();
+    }
+  }
+  txBuffer[txHead] = value;
+
+  // The ISR clears UDRIE0 once it has sent the last byte. If it ran between the read and
+  // the write back of UCSR0B, UDRIE0 would be set again with nothing left to send.
+  byte oldSREG = SREG;
+  cli();
+  txHead = next;
+  UCSR0B |= 1 << UDRIE0;
+  SREG = oldSREG;
+  return 1;
+}
+
+void MidiUart::flush()
+{
+  while (txHead != txTail)
+  {
+    yield(); // does nothing on the UNO, the native tests move time on
+  }
+}
+
+// The count is two bytes wide, so it's read with the receive interrupt held off
+unsigned int MidiUart::overflowCount() const
+{
+  byte oldSREG = SREG;
+  cli();
+  unsigned int count = rxOverflows;
+  SREG = oldSREG;
+  return count;
+}
+
+void MidiUart::resetStats()
+{
+  byte oldSREG = SREG;
+  cli();
+  rxOverflows = 0;
+  rxHighWater = 0;
+  SREG = oldSREG;
+}
+
+inline void MidiUart::rxComplete()
+{
+#if MIDI_LATENCY_STATS
+  word stamp = TCNT1;
+#endif
+  byte value = UDR0;
+  byte head = rxHead;
+  byte next = (head + 1) & RX_MASK;
+  if (next == rxTail)
+  {
+    // No room, the byte is lost
+    if (rxOverflows != 0xFFFF)
+    {
+      rxOverflows++;
+    }
+    return;
+  }
+  rxBuffer[head] = value;
+#if MIDI_LATENCY_STATS
+  rxStamps[head] = stamp;
+#endif
+  rxHead = next;
+
+  byte used = (byte)(next - rxTail) & RX_MASK;
+  if (used > rxHighWater)
+  {
+    rxHighWater = used;
+  }
+}
+
+inline void MidiUart::txRegisterEmpty()
+{
+  byte tail = txTail;
+  UDR0 = txBuffer[tail];
+#if MIDI_LATENCY_STATS
+  byte mark = markSent;
+  if (mark != markHead && markPosition[mark] == tail)
+  {
+    markTicks[mark] = TCNT1 - markTicks[mark];
+    markSent = (mark + 1) & MARK_MASK;
+  }
+#endif
+  tail = (tail + 1) & TX_MASK;
+  txTail = tail;
+  if (tail == txHead)
+  {
+    UCSR0B &= ~(1 << UDRIE0); // nothing left to send
+  }
+}
+
+#if defined(USART_RX_vect)
+ISR(USART_RX_vect)
+#else
+ISR(USART0_RX_vect)
+#endif
+{
+  MidiSerial.rxComplete();
+}
+
+#if defined(USART_UDRE_vect)
+ISR(USART_UDRE_vect)
+#else
+ISR(USART0_UDRE_vect)
+#endif
+{
+  MidiSerial.txRegisterEmpty();
+}
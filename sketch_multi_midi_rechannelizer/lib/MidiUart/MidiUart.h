@@ -0,0 +1,111 @@
+/*
+ * Interrupt driven USART0 driver for MIDI.
+ *
+ * Incoming bytes are moved into a ring buffer by the USART receive interrupt
+ * as soon as they arrive, so a slow pass of loop() (LCD, keypad, EEPROM) does
+ * not overflow the receiver. The buffer has a single producer (the ISR) and a
+ * single consumer (loop()) so no locking is needed on either side.
+ *
+ * MidiUart replaces HardwareSerial for USART0. Do not use Serial in the same
+ * sketch: both define the USART0 interrupt handlers.
+ *
+ * Built with MIDI_LATENCY_STATS the receive interrupt also stamps each byte
+ * with the Timer1 count, and the transmit interrupt works out the latency of a
+ * message when its last byte is moved into the transmitter. Timer1 is left
+ * free running for this so it can't be used for anything else.
+ */
+
+#ifndef MIDIUART_H
+#define MIDIUART_H
+
+#include <Arduino.h>
+
+// Size of the receive ring buffer in bytes.
+// Must be a power of two no larger than 256. Override with a build flag.
+#ifndef MIDI_UART_RX_BUFFER_SIZE
+#define MIDI_UART_RX_BUFFER_SIZE 128
+#endif
+
+// Size of the transmit ring buffer in bytes. Same rules as above.
+#ifndef MIDI_UART_TX_BUFFER_SIZE
+#define MIDI_UART_TX_BUFFER_SIZE 64
+#endif
+
+// Set to 1 with a build flag to time each message through the box. It costs
+// two bytes of RAM for each byte of the receive buffer.
+#ifndef MIDI_LATENCY_STATS
+#define MIDI_LATENCY_STATS 0
+#endif
+
+#if MIDI_LATENCY_STATS
+// Number of sent messages whose latency can be waiting to be read. Must be a power of two.
+#ifndef MIDI_UART_LATENCY_QUEUE_SIZE
+#define MIDI_UART_LATENCY_QUEUE_SIZE 8
+#endif
+
+// Timer1 runs at F_CPU / 64, 4us a tick on a 16MHz clock, so it wraps after 262ms
+#define MIDI_UART_TICK_US (64 / (F_CPU / 1000000UL))
+#endif
+
+class MidiUart : public Stream
+{
+public:
+  void begin(unsigned long baud);
+  int available();
+  int peek();
+  int read();
+  byte readBatch(byte *buffer, byte maxBytes);
+  size_t write(uint8_t value);
+  using Print::write;
+  void flush();
+
+  // Number of bytes dropped because the receive buffer was full
+  unsigned int overflowCount() const;
+  // The largest number of bytes that have been waiting in the receive buffer
+  byte highWaterMark() const { return rxHighWater; }
+  void resetStats();
+
+#if MIDI_LATENCY_STATS
+  byte readBatch(byte *buffer, byte maxBytes, word *stamps);
+  // Timer1 count when the byte last returned by read() arrived
+  word lastReadStamp() const { return readStamp; }
+  // Position in the transmit buffer, which moves on when anything is written
+  byte txPosition() const { return txHead; }
+  void markMessageSent(word startStamp);
+  bool nextLatency(word &ticks);
+  // Number of messages that weren't timed because the latency queue was full
+  unsigned int latencyOverflows;
+#endif
+
+  // Only to be called from the USART interrupt handlers
+  inline void rxComplete();
+  inline void txRegisterEmpty();
+
+private:
+  volatile byte rxHead;
+  volatile byte rxTail;
+  byte rxBuffer[MIDI_UART_RX_BUFFER_SIZE];
+  volatile unsigned int rxOverflows;
+  volatile byte rxHighWater;
+
+  volatile byte txHead;
+  volatile byte txTail;
+  byte txBuffer[MIDI_UART_TX_BUFFER_SIZE];
+
+#if MIDI_LATENCY_STATS
+  word rxStamps[MIDI_UART_RX_BUFFER_SIZE];
+  word readStamp;
+
+  // Marked messages: the transmit buffer position of the last byte, and the
+  // stamp of the first byte received which the ISR replaces with the latency
+  byte markPosition[MIDI_UART_LATENCY_QUEUE_SIZE];
+  word markTicks[MIDI_UART_LATENCY_QUEUE_SIZE];
+  volatile byte markHead; // Next free entry, only changed by loop()
+  volatile byte markSent; // Next entry waiting to be sent, only changed by the ISR
+  byte markTail;          // Next latency to be read, only changed by loop()
+#endif
+};
+
+extern MidiUart MidiSerial;
+
+#endif
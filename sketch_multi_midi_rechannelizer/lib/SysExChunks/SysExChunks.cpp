@@ -0,0 +1,126 @@
+#include "SysExChunks.h"
+
+SysExChunkReader::SysExChunkReader(const byte *header, byte headerLength, Handler handler, ErrorHandler errorHandler)
+    : checksumErrors(0), header(header), headerLength(headerLength), handler(handler), errorHandler(errorHandler),
+      active(false)
+{
+}
+
+void SysExChunkReader::addNibble(byte value)
+{
+  if (value > 0x0F || nibbles >= SYSEX_CHUNK_SIZE * 2)
+  {
+    bad = true;
+    return;
+  }
+  if (nibbles & 1)
+  {
+    payload[nibbles >> 1] |= value;
+  }
+  else
+  {
+    payload[nibbles >> 1] = value << 4;
+  }
+  nibbles++;
+}
+
+void SysExChunkReader::receive(byte value)
+{
+  if (value >= 0xF8)
+  {
+    return; // realtime messages can appear in the middle of a system exclusive message
+  }
+
+  if (value == 0xF0)
+  {
+    active = true;
+    bad = false;
+    position = 0;
+    sum = 0;
+    hasPending = false;
+    nibbles = 0;
+    return;
+  }
+
+  if (!active)
+  {
+    return;
+  }
+
+  if (value & 0x80)
+  {
+    active = false;
+    if (value != 0xF7)
+    {
+      return; // cut short by another message
+    }
+    // The pending byte is the checksum, which is already in the sum
+    if (bad || !hasPending || (nibbles & 1) || (sum & 0x7F) != 0)
+    {
+      checksumErrors++;
+      if (errorHandler != NULL && position - headerLength >= 2)
+      {
+        errorHandler(command, index); // once the command and index have arrived
+      }
+      return;
+    }
+    handler(command, index, payload, nibbles >> 1);
+    return;
+  }
+
+  if (position < headerLength)
+  {
+    if (value != header[position])
+    {
+      active = false; // someone else's message
+    }
+    position++;
+    return;
+  }
+
+  sum += value;
+  byte offset = position - headerLength;
+  if (offset < 2)
+  {
+    position++;
+    if (offset == 0)
+    {
+      command = value;
+    }
+    else
+    {
+      index = value;
+    }
+    return;
+  }
+
+  if (hasPending)
+  {
+    addNibble(pending);
+  }
+  pending = value;
+  hasPending = true;
+}
+
+/**
+ * Sends one chunk as a complete system exclusive message
+ */
+void writeSysExChunk(Print &out, const byte *header, byte headerLength, byte command, byte index,
+                     const byte *payload, byte length)
+{
+  out.write(0xF0);
+  out.write(header, headerLength);
+  out.write(command);
+  out.write(index);
+  byte sum = command + index;
+  for (byte i = 0; i < length; i++)
+  {
+    byte high = payload[i] >> 4;
+    byte low = payload[i] & 0x0F;
+    out.write(high);
+    out.write(low);
+    sum += high + low;
+  }
+  out.write((byte)-sum & 0x7F);
+  out.write(0xF7);
+}
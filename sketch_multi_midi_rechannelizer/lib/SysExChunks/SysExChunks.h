@@ -0,0 +1,59 @@
+/*
+ * Blocks of data sent over midi in system exclusive messages.
+ *
+ * Each message is F0 <header> <command> <index> <payload> <checksum> F7. Each
+ * payload byte is sent as two data bytes, high nibble first, so any byte value
+ * can be sent. The checksum makes the low 7 bits of the sum of the command,
+ * index, payload and checksum bytes zero.
+ *
+ * SysExChunkReader is fed received bytes one at a time and calls a handler for
+ * each message with the right header and a good checksum. A message with the
+ * right header that arrives damaged is passed to an error handler, if there is
+ * one, so the sender can be asked for it again. Only one payload is held in
+ * RAM, so a large block can be received as a series of chunks.
+ */
+
+#ifndef SYSEXCHUNKS_H
+#define SYSEXCHUNKS_H
+
+#include <Arduino.h>
+
+// The largest payload in bytes. Override with a build flag.
+#ifndef SYSEX_CHUNK_SIZE
+#define SYSEX_CHUNK_SIZE 32
+#endif
+
+class SysExChunkReader
+{
+public:
+  typedef void (*Handler)(byte command, byte index, const byte *payload, byte length);
+  typedef void (*ErrorHandler)(byte command, byte index);
+
+  unsigned int checksumErrors; // Messages with the right header that were not valid
+
+  SysExChunkReader(const byte *header, byte headerLength, Handler handler, ErrorHandler errorHandler = NULL);
+  void receive(byte value);
+
+private:
+  const byte *header;
+  byte headerLength;
+  Handler handler;
+  ErrorHandler errorHandler;
+  bool active;     // In a message whose header matches so far
+  bool bad;        // The payload is too long or has a byte that isn't a nibble
+  byte position;   // Data bytes received since the F0
+  byte sum;
+  byte command;
+  byte index;
+  bool hasPending; // The last data byte is held back until it is known not to be the checksum
+  byte pending;
+  byte nibbles;
+  byte payload[SYSEX_CHUNK_SIZE];
+
+  void addNibble(byte value);
+};
+
+void writeSysExChunk(Print &out, const byte *header, byte headerLength, byte command, byte index,
+                     const byte *payload, byte length);
+
+#endif
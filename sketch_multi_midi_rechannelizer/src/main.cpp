@@ -1,13 +1,21 @@
 #include <LiquidCrystal.h>
 #include <MIDI.h>
 #include <midi_DEFS.h>
-#include <EEPROM.h>
 #include "AnalogDebounce.h"
-#include <ArduinoJson.h>
+#include "MidiUart.h"
+#include "MidiForwarder.h"
+#include "MidiOutput.h"
+#include "LcdFrameBuffer.h"
+#include "EepromStore.h"
+#include "JsonStream.h"
+#include "SysExChunks.h"
+#include "LatencyHistogram.h"
 
 //#include <SoftwareSerial.h>
 
-MIDI_CREATE_INSTANCE(HardwareSerial, Serial, midiA);
+// MIDI is received through the interrupt driven MidiUart rather than HardwareSerial
+// so that bytes are buffered even while loop() is busy with the LCD or EEPROM
+MIDI_CREATE_INSTANCE(MidiUart, MidiSerial, midiA);
 
 const byte rxPin = 3;
 const byte txPin = 2;
@@ -15,7 +23,11 @@ const byte txPin = 2;
 //SoftwareSerial mySerial(rxPin, txPin);
 
 // select the pins used on the LCD panel
-LiquidCrystal lcd(8, 9, 4, 5, 6, 7);
+LiquidCrystal lcdDisplay(8, 9, 4, 5, 6, 7);
+
+// The UI draws into this frame buffer. Only the characters that change are sent to the display
+LcdFrameBuffer lcd(lcdDisplay);
+const unsigned int LCD_FLUSH_BUDGET = 400; // The most time (us) spent updating the display per pass of loop()
 
 #define BUTTON_ADC_PIN A0 // A0 is the button ADC input for the Keypad
 
@@ -40,133 +52,57 @@ const byte MaxChannel = 16;
 
 /*
    --------------------------------------------------------------------------------------
-   EXTENDED EEPROM READ AND WRITE FUNCTIONS 
+   EEPROM
    --------------------------------------------------------------------------------------
 */
 // Absolute min and max eeprom addresses. Actual values are hardware-dependent.
-// These values can be changed e.g. to protect eeprom cells outside this range.
 const int EEPROM_MIN_ADDR = 0;
 const int EEPROM_MAX_ADDR = 1023; // Arduino UNO => 1024B
 
-// Returns true if the address is between the
-// minimum and maximum allowed values, false otherwise.
-//
-// This function is used by the other, higher-level functions
-// to prevent bugs and runtime errors due to invalid addresses.
-boolean eeprom_is_addr_ok(int addr)
-{
-  return ((addr >= EEPROM_MIN_ADDR) && (addr <= EEPROM_MAX_ADDR));
-}
-
-/**
-   Writes a sequence of bytes to eeprom starting at the specified address.
-   Returns true if the whole array is successfully written.
-   Returns false if the start or end addresses aren't between the minimum and maximum allowed values.
-   When returning false, nothing gets written to eeprom.
-*/
-boolean eeprom_write_bytes(int startAddr, const byte *array, int numBytes)
-{
-  int i;
-  // both first byte and last byte addresses must fall within the allowed range
-  if (!eeprom_is_addr_ok(startAddr) || !eeprom_is_addr_ok(startAddr + numBytes))
-  {
-    return false;
-  }
-  for (i = 0; i < numBytes; i++)
-  {
-    EEPROM.write(startAddr + i, array[i]);
-  }
-  return true;
-}
-
-/**
-   Writes a string starting at the specified address.
-   Returns true if the whole string is successfully written.
-   Returns false if the address of one or more bytes fall outside the allowed range.
-   If false is returned, nothing gets written to the eeprom.
-*/
-boolean eeprom_write_string(int addr, const char *string)
-{
-  int numBytes;                  // actual number of bytes to be written
-  numBytes = strlen(string) + 1; //write the string contents plus the string terminator byte (0x00)
-  return eeprom_write_bytes(addr, (const byte *)string, numBytes);
-}
-
-/**
-   Reads a string starting from the specified address.
-   Returns true if at least one byte (even only the string terminator one) is read.
-   Returns false if the start address falls outside the allowed range or declare buffer size is zero.
-
-   The reading might stop for several reasons:
-   - no more space in the provided buffer
-   - last eeprom address reached
-   - string terminator byte (0x00) encountered.
-*/
-boolean eeprom_read_string(int addr, char *buffer, int bufSize)
-{
-  byte ch;       // byte read from eeprom
-  int bytesRead; // number of bytes read so far
-  if (!eeprom_is_addr_ok(addr))
-  { // check start address
-    return false;
-  }
-
-  if (bufSize == 0)
-  { // how can we store bytes in an empty buffer ?
-    return false;
-  }
-  // is there is room for the string terminator only, no reason to go further
-  if (bufSize == 1)
-  {
-    buffer[0] = 0;
-    return true;
-  }
-  bytesRead = 0;                      // initialize byte counter
-  ch = EEPROM.read(addr + bytesRead); // read next byte from eeprom
-  buffer[bytesRead] = ch;             // store it into the user buffer
-  bytesRead++;                        // increment byte counter
-  // stop conditions:
-  // - the character just read is the string terminator one (0x00)
-  // - we have filled the user buffer
-  // - we have reached the last eeprom address
-  while ((ch != 0x00) && (bytesRead < bufSize) && ((addr + bytesRead) <= EEPROM_MAX_ADDR))
-  {
-    // if no stop condition is met, read the next byte from eeprom
-    ch = EEPROM.read(addr + bytesRead);
-    buffer[bytesRead] = ch; // store it into the user buffer
-    bytesRead++;            // increment byte counter
-  }
-  // make sure the user buffer has a string terminator, (0x00) as its last byte
-  if ((ch != 0x00) && (bytesRead >= 1))
-  {
-    buffer[bytesRead - 1] = 0;
-  }
-  return true;
-}
-
 /*
    --------------------------------------------------------------------------------------
    MENU
    --------------------------------------------------------------------------------------
 */
 byte curMenuIndex = 0; // The currently selected menu page index
-const byte NUM_MENU_PAGES = 6;
+#if MIDI_LATENCY_STATS
+const byte NUM_MENU_PAGES = 12;
+#else
+const byte NUM_MENU_PAGES = 11;
+#endif
 
 String menu[] = {
     "LOAD PATCH",
     "MIDIMAP",
+    "MIDI LAYERS",
+    "MIDI FILTERS",
     "SAVE PATCH",
     "CLEAR PATCH",
     "RESET MIDIMAP",
-    "MIDI MONITOR"};
+    "MIDI MONITOR",
+    "FORWARD MODE",
+    "PROGRAM CHANNEL",
+    "BACKUP PATCHES",
+#if MIDI_LATENCY_STATS
+    "LATENCY (us)",
+#endif
+};
 
 // These constants must be in the order of the above menu
 const byte MENU_LOAD_PATCH = 0;
 const byte MENU_MIDIMAP = 1;
-const byte MENU_SAVE_PATCH = 2;
-const byte MENU_CLEAR_PATCH = 3;
-const byte MENU_RESET_MIDIMAP = 4;
-const byte DEBUG_MENU_MONITOR = 5;
+const byte MENU_MIDI_LAYERS = 2;
+const byte MENU_MIDI_FILTERS = 3;
+const byte MENU_SAVE_PATCH = 4;
+const byte MENU_CLEAR_PATCH = 5;
+const byte MENU_RESET_MIDIMAP = 6;
+const byte DEBUG_MENU_MONITOR = 7;
+const byte MENU_FORWARD_MODE = 8;
+const byte MENU_PROGRAM_CHANNEL = 9;
+const byte MENU_BACKUP_PATCHES = 10;
+#if MIDI_LATENCY_STATS
+const byte MENU_LATENCY = 11;
+#endif
 
 /*
    --------------------------------------------------------------------------------------
@@ -177,8 +113,12 @@ class MidiMapItem
 {
 public:
   byte mapsTo;
+  word layers; // Extra output channels the input is layered onto. Bit 0 is channel 1.
+  byte filters; // Bit n is set to drop channel messages with status (0x80 + n * 0x10) e.g. bit 2 drops poly aftertouch
   void incrementMapsTo();
   void decrementMapsTo();
+  bool hasLayer(byte channel);
+  void toggleLayer(byte channel);
 
 private:
 };
@@ -193,306 +133,1957 @@ void MidiMapItem::decrementMapsTo()
   mapsTo = (mapsTo > 1) ? mapsTo - 1 : MaxChannel;
 }
 
-MidiMapItem midiMap[MaxChannel + 1]; // midiMap[0] is not used because we are not using zero index to make it easier to understand
-
-/*
-   --------------------------------------------------------------------------------------
-   PATCH MANAGER
-   --------------------------------------------------------------------------------------
-*/
-class PatchManager
+bool MidiMapItem::hasLayer(byte channel)
 {
-public:
-  static const byte MAX_PATCHES = 25; // The maximum number of patches
-  // A patch contains a single midimap which contains 16 bytes (one byte for each midi channel)
-  // It can be larger, depending on the EEPROM size.
-  // Arduino UNO has 1KB of EEPROM so 1024/16 = 64 so UNO could have 64 patches
-  byte patchNumber;
-  void incrementPatchNumber();
-  void decrementPatchNumber();
-  void saveMidiMap();
-  void loadMidiMap();
-  bool patchExists();
-  void clearPatch();
-
-  // New functionality saving patches as json
-  // Json to create is shown in example below
-  // {
-  //   "0": [0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15],
-  //   "1": [0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15],
-  //   "2": [0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15],
-  //   "3": [0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15],
-  //   "4": [0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15],
-  //   "5": [0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15],
-  //   "6": [0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15]
-  // }
+  return layers & (1 << (channel - 1));
+}
 
-  // Based on ArduinoJson assistant the capacity required is:
-  // 7*JSON_ARRAY_SIZE(16) + JSON_OBJECT_SIZE(7) + 14 bytes for strings duplication
-  // https://arduinojson.org/v6/assistant/
+void MidiMapItem::toggleLayer(byte channel)
+{
+  layers ^= 1 << (channel - 1);
+}
 
-  // ??? This means that the most basic of json is too much for a Arduino UNO
-  static const int PatchCapacity = 7*JSON_ARRAY_SIZE(16) + JSON_OBJECT_SIZE(7) + 14;  // AVR 8-bit	952+14 = 966
+MidiMapItem midiMap[MaxChannel + 1]; // midiMap[0] is not used because we are not using zero index to make it easier to understand
 
+// Bit n is set to drop system messages with status 0xF0 + n e.g. bit 8 drops clock
+word systemFilters = 0;
 
-  StaticJsonDocument<PatchManager::PatchCapacity> jsonDoc;
+// The output channels for each input channel, built from the midimap by applyMidiMap().
+// A new table is built in the one not in use and swapped in between messages, so no
+// message is routed partly by the old table and partly by the new one.
+MidiRoutingTable routingTables[2];
+MidiRoutingTable *midiRouting = &routingTables[0]; // The table in use
+MidiRoutingTable *nextRouting = NULL;              // A table waiting to be swapped in
 
-  void saveJsonPatch();
-  void loadJsonPatch();
-  void clearJsonPatch();
-};
+// Program changes on this channel select a patch instead of being forwarded. 0 is off.
+byte programChannel = 0;
 
-void PatchManager::incrementPatchNumber()
-{
-  patchNumber = (patchNumber < PatchManager::MAX_PATCHES - 1) ? patchNumber + 1 : 0;
-}
+// The time from a program change being received to the next message being routed with its patch
+unsigned long patchSwitchStart = 0;
+bool patchSwitchTiming = false;
+unsigned long patchSwitchLatency = 0; // us, of the last switch
 
-void PatchManager::decrementPatchNumber()
+/**
+ * Compiles the filters of the midimap into a table of MidiRoutingTable::FILTER_SIZE bytes
+ * with bit (status & 0x7F) set for each status that is forwarded
+ */
+void compileMidiFilters(byte *allowed)
 {
-  patchNumber = (patchNumber > 0) ? patchNumber - 1 : MAX_PATCHES - 1;
+  memset(allowed, 0xFF, MidiRoutingTable::FILTER_SIZE);
+  for (byte i = 1; i <= MaxChannel; i++)
+  {
+    for (byte type = 0; type < 7; type++)
+    {
+      if (midiMap[i].filters & (1 << type))
+      {
+        byte index = type << 4 | (i - 1); // the status without its top bit
+        allowed[index >> 3] &= ~(1 << (index & 0x07));
+      }
+    }
+  }
+  for (byte n = 0; n < 16; n++)
+  {
+    if (systemFilters & (1 << n))
+    {
+      allowed[14 + (n >> 3)] &= ~(1 << (n & 0x07)); // 0xF0-0xFF are the last two bytes
+    }
+  }
 }
 
-void PatchManager::saveMidiMap()
+/**
+ * Sets the filters of the midimap from a table made by compileMidiFilters()
+ */
+void decompileMidiFilters(const byte *allowed)
 {
-  int addr = patchNumber * MaxChannel; // the current address in the EEPROM (i.e. which byte we're going to write to next)
   for (byte i = 1; i <= MaxChannel; i++)
   {
-    EEPROM.write(addr, midiMap[i].mapsTo);
-    addr++;
+    midiMap[i].filters = 0;
+    for (byte type = 0; type < 7; type++)
+    {
+      byte index = type << 4 | (i - 1);
+      if (!(allowed[index >> 3] & (1 << (index & 0x07))))
+      {
+        midiMap[i].filters |= 1 << type;
+      }
+    }
   }
+  systemFilters = ~(allowed[14] | allowed[15] << 8);
 }
 
-void PatchManager::loadMidiMap()
+/**
+ * Returns the number of layers in the midimap, not counting layers onto an input's main output channel
+ */
+byte countMidiMapLayers()
 {
-  int addr = patchNumber * MaxChannel; // the current address in the EEPROM (i.e. which byte we're going to write to next)
+  byte count = 0;
   for (byte i = 1; i <= MaxChannel; i++)
   {
-    byte val = EEPROM.read(addr);
-    if (val != 255)
-    { // uninitialized EEPROM locations read 255
-      midiMap[i].mapsTo = val;
+    for (byte channel = 1; channel <= MaxChannel; channel++)
+    {
+      if (midiMap[i].hasLayer(channel) && channel != midiMap[i].mapsTo)
+      {
+        count++;
+      }
     }
-    addr++;
   }
+  return count;
 }
 
-bool PatchManager::patchExists()
+/*
+   --------------------------------------------------------------------------------------
+   PATCH RECORD
+   --------------------------------------------------------------------------------------
+*/
+/**
+ * A patch as it is stored in the EEPROM. It is a fixed size and is encoded from
+ * and decoded into the midimap in place, so saving and loading need no more RAM
+ * than the record itself.
+ */
+struct PatchRecord
 {
-  int addr = patchNumber * MaxChannel;
-  byte val = EEPROM.read(addr);
-  return val != 255; // A patch has been saved to the current patch number if the first byte is not 255 (when written it will be between 1-16
+  static const byte VERSION = 2; // Version 1 stored a whole byte for each channel of the map
+  static const byte MAP_SIZE = MaxChannel / 2;
+  static const byte LAYERS_SIZE = 1 + MidiRoutingTable::MAX_LAYERS;
+  static const byte FILTERS_SIZE = MidiRoutingTable::FILTER_SIZE;
+
+  byte version;               // VERSION, or 255 if the patch is empty
+  byte crc;                   // CRC-8 of the map, layers and filters
+  byte map[MAP_SIZE];         // The output channel - 1 of each input channel, packed two to a byte with the odd channel in the high nibble
+  byte layers[LAYERS_SIZE];   // A layer count then (input channel - 1) << 4 | (output channel - 1) per layer
+  byte filters[FILTERS_SIZE]; // The table made by compileMidiFilters()
+
+  byte mapsTo(byte channel) const;
+  void setMapsTo(byte channel, byte mapsTo);
+  void encode();
+  void decode() const;
+  byte calculateCrc() const;
+  byte calculateUnpackedCrc() const;
+  bool isEmpty() const { return version == 255; }
+  bool isValid() const;
+};
+
+byte PatchRecord::mapsTo(byte channel) const
+{
+  byte packed = map[(channel - 1) >> 1];
+  return ((channel & 1) ? packed >> 4 : packed & 0x0F) + 1;
 }
 
-void PatchManager::clearPatch()
+void PatchRecord::setMapsTo(byte channel, byte mapsTo)
 {
-  int addr = patchNumber * MaxChannel; // the current address in the EEPROM (i.e. which byte we're going to write to next)
-  for (byte i = 1; i <= MaxChannel; i++)
+  byte &packed = map[(channel - 1) >> 1];
+  if (channel & 1)
+  {
+    packed = (packed & 0x0F) | (mapsTo - 1) << 4;
+  }
+  else
   {
-    EEPROM.write(addr, 255); // clear the patch by writing 255
-    addr++;
+    packed = (packed & 0xF0) | ((mapsTo - 1) & 0x0F);
   }
 }
 
-void PatchManager::saveJsonPatch()
+/**
+ * Fills the record from the midimap
+ */
+void PatchRecord::encode()
 {
-  // Write the midi map to json
   for (byte i = 1; i <= MaxChannel; i++)
   {
-    jsonDoc["midiMap"][i-1] = midiMap[i].mapsTo;
+    setMapsTo(i, midiMap[i].mapsTo);
   }
 
-  // Declare a buffer to hold the serialized json string
-  const int size = measureJson(jsonDoc) + 1;    // NB: measureJson() count doesn’t count the null-terminator so we need to add one to account for it in the string 
-  char buffer[size];
-  serializeJson(jsonDoc, buffer, size);         // Produce a minified JSON document
+  byte count = 0;
+  memset(layers, 255, LAYERS_SIZE);
+  for (byte i = 1; i <= MaxChannel; i++)
+  {
+    for (byte channel = 1; channel <= MaxChannel; channel++)
+    {
+      if (midiMap[i].hasLayer(channel) && channel != midiMap[i].mapsTo && count < MidiRoutingTable::MAX_LAYERS)
+      {
+        count++;
+        layers[count] = (i - 1) << 4 | (channel - 1);
+      }
+    }
+  }
+  layers[0] = count;
 
-  Serial.println("Saving json string to address 0");
-  eeprom_write_string(0, buffer);
+  compileMidiFilters(filters);
+  version = VERSION;
+  crc = calculateCrc();
 }
 
-void PatchManager::loadJsonPatch()
+/**
+ * Sets the midimap from the record. Check isValid() first.
+ */
+void PatchRecord::decode() const
 {
-  // Load the patch from the EEPROM
-  // TODO
+  for (byte i = 1; i <= MaxChannel; i++)
+  {
+    midiMap[i].mapsTo = mapsTo(i);
+    midiMap[i].layers = 0;
+  }
 
-  // Write the json midi map of the patch to the MidiMap
-  // TODO
+  byte count = layers[0];
+  if (count > MidiRoutingTable::MAX_LAYERS)
+  {
+    count = 0; // never written
+  }
+  for (byte i = 1; i <= count; i++)
+  {
+    midiMap[(layers[i] >> 4) + 1].toggleLayer((layers[i] & 0x0F) + 1);
+  }
+
+  decompileMidiFilters(filters);
 }
 
-void PatchManager::clearJsonPatch()
+byte PatchRecord::calculateCrc() const
 {
+  byte value = EepromStore::crc8(0, map, MAP_SIZE);
+  value = EepromStore::crc8(value, layers, LAYERS_SIZE);
+  return EepromStore::crc8(value, filters, FILTERS_SIZE);
 }
 
-/*
-  --------------------------------------------------------------------------------------
-  Variables
-  --------------------------------------------------------------------------------------
-*/
-byte midiChannel = 1;
-
-PatchManager patchManager;
-
-bool enableThru = false; // Do not enable auto thru for the midi library
-
-void initializeDefaultMidiMap()
+/**
+ * Returns the CRC the record would have with one byte for each channel of the map.
+ * This is the CRC of version 1 records and of patches in a backup.
+ */
+byte PatchRecord::calculateUnpackedCrc() const
 {
-  for (int i = 1; i <= MaxChannel; i++)
+  byte value = 0;
+  for (byte i = 1; i <= MaxChannel; i++)
   {
-    midiMap[i].mapsTo = i;
+    byte channel = mapsTo(i);
+    value = EepromStore::crc8(value, &channel, 1);
   }
+  value = EepromStore::crc8(value, layers, LAYERS_SIZE);
+  return EepromStore::crc8(value, filters, FILTERS_SIZE);
+}
+
+/**
+ * Returns true if the record is empty, or is the current version with a matching CRC
+ */
+bool PatchRecord::isValid() const
+{
+  return isEmpty() || (version == VERSION && crc == calculateCrc());
 }
 
+static_assert(sizeof(PatchRecord) == 2 + PatchRecord::MAP_SIZE + PatchRecord::LAYERS_SIZE + PatchRecord::FILTERS_SIZE,
+              "PatchRecord must not be padded");
+
 /*
    --------------------------------------------------------------------------------------
-   LCD FUNCTIONS
+   PATCH MANAGER
    --------------------------------------------------------------------------------------
 */
+// The number of recently used patch records kept in RAM. 0 turns the cache off.
+#ifndef PATCH_CACHE_SIZE
+#define PATCH_CACHE_SIZE 2
+#endif
 
-void lcdPrintMidiChannelMap()
+class PatchManager
 {
-  char buffer[6];
-  sprintf(buffer, "%02d->%02d", midiChannel, midiMap[midiChannel].mapsTo);
-  lcd.setCursor(0, 1);
-  lcd.print(buffer);
+public:
+  static const byte MAX_PATCHES = 31; // The maximum number of patches
+  // A patch is a 32 byte PatchRecord, so the 1KB EEPROM of an Arduino UNO holds 31 patches
+  // with room left for the last patch number and the layout marker
+
+  // The fields of a PatchRecord are stored in separate areas, in the same order as the areas
+  // used before the map was packed, so the old layout can be converted in place.
+  // The packed midimaps of all the patches come first, then the layers of each patch.
+  static const byte MAP_SIZE = PatchRecord::MAP_SIZE;
+  static const int LAYERS_ADDR = MAX_PATCHES * MAP_SIZE;
+  static const byte LAYERS_SIZE = PatchRecord::LAYERS_SIZE;
+
+  // The filters of each patch are stored after the layers.
+  // Bits are set for messages that are forwarded so erased EEPROM means nothing is filtered.
+  static const int FILTERS_ADDR = LAYERS_ADDR + MAX_PATCHES * LAYERS_SIZE;
+  static const byte FILTERS_SIZE = PatchRecord::FILTERS_SIZE;
+
+  // The header (version and CRC) of each patch is written last, so a patch that was only partly
+  // written when the power went off is detected.
+  static const int HEADERS_ADDR = FILTERS_ADDR + MAX_PATCHES * FILTERS_SIZE;
+  static const byte HEADER_SIZE = 2;
+
+  // The last used patch number changes often so it is wear levelled across several slots
+  static const int LAST_PATCH_ADDR = HEADERS_ADDR + MAX_PATCHES * HEADER_SIZE;
+  static const byte LAST_PATCH_SLOTS = 12;
+
+  // The channel whose program changes select patches
+  static const int PROGRAM_CHANNEL_ADDR = LAST_PATCH_ADDR + WearLevelledByte::size(LAST_PATCH_SLOTS);
+
+  // The last byte of the EEPROM says whether it holds the packed layout. In the old layout it
+  // was the value of the last wear levelled slot, so it held 255 or a patch number below 25.
+  static const int LAYOUT_ADDR = EEPROM_MAX_ADDR;
+  static const byte LAYOUT_PACKED = 0x40;
+  static const byte LAYOUT_CONVERTING = 0x80; // | step << 5 | the next patch to convert
+  static const byte LAYOUT_STARTING = LAYOUT_CONVERTING | 0x1F; // Copying the old map of patch 0
+
+  // Results of loading a patch
+  static const byte PATCH_OK = 0;
+  static const byte PATCH_EMPTY = 1;
+  static const byte PATCH_CORRUPT = 2;
+
+  byte patchNumber;
+  EepromStore &store; // Writes are queued and finish in the background
+  PatchManager();
+  void incrementPatchNumber();
+  void decrementPatchNumber();
+  void saveMidiMap();
+  byte loadMidiMap();
+  bool patchExists();
+  bool patchIsValid();
+  void clearPatch();
+  byte readLastPatchNumber();
+  void writeLastPatchNumber();
+  byte readProgramChannel();
+  void writeProgramChannel(byte channel);
+  void buildIndex();
+  void readRecord(byte number, PatchRecord &record);
+  void writeRecord(byte number, const PatchRecord &record);
+  void writePending();
+  bool busy() const;
+
+private:
+  WearLevelledByte lastPatchNumber;
+
+  // Writes started from the menu wait here until they fit in the store's queue, so that
+  // loop() never waits for the EEPROM. 255 means nothing is waiting.
+  static const byte RECORD_RANGES = 4; // Ranges queued by writeRecord()
+  PatchRecord pendingRecord;
+  byte pendingNumber;
+  byte pendingLastPatch;
+  byte pendingProgramChannel;
+  void queueRecord();
+
+  // The layout used before the map was packed, with 16 bytes of map per patch
+  static const byte OLD_MAX_PATCHES = 25;
+  static const int OLD_LAYERS_ADDR = OLD_MAX_PATCHES * MaxChannel;
+  static const int OLD_FILTERS_ADDR = OLD_LAYERS_ADDR + OLD_MAX_PATCHES * LAYERS_SIZE;
+  static const int OLD_HEADERS_ADDR = OLD_FILTERS_ADDR + OLD_MAX_PATCHES * FILTERS_SIZE;
+  static const int OLD_LAST_PATCH_ADDR = OLD_HEADERS_ADDR + OLD_MAX_PATCHES * HEADER_SIZE;
+  // The last patch number is kept here while the layout is converted. It is the value of
+  // an old wear levelled slot past the copy of the old map of patch 0, and isn't used in
+  // the packed layout.
+  static const int KEPT_LAST_PATCH_ADDR = PROGRAM_CHANNEL_ADDR + 1;
+  void convertLayout();
+  void convertPatch(byte number);
+  void moveBytes(int from, int to, byte length);
+
+  // Built from the EEPROM once at boot and kept up to date by writeRecord(),
+  // so that browsing the patches doesn't read the EEPROM
+  static const byte INDEX_SIZE = (MAX_PATCHES + 7) / 8;
+  byte occupied[INDEX_SIZE]; // Bit set for each patch that has been saved
+  byte valid[INDEX_SIZE];    // Bit set for each patch whose CRC matches
+  byte crcs[MAX_PATCHES];    // The stored CRC of each patch
+  void indexRecord(byte number, const PatchRecord &record);
+  static bool indexBit(const byte *bits, byte number) { return bits[number >> 3] & (1 << (number & 0x07)); }
+  static void setIndexBit(byte *bits, byte number, bool value);
+
+#if PATCH_CACHE_SIZE > 0
+  // The most recently used record is first
+  byte cachedNumbers[PATCH_CACHE_SIZE];
+  PatchRecord cachedRecords[PATCH_CACHE_SIZE];
+  void cacheRecord(byte number, const PatchRecord &record);
+#endif
+};
+
+static_assert(PatchManager::PROGRAM_CHANNEL_ADDR < PatchManager::LAYOUT_ADDR,
+              "Patches do not fit in EEPROM");
+
+PatchManager::PatchManager()
+    : store(EepromStorage), lastPatchNumber(EepromStorage, LAST_PATCH_ADDR, LAST_PATCH_SLOTS),
+      pendingNumber(255), pendingLastPatch(255), pendingProgramChannel(255)
+{
+#if PATCH_CACHE_SIZE > 0
+  memset(cachedNumbers, 255, PATCH_CACHE_SIZE);
+#endif
 }
 
-void lcdPrintPatchNumber()
+void PatchManager::incrementPatchNumber()
 {
-  char buffer[2];
-  sprintf(buffer, "%02d", patchManager.patchNumber);
-  lcd.setCursor(0, 1);
-  lcd.print(buffer);
-  if (patchManager.patchExists())
+  patchNumber = (patchNumber < PatchManager::MAX_PATCHES - 1) ? patchNumber + 1 : 0;
+}
+
+void PatchManager::decrementPatchNumber()
+{
+  patchNumber = (patchNumber > 0) ? patchNumber - 1 : MAX_PATCHES - 1;
+}
+
+void PatchManager::setIndexBit(byte *bits, byte number, bool value)
+{
+  if (value)
   {
-    lcd.print("*");
+    bits[number >> 3] |= 1 << (number & 0x07);
   }
   else
   {
-    lcd.print(" ");
+    bits[number >> 3] &= ~(1 << (number & 0x07));
   }
 }
 
-String previousTypeDescription = "";
+void PatchManager::indexRecord(byte number, const PatchRecord &record)
+{
+  setIndexBit(occupied, number, !record.isEmpty());
+  setIndexBit(valid, number, record.isValid());
+  crcs[number] = record.crc;
+}
 
 /**
- * TODO: THIS STILL CRASHES WHEN MIDI MONITOR IS NOT THE FIRST THE MENU ITEM
+ * Copies bytes while converting the layout
  */
-void lcdPrintMidiMonitor(byte channel, midi::MidiType type, midi::DataByte dataByte1, midi::DataByte dataByte2)
+void PatchManager::moveBytes(int from, int to, byte length)
+{
+  byte buffer[FILTERS_SIZE];
+  store.readBytes(from, buffer, length);
+  store.updateBytes(to, buffer, length);
+}
+
+/**
+ * Packs the map of a patch saved in the old layout and gives it a current header.
+ * The header stays in the old headers area until the headers are moved.
+ */
+void PatchManager::convertPatch(byte number)
 {
-  if (type == midi::MidiType::Clock || type == midi::MidiType::ActiveSensing)
+  byte oldMap[MaxChannel];
+  PatchRecord record;
+  store.readBytes((number == 0) ? OLD_LAST_PATCH_ADDR : number * MaxChannel, oldMap, MaxChannel);
+  store.readBytes(OLD_LAYERS_ADDR + number * LAYERS_SIZE, record.layers, LAYERS_SIZE);
+  store.readBytes(OLD_FILTERS_ADDR + number * FILTERS_SIZE, record.filters, FILTERS_SIZE);
+  store.readBytes(OLD_HEADERS_ADDR + number * HEADER_SIZE, &record.version, HEADER_SIZE);
+  for (byte i = 1; i <= MaxChannel; i++)
   {
-    // ignore particular messages
-    return;
+    record.setMapsTo(i, oldMap[i - 1]);
   }
-  String typeDescription = "";
 
-  switch (type)
+  if (oldMap[0] == 255)
   {
-  case midi::MidiType::NoteOn:
-    typeDescription = "NoteOn";
-    break;
-  case midi::MidiType::NoteOff:
-    typeDescription = "NoteOff";
-    break;
-  case midi::MidiType::AfterTouchPoly:
-    typeDescription = "AfterTouchPoly";
-    break;
-  case midi::MidiType::AfterTouchChannel:
-    typeDescription = "AfterTouchChan";
-    break;
-  case midi::MidiType::ControlChange:
-    typeDescription = "ControlChange";
-    break;
-  case midi::MidiType::ProgramChange:
-    typeDescription = "ProgramChange";
-    break;
-  case midi::MidiType::PitchBend:
-    typeDescription = "PitchBend";
-    break;
-  case midi::MidiType::SystemExclusive:
-    typeDescription = "SystemExclusive";
-    break;
-  case midi::MidiType::SongPosition:
-    typeDescription = "SongPosition";
-    break;
-  case midi::MidiType::SongSelect:
-    typeDescription = "SongSelect";
-    break;
-  case midi::MidiType::TuneRequest:
-    typeDescription = "TuneRequest";
-    break;
-  case midi::MidiType::Start:
-    typeDescription = "Start";
-    break;
-  case midi::MidiType::Stop:
-    typeDescription = "Stop";
-    break;
-  case midi::MidiType::Continue:
-    typeDescription = "Continue";
-    break;
-  case midi::MidiType::SystemReset:
-    typeDescription = "SystemReset";
-    break;
-  default:
-    typeDescription = "Unknown";
-    break;
+    record.version = 255; // empty
+    record.crc = 255;
+  }
+  else if (record.version == 255 || record.crc == record.calculateUnpackedCrc() ||
+           (record.version == PatchRecord::VERSION && (record.crc == 255 || record.crc == record.calculateCrc())))
+  {
+    // Saved before patches had a header, a good version 1 patch, or converted already
+    // (maybe only the version byte of it) before the power went off
+    record.version = PatchRecord::VERSION;
+    record.crc = record.calculateCrc();
   }
+  // Otherwise the version 1 header is kept, which shows the patch is corrupt
+
+  store.updateBytes(number * MAP_SIZE, record.map, MAP_SIZE);
+  store.updateBytes(OLD_HEADERS_ADDR + number * HEADER_SIZE, &record.version, HEADER_SIZE);
+}
 
-  if (typeDescription != previousTypeDescription)
+/**
+ * Converts a bank saved with 16 bytes of map per patch to the packed layout, in place.
+ * Each step moves one area to a lower address, patch by patch in increasing order, so
+ * nothing is overwritten before it has been read. The step and patch reached are kept in
+ * the layout byte so a conversion cut short by the power going off carries on from there.
+ */
+void PatchManager::convertLayout()
+{
+  static_assert(LAYERS_ADDR <= OLD_LAYERS_ADDR && FILTERS_ADDR <= OLD_FILTERS_ADDR && HEADERS_ADDR <= OLD_HEADERS_ADDR,
+                "Each area must move down for the layout to be converted in place");
+  static_assert(OLD_LAST_PATCH_ADDR + MaxChannel <= LAYOUT_ADDR, "No room to keep the old map of patch 0");
+  static_assert(KEPT_LAST_PATCH_ADDR >= OLD_LAST_PATCH_ADDR + MaxChannel && KEPT_LAST_PATCH_ADDR < LAYOUT_ADDR &&
+                    (KEPT_LAST_PATCH_ADDR - OLD_LAST_PATCH_ADDR) % 2 == 1,
+                "The last patch number must be kept in the value of an old slot past the copy");
+
+  byte layout = store.read(LAYOUT_ADDR);
+  if (layout == LAYOUT_PACKED)
   {
-    lcd.setCursor(0, 0);
-    lcd.print("                ");
-    lcd.setCursor(0, 0);
-    lcd.print(typeDescription.c_str());
+    return;
   }
-  previousTypeDescription = typeDescription;
 
-  lcd.setCursor(0, 1);
-  char buffer[16];
+  if (layout == 255 || !(layout & LAYOUT_CONVERTING))
+  {
+    // Changing the value of an old slot that isn't the latest doesn't change the number
+    // read from them, and the latest slot holds it already, so a conversion that is cut
+    // short before it gets going reads the same number again
+    store.update(KEPT_LAST_PATCH_ADDR, WearLevelledByte(store, OLD_LAST_PATCH_ADDR, LAST_PATCH_SLOTS).read());
+    layout = LAYOUT_STARTING;
+    store.update(LAYOUT_ADDR, layout);
+  }
 
-  if (dataByte2 != 0)
+  byte step = 0;
+  byte number = 0;
+  if (layout == LAYOUT_STARTING)
   {
-    snprintf(buffer, 16, "%02d %02X %02X %02X", channel, type, dataByte1, dataByte2);
+    // The packed map of patch 0 overwrites its own old map, so a copy of the old one is
+    // kept where the old slots were, in case the conversion has to start patch 0 again
+    moveBytes(0, OLD_LAST_PATCH_ADDR, MaxChannel);
+    store.update(LAYOUT_ADDR, LAYOUT_CONVERTING);
   }
   else
   {
-    snprintf(buffer, 16, "%02d %02X %02X", channel, type, dataByte1);
+    step = (layout >> 5) & 0x03;
+    number = layout & 0x1F;
   }
-  snprintf(buffer, 16, "%02d", 1);
-  lcd.print(buffer);
-}
+  byte lastPatch = store.read(KEPT_LAST_PATCH_ADDR);
 
-void lcdPrintMenuPage()
-{
-  lcd.clear();
-  lcd.print(menu[curMenuIndex]);
-  if (curMenuIndex == MENU_MIDIMAP)
+  for (; step < 4; step++, number = 0)
   {
-    lcdPrintMidiChannelMap();
+    for (; number < OLD_MAX_PATCHES; number++)
+    {
+      switch (step)
+      {
+      case 0:
+        convertPatch(number);
+        break;
+      case 1:
+        moveBytes(OLD_LAYERS_ADDR + number * LAYERS_SIZE, LAYERS_ADDR + number * LAYERS_SIZE, LAYERS_SIZE);
+        break;
+      case 2:
+        moveBytes(OLD_FILTERS_ADDR + number * FILTERS_SIZE, FILTERS_ADDR + number * FILTERS_SIZE, FILTERS_SIZE);
+        break;
+      case 3:
+        moveBytes(OLD_HEADERS_ADDR + number * HEADER_SIZE, HEADERS_ADDR + number * HEADER_SIZE, HEADER_SIZE);
+        break;
+      }
+      store.update(LAYOUT_ADDR, LAYOUT_CONVERTING | step << 5 | (number + 1));
+    }
   }
-  else if (curMenuIndex == MENU_LOAD_PATCH)
+
+  // The patches that did not fit in the old layout start empty
+  const byte added = MAX_PATCHES - OLD_MAX_PATCHES;
+  store.fill(OLD_MAX_PATCHES * MAP_SIZE, 255, added * MAP_SIZE);
+  store.fill(LAYERS_ADDR + OLD_MAX_PATCHES * LAYERS_SIZE, 255, added * LAYERS_SIZE);
+  store.fill(FILTERS_ADDR + OLD_MAX_PATCHES * FILTERS_SIZE, 255, added * FILTERS_SIZE);
+  store.fill(HEADERS_ADDR + OLD_MAX_PATCHES * HEADER_SIZE, 255, added * HEADER_SIZE);
+  // The last patch number and settings, leaving the kept number until the layout is marked packed
+  store.fill(LAST_PATCH_ADDR, 255, KEPT_LAST_PATCH_ADDR - LAST_PATCH_ADDR);
+  store.fill(KEPT_LAST_PATCH_ADDR + 1, 255, LAYOUT_ADDR - KEPT_LAST_PATCH_ADDR - 1);
+  if (lastPatch < OLD_MAX_PATCHES)
   {
-    lcdPrintPatchNumber();
+    lastPatchNumber.write(lastPatch);
   }
-  else if (curMenuIndex == MENU_SAVE_PATCH)
+  store.update(LAYOUT_ADDR, LAYOUT_PACKED);
+  store.update(KEPT_LAST_PATCH_ADDR, 255);
+}
+
+/**
+ * Converts an old layout if needed, then reads every patch to build the index. Called once at boot.
+ */
+void PatchManager::buildIndex()
+{
+  convertLayout();
+  for (byte number = 0; number < MAX_PATCHES; number++)
   {
-    lcdPrintPatchNumber();
+    PatchRecord record;
+    readRecord(number, record);
+    indexRecord(number, record);
   }
-  else if (curMenuIndex == MENU_CLEAR_PATCH)
+}
+
+#if PATCH_CACHE_SIZE > 0
+/**
+ * Puts the record first in the cache, dropping the least recently used one
+ */
+void PatchManager::cacheRecord(byte number, const PatchRecord &record)
+{
+  byte slot = 0;
+  while (slot < PATCH_CACHE_SIZE - 1 && cachedNumbers[slot] != number)
   {
-    lcdPrintPatchNumber();
+    slot++;
   }
-  else if (curMenuIndex == MENU_RESET_MIDIMAP)
+  for (; slot > 0; slot--)
   {
+    cachedNumbers[slot] = cachedNumbers[slot - 1];
+    cachedRecords[slot] = cachedRecords[slot - 1];
   }
-  else if (curMenuIndex == DEBUG_MENU_MONITOR)
+  cachedNumbers[0] = number;
+  cachedRecords[0] = record;
+}
+#endif
+
+void PatchManager::readRecord(byte number, PatchRecord &record)
+{
+  if (number == pendingNumber)
   {
+    record = pendingRecord;
+    return;
+  }
+#if PATCH_CACHE_SIZE > 0
+  for (byte slot = 0; slot < PATCH_CACHE_SIZE; slot++)
+  {
+    if (cachedNumbers[slot] == number)
+    {
+      record = cachedRecords[slot];
+      cacheRecord(number, record);
+      return;
+    }
   }
+#endif
+  store.readBytes(number * MAP_SIZE, record.map, MAP_SIZE);
+  store.readBytes(LAYERS_ADDR + number * LAYERS_SIZE, record.layers, LAYERS_SIZE);
+  store.readBytes(FILTERS_ADDR + number * FILTERS_SIZE, record.filters, FILTERS_SIZE);
+  store.readBytes(HEADERS_ADDR + number * HEADER_SIZE, &record.version, HEADER_SIZE);
+#if PATCH_CACHE_SIZE > 0
+  cacheRecord(number, record);
+#endif
 }
 
-/*
-   -------------------------------------------------------------------------------------------
-   MIDIMAP PAGE LOGIC
+/**
+ * Queues the record to be written. Only bytes that have changed are written.
+ * Waits if there is no room in the queue, see writePending().
+ */
+void PatchManager::writeRecord(byte number, const PatchRecord &record)
+{
+  store.updateBytes(number * MAP_SIZE, record.map, MAP_SIZE);
+  store.updateBytes(LAYERS_ADDR + number * LAYERS_SIZE, record.layers, LAYERS_SIZE);
+  store.updateBytes(FILTERS_ADDR + number * FILTERS_SIZE, record.filters, FILTERS_SIZE);
+  // The header goes last so that it only matches once everything else is written
+  store.updateBytes(HEADERS_ADDR + number * HEADER_SIZE, &record.version, HEADER_SIZE);
+  indexRecord(number, record);
+#if PATCH_CACHE_SIZE > 0
+  cacheRecord(number, record);
+#endif
+}
+
+/**
+ * Holds pendingRecord for the current patch until writePending() queues it.
+ * It is indexed straight away and read back from RAM until then.
+ */
+void PatchManager::queueRecord()
+{
+  pendingNumber = patchNumber;
+  indexRecord(pendingNumber, pendingRecord);
+  writePending();
+}
+
+/**
+ * Queues each write that is waiting once there is room for all of it, the patch
+ * first so the last patch number never points at a patch not yet written.
+ * Called on every pass of loop().
+ */
+void PatchManager::writePending()
+{
+  if (pendingNumber != 255 && store.hasRoom(RECORD_RANGES, sizeof(PatchRecord)))
+  {
+    writeRecord(pendingNumber, pendingRecord);
+    pendingNumber = 255;
+  }
+  if (pendingNumber == 255 && pendingLastPatch != 255 &&
+      store.hasRoom(WearLevelledByte::WRITE_RANGES, WearLevelledByte::WRITE_RANGES))
+  {
+    lastPatchNumber.write(pendingLastPatch);
+    pendingLastPatch = 255;
+  }
+  if (pendingProgramChannel != 255 && store.hasRoom(1, 1))
+  {
+    store.update(PROGRAM_CHANNEL_ADDR, pendingProgramChannel);
+    pendingProgramChannel = 255;
+  }
+}
+
+/**
+ * Returns true until everything saved has been written to the EEPROM
+ */
+bool PatchManager::busy() const
+{
+  return pendingNumber != 255 || pendingLastPatch != 255 || pendingProgramChannel != 255 || store.busy();
+}
+
+/**
+ * Saves the midimap to the current patch
+ */
+void PatchManager::saveMidiMap()
+{
+  pendingRecord.encode();
+  queueRecord();
+}
+
+/**
+ * Loads the current patch into the midimap. The midimap is left unchanged if
+ * the patch is empty or corrupt.
+ */
+byte PatchManager::loadMidiMap()
+{
+  if (!patchExists())
+  {
+    return PATCH_EMPTY;
+  }
+  if (!patchIsValid())
+  {
+    return PATCH_CORRUPT;
+  }
+  PatchRecord record;
+  readRecord(patchNumber, record);
+  if (record.crc != crcs[patchNumber])
+  {
+    return PATCH_CORRUPT; // changed since the index was built
+  }
+  record.decode();
+  return PATCH_OK;
+}
+
+/**
+ * Returns true if a patch has been saved to the current patch number
+ */
+bool PatchManager::patchExists()
+{
+  return indexBit(occupied, patchNumber);
+}
+
+/**
+ * Returns true if the current patch is empty or its CRC matches
+ */
+bool PatchManager::patchIsValid()
+{
+  return indexBit(valid, patchNumber);
+}
+
+void PatchManager::clearPatch()
+{
+  // clear the patch by writing 255
+  memset(&pendingRecord, 255, sizeof(pendingRecord));
+  queueRecord();
+}
+
+/**
+ * Returns the patch number that was last loaded or saved, or 255 if there isn't one
+ */
+byte PatchManager::readLastPatchNumber()
+{
+  byte number = lastPatchNumber.read();
+  return (number < MAX_PATCHES) ? number : 255;
+}
+
+void PatchManager::writeLastPatchNumber()
+{
+  pendingLastPatch = patchNumber;
+  writePending();
+}
+
+/**
+ * Returns the channel whose program changes select patches, or 0 for none
+ */
+byte PatchManager::readProgramChannel()
+{
+  byte channel = store.read(PROGRAM_CHANNEL_ADDR);
+  return (channel <= MaxChannel) ? channel : 0;
+}
+
+void PatchManager::writeProgramChannel(byte channel)
+{
+  pendingProgramChannel = channel;
+  writePending();
+}
+
+/*
+  --------------------------------------------------------------------------------------
+  Variables
+  --------------------------------------------------------------------------------------
+*/
+byte midiChannel = 1;
+byte layerChannel = 1; // The output channel selected on the layers page
+byte filterTypeIndex = 0; // The message type selected on the filters page
+
+PatchManager patchManager;
+
+bool enableThru = false; // Do not enable auto thru for the midi library
+
+bool enableRunningStatus = true; // Leave out repeated status bytes on the output
+
+const byte MIDI_BATCH_SIZE = 32; // The maximum number of received bytes handled per pass of loop()
+
+// How incoming midi is forwarded
+const byte FORWARD_CUT_THROUGH = 0; // Each byte is rewritten and sent as soon as it arrives
+const byte FORWARD_PARSED = 1;      // Whole messages are parsed by the MIDI library and then re-sent
+byte forwardingMode = FORWARD_CUT_THROUGH;
+
+MidiOutput midiOut(MidiSerial);
+MidiForwarder midiForwarder(midiOut, routingTables[0]);
+
+void initializeDefaultMidiMap()
+{
+  for (int i = 1; i <= MaxChannel; i++)
+  {
+    midiMap[i].mapsTo = i;
+    midiMap[i].layers = 0;
+    midiMap[i].filters = 0;
+  }
+  systemFilters = 0;
+}
+
+/*
+   --------------------------------------------------------------------------------------
+   BANDWIDTH
+   Layering sends each message once for every output channel. Input is counted per
+   channel so the output rate of the current layers can be estimated and a warning
+   shown when it would be more than midi can carry.
+   --------------------------------------------------------------------------------------
+*/
+const unsigned int MIDI_BYTES_PER_SECOND = 3125; // 31250 baud with 10 bits per byte
+
+unsigned int inputBytes[MaxChannel + 1]; // Bytes received this second on each channel, [0] is system messages
+unsigned int inputRate[MaxChannel + 1];  // Bytes received in the last whole second
+unsigned long rateWindowStart = 0;
+bool bandwidthWarning = false;
+
+void countInputMessage(byte status)
+{
+  if (!midiRouting->allows(status))
+  {
+    return; // filtered messages are not sent so they use no output bandwidth
+  }
+  if (status >= 0xF0)
+  {
+    inputBytes[0]++;
+  }
+  else
+  {
+    byte type = status & 0xF0;
+    inputBytes[(status & 0x0F) + 1] += (type == 0xC0 || type == 0xD0) ? 2 : 3;
+  }
+}
+
+/**
+ * Returns the estimated bytes per second sent for the input rate of the last second
+ */
+unsigned long estimateOutputRate(const MidiRoutingTable &routing)
+{
+  unsigned long rate = inputRate[0];
+  for (byte i = 1; i <= MaxChannel; i++)
+  {
+    rate += (unsigned long)inputRate[i] * routing.destinationCount(i - 1);
+  }
+  return rate;
+}
+
+/**
+ * Puts a newly built routing table in use, unless a message is part way through being forwarded
+ */
+void swapRoutingTables()
+{
+  if (nextRouting != NULL && midiForwarder.atMessageBoundary())
+  {
+    midiRouting = nextRouting;
+    nextRouting = NULL;
+    midiForwarder.setRoutingTable(*midiRouting);
+  }
+}
+
+/**
+ * Applies the midi map to the routing table used for forwarding.
+ * This must be called whenever the midi map changes.
+ */
+void applyMidiMap()
+{
+  MidiRoutingTable &routing = (midiRouting == &routingTables[0]) ? routingTables[1] : routingTables[0];
+  routing.beginBuild();
+  for (byte i = 1; i <= MaxChannel; i++)
+  {
+    // The outgoing midi channel is overriden if a mapping exists, otherwise it is unchanged
+    byte mapsTo = (midiMap[i].mapsTo > 0) ? midiMap[i].mapsTo : i;
+    routing.addInputChannel(mapsTo - 1, midiMap[i].layers);
+  }
+
+  byte allowed[MidiRoutingTable::FILTER_SIZE];
+  compileMidiFilters(allowed);
+  if (programChannel != 0)
+  {
+    byte index = (0xC0 | (programChannel - 1)) & 0x7F; // program changes that select patches aren't forwarded
+    allowed[index >> 3] &= ~(1 << (index & 0x07));
+  }
+  routing.setFilter(allowed);
+
+  bandwidthWarning = estimateOutputRate(routing) > MIDI_BYTES_PER_SECOND;
+
+  nextRouting = &routing;
+  swapRoutingTables();
+}
+
+/*
+   --------------------------------------------------------------------------------------
+   PATCH BANK BACKUP
+   Midi is forwarded as usual while the backup page is showing. Pressing right arms the
+   page and only then does the serial port carry a JSON copy of the patch bank instead of
+   midi, until left is pressed or the page is left. Whatever is connected to the midi out
+   would otherwise take the JSON for midi data.
+   The bank is sent one patch per line and a backup sent back is read as it arrives, so
+   neither needs more RAM than one patch record:
+   {"version":1,"patches":[
+   {"map":[1,2,...,16],"layers":[[1,3]],"filters":[255,...,255],"crc":57},
+   null,
+   ...]}
+   Empty patches are null and clear the patch when read back. Layers are [input channel,
+   output channel] pairs and filters is the table made by compileMidiFilters(). The CRC is
+   PatchRecord::calculateUnpackedCrc() so backups don't depend on how the map is stored.
+   Storing a patch can take up to 130ms, so each patch read is answered with {"ack":n} once
+   it has been stored, or {"nak":n} if it was bad or did not write, and the sender waits for
+   that before sending the next patch. Nothing more is read until the answer has been sent.
+   Bytes lost to a full receive buffer show as a read error. A backup must start with
+   its version, and every patch of a backup of any other version is refused.
+   --------------------------------------------------------------------------------------
+*/
+const byte BACKUP_VERSION = 1; // The backup format, which doesn't change with PatchRecord::VERSION
+JsonWriter backupWriter(MidiSerial);
+byte backupSendPatch = 255; // The next patch to send, or 255 when not sending
+
+void readBackupJson(JsonReader &json, byte event);
+JsonReader backupReader(readBackupJson);
+PatchRecord backupRecord; // The patch being read
+bool backupRecordBad;
+bool backupVersionBad; // The backup being read hasn't given BACKUP_VERSION
+byte backupMapCount; // Channels of the map read
+bool backupArmed = false;   // The serial port is carrying a backup instead of midi
+bool backupPatchRead = false; // backupRecord is complete and waiting to be stored
+bool backupPatchQueued = false; // and has been queued to the EEPROM
+byte backupPatchNumber;
+unsigned int backupFailureCount; // The EEPROM failure count when it was queued
+byte backupReadCount = 0;  // Patches read and stored
+byte backupErrorCount = 0; // Patches read with a bad value or CRC
+unsigned int backupOverflows = 0;
+
+void sendBackupPatch(byte number)
+{
+  PatchRecord record;
+  patchManager.readRecord(number, record);
+  backupWriter.breakLine();
+  if (record.isEmpty() || !record.isValid())
+  {
+    backupWriter.null();
+    return;
+  }
+
+  // Patches saved before layering existed have no layer count
+  byte count = (record.layers[0] <= MidiRoutingTable::MAX_LAYERS) ? record.layers[0] : 0;
+  record.layers[0] = count;
+  memset(record.layers + 1 + count, 255, MidiRoutingTable::MAX_LAYERS - count);
+
+  backupWriter.beginObject();
+  backupWriter.key(F("map"));
+  backupWriter.beginArray();
+  for (byte i = 1; i <= MaxChannel; i++)
+  {
+    backupWriter.value(record.mapsTo(i));
+  }
+  backupWriter.endArray();
+  backupWriter.key(F("layers"));
+  backupWriter.beginArray();
+  for (byte i = 1; i <= count; i++)
+  {
+    backupWriter.beginArray();
+    backupWriter.value((record.layers[i] >> 4) + 1);
+    backupWriter.value((record.layers[i] & 0x0F) + 1);
+    backupWriter.endArray();
+  }
+  backupWriter.endArray();
+  backupWriter.key(F("filters"));
+  backupWriter.beginArray();
+  for (byte i = 0; i < PatchRecord::FILTERS_SIZE; i++)
+  {
+    backupWriter.value(record.filters[i]);
+  }
+  backupWriter.endArray();
+  backupWriter.key(F("crc"));
+  backupWriter.value(record.calculateUnpackedCrc());
+  backupWriter.endObject();
+}
+
+/**
+ * Sends the next part of the bank. The header goes with the first patch and the end with the last.
+ */
+void sendBackup()
+{
+  if (backupSendPatch == 0)
+  {
+    backupWriter.reset();
+    backupWriter.beginObject();
+    backupWriter.key(F("version"));
+    backupWriter.value(BACKUP_VERSION);
+    backupWriter.key(F("patches"));
+    backupWriter.beginArray();
+  }
+  sendBackupPatch(backupSendPatch++);
+  if (backupSendPatch == PatchManager::MAX_PATCHES)
+  {
+    backupWriter.endArray();
+    backupWriter.endObject();
+    MidiSerial.println();
+    backupSendPatch = 255;
+  }
+}
+
+/**
+ * Returns true if the value is a midi channel
+ */
+bool isBackupChannel(long value)
+{
+  if (value < 1 || value > MaxChannel)
+  {
+    backupRecordBad = true;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Returns true if the value fits in a byte
+ */
+bool isBackupByte(long value)
+{
+  if (value < 0 || value > 255)
+  {
+    backupRecordBad = true;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Handles a number read from a backup
+ */
+void readBackupNumber(JsonReader &json)
+{
+  byte depth = json.depth();
+  long value = json.number();
+
+  if (depth == 1 && json.keyIs(F("version")))
+  {
+    backupVersionBad = value != BACKUP_VERSION;
+  }
+  else if (depth == 4 && json.keyIs(F("map")))
+  {
+    if (json.index() < MaxChannel && isBackupChannel(value))
+    {
+      backupRecord.setMapsTo(json.index() + 1, value);
+      backupMapCount++;
+    }
+  }
+  else if (depth == 5 && json.keyIs(F("layers")))
+  {
+    byte layer = json.index(3);
+    if (layer < MidiRoutingTable::MAX_LAYERS && json.index() < 2 && isBackupChannel(value))
+    {
+      if (json.index() == 0)
+      {
+        backupRecord.layers[1 + layer] = (value - 1) << 4;
+      }
+      else
+      {
+        backupRecord.layers[1 + layer] |= value - 1;
+      }
+      backupRecord.layers[0] = layer + 1;
+    }
+  }
+  else if (depth == 4 && json.keyIs(F("filters")))
+  {
+    if (json.index() < PatchRecord::FILTERS_SIZE && isBackupByte(value))
+    {
+      backupRecord.filters[json.index()] = value;
+    }
+  }
+  else if (depth == 3 && json.keyIs(F("crc")))
+  {
+    if (isBackupByte(value))
+    {
+      backupRecord.crc = value;
+    }
+  }
+}
+
+/**
+ * Handles each value read from a backup, storing each patch as soon as it is complete
+ */
+void readBackupJson(JsonReader &json, byte event)
+{
+  byte depth = json.depth();
+
+  if (event == JsonReader::NUMBER)
+  {
+    readBackupNumber(json);
+  }
+  else if (depth == 0 && event == JsonReader::BEGIN_OBJECT)
+  {
+    backupVersionBad = true; // until the version has been read
+  }
+  else if (depth == 2 && event == JsonReader::BEGIN_OBJECT)
+  {
+    memset(&backupRecord, 255, sizeof(backupRecord));
+    backupRecord.layers[0] = 0;
+    backupRecordBad = false;
+    backupMapCount = 0;
+  }
+  else if (depth == 2 && (event == JsonReader::END_OBJECT || event == JsonReader::NULL_VALUE))
+  {
+    if (event == JsonReader::NULL_VALUE)
+    {
+      memset(&backupRecord, 255, sizeof(backupRecord)); // an erased patch
+      backupRecordBad = false;
+    }
+    else
+    {
+      backupRecordBad |= backupMapCount != MaxChannel || backupRecord.crc != backupRecord.calculateUnpackedCrc();
+      backupRecord.version = PatchRecord::VERSION;
+      backupRecord.crc = backupRecord.calculateCrc();
+    }
+
+    backupRecordBad |= backupVersionBad || json.index() >= PatchManager::MAX_PATCHES;
+    backupPatchNumber = json.index();
+    backupPatchRead = true; // stored and answered by storeBackupPatch()
+  }
+}
+
+/**
+ * Stores the patch that has been read once the EEPROM is free, then answers it so the
+ * sender can send the next one
+ */
+void storeBackupPatch()
+{
+  if (patchManager.busy())
+  {
+    return;
+  }
+  if (!backupRecordBad && !backupPatchQueued)
+  {
+    backupFailureCount = patchManager.store.failureCount;
+    patchManager.writeRecord(backupPatchNumber, backupRecord);
+    backupPatchQueued = true;
+    return;
+  }
+
+  bool stored = backupPatchQueued && patchManager.store.failureCount == backupFailureCount;
+  if (stored)
+  {
+    backupReadCount++;
+  }
+  else
+  {
+    backupErrorCount++;
+  }
+  backupWriter.reset();
+  backupWriter.beginObject();
+  backupWriter.key(stored ? F("ack") : F("nak"));
+  backupWriter.value(backupPatchNumber);
+  backupWriter.endObject();
+  MidiSerial.println();
+  backupPatchRead = false;
+  backupPatchQueued = false;
+}
+
+/**
+ * Gets ready to send or read a backup
+ */
+void resetBackup()
+{
+  backupSendPatch = 255;
+  backupReader.reset();
+  backupPatchRead = false;
+  backupPatchQueued = false;
+  backupReadCount = 0;
+  backupErrorCount = 0;
+  backupOverflows = MidiSerial.overflowCount();
+}
+
+/**
+ * Drops whatever is waiting to be read, which is midi when the backup starts and
+ * JSON when it stops
+ */
+void discardSerialInput()
+{
+  while (MidiSerial.available() > 0)
+  {
+    MidiSerial.read();
+  }
+}
+
+/**
+ * Takes the serial port over from midi for the backup
+ */
+void armBackup()
+{
+  backupArmed = true;
+  discardSerialInput();
+  resetBackup();
+}
+
+/**
+ * Gives the serial port back to midi, which starts again from a clean state
+ */
+void disarmBackup()
+{
+  backupArmed = false; // a patch already queued is still written, but not answered
+  discardSerialInput();
+  midiForwarder.reset();
+  midiOut.cancelRunningStatus();
+}
+
+#if MIDI_LATENCY_STATS
+/*
+   --------------------------------------------------------------------------------------
+   LATENCY STATS
+   Only built with the MIDI_LATENCY_STATS flag. Each forwarded message is timed from its
+   first byte being received to its last byte going to the transmitter, with the Timer1
+   stamps taken by MidiUart. In parsed mode the library doesn't say where a message
+   started, so it is timed from its last byte being received. The times are shown on the
+   LATENCY page and sent in reply to a system exclusive request.
+   The page also shows the longest pass of loop(), passes per second and the most stack used. Free RAM is
+   filled with STACK_PAINT at power up and the stack is however much of it was overwritten.
+   --------------------------------------------------------------------------------------
+*/
+LatencyHistogram latencyHistogram; // In Timer1 ticks of MIDI_UART_TICK_US
+word latencyMessageStamp;          // When the message being forwarded started to arrive
+byte latencyMessageTxPosition;     // Where the transmit buffer was then
+byte latencyByteTxPosition;        // Where it was before the last byte was forwarded
+
+// The longest time between the start of one pass of loop() and the next, in Timer1 ticks
+word loopMaxTicks = 0;
+word loopStartStamp;
+bool loopTimed = false;
+unsigned long loopCount = 0;     // Passes of loop() in the current second
+unsigned long loopRate = 0;      // Passes of loop() in the last second
+unsigned long loopRateStart = 0;
+
+const byte STACK_PAINT = 0xC5;
+extern uint8_t __heap_start;
+extern void *__brkval;
+
+const byte LATENCY_VIEWS = 6;
+byte latencyView = 0;
+const unsigned long LATENCY_REFRESH_TIME = 250; // ms between refreshes of the latency page
+unsigned long latencyRefreshTime = 0;
+
+/**
+ * Called before each received byte is forwarded in cut-through mode
+ */
+inline void latencyBeginByte(byte value, word stamp)
+{
+  latencyByteTxPosition = MidiSerial.txPosition();
+  if (value < 0xF8 && midiForwarder.atMessageBoundary())
+  {
+    latencyMessageStamp = stamp;
+    latencyMessageTxPosition = latencyByteTxPosition;
+  }
+}
+
+/**
+ * Called when a message is complete in cut-through mode. It is timed if anything was sent for it
+ */
+inline void latencyEndMessage(byte value, word stamp)
+{
+  if (value >= 0xF8)
+  {
+    // Realtime messages are a single byte, which may be in the middle of another message
+    if (MidiSerial.txPosition() != latencyByteTxPosition)
+    {
+      MidiSerial.markMessageSent(stamp);
+    }
+  }
+  else if (MidiSerial.txPosition() != latencyMessageTxPosition)
+  {
+    MidiSerial.markMessageSent(latencyMessageStamp);
+  }
+}
+
+unsigned long latencyMicros(word ticks)
+{
+  return (unsigned long)ticks * MIDI_UART_TICK_US;
+}
+
+inline void timeLoop()
+{
+  word now = TCNT1;
+  if (loopTimed && (word)(now - loopStartStamp) > loopMaxTicks)
+  {
+    loopMaxTicks = now - loopStartStamp;
+  }
+  loopStartStamp = now;
+  loopTimed = true;
+  loopCount++;
+}
+
+byte *stackPaintStart()
+{
+  return (__brkval != NULL) ? (byte *)__brkval : &__heap_start;
+}
+
+/**
+ * Fills the free RAM between the heap and the stack. Called first thing in setup()
+ */
+void paintStack()
+{
+  byte *top = (byte *)SP - 16; // leave this function's own frame alone
+  for (byte *p = stackPaintStart(); p < top; p++)
+  {
+    *p = STACK_PAINT;
+  }
+}
+
+/**
+ * Returns the number of bytes between the heap and the deepest the stack has reached
+ */
+unsigned int stackUnused()
+{
+  byte *p = stackPaintStart();
+  byte *start = p;
+  while (*p == STACK_PAINT && p < (byte *)SP)
+  {
+    p++;
+  }
+  return p - start;
+}
+#endif
+
+/*
+   --------------------------------------------------------------------------------------
+   SYSEX PATCH DUMP
+   The patch bank can be dumped and loaded over midi with system exclusive messages made by
+   writeSysExChunk(), one patch per message:
+   F0 7D 4D 52 01 00 cs F7                 dump request, each patch is sent back
+   F0 7D 4D 52 02 patch <PatchRecord> cs F7 a patch, in a dump or to be stored
+   F0 7D 4D 52 03 patch cs F7              reply when a patch has been stored
+   F0 7D 4D 52 04 patch cs F7              reply when a patch was not stored and should be sent again
+   F0 7D 4D 52 05 00 cs F7                 latency request, only with MIDI_LATENCY_STATS
+   F0 7D 4D 52 06 n <data> cs F7           the latency stats: n=0 samples (4 bytes), min, max, p50,
+                                           p90, p99, overflows (2 bytes each), tick in us (1 byte);
+                                           n=1 and 2 the histogram bins 0-15 and 16-31 (2 bytes each)
+   Dumped patches are sent one per pass of loop(), between forwarded messages. Storing a
+   patch can take 100ms so a patch sent before the last one has been acknowledged is refused.
+   A patch that arrives with a bad checksum is refused too, so the sender never waits forever.
+   --------------------------------------------------------------------------------------
+*/
+const byte SYSEX_HEADER[] = {0x7D, 0x4D, 0x52}; // The manufacturer id for non-commercial use, then "MR"
+const byte SYSEX_DUMP_REQUEST = 0x01;
+const byte SYSEX_PATCH = 0x02;
+const byte SYSEX_ACK = 0x03;
+const byte SYSEX_NAK = 0x04;
+const byte SYSEX_LATENCY_REQUEST = 0x05;
+const byte SYSEX_LATENCY = 0x06;
+
+byte sysExDumpPatch = 255;    // The next patch to dump, or 255 when not dumping
+PatchRecord sysExRecord;      // A received patch waiting to be stored
+byte sysExRecordPatch = 255;  // The number of that patch, or 255 if there isn't one
+byte sysExStoringPatch = 255; // The patch being written, acknowledged once the writes finish
+unsigned int sysExFailureCount; // The EEPROM failure count when that patch was queued
+byte sysExReplyCommand = 0;   // A reply waiting to be sent, or 0
+byte sysExReplyPatch = 0;
+#if MIDI_LATENCY_STATS
+byte sysExLatencyChunk = 255; // The next latency message to send, or 255 when not sending
+#endif
+
+void receiveSysExChunk(byte command, byte index, const byte *payload, byte length);
+void receiveBadSysExChunk(byte command, byte index);
+SysExChunkReader sysExReader(SYSEX_HEADER, sizeof(SYSEX_HEADER), receiveSysExChunk, receiveBadSysExChunk);
+
+void replySysEx(byte command, byte patch)
+{
+  sysExReplyCommand = command;
+  sysExReplyPatch = patch;
+}
+
+/**
+ * Handles each of our system exclusive messages that is received.
+ * Nothing is sent from here as the message is still being forwarded.
+ */
+void receiveSysExChunk(byte command, byte index, const byte *payload, byte length)
+{
+  if (command == SYSEX_DUMP_REQUEST)
+  {
+    sysExDumpPatch = 0;
+  }
+  else if (command == SYSEX_PATCH)
+  {
+    if (sysExRecordPatch != 255 || sysExStoringPatch != 255 || index >= PatchManager::MAX_PATCHES || length != sizeof(PatchRecord))
+    {
+      replySysEx(SYSEX_NAK, index);
+      return;
+    }
+    memcpy(&sysExRecord, payload, length);
+    if (!sysExRecord.isValid())
+    {
+      replySysEx(SYSEX_NAK, index);
+      return;
+    }
+    sysExRecordPatch = index;
+  }
+#if MIDI_LATENCY_STATS
+  else if (command == SYSEX_LATENCY_REQUEST)
+  {
+    sysExLatencyChunk = 0;
+  }
+#endif
+}
+
+/**
+ * Asks for a patch that was damaged on the way to be sent again
+ */
+void receiveBadSysExChunk(byte command, byte index)
+{
+  if (command == SYSEX_PATCH)
+  {
+    replySysEx(SYSEX_NAK, index);
+  }
+}
+
+#if MIDI_LATENCY_STATS
+void sendSysExLatency()
+{
+  if (sysExLatencyChunk == 0)
+  {
+    word summary[6] = {latencyHistogram.minimum, latencyHistogram.maximum, latencyHistogram.percentile(50),
+                       latencyHistogram.percentile(90), latencyHistogram.percentile(99), (word)MidiSerial.latencyOverflows};
+    byte payload[4 + sizeof(summary) + 1];
+    memcpy(payload, &latencyHistogram.samples, 4);
+    memcpy(payload + 4, summary, sizeof(summary));
+    payload[sizeof(payload) - 1] = MIDI_UART_TICK_US;
+    writeSysExChunk(midiOut, SYSEX_HEADER, sizeof(SYSEX_HEADER), SYSEX_LATENCY, 0, payload, sizeof(payload));
+    sysExLatencyChunk = 1;
+  }
+  else
+  {
+    const byte half = LatencyHistogram::BINS / 2;
+    const unsigned int *bins = &latencyHistogram.bins[(sysExLatencyChunk - 1) * half];
+    writeSysExChunk(midiOut, SYSEX_HEADER, sizeof(SYSEX_HEADER), SYSEX_LATENCY, sysExLatencyChunk, (const byte *)bins, half * 2);
+    sysExLatencyChunk = (sysExLatencyChunk < 2) ? sysExLatencyChunk + 1 : 255;
+  }
+}
+#endif
+
+/**
+ * Stores received patches, and sends replies and dumped patches between forwarded messages.
+ * Called on every pass of loop()
+ */
+void updateSysExPatchDump()
+{
+  if (sysExRecordPatch != 255 && !patchManager.busy())
+  {
+    sysExFailureCount = patchManager.store.failureCount;
+    patchManager.writeRecord(sysExRecordPatch, sysExRecord);
+    sysExStoringPatch = sysExRecordPatch;
+    sysExRecordPatch = 255;
+  }
+  else if (sysExStoringPatch != 255 && !patchManager.busy())
+  {
+    // Only failures since the patch was queued count, whatever else has been written
+    bool stored = patchManager.store.failureCount == sysExFailureCount;
+    replySysEx(stored ? SYSEX_ACK : SYSEX_NAK, sysExStoringPatch);
+    sysExStoringPatch = 255;
+  }
+
+  if (!midiForwarder.atMessageBoundary())
+  {
+    return; // don't break up a message that is being forwarded
+  }
+
+  if (sysExReplyCommand != 0)
+  {
+    writeSysExChunk(midiOut, SYSEX_HEADER, sizeof(SYSEX_HEADER), sysExReplyCommand, sysExReplyPatch, NULL, 0);
+    sysExReplyCommand = 0;
+  }
+  else if (sysExDumpPatch != 255)
+  {
+    PatchRecord record;
+    patchManager.readRecord(sysExDumpPatch, record);
+    writeSysExChunk(midiOut, SYSEX_HEADER, sizeof(SYSEX_HEADER), SYSEX_PATCH, sysExDumpPatch, (const byte *)&record, sizeof(record));
+    sysExDumpPatch++;
+    if (sysExDumpPatch == PatchManager::MAX_PATCHES)
+    {
+      sysExDumpPatch = 255;
+    }
+  }
+#if MIDI_LATENCY_STATS
+  else if (sysExLatencyChunk != 255)
+  {
+    sendSysExLatency();
+  }
+#endif
+}
+
+/*
+   --------------------------------------------------------------------------------------
+   LCD FUNCTIONS
+   --------------------------------------------------------------------------------------
+*/
+
+void lcdPrintMidiChannelMap()
+{
+  char buffer[7];
+  sprintf(buffer, "%02d->%02d", midiChannel, midiMap[midiChannel].mapsTo);
+  lcd.setCursor(0, 1);
+  lcd.print(buffer);
+}
+
+void lcdPrintMidiLayer()
+{
+  // e.g. "01+05 on   x2" shows channel 5 is layered onto input channel 1 which goes to 2 outputs
+  const char *state = (layerChannel == midiMap[midiChannel].mapsTo) ? "main" : midiMap[midiChannel].hasLayer(layerChannel) ? "on  " : "off ";
+  char buffer[17];
+  snprintf(buffer, sizeof(buffer), "%02d+%02d %s x%d", midiChannel, layerChannel, state, midiRouting->destinationCount(midiChannel - 1));
+  lcd.setCursor(0, 1);
+  lcd.print(buffer);
+}
+
+void lcdPrintBandwidthWarning()
+{
+  if (curMenuIndex != DEBUG_MENU_MONITOR)
+  {
+    lcd.setCursor(15, 0);
+    lcd.print(bandwidthWarning ? "!" : " ");
+  }
+}
+
+void lcdPrintPatchNumber()
+{
+  char buffer[3];
+  sprintf(buffer, "%02d", patchManager.patchNumber);
+  lcd.setCursor(0, 1);
+  lcd.print(buffer);
+  if (!patchManager.patchIsValid())
+  {
+    lcd.print("?");
+  }
+  else if (patchManager.patchExists())
+  {
+    lcd.print("*");
+  }
+  else
+  {
+    lcd.print(" ");
+  }
+}
+
+/*
+   Midi monitor type names are kept in flash. The table is indexed by
+   (status >> 4) - 8 for channel messages and 7 + (status & 0x0F) for system messages
+*/
+const char typeNoteOff[] PROGMEM = "NoteOff";
+const char typeNoteOn[] PROGMEM = "NoteOn";
+const char typeAfterTouchPoly[] PROGMEM = "AfterTouchPoly";
+const char typeControlChange[] PROGMEM = "ControlChange";
+const char typeProgramChange[] PROGMEM = "ProgramChange";
+const char typeAfterTouchChannel[] PROGMEM = "AfterTouchChan";
+const char typePitchBend[] PROGMEM = "PitchBend";
+const char typeSystemExclusive[] PROGMEM = "SystemExclusive";
+const char typeTimeCode[] PROGMEM = "TimeCode";
+const char typeSongPosition[] PROGMEM = "SongPosition";
+const char typeSongSelect[] PROGMEM = "SongSelect";
+const char typeTuneRequest[] PROGMEM = "TuneRequest";
+const char typeClock[] PROGMEM = "Clock";
+const char typeStart[] PROGMEM = "Start";
+const char typeContinue[] PROGMEM = "Continue";
+const char typeStop[] PROGMEM = "Stop";
+const char typeActiveSensing[] PROGMEM = "ActiveSensing";
+const char typeSystemReset[] PROGMEM = "SystemReset";
+const char typeUnknown[] PROGMEM = "Unknown";
+
+const char *const midiTypeNames[] PROGMEM = {
+    typeNoteOff, typeNoteOn, typeAfterTouchPoly, typeControlChange,
+    typeProgramChange, typeAfterTouchChannel, typePitchBend,
+    typeSystemExclusive, typeTimeCode, typeSongPosition, typeSongSelect,  // F0-F3
+    typeUnknown, typeUnknown, typeTuneRequest, typeUnknown,               // F4-F7
+    typeClock, typeUnknown, typeStart, typeContinue,                      // F8-FB
+    typeStop, typeUnknown, typeActiveSensing, typeSystemReset};           // FC-FF
+
+/**
+ * Returns the name of a message type (a status byte with the channel removed) in flash
+ */
+PGM_P midiTypeName(byte type)
+{
+  if (type < midi::NoteOff)
+  {
+    return typeUnknown;
+  }
+  byte index = (type < midi::SystemExclusive) ? (type >> 4) - 8 : 7 + (type & 0x0F);
+  return (PGM_P)pgm_read_ptr(&midiTypeNames[index]);
+}
+
+char hexDigit(byte value)
+{
+  return (value < 10) ? '0' + value : 'A' + value - 10;
+}
+
+/**
+ * Write a byte as two hex digits and return the position after them
+ */
+char *formatHex(char *position, byte value)
+{
+  *position++ = hexDigit(value >> 4);
+  *position++ = hexDigit(value & 0x0F);
+  return position;
+}
+
+/**
+ * Write a number from 0-99 as two decimal digits and return the position after them
+ */
+char *formatDecimal(char *position, byte value)
+{
+  *position++ = '0' + (value / 10) % 10;
+  *position++ = '0' + value % 10;
+  return position;
+}
+
+void lcdPrintMidiMonitor(byte channel, midi::MidiType type, midi::DataByte dataByte1, midi::DataByte dataByte2)
+{
+  // Both lines are padded with spaces so that they overwrite the previous message
+  char line[LcdFrameBuffer::COLS + 1];
+  memset(line, ' ', LcdFrameBuffer::COLS);
+  line[LcdFrameBuffer::COLS] = 0;
+
+  PGM_P name = midiTypeName(type);
+  memcpy_P(line, name, strlen_P(name));
+  lcd.setCursor(0, 0);
+  lcd.print(line);
+
+  // e.g. "01 90 3C 7F" for a note on channel 1
+  memset(line, ' ', LcdFrameBuffer::COLS);
+  char *position = formatDecimal(line, channel);
+  *position++ = ' ';
+  position = formatHex(position, type);
+  if (type < midi::SystemExclusive || type == midi::TimeCodeQuarterFrame || type == midi::SongPosition || type == midi::SongSelect)
+  {
+    *position++ = ' ';
+    position = formatHex(position, dataByte1);
+  }
+  if (type < midi::ProgramChange || type == midi::PitchBend || type == midi::SongPosition)
+  {
+    *position++ = ' ';
+    position = formatHex(position, dataByte2);
+  }
+  lcd.setCursor(0, 1);
+  lcd.print(line);
+}
+
+// The message types that can be filtered, in the order they are shown on the filters page
+const byte filterTypes[] PROGMEM = {
+    midi::NoteOff, midi::NoteOn, midi::AfterTouchPoly, midi::ControlChange, midi::ProgramChange,
+    midi::AfterTouchChannel, midi::PitchBend, midi::SystemExclusive, midi::TimeCodeQuarterFrame,
+    midi::SongPosition, midi::SongSelect, midi::TuneRequest, midi::Clock, midi::Start,
+    midi::Continue, midi::Stop, midi::ActiveSensing, midi::SystemReset};
+const byte NUM_FILTER_TYPES = sizeof(filterTypes);
+
+bool isMidiTypeFiltered(byte channel, byte type)
+{
+  if (type < midi::SystemExclusive)
+  {
+    return midiMap[channel].filters & (1 << ((type >> 4) - 8));
+  }
+  return systemFilters & (1 << (type & 0x0F));
+}
+
+void lcdPrintMidiFilter()
+{
+  // The top line shows the input channel, "--" for system messages which have no channel
+  byte type = pgm_read_byte(&filterTypes[filterTypeIndex]);
+  char buffer[LcdFrameBuffer::COLS + 1];
+  if (type < midi::SystemExclusive)
+  {
+    snprintf(buffer, sizeof(buffer), "%02d", midiChannel);
+  }
+  else
+  {
+    strcpy(buffer, "--");
+  }
+  lcd.setCursor(13, 0);
+  lcd.print(buffer);
+
+  // The bottom line shows the type with '+' if it is forwarded or '-' if it is dropped
+  memset(buffer, ' ', LcdFrameBuffer::COLS);
+  buffer[LcdFrameBuffer::COLS] = 0;
+  buffer[0] = isMidiTypeFiltered(midiChannel, type) ? '-' : '+';
+  PGM_P name = midiTypeName(type);
+  memcpy_P(buffer + 1, name, strlen_P(name));
+  lcd.setCursor(0, 1);
+  lcd.print(buffer);
+}
+
+void lcdPrintForwardingMode()
+{
+  lcd.setCursor(0, 1);
+  lcd.print((forwardingMode == FORWARD_CUT_THROUGH) ? "cut-through" : "parsed     ");
+
+  // Show the bytes saved by running status compared to sending every status byte
+  unsigned long offered = midiOut.bytesOffered();
+  byte savedPercent = (offered > 0) ? (offered - midiOut.bytesSent()) * 100 / offered : 0;
+  char buffer[6];
+  snprintf(buffer, sizeof(buffer), " -%02d%%", savedPercent);
+  lcd.print(buffer);
+}
+
+void lcdPrintProgramChannel()
+{
+  // e.g. "ch16 sw=184us" shows how long the last patch switch took
+  char buffer[LcdFrameBuffer::COLS + 1];
+  if (programChannel == 0)
+  {
+    snprintf(buffer, sizeof(buffer), "off             ");
+  }
+  else
+  {
+    snprintf(buffer, sizeof(buffer), "ch%02d sw=%luus        ", programChannel, patchSwitchLatency);
+  }
+  lcd.setCursor(0, 1);
+  lcd.print(buffer);
+}
+
+void lcdPrintBackupStatus()
+{
+  char buffer[LcdFrameBuffer::COLS + 1];
+  if (backupSendPatch != 255)
+  {
+    snprintf(buffer, sizeof(buffer), "sending %02d/%02d", backupSendPatch, PatchManager::MAX_PATCHES);
+  }
+  else if (backupReader.failed() || MidiSerial.overflowCount() != backupOverflows)
+  {
+    snprintf(buffer, sizeof(buffer), "read error n=%u", backupReadCount);
+  }
+  else if (backupReadCount > 0 || backupErrorCount > 0)
+  {
+    snprintf(buffer, sizeof(buffer), "%s n=%u e=%u", backupReader.done() ? "read" : "reading", backupReadCount, backupErrorCount);
+  }
+  else if (backupArmed)
+  {
+    snprintf(buffer, sizeof(buffer), "RIGHT to send");
+  }
+  else
+  {
+    snprintf(buffer, sizeof(buffer), "RIGHT to arm");
+  }
+  lcd.setCursor(0, 1);
+  lcd.print(buffer);
+  for (byte i = strlen(buffer); i < LcdFrameBuffer::COLS; i++)
+  {
+    lcd.write(' ');
+  }
+}
+
+#if MIDI_LATENCY_STATS
+void lcdPrintLatencyStats()
+{
+  char buffer[LcdFrameBuffer::COLS + 1];
+  if (latencyView == 3)
+  {
+    snprintf(buffer, sizeof(buffer), "loop max %lu", latencyMicros(loopMaxTicks));
+  }
+  else if (latencyView == 5)
+  {
+    snprintf(buffer, sizeof(buffer), "loops/s %lu", loopRate);
+  }
+  else if (latencyView == 4)
+  {
+    unsigned int unused = stackUnused();
+    unsigned int used = ((byte *)RAMEND + 1 - stackPaintStart()) - unused;
+    snprintf(buffer, sizeof(buffer), "stack %u free %u", used, unused);
+  }
+  else if (latencyHistogram.samples == 0)
+  {
+    snprintf(buffer, sizeof(buffer), "no messages");
+  }
+  else if (latencyView == 0)
+  {
+    snprintf(buffer, sizeof(buffer), "p50 %lu p90 %lu", latencyMicros(latencyHistogram.percentile(50)),
+             latencyMicros(latencyHistogram.percentile(90)));
+  }
+  else if (latencyView == 1)
+  {
+    snprintf(buffer, sizeof(buffer), "p99 %lu max %lu", latencyMicros(latencyHistogram.percentile(99)),
+             latencyMicros(latencyHistogram.maximum));
+  }
+  else if (latencyView == 2)
+  {
+    snprintf(buffer, sizeof(buffer), "min %lu n %lu", latencyMicros(latencyHistogram.minimum), latencyHistogram.samples);
+  }
+  lcd.setCursor(0, 1);
+  lcd.print(buffer);
+  for (byte i = strlen(buffer); i < LcdFrameBuffer::COLS; i++)
+  {
+    lcd.write(' ');
+  }
+}
+#endif
+
+void lcdPrintMenuPage()
+{
+  lcd.clear();
+  lcd.print(menu[curMenuIndex]);
+  lcdPrintBandwidthWarning();
+  if (curMenuIndex == MENU_MIDIMAP)
+  {
+    lcdPrintMidiChannelMap();
+  }
+  else if (curMenuIndex == MENU_MIDI_LAYERS)
+  {
+    lcdPrintMidiLayer();
+  }
+  else if (curMenuIndex == MENU_MIDI_FILTERS)
+  {
+    lcdPrintMidiFilter();
+  }
+  else if (curMenuIndex == MENU_LOAD_PATCH)
+  {
+    lcdPrintPatchNumber();
+  }
+  else if (curMenuIndex == MENU_SAVE_PATCH)
+  {
+    lcdPrintPatchNumber();
+  }
+  else if (curMenuIndex == MENU_CLEAR_PATCH)
+  {
+    lcdPrintPatchNumber();
+  }
+  else if (curMenuIndex == MENU_RESET_MIDIMAP)
+  {
+  }
+  else if (curMenuIndex == DEBUG_MENU_MONITOR)
+  {
+  }
+  else if (curMenuIndex == MENU_FORWARD_MODE)
+  {
+    lcdPrintForwardingMode();
+  }
+  else if (curMenuIndex == MENU_PROGRAM_CHANNEL)
+  {
+    lcdPrintProgramChannel();
+  }
+  else if (curMenuIndex == MENU_BACKUP_PATCHES)
+  {
+    lcdPrintBackupStatus();
+  }
+#if MIDI_LATENCY_STATS
+  else if (curMenuIndex == MENU_LATENCY)
+  {
+    lcdPrintLatencyStats();
+  }
+#endif
+}
+
+/*
+   -------------------------------------------------------------------------------------------
+   TIMED UI STATES
+   The splash screen and the transient "saved!" style messages are driven from loop()
+   instead of delay() so that midi keeps being forwarded while they are showing
+   -------------------------------------------------------------------------------------------
+*/
+const unsigned long SPLASH_HOLD_TIME = 250;   // ms before the splash starts scrolling
+const unsigned long SPLASH_SCROLL_TIME = 100; // ms between each scroll step
+const byte SPLASH_SCROLL_STEPS = 15;
+const unsigned long MESSAGE_TIME = 250; // ms a transient message is shown for
+
+bool splashActive = false;
+byte splashStep = 0;
+unsigned long splashNextTime = 0;
+
+bool messageActive = false;
+byte messageNextMenuIndex = 0; // The menu page shown when the message expires
+unsigned long messageExpireTime = 0;
+
+const char *storedMessage = NULL; // Shown once the queued EEPROM writes have finished
+byte storedMenuIndex = 0;         // The menu page the writes were started from
+byte storedNextMenuIndex = 0;
+unsigned int storedWriteCount = 0;   // The EEPROM counts when the writes were started
+unsigned int storedFailureCount = 0;
+
+void startSplash()
+{
+  lcd.setCursor(0, 0); //top left
+  lcd.print("MIDIChannelizer!");
+  splashActive = true;
+  splashStep = 0;
+  splashNextTime = millis() + SPLASH_HOLD_TIME;
+}
+
+/**
+ * Show a message on the bottom line, then show the given menu page once it expires
+ */
+void showTransientMessage(const char *message, byte nextMenuIndex)
+{
+  lcd.setCursor(0, 1);
+  lcd.print(message);
+  messageActive = true;
+  messageNextMenuIndex = nextMenuIndex;
+  messageExpireTime = millis() + MESSAGE_TIME;
+}
+
+void finishTransientMessage()
+{
+  messageActive = false;
+  curMenuIndex = messageNextMenuIndex;
+  lcdPrintMenuPage();
+}
+
+/**
+ * Show a message with the number of EEPROM bytes written since the writes were started
+ */
+void showWriteCountMessage(const char *message, byte nextMenuIndex)
+{
+  if (patchManager.store.failureCount != storedFailureCount)
+  {
+    message = "write failed!";
+  }
+  char buffer[LcdFrameBuffer::COLS + 1];
+  unsigned int written = patchManager.store.writeCount - storedWriteCount;
+  snprintf(buffer, sizeof(buffer), "%s w=%u", message, written); // e.g. "saved! w=3"
+  showTransientMessage(buffer, nextMenuIndex);
+}
+
+/**
+ * Show "saving..." until the queued EEPROM writes finish, then show the message.
+ * Returns false, without starting, if an earlier save is still being written.
+ * The writes wait in the patch manager until the EEPROM queue has room, so saving
+ * never holds up loop().
+ */
+bool startStoring(const char *message, byte nextMenuIndex)
+{
+  if (storedMessage != NULL)
+  {
+    showTransientMessage("busy!", curMenuIndex);
+    return false;
+  }
+  // The counts are not reset as a system exclusive load may be counting failures too
+  storedWriteCount = patchManager.store.writeCount;
+  storedFailureCount = patchManager.store.failureCount;
+  storedMessage = message;
+  storedMenuIndex = curMenuIndex;
+  storedNextMenuIndex = nextMenuIndex;
+  lcd.setCursor(0, 1);
+  lcd.print("saving...       ");
+  return true;
+}
+
+/**
+ * Advance the splash and transient messages. Called on every pass of loop()
+ */
+void updateTimedUi()
+{
+  unsigned long now = millis();
+  if (splashActive && (long)(now - splashNextTime) >= 0)
+  {
+    if (splashStep < SPLASH_SCROLL_STEPS)
+    {
+      // scroll one position left
+      lcdDisplay.scrollDisplayLeft();
+      splashStep++;
+      splashNextTime += SPLASH_SCROLL_TIME;
+    }
+    else
+    {
+      // Clearing the display also undoes the scrolling
+      splashActive = false;
+      lcdDisplay.clear();
+      lcd.begin();
+      lcdPrintMenuPage();
+    }
+  }
+
+  if (messageActive && (long)(now - messageExpireTime) >= 0)
+  {
+    finishTransientMessage();
+  }
+
+  if (storedMessage != NULL && !patchManager.busy())
+  {
+    // Only report it if the page that started the writes is still showing
+    if (curMenuIndex == storedMenuIndex && !splashActive)
+    {
+      showWriteCountMessage(storedMessage, storedNextMenuIndex);
+    }
+    storedMessage = NULL;
+  }
+}
+
+/*
+   -------------------------------------------------------------------------------------------
+   MIDIMAP PAGE LOGIC
    -------------------------------------------------------------------------------------------
 */
 void midimap_incrementMidiChannel()
@@ -510,23 +2101,109 @@ void midimap_decrementMidiChannel()
 void midimap_incrementMapsToChannel()
 {
   midiMap[midiChannel].incrementMapsTo();
+  applyMidiMap();
   lcdPrintMidiChannelMap();
 }
 
 void midimap_decrementMapsToChannel()
 {
   midiMap[midiChannel].decrementMapsTo();
+  applyMidiMap();
   lcdPrintMidiChannelMap();
 }
 
+/*
+   -------------------------------------------------------------------------------------------
+   MIDI LAYERS PAGE LOGIC
+   Up and down select an output channel, right toggles the layer onto it and left moves
+   on to the next input channel. A patch holds MidiRoutingTable::MAX_LAYERS layers in
+   total across all the input channels.
+   -------------------------------------------------------------------------------------------
+*/
+void layers_incrementLayerChannel()
+{
+  layerChannel = (layerChannel < 16) ? layerChannel + 1 : 1;
+  lcdPrintMidiLayer();
+}
+
+void layers_decrementLayerChannel()
+{
+  layerChannel = (layerChannel > 1) ? layerChannel - 1 : 16;
+  lcdPrintMidiLayer();
+}
+
+void layers_incrementMidiChannel()
+{
+  midiChannel = (midiChannel < 16) ? midiChannel + 1 : 1;
+  lcdPrintMidiLayer();
+}
+
+void layers_toggleLayer()
+{
+  MidiMapItem &item = midiMap[midiChannel];
+  if (layerChannel == item.mapsTo)
+  {
+    return; // the main output can only be changed on the midimap page
+  }
+  if (!item.hasLayer(layerChannel) && countMidiMapLayers() >= MidiRoutingTable::MAX_LAYERS)
+  {
+    // The limit is for the whole patch, not each input channel
+    char buffer[LcdFrameBuffer::COLS + 1];
+    snprintf(buffer, sizeof(buffer), "max %d layers!", MidiRoutingTable::MAX_LAYERS);
+    showTransientMessage(buffer, MENU_MIDI_LAYERS);
+    return;
+  }
+  item.toggleLayer(layerChannel);
+  applyMidiMap();
+  lcdPrintBandwidthWarning();
+  lcdPrintMidiLayer();
+}
+
+/*
+   -------------------------------------------------------------------------------------------
+   MIDI FILTERS PAGE LOGIC
+   Up and down select a message type, right toggles whether it is dropped and left moves
+   on to the next input channel
+   -------------------------------------------------------------------------------------------
+*/
+void filters_incrementType()
+{
+  filterTypeIndex = (filterTypeIndex < NUM_FILTER_TYPES - 1) ? filterTypeIndex + 1 : 0;
+  lcdPrintMidiFilter();
+}
+
+void filters_decrementType()
+{
+  filterTypeIndex = (filterTypeIndex > 0) ? filterTypeIndex - 1 : NUM_FILTER_TYPES - 1;
+  lcdPrintMidiFilter();
+}
+
+void filters_incrementMidiChannel()
+{
+  midiChannel = (midiChannel < 16) ? midiChannel + 1 : 1;
+  lcdPrintMidiFilter();
+}
+
+void filters_toggleFilter()
+{
+  byte type = pgm_read_byte(&filterTypes[filterTypeIndex]);
+  if (type < midi::SystemExclusive)
+  {
+    midiMap[midiChannel].filters ^= 1 << ((type >> 4) - 8);
+  }
+  else
+  {
+    systemFilters ^= 1 << (type & 0x0F);
+  }
+  applyMidiMap();
+  lcdPrintMidiFilter();
+}
+
 void resetMidiMap()
 {
   initializeDefaultMidiMap();
-  lcd.setCursor(0, 1);
-  lcd.print("reset!");
-  delay(250);
-  curMenuIndex = MENU_MIDIMAP;
-  lcdPrintMenuPage();
+  applyMidiMap();
+  showTransientMessage("reset!", MENU_MIDIMAP);
 }
 
 /*
@@ -536,44 +2213,143 @@ void resetMidiMap()
 */
 void loadSelectedPatch()
 {
-  patchManager.loadMidiMap();
-  lcd.setCursor(0, 1);
-  lcd.print("loaded!");
-  delay(250);
-  curMenuIndex = MENU_MIDIMAP;
-  lcdPrintMenuPage();
+  byte result = patchManager.loadMidiMap();
+  if (result == PatchManager::PATCH_CORRUPT)
+  {
+    showTransientMessage("bad patch!", curMenuIndex);
+    return;
+  }
+  if (result == PatchManager::PATCH_OK)
+  {
+    patchManager.writeLastPatchNumber();
+  }
+  applyMidiMap();
+  showTransientMessage("loaded!", MENU_MIDIMAP);
+}
+
+void saveMidiMapToSelectedPatch()
+{
+  if (startStoring("saved!", MENU_MIDIMAP))
+  {
+    patchManager.saveMidiMap();
+    patchManager.writeLastPatchNumber();
+  }
+}
+
+void clearSelectedPatch()
+{
+  if (startStoring("cleared!", curMenuIndex))
+  {
+    patchManager.clearPatch();
+  }
+}
+
+void incrementPatchNumber()
+{
+  patchManager.incrementPatchNumber();
+  lcdPrintPatchNumber();
+}
+
+void decrementPatchNumber()
+{
+  patchManager.decrementPatchNumber();
+  lcdPrintPatchNumber();
+}
+
+/*
+   -------------------------------------------------------------------------------------------
+   FORWARD MODE PAGE LOGIC
+   -------------------------------------------------------------------------------------------
+*/
+void toggleForwardingMode()
+{
+  forwardingMode = (forwardingMode == FORWARD_CUT_THROUGH) ? FORWARD_PARSED : FORWARD_CUT_THROUGH;
+  midiForwarder.reset();
+  lcdPrintForwardingMode();
+}
+
+/*
+   -------------------------------------------------------------------------------------------
+   PROGRAM CHANNEL PAGE LOGIC
+   -------------------------------------------------------------------------------------------
+*/
+void program_channelChanged()
+{
+  patchManager.writeProgramChannel(programChannel);
+  applyMidiMap();
+  lcdPrintProgramChannel();
+}
+
+void program_incrementChannel()
+{
+  programChannel = (programChannel < MaxChannel) ? programChannel + 1 : 0;
+  program_channelChanged();
+}
+
+void program_decrementChannel()
+{
+  programChannel = (programChannel > 0) ? programChannel - 1 : MaxChannel;
+  program_channelChanged();
+}
+
+/*
+   -------------------------------------------------------------------------------------------
+   BACKUP PAGE LOGIC
+   -------------------------------------------------------------------------------------------
+*/
+/**
+ * The first press arms the page, the next sends the bank
+ */
+void backup_armOrSend()
+{
+  if (!backupArmed)
+  {
+    armBackup();
+  }
+  else if (backupSendPatch == 255 && !backupPatchRead)
+  {
+    backupSendPatch = 0;
+  }
+  lcdPrintBackupStatus();
 }
 
-void saveMidiMapToSelectedPatch()
+void backup_disarm()
 {
-  patchManager.saveMidiMap();
-  lcd.setCursor(0, 1);
-  lcd.print("saved!");
-  delay(250);
-  curMenuIndex = MENU_MIDIMAP;
-  lcdPrintMenuPage();
+  if (backupArmed)
+  {
+    disarmBackup();
+    resetBackup();
+    lcdPrintBackupStatus();
+  }
 }
 
-void clearSelectedPatch()
+#if MIDI_LATENCY_STATS
+/*
+   -------------------------------------------------------------------------------------------
+   LATENCY PAGE LOGIC
+   Up and down step through the readouts and right starts the stats and loop time again
+   -------------------------------------------------------------------------------------------
+*/
+void latency_nextView()
 {
-  patchManager.clearPatch();
-  lcd.setCursor(0, 1);
-  lcd.print("cleared!");
-  delay(250);
-  lcdPrintMenuPage();
+  latencyView = (latencyView < LATENCY_VIEWS - 1) ? latencyView + 1 : 0;
+  lcdPrintLatencyStats();
 }
 
-void incrementPatchNumber()
+void latency_previousView()
 {
-  patchManager.incrementPatchNumber();
-  lcdPrintPatchNumber();
+  latencyView = (latencyView > 0) ? latencyView - 1 : LATENCY_VIEWS - 1;
+  lcdPrintLatencyStats();
 }
 
-void decrementPatchNumber()
+void latency_reset()
 {
-  patchManager.decrementPatchNumber();
-  lcdPrintPatchNumber();
+  latencyHistogram.reset();
+  loopMaxTicks = 0;
+  MidiSerial.latencyOverflows = 0;
+  lcdPrintLatencyStats();
 }
+#endif
 
 /*
    -------------------------------------------------------------------------------------------
@@ -582,7 +2358,16 @@ void decrementPatchNumber()
 */
 void changeMenu()
 {
+  byte previousMenuIndex = curMenuIndex;
   curMenuIndex = (curMenuIndex < (NUM_MENU_PAGES - 1)) ? curMenuIndex + 1 : 0; // change the menu page
+  if (curMenuIndex == MENU_BACKUP_PATCHES)
+  {
+    resetBackup();
+  }
+  else if (previousMenuIndex == MENU_BACKUP_PATCHES && backupArmed)
+  {
+    disarmBackup();
+  }
   lcdPrintMenuPage();
 }
 
@@ -599,6 +2384,12 @@ void handleButtonRightPressed()
   case MENU_MIDIMAP:
     midimap_incrementMidiChannel();
     break;
+  case MENU_MIDI_LAYERS:
+    layers_toggleLayer();
+    break;
+  case MENU_MIDI_FILTERS:
+    filters_toggleFilter();
+    break;
   case MENU_RESET_MIDIMAP:
     resetMidiMap();
     break;
@@ -611,6 +2402,14 @@ void handleButtonRightPressed()
   case MENU_CLEAR_PATCH:
     clearSelectedPatch();
     break;
+  case MENU_BACKUP_PATCHES:
+    backup_armOrSend();
+    break;
+#if MIDI_LATENCY_STATS
+  case MENU_LATENCY:
+    latency_reset();
+    break;
+#endif
   }
 }
 
@@ -621,6 +2420,15 @@ void handleButtonLeftPressed()
   case MENU_MIDIMAP:
     midimap_decrementMidiChannel();
     break;
+  case MENU_MIDI_LAYERS:
+    layers_incrementMidiChannel();
+    break;
+  case MENU_MIDI_FILTERS:
+    filters_incrementMidiChannel();
+    break;
+  case MENU_BACKUP_PATCHES:
+    backup_disarm();
+    break;
   }
 }
 
@@ -631,11 +2439,28 @@ void handleButtonUpPressed()
   case MENU_MIDIMAP:
     midimap_incrementMapsToChannel();
     break;
+  case MENU_MIDI_LAYERS:
+    layers_incrementLayerChannel();
+    break;
+  case MENU_MIDI_FILTERS:
+    filters_incrementType();
+    break;
   case MENU_LOAD_PATCH:
   case MENU_SAVE_PATCH:
   case MENU_CLEAR_PATCH:
     incrementPatchNumber();
     break;
+  case MENU_FORWARD_MODE:
+    toggleForwardingMode();
+    break;
+  case MENU_PROGRAM_CHANNEL:
+    program_incrementChannel();
+    break;
+#if MIDI_LATENCY_STATS
+  case MENU_LATENCY:
+    latency_previousView();
+    break;
+#endif
   }
 }
 
@@ -646,11 +2471,28 @@ void handleButtonDownPressed()
   case MENU_MIDIMAP:
     midimap_decrementMapsToChannel();
     break;
+  case MENU_MIDI_LAYERS:
+    layers_decrementLayerChannel();
+    break;
+  case MENU_MIDI_FILTERS:
+    filters_decrementType();
+    break;
   case MENU_LOAD_PATCH:
   case MENU_SAVE_PATCH:
   case MENU_CLEAR_PATCH:
     decrementPatchNumber();
     break;
+  case MENU_FORWARD_MODE:
+    toggleForwardingMode();
+    break;
+  case MENU_PROGRAM_CHANNEL:
+    program_decrementChannel();
+    break;
+#if MIDI_LATENCY_STATS
+  case MENU_LATENCY:
+    latency_nextView();
+    break;
+#endif
   }
 }
 
@@ -665,8 +2507,19 @@ void handleButtonSelectPressed()
  */
 void handleKeypadButtonPush(byte button)
 {
+  if (splashActive)
+  {
+    return; // buttons do nothing until the splash has finished
+  }
+
   if (button != BUTTON_NONE)
   {
+    if (messageActive)
+    {
+      // Don't wait for the message to expire before acting on the button
+      finishTransientMessage();
+    }
+
     switch (button)
     {
     case BUTTON_LEFT:
@@ -693,11 +2546,338 @@ void handleKeypadButtonPush(byte button)
    MIDI STUFF
    -------------------------------------------------------------------------------------------
 */
-void doMidiMonitor()
+/**
+ * Starts a new input rate measurement every second and updates the warning
+ */
+void updateBandwidthMonitor()
+{
+  unsigned long now = millis();
+  if (now - rateWindowStart < 1000)
+  {
+    return;
+  }
+  rateWindowStart = now;
+  for (byte i = 0; i <= MaxChannel; i++)
+  {
+    inputRate[i] = inputBytes[i];
+    inputBytes[i] = 0;
+  }
+
+  bool warning = estimateOutputRate(*midiRouting) > MIDI_BYTES_PER_SECOND;
+  if (warning != bandwidthWarning)
+  {
+    bandwidthWarning = warning;
+    lcdPrintBandwidthWarning();
+  }
+}
+
+bool monitorRateLimited = true;                 // Show only the latest message on each monitor refresh
+const unsigned long MONITOR_REFRESH_TIME = 100; // ms between monitor refreshes when rate limited
+
+// The latest message waiting to be shown on the monitor
+bool monitorPending = false;
+byte monitorChannel;
+midi::MidiType monitorType;
+midi::DataByte monitorData1;
+midi::DataByte monitorData2;
+unsigned long monitorRefreshTime = 0;
+
+void doMidiMonitor(byte channel, midi::MidiType type, midi::DataByte dataByte1, midi::DataByte dataByte2)
+{
+  if (curMenuIndex != DEBUG_MENU_MONITOR || type == midi::Clock || type == midi::ActiveSensing)
+  {
+    // ignore particular messages
+    return;
+  }
+
+  if (monitorRateLimited)
+  {
+    monitorPending = true;
+    monitorChannel = channel;
+    monitorType = type;
+    monitorData1 = dataByte1;
+    monitorData2 = dataByte2;
+  }
+  else
+  {
+    lcdPrintMidiMonitor(channel, type, dataByte1, dataByte2);
+  }
+}
+
+/**
+ * Show the latest message on the monitor at most once per refresh time
+ */
+void updateMidiMonitor()
+{
+  unsigned long now = millis();
+  if (monitorPending && (long)(now - monitorRefreshTime) >= 0)
+  {
+    monitorPending = false;
+    monitorRefreshTime = now + MONITOR_REFRESH_TIME;
+    if (curMenuIndex == DEBUG_MENU_MONITOR)
+    {
+      lcdPrintMidiMonitor(monitorChannel, monitorType, monitorData1, monitorData2);
+    }
+  }
+}
+
+#if MIDI_LATENCY_STATS
+/**
+ * Adds the latency of each message that has been sent to the histogram and refreshes the page
+ */
+void updateLatencyStats()
+{
+  word ticks;
+  while (MidiSerial.nextLatency(ticks))
+  {
+    latencyHistogram.add(ticks);
+  }
+
+  unsigned long now = millis();
+  if (now - loopRateStart >= 1000)
+  {
+    loopRateStart = now;
+    loopRate = loopCount;
+    loopCount = 0;
+  }
+
+  if (curMenuIndex == MENU_LATENCY && !splashActive && !messageActive && (long)(now - latencyRefreshTime) >= 0)
+  {
+    latencyRefreshTime = now + LATENCY_REFRESH_TIME;
+    lcdPrintLatencyStats();
+  }
+}
+#endif
+
+/**
+ * Loads the patch selected by a program change on the program channel. The routing table
+ * built from it is swapped in before the next message is forwarded.
+ */
+void selectProgramPatch(byte program)
+{
+  if (program >= PatchManager::MAX_PATCHES)
+  {
+    return;
+  }
+  patchSwitchStart = micros();
+  byte previous = patchManager.patchNumber;
+  patchManager.patchNumber = program;
+  if (patchManager.loadMidiMap() != PatchManager::PATCH_OK)
+  {
+    patchManager.patchNumber = previous;
+    return;
+  }
+  applyMidiMap();
+  patchSwitchTiming = true;
+  // The last patch number is only written when a patch is loaded from the menu so that
+  // program changes don't wear the EEPROM
+
+  if (!splashActive && !messageActive)
+  {
+    lcdPrintMenuPage();
+  }
+}
+
+/**
+ * Finishes timing a patch switch when the first message after it is routed
+ */
+void timePatchSwitch()
+{
+  if (patchSwitchTiming && nextRouting == NULL)
+  {
+    patchSwitchLatency = micros() - patchSwitchStart;
+    patchSwitchTiming = false;
+    if (curMenuIndex == MENU_PROGRAM_CHANNEL)
+    {
+      lcdPrintProgramChannel();
+    }
+  }
+}
+
+/**
+ * Forward each received byte as soon as it arrives, rewriting the channel of status bytes
+ */
+void performCutThroughMidiMapping()
+{
+  byte batch[MIDI_BATCH_SIZE];
+#if MIDI_LATENCY_STATS
+  word stamps[MIDI_BATCH_SIZE];
+  byte count = MidiSerial.readBatch(batch, MIDI_BATCH_SIZE, stamps);
+#else
+  byte count = MidiSerial.readBatch(batch, MIDI_BATCH_SIZE);
+#endif
+  for (byte i = 0; i < count; i++)
+  {
+    swapRoutingTables();
+    if (batch[i] < 0xF8)
+    {
+      timePatchSwitch();
+    }
+#if MIDI_LATENCY_STATS
+    latencyBeginByte(batch[i], stamps[i]);
+#endif
+    bool complete = midiForwarder.forward(batch[i]);
+    sysExReader.receive(batch[i]);
+    if (complete)
+    {
+#if MIDI_LATENCY_STATS
+      latencyEndMessage(batch[i], stamps[i]);
+#endif
+      byte status = midiForwarder.status;
+      if (programChannel != 0 && status == (0xC0 | (programChannel - 1)))
+      {
+        selectProgramPatch(midiForwarder.data1);
+      }
+      countInputMessage(status);
+      if (status < 0xF0)
+      {
+        doMidiMonitor((status & 0x0F) + 1, (midi::MidiType)(status & 0xF0), midiForwarder.data1, midiForwarder.data2);
+      }
+      else
+      {
+        doMidiMonitor(0, (midi::MidiType)status, midiForwarder.data1, midiForwarder.data2);
+      }
+    }
+  }
+}
+
+/**
+ * Send a parsed message through the running status aware output
+ */
+void sendMidiMessage(midi::MidiType type, midi::DataByte dataByte1, midi::DataByte dataByte2, byte channel)
+{
+  if (type < midi::SystemExclusive)
+  {
+    midiOut.write(type | ((channel - 1) & 0x0F));
+    midiOut.write(dataByte1);
+    if (type != midi::ProgramChange && type != midi::AfterTouchChannel)
+    {
+      midiOut.write(dataByte2);
+    }
+  }
+  else if (type == midi::SystemExclusive)
+  {
+    // The array holds the whole message including the F0 and F7 bytes
+    midiOut.write(midiA.getSysExArray(), midiA.getSysExArrayLength());
+  }
+  else
+  {
+    midiOut.write(type);
+    if (type == midi::TimeCodeQuarterFrame || type == midi::SongSelect || type == midi::SongPosition)
+    {
+      midiOut.write(dataByte1);
+    }
+    if (type == midi::SongPosition)
+    {
+      midiOut.write(dataByte2);
+    }
+  }
+}
+
+/**
+ * Let the MIDI library parse whole messages and re-send them on the mapped channel
+ */
+void performParsedMidiMapping()
+{
+  // Drain the receive buffer in batches so a backlog built up during a slow loop() is worked off quickly
+  for (byte i = 0; i < MIDI_BATCH_SIZE && MidiSerial.available(); i++)
+  {
+    if (!midiA.read())
+    {
+      continue; // the message is not complete yet
+    }
+
+    midi::MidiType type = midiA.getType();
+    byte status = (type < midi::SystemExclusive) ? type | (midiA.getChannel() - 1) : type;
+    swapRoutingTables();
+    if (type < midi::Clock)
+    {
+      timePatchSwitch();
+    }
+#if MIDI_LATENCY_STATS
+    byte txPosition = MidiSerial.txPosition();
+#endif
+    if (!midiRouting->allows(status))
+    {
+      // filtered out
+    }
+    else if (type < midi::SystemExclusive)
+    {
+      // Send the message to each output channel of the incoming channel
+      byte incomingMidiChannel = midiA.getChannel();
+      byte count = midiRouting->destinationCount(incomingMidiChannel - 1);
+      const byte *destinations = midiRouting->destinations(incomingMidiChannel - 1);
+      for (byte d = 0; d < count; d++)
+      {
+        sendMidiMessage(type, midiA.getData1(), midiA.getData2(), destinations[d] + 1);
+      }
+    }
+    else
+    {
+      sendMidiMessage(type, midiA.getData1(), midiA.getData2(), 0);
+    }
+#if MIDI_LATENCY_STATS
+    if (MidiSerial.txPosition() != txPosition)
+    {
+      MidiSerial.markMessageSent(MidiSerial.lastReadStamp());
+    }
+#endif
+    if (type == midi::ProgramChange && midiA.getChannel() == programChannel)
+    {
+      selectProgramPatch(midiA.getData1());
+    }
+    countInputMessage(status);
+
+    if (type == midi::SystemExclusive)
+    {
+      const byte *sysEx = midiA.getSysExArray();
+      for (unsigned int b = 0; b < midiA.getSysExArrayLength(); b++)
+      {
+        sysExReader.receive(sysEx[b]);
+      }
+    }
+
+    doMidiMonitor(midiA.getChannel(), midiA.getType(), midiA.getData1(), midiA.getData2());
+  }
+}
+
+/**
+ * Once the backup page is armed the serial port is used for the backup instead of midi
+ */
+void performPatchBackup()
 {
-  if (curMenuIndex == DEBUG_MENU_MONITOR)
+  if (backupSendPatch != 255)
+  {
+    sendBackup();
+    lcdPrintBackupStatus();
+    return;
+  }
+
+  if (backupPatchRead)
+  {
+    storeBackupPatch();
+    if (!backupPatchRead)
+    {
+      lcdPrintBackupStatus();
+    }
+    return;
+  }
+
+  // The rest of the input waits in the receive buffer while a patch is being stored
+  byte count = 0;
+  while (count < MIDI_BATCH_SIZE && !backupPatchRead && MidiSerial.available() > 0)
+  {
+    char c = MidiSerial.read();
+    if (backupReader.done() && c == '{')
+    {
+      resetBackup(); // another backup
+    }
+    backupReader.feed(c);
+    count++;
+  }
+  if (count > 0)
   {
-    lcdPrintMidiMonitor(midiA.getChannel(), midiA.getType(), midiA.getData1(), midiA.getData2());
+    lcdPrintBackupStatus();
   }
 }
 
@@ -707,27 +2887,143 @@ void performMidiMapping()
   {
     // Thru on A has already pushed the input message to out A.
   }
+  else if (forwardingMode == FORWARD_CUT_THROUGH)
+  {
+    performCutThroughMidiMapping();
+  }
   else
   {
     // Thru is disabled in the library so do it manually
-    // Perform the Thru manually
-    if (midiA.read())
+    performParsedMidiMapping();
+  }
+}
+
+// Set to 1 with a build flag to time the forwarder against a built in capture at power up
+#ifndef MIDI_REPLAY_BENCHMARK
+#define MIDI_REPLAY_BENCHMARK 0
+#endif
+
+#if MIDI_REPLAY_BENCHMARK
+/*
+   -------------------------------------------------------------------------------------------
+   REPLAY BENCHMARK
+   Only built with the MIDI_REPLAY_BENCHMARK flag. At power up a short capture is replayed
+   through the cut-through forwarder in place of the splash:
+   - once through a one to one routing table, where the output must match the capture byte
+     for byte after running status is applied
+   - REPLAY_PASSES times through the routing table of the loaded patch, timed with micros()
+   The top line shows "replay ok" or the position of the first wrong byte, with the CRC of
+   the timed output so builds can be compared. The bottom line shows the time per message
+   and messages per second, e.g. "9.8us 102040/s".
+   -------------------------------------------------------------------------------------------
+*/
+const byte REPLAY_CAPTURE[] PROGMEM = {
+    0x90, 0x3C, 0x64, 0x40, 0x64, 0x43, 0x64, // chord on channel 1 with running status
+    0xF8,                                     // clock
+    0xB1, 0x07, 0x50, 0x0A, 0xF8, 0x40,       // volume and pan on channel 2, a clock in the middle
+    0xE2, 0x00, 0x40, 0x10, 0x48,             // pitch bend on channel 3
+    0xC9, 0x05,                               // program change on channel 10
+    0x99, 0x24, 0x7F, 0x26, 0x7F,             // drums on channel 10
+    0xF0, 0x7E, 0x7F, 0x06, 0x01, 0xF7,       // identity request
+    0x80, 0x3C, 0x00, 0x40, 0x00, 0x43, 0x00, // chord off on channel 1
+    0xD0, 0x30,                               // channel pressure
+    0xFA, 0xF8, 0xFC};                        // start, clock, stop
+
+const byte REPLAY_PASSES = 100;
+const unsigned long REPLAY_RESULT_TIME = 3000; // ms the result is shown for
+
+/**
+ * Takes the place of the serial port. Counts and checksums the output and can check it
+ * against the expected bytes.
+ */
+class ReplaySink : public Print
+{
+public:
+  unsigned int count;           // Bytes written
+  unsigned int firstDifference; // Position of the first byte that wasn't expected, 0xFFFF if none
+  byte crc;
+
+  ReplaySink(const byte *expected, unsigned int expectedLength)
+      : count(0), firstDifference(0xFFFF), crc(0), expected(expected), expectedLength(expectedLength)
+  {
+  }
+
+  size_t write(uint8_t value)
+  {
+    if (expected != NULL && firstDifference == 0xFFFF && (count >= expectedLength || expected[count] != value))
     {
-      int incomingMidiChannel = midiA.getChannel();
-      MidiMapItem midiMapItem = midiMap[incomingMidiChannel];
+      firstDifference = count;
+    }
+    crc = EepromStore::crc8(crc, &value, 1);
+    count++;
+    return 1;
+  }
+  using Print::write;
 
-      // The outgoing midi channel is overriden if a mapping exists, otherwise it is unchanged
-      int outgoingMidiChannel = (midiMapItem.mapsTo > 0) ? midiMapItem.mapsTo : incomingMidiChannel;
+private:
+  const byte *expected;
+  unsigned int expectedLength;
+};
 
-      midiA.send(midiA.getType(),
-                 midiA.getData1(),
-                 midiA.getData2(),
-                 outgoingMidiChannel);
+void runReplayBenchmark()
+{
+  // The live path forwards from a RAM batch, so do the same
+  byte capture[sizeof(REPLAY_CAPTURE)];
+  memcpy_P(capture, REPLAY_CAPTURE, sizeof(capture));
+
+  MidiRoutingTable oneToOne;
+  ReplaySink checked(capture, sizeof(capture));
+  MidiOutput checkedOut(checked);
+  MidiForwarder checker(checkedOut, oneToOne);
+  for (byte i = 0; i < sizeof(capture); i++)
+  {
+    checker.forward(capture[i]);
+  }
+  if (checked.firstDifference == 0xFFFF && checked.count != sizeof(capture))
+  {
+    checked.firstDifference = checked.count; // bytes are missing from the end
+  }
 
-      doMidiMonitor();
+  ReplaySink timed(NULL, 0);
+  MidiOutput timedOut(timed);
+  MidiForwarder forwarder(timedOut, *midiRouting);
+  unsigned int messages = 0;
+  unsigned long start = micros();
+  for (byte pass = 0; pass < REPLAY_PASSES; pass++)
+  {
+    for (byte i = 0; i < sizeof(capture); i++)
+    {
+      if (forwarder.forward(capture[i]))
+      {
+        messages++;
+      }
     }
   }
+  unsigned long elapsed = micros() - start;
+
+  char buffer[LcdFrameBuffer::COLS + 1];
+  if (checked.firstDifference == 0xFFFF)
+  {
+    snprintf(buffer, sizeof(buffer), "replay ok crc%02X", timed.crc);
+  }
+  else
+  {
+    snprintf(buffer, sizeof(buffer), "diff@%u crc%02X", checked.firstDifference, timed.crc);
+  }
+  lcd.setCursor(0, 0);
+  lcd.print(buffer);
+
+  unsigned long tenths = elapsed * 10 / messages;
+  snprintf(buffer, sizeof(buffer), "%lu.%luus %lu/s", tenths / 10, tenths % 10, messages * 1000000UL / elapsed);
+  lcd.setCursor(0, 1);
+  lcd.print(buffer);
+
+  // Hold the result like the splash, then go to the menu
+  splashActive = true;
+  splashStep = SPLASH_SCROLL_STEPS;
+  splashNextTime = millis() + REPLAY_RESULT_TIME;
 }
+#endif
 
 /*
    -------------------------------------------------------------------------------------------
@@ -736,12 +3032,30 @@ void performMidiMapping()
 */
 void setup()
 {
-  Serial.begin(9600);
+#if MIDI_LATENCY_STATS
+  paintStack();
+#endif
+
   //int tickEvent = t.every(250, onTimerTick);
 
   // Initialize default midi mapping. i.e. Each channel maps to itself
   initializeDefaultMidiMap();
 
+  // Read through the patches once so browsing them doesn't need the EEPROM
+  patchManager.buildIndex();
+
+  // Then carry on with the patch that was used last
+  byte lastPatchNumber = patchManager.readLastPatchNumber();
+  if (lastPatchNumber != 255)
+  {
+    patchManager.patchNumber = lastPatchNumber;
+    patchManager.loadMidiMap();
+  }
+  programChannel = patchManager.readProgramChannel();
+  applyMidiMap();
+
+  midiOut.runningStatusEnabled = enableRunningStatus;
+
   // Initiate MIDI communications, listen to all channels
   midiA.begin(MIDI_CHANNEL_OMNI);
 
@@ -762,27 +3076,25 @@ void setup()
   //pinMode( txPin, OUTPUT);
   //mySerial.begin( 31250 );
 
-  lcd.begin(16, 2); // start the library
-  //Print some initial text to the LCD.
-  lcd.setCursor(0, 0); //top left
-
-  lcd.print("MIDIChannelizer!");
+  lcdDisplay.begin(16, 2); // start the library
+  lcd.begin();
 
   //loadMidiMapFromEEPROM();
-  delay(250);
-  for (int positionCounter = 0; positionCounter < 15; positionCounter++)
-  {
-    // scroll one position left:
-    lcd.scrollDisplayLeft();
-    // wait a bit:
-    delay(100);
-  }
 
-  lcdPrintMenuPage();
+#if MIDI_REPLAY_BENCHMARK
+  runReplayBenchmark();
+#else
+  // Print some initial text to the LCD. It is scrolled away by updateTimedUi() and
+  // then replaced with the menu page
+  startSplash();
+#endif
 
   //button adc input
   pinMode(BUTTON_ADC_PIN, INPUT);    //ensure A0 is an input
   digitalWrite(BUTTON_ADC_PIN, LOW); //ensure pullup is off on A0
+
+  // Read the keypad from the ADC interrupt so loop() doesn't wait 110us for analogRead()
+  AnalogKeypadButtons.beginSampling();
 }
 
 /*
@@ -792,7 +3104,33 @@ void setup()
 */
 void loop()
 {
+#if MIDI_LATENCY_STATS
+  timeLoop();
+#endif
+
   AnalogKeypadButtons.loopCheck();
 
-  performMidiMapping();
+  if (backupArmed)
+  {
+    performPatchBackup();
+  }
+  else
+  {
+    performMidiMapping();
+    updateSysExPatchDump();
+  }
+
+  patchManager.writePending();
+
+  updateTimedUi();
+
+  updateMidiMonitor();
+
+  updateBandwidthMonitor();
+
+#if MIDI_LATENCY_STATS
+  updateLatencyStats();
+#endif
+
+  lcd.flushChanges(LCD_FLUSH_BUDGET);
 }
\ No newline at end of file
@@ -0,0 +1,27 @@
+/*
+ * Presses buttons on the emulated LCD keypad shield for the native tests.
+ */
+
+#ifndef KEYPAD_H
+#define KEYPAD_H
+
+#include <NativeAvr.h>
+
+// A reading of A0 for each button, in the order of the sketch's BUTTON_ numbers:
+// right, up, down, left and select
+const uint16_t KEYPAD_READINGS[5] = {0, 100, 300, 500, 700};
+const uint16_t KEYPAD_NONE = 1023;
+
+/**
+ * Holds a button down long enough to be debounced, then lets go of it and
+ * waits for the release to be debounced too. loop() runs throughout.
+ */
+inline void pressButton(byte button)
+{
+  NativeAvr::setAnalog(0, KEYPAD_READINGS[button]);
+  NativeAvr::runFor(100 * NativeAvr::CYCLES_PER_MS);
+  NativeAvr::setAnalog(0, KEYPAD_NONE);
+  NativeAvr::runFor(100 * NativeAvr::CYCLES_PER_MS);
+}
+
+#endif
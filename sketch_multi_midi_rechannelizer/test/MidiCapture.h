@@ -0,0 +1,415 @@
+/*
+ * MIDI byte streams for the native tests: loading the captures in
+ * test/captures, taking a stream apart into messages and putting it back
+ * together with running status.
+ */
+
+#ifndef MIDICAPTURE_H
+#define MIDICAPTURE_H
+
+#include <NativeAvr.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <unity.h>
+#include <vector>
+
+#ifndef NATIVE_CAPTURE_DIR
+#define NATIVE_CAPTURE_DIR "test/captures"
+#endif
+
+// A byte of a capture and the earliest time it can be sent, from the start of the capture
+struct CaptureByte
+{
+  NativeAvr::Cycles at;
+  byte value;
+};
+
+// A whole message and the position in its stream of the byte that completed it
+struct CapturedMessage
+{
+  std::vector<byte> bytes;
+  size_t end;
+};
+
+inline bool readCaptureFile(const char *name, std::vector<byte> &data)
+{
+  std::string path = std::string(NATIVE_CAPTURE_DIR) + "/" + name;
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == NULL)
+  {
+    return false;
+  }
+  int c;
+  while ((c = fgetc(file)) != EOF)
+  {
+    data.push_back(c);
+  }
+  fclose(file);
+  return true;
+}
+
+inline unsigned long readBigEndian(const std::vector<byte> &data, size_t position, byte length)
+{
+  unsigned long value = 0;
+  for (byte i = 0; i < length; i++)
+  {
+    value = (value << 8) | data[position + i];
+  }
+  return value;
+}
+
+inline unsigned long readVariableLength(const std::vector<byte> &data, size_t &position)
+{
+  unsigned long value = 0;
+  while (position < data.size())
+  {
+    byte b = data[position++];
+    value = (value << 7) | (b & 0x7F);
+    if (!(b & 0x80))
+    {
+      break;
+    }
+  }
+  return value;
+}
+
+struct SmfEvent
+{
+  unsigned long tick;
+  std::vector<byte> bytes;
+  unsigned long tempo; // microseconds per quarter note for a tempo change, otherwise 0
+};
+
+/**
+ * Reads the events of a type 0 or type 1 standard midi file, merged in time order
+ */
+inline bool readSmf(const std::vector<byte> &data, std::vector<SmfEvent> &events, unsigned int &division)
+{
+  if (data.size() < 14 || memcmp(&data[0], "MThd", 4) != 0)
+  {
+    return false;
+  }
+  unsigned int tracks = readBigEndian(data, 10, 2);
+  division = readBigEndian(data, 12, 2);
+  size_t position = 8 + readBigEndian(data, 4, 4);
+  for (unsigned int t = 0; t < tracks; t++)
+  {
+    if (position + 8 > data.size() || memcmp(&data[position], "MTrk", 4) != 0)
+    {
+      return false;
+    }
+    size_t end = position + 8 + readBigEndian(data, position + 4, 4);
+    position += 8;
+    unsigned long tick = 0;
+    byte status = 0;
+    while (position < end)
+    {
+      tick += readVariableLength(data, position);
+      SmfEvent event = {tick, std::vector<byte>(), 0};
+      byte b = data[position];
+      if (b == 0xFF)
+      {
+        byte type = data[position + 1];
+        position += 2;
+        unsigned long length = readVariableLength(data, position);
+        if (type == 0x51 && length == 3)
+        {
+          event.tempo = readBigEndian(data, position, 3);
+          events.push_back(event);
+        }
+        position += length;
+        continue;
+      }
+      if (b == 0xF0 || b == 0xF7)
+      {
+        position++;
+        unsigned long length = readVariableLength(data, position);
+        if (b == 0xF0)
+        {
+          event.bytes.push_back(0xF0);
+          event.bytes.insert(event.bytes.end(), data.begin() + position, data.begin() + position + length);
+          events.push_back(event);
+        }
+        position += length;
+        continue;
+      }
+      if (b & 0x80)
+      {
+        status = b;
+        position++;
+      }
+      byte type = status & 0xF0;
+      event.bytes.push_back(status);
+      event.bytes.push_back(data[position++]);
+      if (type != 0xC0 && type != 0xD0)
+      {
+        event.bytes.push_back(data[position++]);
+      }
+      events.push_back(event);
+    }
+    position = end;
+  }
+  // A stable merge: events at the same tick keep the order of the tracks
+  std::vector<SmfEvent> sorted;
+  for (size_t i = 0; i < events.size(); i++)
+  {
+    size_t at = sorted.size();
+    while (at > 0 && sorted[at - 1].tick > events[i].tick)
+    {
+      at--;
+    }
+    sorted.insert(sorted.begin() + at, events[i]);
+  }
+  events.swap(sorted);
+  return true;
+}
+
+/**
+ * Loads a capture from test/captures. A .mid file is played at its tempo the
+ * way a sequencer would send it, with running status. A .raw file is bytes
+ * straight off the wire, sent back to back.
+ */
+inline bool loadCapture(const char *name, std::vector<CaptureByte> &capture)
+{
+  std::vector<byte> data;
+  if (!readCaptureFile(name, data))
+  {
+    return false;
+  }
+  size_t length = strlen(name);
+  if (length < 4 || strcmp(name + length - 4, ".mid") != 0)
+  {
+    for (size_t i = 0; i < data.size(); i++)
+    {
+      capture.push_back({0, data[i]});
+    }
+    return true;
+  }
+
+  std::vector<SmfEvent> events;
+  unsigned int division = 0;
+  if (!readSmf(data, events, division) || division == 0 || (division & 0x8000))
+  {
+    return false;
+  }
+  unsigned long tempo = 500000;
+  unsigned long tempoTick = 0;
+  NativeAvr::Cycles tempoAt = 0;
+  byte runningStatus = 0;
+  for (size_t i = 0; i < events.size(); i++)
+  {
+    const SmfEvent &event = events[i];
+    NativeAvr::Cycles at = tempoAt + (NativeAvr::Cycles)(event.tick - tempoTick) * tempo / division * NativeAvr::CYCLES_PER_US;
+    if (event.tempo != 0)
+    {
+      tempo = event.tempo;
+      tempoTick = event.tick;
+      tempoAt = at;
+      continue;
+    }
+    size_t first = 0;
+    if (event.bytes[0] < 0xF0 && event.bytes[0] == runningStatus)
+    {
+      first = 1;
+    }
+    runningStatus = (event.bytes[0] < 0xF0) ? event.bytes[0] : 0;
+    for (size_t b = first; b < event.bytes.size(); b++)
+    {
+      capture.push_back({at, event.bytes[b]});
+    }
+  }
+  return true;
+}
+
+inline std::vector<byte> captureBytes(const std::vector<CaptureByte> &capture)
+{
+  std::vector<byte> bytes;
+  for (size_t i = 0; i < capture.size(); i++)
+  {
+    bytes.push_back(capture[i].value);
+  }
+  return bytes;
+}
+
+/**
+ * Leaves out channel status bytes that repeat the last one, as a running
+ * status sender does. System common and exclusive cancel running status.
+ */
+inline std::vector<byte> applyRunningStatus(const std::vector<byte> &stream)
+{
+  std::vector<byte> out;
+  byte runningStatus = 0;
+  for (size_t i = 0; i < stream.size(); i++)
+  {
+    byte b = stream[i];
+    if (b >= 0x80 && b < 0xF0)
+    {
+      if (b == runningStatus)
+      {
+        continue;
+      }
+      runningStatus = b;
+    }
+    else if (b >= 0xF0 && b < 0xF8)
+    {
+      runningStatus = 0;
+    }
+    out.push_back(b);
+  }
+  return out;
+}
+
+/**
+ * Takes a stream apart into whole messages, in the order they complete. A
+ * realtime byte in the middle of a message completes first. With
+ * noteOffs a note on with velocity 0 becomes a note off, as the MIDI library
+ * reads it.
+ */
+inline std::vector<CapturedMessage> splitMessages(const std::vector<byte> &stream, bool noteOffs)
+{
+  std::vector<CapturedMessage> messages;
+  std::vector<byte> pending;
+  byte status = 0;
+  byte dataLength = 0;
+  for (size_t i = 0; i < stream.size(); i++)
+  {
+    byte b = stream[i];
+    if (b >= 0xF8)
+    {
+      messages.push_back({std::vector<byte>(1, b), i});
+    }
+    else if (b == 0xF0)
+    {
+      status = b;
+      pending.assign(1, b);
+    }
+    else if (b == 0xF7)
+    {
+      if (status == 0xF0)
+      {
+        pending.push_back(b);
+        messages.push_back({pending, i});
+      }
+      status = 0;
+      pending.clear();
+    }
+    else if (b >= 0xF0)
+    {
+      status = 0;
+      pending.clear();
+      if (b == 0xF1 || b == 0xF3)
+      {
+        status = b;
+        dataLength = 1;
+      }
+      else if (b == 0xF2)
+      {
+        status = b;
+        dataLength = 2;
+      }
+      else if (b == 0xF6)
+      {
+        messages.push_back({std::vector<byte>(1, b), i});
+      }
+    }
+    else if (b >= 0x80)
+    {
+      status = b;
+      dataLength = ((b & 0xF0) == 0xC0 || (b & 0xF0) == 0xD0) ? 1 : 2;
+      pending.clear();
+    }
+    else if (status == 0xF0)
+    {
+      pending.push_back(b);
+    }
+    else if (status != 0)
+    {
+      if (pending.empty())
+      {
+        pending.push_back(status);
+      }
+      pending.push_back(b);
+      if (pending.size() == (size_t)dataLength + 1)
+      {
+        if (noteOffs && (pending[0] & 0xF0) == 0x90 && pending[2] == 0)
+        {
+          pending[0] = 0x80 | (pending[0] & 0x0F);
+        }
+        messages.push_back({pending, i});
+        pending.clear();
+        if (status >= 0xF0)
+        {
+          status = 0;
+        }
+      }
+    }
+  }
+  return messages;
+}
+
+/**
+ * Puts messages back together into a stream with running status
+ */
+inline std::vector<byte> joinMessages(const std::vector<CapturedMessage> &messages)
+{
+  std::vector<byte> stream;
+  for (size_t i = 0; i < messages.size(); i++)
+  {
+    stream.insert(stream.end(), messages[i].bytes.begin(), messages[i].bytes.end());
+  }
+  return applyRunningStatus(stream);
+}
+
+/**
+ * The longest time from the last byte of a message arriving to the last byte
+ * of its copy being sent, for input whose bytes arrived at the given cycles.
+ * Messages in and out are paired in order, so only use it where each message
+ * is sent once.
+ */
+inline NativeAvr::Cycles worstLatency(const std::vector<byte> &input, const std::vector<NativeAvr::Cycles> &arrived, bool noteOffs)
+{
+  std::vector<CapturedMessage> in = splitMessages(input, noteOffs);
+  std::vector<CapturedMessage> out = splitMessages(NativeAvr::sentBytes(), false);
+  NativeAvr::Cycles worst = 0;
+  for (size_t i = 0; i < in.size() && i < out.size(); i++)
+  {
+    NativeAvr::Cycles latency = NativeAvr::sent()[out[i].end].at - arrived[in[i].end];
+    if (latency > worst)
+    {
+      worst = latency;
+    }
+  }
+  return worst;
+}
+
+/**
+ * Fails the test at the first byte that differs, showing the bytes around it
+ */
+inline void assertSameBytes(const std::vector<byte> &expected, const std::vector<byte> &actual, const char *what)
+{
+  size_t i = 0;
+  while (i < expected.size() && i < actual.size() && expected[i] == actual[i])
+  {
+    i++;
+  }
+  if (i == expected.size() && i == actual.size())
+  {
+    return;
+  }
+  char message[240];
+  int length = snprintf(message, sizeof(message), "%s: %u bytes expected, %u sent, first difference at %u, expected",
+                        what, (unsigned)expected.size(), (unsigned)actual.size(), (unsigned)i);
+  for (size_t j = i; j < i + 6 && j < expected.size() && length < 150; j++)
+  {
+    length += snprintf(message + length, sizeof(message) - length, " %02X", expected[j]);
+  }
+  length += snprintf(message + length, sizeof(message) - length, ", sent");
+  for (size_t j = i; j < i + 6 && j < actual.size() && length < 220; j++)
+  {
+    length += snprintf(message + length, sizeof(message) - length, " %02X", actual[j]);
+  }
+  TEST_FAIL_MESSAGE(message);
+}
+
+#endif
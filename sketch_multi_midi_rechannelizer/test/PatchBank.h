@@ -0,0 +1,71 @@
+/*
+ * Fills the patch bank for the native tests that back it up and restore it.
+ * It uses the sketch's own globals, so include it after src/main.cpp.
+ */
+
+#ifndef PATCHBANK_H
+#define PATCHBANK_H
+
+#include <NativeAvr.h>
+
+// The patch records, without the wear levelled last patch number that follows them
+const int BANK_SIZE = PatchManager::LAST_PATCH_ADDR;
+
+/**
+ * Saves a different patch to every patch number but every fourth, which is left empty.
+ * Runs loop() while each one is written.
+ */
+inline void fillBank()
+{
+  for (byte number = 0; number < PatchManager::MAX_PATCHES; number++)
+  {
+    if (number % 4 == 3)
+    {
+      continue;
+    }
+    initializeDefaultMidiMap();
+    for (byte channel = 1; channel <= MaxChannel; channel++)
+    {
+      midiMap[channel].mapsTo = (channel + number) % MaxChannel + 1;
+      midiMap[channel].filters = (channel * number) & 0x7F;
+    }
+    for (byte layer = 0; layer < number % (MidiRoutingTable::MAX_LAYERS + 1); layer++)
+    {
+      midiMap[1 + layer].toggleLayer(1 + (layer + number + 8) % MaxChannel);
+    }
+    systemFilters = number * 0x0811;
+    patchManager.patchNumber = number;
+    patchManager.saveMidiMap();
+    while (patchManager.busy())
+    {
+      NativeAvr::runLoop();
+    }
+  }
+  initializeDefaultMidiMap();
+  systemFilters = 0;
+  applyMidiMap();
+}
+
+/**
+ * Checks a patch of a restored bank against the original one. An empty patch only
+ * has to be empty, as what is left in the rest of its record doesn't matter.
+ */
+inline void assertSamePatch(const byte *expected, const byte *actual, byte number)
+{
+  int header = PatchManager::HEADERS_ADDR + number * PatchManager::HEADER_SIZE;
+  if (expected[header] == 255)
+  {
+    TEST_ASSERT_EQUAL_HEX8(255, actual[header]);
+    return;
+  }
+  const int areas[4][2] = {{number * PatchManager::MAP_SIZE, PatchManager::MAP_SIZE},
+                           {PatchManager::LAYERS_ADDR + number * PatchManager::LAYERS_SIZE, PatchManager::LAYERS_SIZE},
+                           {PatchManager::FILTERS_ADDR + number * PatchManager::FILTERS_SIZE, PatchManager::FILTERS_SIZE},
+                           {header, PatchManager::HEADER_SIZE}};
+  for (byte i = 0; i < 4; i++)
+  {
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected + areas[i][0], actual + areas[i][0], areas[i][1]);
+  }
+}
+
+#endif
@@ -0,0 +1,193 @@
+#!/usr/bin/env python3
+"""
+Writes the MIDI captures replayed by the native tests.
+
+    python3 make_captures.py
+
+The captures are made up rather than recorded, so they can be rebuilt and
+changed, but they have what a real rig sends: chords with running status,
+note offs as note on with velocity 0, controller sweeps, clock in the middle
+of other messages, song position and system exclusive.
+
+They leave out what the two forwarding modes are allowed to treat
+differently: the undefined status bytes F4, F5, F9 and FD, an F7 without an
+F0, data bytes without a status and system exclusive longer than the 128
+bytes the MIDI library keeps.
+
+piano.mid      a type 0 file, one player on channel 1
+band.mid       a type 1 file, drums, bass and pads on their own tracks
+sequencer.raw  bytes as they came off the wire from a busy sequencer, replayed
+               back to back at 31250 baud
+"""
+
+import os
+import random
+import struct
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+PPQ = 480
+
+
+def vlq(value):
+    out = [value & 0x7F]
+    value >>= 7
+    while value:
+        out.insert(0, (value & 0x7F) | 0x80)
+        value >>= 7
+    return bytes(out)
+
+
+def track(events, running_status=True):
+    """events are (tick, bytes) for midi messages or (tick, 'sysex', bytes after F0)"""
+    data = bytearray()
+    last_tick = 0
+    status = None
+    for event in sorted(events, key=lambda e: e[0]):
+        tick = event[0]
+        data += vlq(tick - last_tick)
+        last_tick = tick
+        if event[1] == 'sysex':
+            body = event[2]
+            data += b'\xF0' + vlq(len(body)) + body
+            status = None
+        elif event[1] == 'tempo':
+            data += b'\xFF\x51\x03' + struct.pack('>I', event[2])[1:]
+            status = None
+        else:
+            message = event[1]
+            if running_status and message[0] == status:
+                data += message[1:]
+            else:
+                data += message
+            status = message[0]
+    data += vlq(0) + b'\xFF\x2F\x00'
+    return b'MTrk' + struct.pack('>I', len(data)) + data
+
+
+def smf(path, file_format, tracks):
+    with open(path, 'wb') as f:
+        f.write(b'MThd' + struct.pack('>IHHH', 6, file_format, len(tracks), PPQ))
+        for t in tracks:
+            f.write(t)
+
+
+def note(events, tick, length, channel, key, velocity, zero_velocity_off=True):
+    events.append((tick, bytes([0x90 | channel, key, velocity])))
+    if zero_velocity_off:
+        events.append((tick + length, bytes([0x90 | channel, key, 0])))
+    else:
+        events.append((tick + length, bytes([0x80 | channel, key, 0x40])))
+
+
+def piano(rng):
+    events = [(0, 'tempo', 60000000 // 140), (0, bytes([0xC0, 0])), (0, bytes([0xB0, 7, 100]))]
+    chords = [[48, 55, 60, 64], [45, 52, 57, 60], [41, 48, 53, 57], [43, 50, 55, 59]]
+    for bar in range(16):
+        start = bar * 4 * PPQ
+        chord = chords[bar % 4]
+        events.append((start, bytes([0xB0, 64, 127])))
+        for beat in range(4):
+            for key in chord:
+                note(events, start + beat * PPQ, PPQ - 20, 0, key, 60 + rng.randrange(30))
+        for step in range(8):
+            tick = start + step * PPQ // 2
+            note(events, tick, PPQ // 2 - 10, 0, chord[-1] + 12 + rng.choice([0, 2, 4, 5, 7]), 80 + rng.randrange(40))
+        events.append((start + 4 * PPQ - 10, bytes([0xB0, 64, 0])))
+        for step in range(16):
+            bend = 0x2000 + int(1500 * ((step - 8) / 8.0))
+            events.append((start + step * PPQ // 4, bytes([0xE0, bend & 0x7F, bend >> 7])))
+            events.append((start + step * PPQ // 4 + 1, bytes([0xD0, 40 + step * 4])))
+    smf(os.path.join(HERE, 'piano.mid'), 0, [track(events)])
+
+
+def band(rng):
+    tempo = [(0, 'tempo', 60000000 // 174),
+             (0, 'sysex', bytes([0x7E, 0x7F, 0x09, 0x01, 0xF7])),  # GM system on
+             (PPQ, 'sysex', bytes([0x41, 0x10, 0x42, 0x12, 0x40, 0x00, 0x7F, 0x00, 0x41, 0xF7]))]  # GS reset
+    # A long parameter dump, under the MIDI library's 128 byte limit
+    dump = bytes([0x43, 0x00, 0x09, 0x00, 0x50] + [rng.randrange(128) for _ in range(80)] + [0x11, 0xF7])
+    tempo.append((2 * PPQ, 'sysex', dump))
+
+    drums = [(0, bytes([0xB9, 0, 0])), (0, bytes([0xC9, 25]))]
+    for sixteenth in range(32 * 16):
+        tick = sixteenth * PPQ // 4
+        if sixteenth % 8 in (0, 3):
+            note(drums, tick, 30, 9, 36, 110 + rng.randrange(17))
+        if sixteenth % 8 == 4:
+            note(drums, tick, 30, 9, 38, 100 + rng.randrange(27))
+        note(drums, tick, 20, 9, 42 if sixteenth % 4 else 46, 50 + rng.randrange(60))
+        if rng.random() < 0.1:
+            note(drums, tick + PPQ // 8, 20, 9, rng.choice([45, 47, 50]), 70 + rng.randrange(50))
+
+    bass = [(0, bytes([0xC1, 38])), (0, bytes([0xB1, 10, 64]))]
+    keys = [28, 28, 31, 33, 28, 35, 33, 31]
+    for eighth in range(32 * 8):
+        note(bass, eighth * PPQ // 2, PPQ // 2 - 40, 1, keys[eighth % 8] + (12 if eighth % 16 == 15 else 0),
+             90 + rng.randrange(30), zero_velocity_off=False)
+
+    pads = [(0, bytes([0xC2, 89])), (0, bytes([0xB2, 91, 70]))]
+    for bar in range(32):
+        start = bar * 4 * PPQ
+        for key in ([52, 55, 59, 62] if bar % 2 else [52, 57, 60, 64]):
+            pads.append((start, bytes([0x92, key, 70])))
+            for step in range(1, 8):
+                pads.append((start + step * PPQ // 2, bytes([0xA2, key, 70 - step * 5])))
+            pads.append((start + 4 * PPQ - 5, bytes([0x82, key, 0])))
+        for step in range(32):
+            pads.append((start + step * PPQ // 8, bytes([0xB2, 1, abs(64 - (step * 4) % 128)])))
+
+    smf(os.path.join(HERE, 'band.mid'), 1, [track(tempo), track(drums), track(bass), track(pads)])
+
+
+def sequencer(rng):
+    """A sequencer playing every channel flat out, with clock dropped in wherever it falls due"""
+    messages = [bytes([0xFA]), bytes([0xF2, 0x10, 0x02]), bytes([0xF3, 0x03])]
+    status = None
+    for i in range(1800):
+        kind = rng.random()
+        channel = rng.randrange(16)
+        if kind < 0.02:
+            messages.append(bytes([0xF1, (i % 8) << 4 | rng.randrange(16)]))
+            status = None
+            continue
+        if kind < 0.025:
+            body = bytes([0x7E, 0x7F, 0x06, 0x01]) if rng.random() < 0.5 else \
+                bytes([0x43, 0x10, 0x4C] + [rng.randrange(128) for _ in range(rng.randrange(4, 90))])
+            messages.append(b'\xF0' + body + b'\xF7')
+            status = None
+            continue
+        if kind < 0.03:
+            messages.append(bytes([0xF6]))  # tune request
+            status = None
+            continue
+        if kind < 0.035:
+            messages.append(bytes([0xFE]))
+            continue
+        if status is not None and rng.random() < 0.5:
+            # Another message with the same status, sent with running status
+            head = status
+        else:
+            head = rng.choice([0x80, 0x90, 0x90, 0x90, 0xA0, 0xB0, 0xB0, 0xC0, 0xD0, 0xE0]) | channel
+        length = 1 if head & 0xF0 in (0xC0, 0xD0) else 2
+        data = bytes(rng.randrange(128) for _ in range(length))
+        if head & 0xF0 == 0x90 and rng.random() < 0.3:
+            data = data[:1] + b'\x00'  # note off as a zero velocity note on
+        messages.append((bytes([head]) if head != status else b'') + data)
+        status = head
+    messages.append(bytes([0xFC]))
+
+    stream = bytearray()
+    for message in messages:
+        for value in message:
+            if rng.random() < 0.04:
+                stream.append(0xF8)  # clock can come between any two bytes
+            stream.append(value)
+    with open(os.path.join(HERE, 'sequencer.raw'), 'wb') as f:
+        f.write(stream)
+
+
+if __name__ == '__main__':
+    rng = random.Random(31250)
+    piano(rng)
+    band(rng)
+    sequencer(rng)
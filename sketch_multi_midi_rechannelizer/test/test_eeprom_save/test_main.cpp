@@ -0,0 +1,194 @@
+/*
+ * Saving a patch while MIDI is played. The writes are queued and programmed
+ * from the EEPROM ready interrupt, so no pass of loop() should come near the
+ * 3.4ms of a single EEPROM write, however many bytes the save writes.
+ *
+ * The patch saved changes every byte of the map and layers, so they are all
+ * written. The test reports how long the save took on the device, how many bytes it
+ * wrote and the longest pass of loop() while it did.
+ */
+
+#include <NativeAvr.h>
+#include <NativeAvrUnity.h>
+#include "../MidiCapture.h"
+
+#include "../../src/main.cpp"
+
+const NativeAvr::Cycles MS = NativeAvr::CYCLES_PER_MS;
+const NativeAvr::Cycles NOTE_PERIOD = 2 * MS;
+const NativeAvr::Cycles EEPROM_WRITE_TIME = 3400 * NativeAvr::CYCLES_PER_US;
+const NativeAvr::Cycles MAX_LOOP_TIME = 1 * MS;
+
+std::vector<byte> notesSent;
+std::vector<NativeAvr::Cycles> notesArrived;
+
+/**
+ * Plays notes on channel 1 from now for the given time, with running status
+ */
+void playNotes(NativeAvr::Cycles duration)
+{
+  NativeAvr::Cycles start = NativeAvr::now();
+  for (unsigned int i = 0; i * NOTE_PERIOD < duration; i++)
+  {
+    byte message[3] = {0x90, (byte)(i % 128), (byte)(1 + (i / 128) % 127)};
+    for (byte b = (i == 0) ? 0 : 1; b < 3; b++)
+    {
+      notesSent.push_back(message[b]);
+      notesArrived.push_back(NativeAvr::receiveAt(start + i * NOTE_PERIOD, &message[b], 1));
+    }
+  }
+}
+
+/**
+ * Routes channels 2 to 16 every way the patch can store, leaving channel 1 as it is
+ */
+void editEveryOtherChannel()
+{
+  for (byte channel = 2; channel <= MaxChannel; channel++)
+  {
+    midiMap[channel].mapsTo = MaxChannel + 2 - channel;
+    midiMap[channel].filters = channel & 0x7F;
+  }
+  for (byte layer = 0; layer < MidiRoutingTable::MAX_LAYERS; layer++)
+  {
+    midiMap[2 + layer].toggleLayer(7 + layer);
+  }
+  applyMidiMap();
+}
+
+void assertEditedMap()
+{
+  TEST_ASSERT_EQUAL(1, midiMap[1].mapsTo);
+  TEST_ASSERT_EQUAL(0, midiMap[1].layers);
+  TEST_ASSERT_EQUAL(0, midiMap[1].filters);
+  for (byte channel = 2; channel <= MaxChannel; channel++)
+  {
+    TEST_ASSERT_EQUAL(MaxChannel + 2 - channel, midiMap[channel].mapsTo);
+    TEST_ASSERT_EQUAL(channel & 0x7F, midiMap[channel].filters);
+  }
+  for (byte layer = 0; layer < MidiRoutingTable::MAX_LAYERS; layer++)
+  {
+    TEST_ASSERT_TRUE(midiMap[2 + layer].hasLayer(7 + layer));
+  }
+}
+
+/**
+ * Boots, lets the splash finish and starts the notes
+ */
+void bootAndPlay(NativeAvr::Cycles duration)
+{
+  NativeAvr::boot();
+  while (splashActive)
+  {
+    NativeAvr::runLoop();
+  }
+  playNotes(duration);
+  editEveryOtherChannel();
+  NativeAvr::runFor(100 * MS);
+}
+
+/**
+ * Runs loop() until everything saved has been written. Returns how long that took.
+ */
+NativeAvr::Cycles runUntilWritten()
+{
+  NativeAvr::Cycles start = NativeAvr::now();
+  while (patchManager.busy())
+  {
+    NativeAvr::runLoop();
+  }
+  return NativeAvr::now() - start;
+}
+
+void assertForwarded(const char *what)
+{
+  NativeAvr::runUntil(NativeAvr::receiveIdleAt() + 20 * MS);
+  assertSameBytes(notesSent, NativeAvr::sentBytes(), what);
+  TEST_ASSERT_EQUAL(0, MidiSerial.overflowCount());
+}
+
+void test_a_save_doesnt_hold_up_loop()
+{
+  bootAndPlay(2000 * MS);
+  unsigned int writes = EepromStorage.writeCount;
+  NativeAvr::resetLongestLoop();
+  NativeAvr::Cycles start = NativeAvr::now();
+  saveMidiMapToSelectedPatch(); // as the keypad calls it from loop()
+  NativeAvr::Cycles longest = NativeAvr::now() - start;
+  NativeAvr::Cycles took = longest + runUntilWritten();
+  if (NativeAvr::longestLoop() > longest)
+  {
+    longest = NativeAvr::longestLoop();
+  }
+  writes = EepromStorage.writeCount - writes;
+  assertForwarded("save");
+  NativeAvr::Cycles latency = worstLatency(notesSent, notesArrived, false);
+
+  char message[120];
+  snprintf(message, sizeof(message), "save: %u bytes written in %.1fms, longest loop() %.3fms, worst latency %.3fms",
+           writes, (double)took / MS, (double)longest / MS, (double)latency / MS);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_GREATER_OR_EQUAL(2 + PatchRecord::MAP_SIZE + PatchRecord::LAYERS_SIZE, writes);
+  TEST_ASSERT_GREATER_THAN(writes * EEPROM_WRITE_TIME, took + EEPROM_WRITE_TIME);
+  TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(MAX_LOOP_TIME, longest, "loop() time during the save");
+  TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(MAX_LOOP_TIME + NOTE_PERIOD, latency, "latency during the save");
+  TEST_ASSERT_EQUAL(0, EepromStorage.failureCount);
+}
+
+void test_saving_shows_its_progress()
+{
+  bootAndPlay(2000 * MS);
+  curMenuIndex = MENU_SAVE_PATCH;
+  saveMidiMapToSelectedPatch();
+  TEST_ASSERT_TRUE(patchManager.busy());
+  NativeAvr::runFor(20 * MS);
+  TEST_ASSERT_EQUAL_STRING("saving...       ", lcdDisplay.line(1));
+
+  // A second save is refused until the first has been written
+  saveMidiMapToSelectedPatch();
+  NativeAvr::runFor(5 * MS);
+  TEST_ASSERT_EQUAL_MEMORY("busy!", lcdDisplay.line(1), 5);
+
+  runUntilWritten();
+  NativeAvr::runFor(20 * MS);
+  TEST_ASSERT_EQUAL_MEMORY("saved! w=", lcdDisplay.line(1), 9);
+  assertForwarded("progress");
+}
+
+void test_a_patch_still_being_written_loads_from_the_queue()
+{
+  bootAndPlay(2000 * MS);
+  saveMidiMapToSelectedPatch();
+  NativeAvr::runFor(10 * MS);
+  TEST_ASSERT_TRUE(EepromStorage.busy());
+
+  initializeDefaultMidiMap();
+  TEST_ASSERT_EQUAL(PatchManager::PATCH_OK, patchManager.loadMidiMap());
+  assertEditedMap();
+
+  // and from the EEPROM once it has been written
+  runUntilWritten();
+  initializeDefaultMidiMap();
+  TEST_ASSERT_EQUAL(PatchManager::PATCH_OK, patchManager.loadMidiMap());
+  assertEditedMap();
+  assertForwarded("load");
+}
+
+void setUp()
+{
+  notesSent.clear();
+  notesArrived.clear();
+}
+
+void tearDown()
+{
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_ISOLATED_TEST(test_a_save_doesnt_hold_up_loop);
+  RUN_ISOLATED_TEST(test_saving_shows_its_progress);
+  RUN_ISOLATED_TEST(test_a_patch_still_being_written_loads_from_the_queue);
+  return UNITY_END();
+}
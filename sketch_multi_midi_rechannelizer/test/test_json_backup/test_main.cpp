@@ -0,0 +1,289 @@
+/*
+ * Backs the whole patch bank up as JSON on the BACKUP PATCHES page, then
+ * sends the backup back to a freshly erased UNO the way a sender would: one
+ * line at a time, waiting for the {"ack":n} of each patch before sending the
+ * next. Every patch restored must match the original byte for byte, and
+ * nothing may be lost from the receive buffer on the way. Damaged patches,
+ * and every patch of a backup of another version, must be refused.
+ */
+
+#include <NativeAvr.h>
+#include <NativeAvrUnity.h>
+#include <string>
+#include "../Keypad.h"
+
+#include "../../src/main.cpp"
+#include "../PatchBank.h"
+
+const NativeAvr::Cycles MS = NativeAvr::CYCLES_PER_MS;
+const NativeAvr::Cycles ANSWER_TIMEOUT = 500 * MS;
+const size_t MAX_BACKUP_LENGTH = 16384;
+
+struct Backup
+{
+  size_t length;
+  char text[MAX_BACKUP_LENGTH];
+  byte bank[BANK_SIZE];
+  NativeAvr::Cycles took;
+};
+
+struct Restore
+{
+  byte bank[BANK_SIZE];
+  unsigned int acks;
+  unsigned int naks;
+  byte highWater;
+  unsigned int overflows;
+  NativeAvr::Cycles took;
+};
+
+Backup backup;
+Restore restored;
+
+void finishSplash()
+{
+  while (splashActive)
+  {
+    NativeAvr::runLoop();
+  }
+}
+
+void goToPage(byte page)
+{
+  for (byte i = 0; curMenuIndex != page && i < NUM_MENU_PAGES; i++)
+  {
+    pressButton(BUTTON_SELECT);
+  }
+  TEST_ASSERT_EQUAL(page, curMenuIndex);
+}
+
+void armBackupPage()
+{
+  finishSplash();
+  goToPage(MENU_BACKUP_PATCHES);
+  pressButton(BUTTON_RIGHT);
+  TEST_ASSERT_TRUE(backupArmed);
+  NativeAvr::clearSent();
+}
+
+void sendBank(void *context, void *result)
+{
+  Backup &sent = *(Backup *)result;
+  NativeAvr::boot();
+  fillBank();
+  armBackupPage();
+
+  NativeAvr::Cycles start = NativeAvr::now();
+  pressButton(BUTTON_RIGHT);
+  while (backupSendPatch != 255)
+  {
+    NativeAvr::runLoop();
+  }
+  NativeAvr::runFor(100 * MS); // for the transmit buffer to empty
+  sent.took = NativeAvr::sent().back().at - start;
+
+  std::vector<byte> text = NativeAvr::sentBytes();
+  TEST_ASSERT_LESS_THAN(MAX_BACKUP_LENGTH, text.size());
+  sent.length = text.size();
+  memcpy(sent.text, text.data(), text.size());
+  memcpy(sent.bank, NativeAvr::eeprom(), BANK_SIZE);
+}
+
+/**
+ * Runs loop() until the UNO has sent a whole line after the given position in its
+ * output, and returns the line
+ */
+std::string waitForAnswer(size_t &position)
+{
+  NativeAvr::Cycles timeout = NativeAvr::now() + ANSWER_TIMEOUT;
+  std::string answer;
+  while (NativeAvr::now() < timeout)
+  {
+    while (position < NativeAvr::sent().size())
+    {
+      char c = NativeAvr::sent()[position++].value;
+      if (c == '\n')
+      {
+        return answer;
+      }
+      if (c != '\r')
+      {
+        answer += c;
+      }
+    }
+    NativeAvr::runLoop();
+  }
+  TEST_FAIL_MESSAGE("the patch was not answered");
+  return answer;
+}
+
+void receiveBank(void *context, void *result)
+{
+  const Backup &sent = *(const Backup *)context;
+  Restore &stored = *(Restore *)result;
+  NativeAvr::boot();
+  armBackupPage();
+
+  NativeAvr::Cycles start = NativeAvr::now();
+  size_t answered = 0;
+  byte patch = 0;
+  stored.acks = stored.naks = 0;
+  for (size_t lineStart = 0; lineStart < sent.length;)
+  {
+    size_t lineEnd = lineStart;
+    while (lineEnd < sent.length && sent.text[lineEnd++] != '\n')
+    {
+    }
+    NativeAvr::receive((const byte *)sent.text + lineStart, lineEnd - lineStart);
+    bool isPatch = sent.text[lineStart] != '\r' && sent.text[lineStart] != '\n' && strncmp(sent.text + lineStart, "{\"version\"", 10) != 0;
+    lineStart = lineEnd;
+    if (!isPatch)
+    {
+      continue;
+    }
+
+    char expected[16];
+    snprintf(expected, sizeof(expected), "{\"ack\":%u}", patch++);
+    std::string answer = waitForAnswer(answered);
+    if (answer == expected)
+    {
+      stored.acks++;
+    }
+    else
+    {
+      stored.naks++;
+    }
+  }
+  NativeAvr::runUntil(NativeAvr::receiveIdleAt() + 10 * MS);
+  while (patchManager.busy())
+  {
+    NativeAvr::runLoop();
+  }
+  stored.took = NativeAvr::now() - start;
+  stored.highWater = MidiSerial.highWaterMark();
+  stored.overflows = MidiSerial.overflowCount();
+  memcpy(stored.bank, NativeAvr::eeprom(), BANK_SIZE);
+}
+
+/**
+ * Finds the start of the given patch in the backup. Every patch before it must be there.
+ */
+char *findPatch(byte number)
+{
+  char *patch = strstr(backup.text, "{\"map\":[");
+  for (byte i = 0; i < number && patch != NULL; i++)
+  {
+    patch = strstr(patch + 1, "{\"map\":[");
+  }
+  TEST_ASSERT_NOT_NULL(patch);
+  return patch;
+}
+
+/**
+ * Adds 256 to the number at the given position in the backup, which leaves its low
+ * byte as it was
+ */
+void addByteOverflow(char *number)
+{
+  char *end;
+  long value = strtol(number, &end, 10);
+  char text[12];
+  int length = snprintf(text, sizeof(text), "%ld", value + 256);
+  size_t tail = backup.text + backup.length - end;
+  TEST_ASSERT_LESS_THAN(MAX_BACKUP_LENGTH, backup.length + length - (end - number));
+  backup.length += length - (end - number);
+  memmove(number + length, end, tail);
+  memcpy(number, text, length);
+}
+
+/**
+ * Checks that the given patches were refused and left empty, and that every other
+ * patch was restored
+ */
+void assertRefused(byte first, byte count)
+{
+  TEST_ASSERT_EQUAL(PatchManager::MAX_PATCHES - count, restored.acks);
+  TEST_ASSERT_EQUAL(count, restored.naks);
+  TEST_ASSERT_EQUAL(0, restored.overflows);
+  for (byte number = 0; number < PatchManager::MAX_PATCHES; number++)
+  {
+    if (number >= first && number < first + count)
+    {
+      TEST_ASSERT_EQUAL_HEX8(255, restored.bank[PatchManager::HEADERS_ADDR + number * PatchManager::HEADER_SIZE]);
+    }
+    else
+    {
+      assertSamePatch(backup.bank, restored.bank, number);
+    }
+  }
+}
+
+void test_the_whole_bank_round_trips()
+{
+  TEST_ASSERT_TRUE(NativeAvr::runInChild(sendBank, NULL, &backup, sizeof(backup)));
+  TEST_ASSERT_TRUE(NativeAvr::runInChild(receiveBank, &backup, &restored, sizeof(restored)));
+
+  char message[160];
+  snprintf(message, sizeof(message),
+           "%u patches, %u bytes of JSON: sent in %.0fms, restored in %.0fms, %u bytes waiting at most",
+           restored.acks + restored.naks, (unsigned)backup.length, (double)backup.took / MS,
+           (double)restored.took / MS, restored.highWater);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_EQUAL(PatchManager::MAX_PATCHES, restored.acks);
+  TEST_ASSERT_EQUAL(0, restored.naks);
+  TEST_ASSERT_EQUAL(0, restored.overflows);
+  for (byte number = 0; number < PatchManager::MAX_PATCHES; number++)
+  {
+    assertSamePatch(backup.bank, restored.bank, number);
+  }
+}
+
+void test_a_damaged_patch_is_refused()
+{
+  TEST_ASSERT_TRUE(NativeAvr::runInChild(sendBank, NULL, &backup, sizeof(backup)));
+  // Change the first channel of the map of patch 1, so its CRC no longer matches
+  char *channel = findPatch(1) + strlen("{\"map\":[");
+  *channel = (*channel == '9') ? '8' : '9';
+
+  TEST_ASSERT_TRUE(NativeAvr::runInChild(receiveBank, &backup, &restored, sizeof(restored)));
+  assertRefused(1, 1);
+}
+
+void test_a_value_too_big_for_a_byte_is_refused()
+{
+  TEST_ASSERT_TRUE(NativeAvr::runInChild(sendBank, NULL, &backup, sizeof(backup)));
+  // Stored as bytes these would still match the CRC of patches 1 and 2
+  addByteOverflow(strstr(findPatch(1), "\"filters\":[") + strlen("\"filters\":["));
+  addByteOverflow(strstr(findPatch(2), "\"crc\":") + strlen("\"crc\":"));
+
+  TEST_ASSERT_TRUE(NativeAvr::runInChild(receiveBank, &backup, &restored, sizeof(restored)));
+  assertRefused(1, 2);
+}
+
+void test_a_backup_of_another_version_is_refused()
+{
+  TEST_ASSERT_TRUE(NativeAvr::runInChild(sendBank, NULL, &backup, sizeof(backup)));
+  TEST_ASSERT_EQUAL_MEMORY("{\"version\":1,", backup.text, 12);
+  backup.text[11] = '2';
+
+  TEST_ASSERT_TRUE(NativeAvr::runInChild(receiveBank, &backup, &restored, sizeof(restored)));
+  assertRefused(0, PatchManager::MAX_PATCHES);
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_the_whole_bank_round_trips);
+  RUN_TEST(test_a_damaged_patch_is_refused);
+  RUN_TEST(test_a_value_too_big_for_a_byte_is_refused);
+  RUN_TEST(test_a_backup_of_another_version_is_refused);
+  return UNITY_END();
+}
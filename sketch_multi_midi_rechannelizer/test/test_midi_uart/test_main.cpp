@@ -0,0 +1,169 @@
+/*
+ * MIDI arriving at 31250 baud while loop() is held up, as it is by the LCD,
+ * the keypad or the EEPROM. The receive interrupt must take every byte into
+ * the ring buffer, and loop() must then forward all of them.
+ */
+
+#include <NativeAvr.h>
+#include <NativeAvrUnity.h>
+#include "../MidiCapture.h"
+
+#include "../../src/main.cpp"
+
+const NativeAvr::Cycles MS = NativeAvr::CYCLES_PER_MS;
+
+/**
+ * Notes and controllers spread over four channels, with running status
+ * wherever the status repeats. Every message is three bytes.
+ */
+std::vector<byte> densePassage(size_t messages)
+{
+  std::vector<byte> stream;
+  for (size_t i = 0; i < messages; i++)
+  {
+    byte channel = (i / 3) % 4;
+    byte status = (i % 5 == 4) ? 0xB0 | channel : 0x90 | channel;
+    stream.push_back(status);
+    stream.push_back((status & 0xF0) == 0xB0 ? 1 : 36 + i % 48);
+    stream.push_back(1 + i % 127);
+  }
+  return applyRunningStatus(stream);
+}
+
+/**
+ * Sends the stream to the USART spread out to the given percentage of the
+ * line rate. Returns the cycle the last byte arrives.
+ */
+NativeAvr::Cycles receiveAtRate(const std::vector<byte> &stream, unsigned int percent)
+{
+  NativeAvr::Cycles start = NativeAvr::now();
+  NativeAvr::Cycles idle = start;
+  for (size_t i = 0; i < stream.size(); i++)
+  {
+    idle = NativeAvr::receiveAt(start + i * NativeAvr::uartByteCycles() * 100 / percent, &stream[i], 1);
+  }
+  return idle;
+}
+
+/**
+ * Runs loop() until the given cycle, holding it up for stallCycles at the
+ * start of every period. Interrupts carry on during the hold up.
+ */
+void runWithStalls(NativeAvr::Cycles until, NativeAvr::Cycles period, NativeAvr::Cycles stallCycles)
+{
+  NativeAvr::Cycles nextStall = NativeAvr::now();
+  while (NativeAvr::now() < until)
+  {
+    if (NativeAvr::now() >= nextStall)
+    {
+      NativeAvr::advance(stallCycles);
+      nextStall += period;
+    }
+    NativeAvr::runLoop();
+  }
+}
+
+void assertAllForwarded(const std::vector<byte> &input)
+{
+  assertSameBytes(applyRunningStatus(input), NativeAvr::sentBytes(), "forwarded");
+  TEST_ASSERT_EQUAL_MESSAGE(0, MidiSerial.overflowCount(), "the ring buffer overflowed");
+  TEST_ASSERT_EQUAL_MESSAGE(0, NativeAvr::receiveOverruns(), "the USART overran");
+}
+
+void test_bytes_that_arrive_during_a_stall_are_kept()
+{
+  NativeAvr::boot();
+  std::vector<byte> input = densePassage(45);
+  TEST_ASSERT_LESS_THAN(MIDI_UART_RX_BUFFER_SIZE, input.size());
+  NativeAvr::Cycles idle = NativeAvr::receive(input.data(), input.size());
+
+  // loop() doesn't run at all until the whole passage has arrived
+  NativeAvr::advanceTo(idle);
+  TEST_ASSERT_EQUAL(0, NativeAvr::receiveOverruns());
+  TEST_ASSERT_EQUAL(input.size(), MidiSerial.available());
+
+  NativeAvr::runFor(100 * MS);
+  assertAllForwarded(input);
+  TEST_ASSERT_EQUAL(input.size(), MidiSerial.highWaterMark());
+}
+
+void test_a_full_buffer_is_drained_in_batches()
+{
+  NativeAvr::boot();
+  std::vector<byte> input = densePassage(100);
+  input.resize(MIDI_UART_RX_BUFFER_SIZE - 1); // the most the ring buffer holds
+  NativeAvr::advanceTo(NativeAvr::receive(input.data(), input.size()));
+  TEST_ASSERT_EQUAL(MIDI_UART_RX_BUFFER_SIZE - 1, MidiSerial.available());
+
+  unsigned long passes = 0;
+  while (MidiSerial.available() > 0)
+  {
+    NativeAvr::runLoop();
+    passes++;
+  }
+  TEST_ASSERT_LESS_OR_EQUAL((MIDI_UART_RX_BUFFER_SIZE - 1 + MIDI_BATCH_SIZE - 1) / MIDI_BATCH_SIZE + 1, passes);
+  NativeAvr::runFor(100 * MS);
+  assertAllForwarded(input);
+}
+
+void test_overflow_is_counted_when_the_stall_is_too_long()
+{
+  NativeAvr::boot();
+  std::vector<byte> input = densePassage(80);
+  TEST_ASSERT_GREATER_THAN(MIDI_UART_RX_BUFFER_SIZE - 1, input.size());
+  NativeAvr::advanceTo(NativeAvr::receive(input.data(), input.size()));
+
+  // The receive interrupt still takes every byte from the USART, but only
+  // keeps what fits in the ring buffer
+  TEST_ASSERT_EQUAL(0, NativeAvr::receiveOverruns());
+  TEST_ASSERT_EQUAL(input.size() - (MIDI_UART_RX_BUFFER_SIZE - 1), MidiSerial.overflowCount());
+  TEST_ASSERT_EQUAL(MIDI_UART_RX_BUFFER_SIZE - 1, MidiSerial.highWaterMark());
+}
+
+void test_nothing_is_lost_in_a_dense_passage_with_regular_stalls()
+{
+  NativeAvr::boot();
+  // 10 seconds of midi at 80% of the line rate, with loop() held up for 30ms
+  // every 100ms. Up to 96 bytes arrive during each hold up, which the output
+  // then has to catch up on. Nothing can catch up on input at the full line
+  // rate, as the output is idle while loop() is held up.
+  std::vector<byte> input = densePassage(10000);
+  NativeAvr::Cycles idle = receiveAtRate(input, 80);
+  TEST_ASSERT_GREATER_THAN(10000 * MS, idle - NativeAvr::now());
+  runWithStalls(idle + 100 * MS, 100 * MS, 30 * MS);
+
+  assertAllForwarded(input);
+  TEST_ASSERT_GREATER_OR_EQUAL(70, MidiSerial.highWaterMark());
+}
+
+void test_nothing_is_lost_in_parsed_mode_with_regular_stalls()
+{
+  forwardingMode = FORWARD_PARSED;
+  NativeAvr::boot();
+  std::vector<byte> input = densePassage(10000);
+  NativeAvr::Cycles idle = receiveAtRate(input, 80);
+  runWithStalls(idle + 100 * MS, 100 * MS, 30 * MS);
+
+  // Every message is a note on with a velocity above 0 or a controller, so the
+  // parsed output is the same as the input
+  assertAllForwarded(input);
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_ISOLATED_TEST(test_bytes_that_arrive_during_a_stall_are_kept);
+  RUN_ISOLATED_TEST(test_a_full_buffer_is_drained_in_batches);
+  RUN_ISOLATED_TEST(test_overflow_is_counted_when_the_stall_is_too_long);
+  RUN_ISOLATED_TEST(test_nothing_is_lost_in_a_dense_passage_with_regular_stalls);
+  RUN_ISOLATED_TEST(test_nothing_is_lost_in_parsed_mode_with_regular_stalls);
+  return UNITY_END();
+}
@@ -0,0 +1,385 @@
+/*
+ * The packed patch layout: the map of each patch is stored as a nibble per
+ * channel, and a bank saved with a byte per channel is converted in place at
+ * power up.
+ *
+ * Packing is checked for every value of every channel. The conversion is
+ * checked on old banks holding every kind of patch: empty, version 1, saved
+ * before patches had a header, and corrupt. The power is then cut before each
+ * EEPROM write of the conversion in turn, and the UNO powered up again to
+ * finish it. However it was cut short, every good patch must come out as it
+ * was saved and a corrupt one must stay corrupt.
+ */
+
+#include <NativeAvr.h>
+#include <NativeAvrUnity.h>
+#include <random>
+
+#include "../../src/main.cpp"
+
+const NativeAvr::Cycles MS = NativeAvr::CYCLES_PER_MS;
+const byte OLD_LAST_PATCH = 7;
+const unsigned long NO_CUT = ~0UL;
+
+/* ---- PACKING ---- */
+
+void test_every_pair_of_channels_packs_into_one_byte()
+{
+  PatchRecord record;
+  memset(record.map, 0x5A, PatchRecord::MAP_SIZE);
+  for (byte position = 0; position < PatchRecord::MAP_SIZE; position++)
+  {
+    byte odd = position * 2 + 1;
+    for (byte high = 1; high <= MaxChannel; high++)
+    {
+      for (byte low = 1; low <= MaxChannel; low++)
+      {
+        record.setMapsTo(odd, high);
+        record.setMapsTo(odd + 1, low);
+        TEST_ASSERT_EQUAL_HEX8((high - 1) << 4 | (low - 1), record.map[position]);
+        TEST_ASSERT_EQUAL(high, record.mapsTo(odd));
+        TEST_ASSERT_EQUAL(low, record.mapsTo(odd + 1));
+      }
+    }
+    // The channels still to come are untouched
+    for (byte other = 0; other < PatchRecord::MAP_SIZE; other++)
+    {
+      TEST_ASSERT_EQUAL_HEX8(other <= position ? 0xFF : 0x5A, record.map[other]);
+    }
+  }
+}
+
+void test_every_packed_byte_unpacks_and_packs_again()
+{
+  PatchRecord record;
+  for (byte position = 0; position < PatchRecord::MAP_SIZE; position++)
+  {
+    for (int value = 0; value < 256; value++)
+    {
+      record.map[position] = value;
+      byte odd = record.mapsTo(position * 2 + 1);
+      byte even = record.mapsTo(position * 2 + 2);
+      TEST_ASSERT_EQUAL((value >> 4) + 1, odd);
+      TEST_ASSERT_EQUAL((value & 0x0F) + 1, even);
+      record.map[position] = ~value;
+      record.setMapsTo(position * 2 + 1, odd);
+      record.setMapsTo(position * 2 + 2, even);
+      TEST_ASSERT_EQUAL_HEX8(value, record.map[position]);
+    }
+  }
+}
+
+/**
+ * Sets a midimap from the generator, with up to the most layers a patch holds
+ */
+void randomMidiMap(std::mt19937 &random)
+{
+  initializeDefaultMidiMap();
+  for (byte channel = 1; channel <= MaxChannel; channel++)
+  {
+    midiMap[channel].mapsTo = 1 + random() % MaxChannel;
+    midiMap[channel].filters = random() & 0x7F;
+  }
+  byte layers = random() % (MidiRoutingTable::MAX_LAYERS + 1);
+  for (byte layer = 0; layer < layers; layer++)
+  {
+    byte channel = 1 + random() % MaxChannel;
+    byte onto = 1 + random() % MaxChannel;
+    if (onto != midiMap[channel].mapsTo && !midiMap[channel].hasLayer(onto))
+    {
+      midiMap[channel].toggleLayer(onto);
+    }
+  }
+  systemFilters = random() & 0xFFFF;
+}
+
+void test_every_channel_of_the_midimap_round_trips()
+{
+  std::mt19937 random(14);
+  for (byte channel = 1; channel <= MaxChannel; channel++)
+  {
+    for (byte mapsTo = 1; mapsTo <= MaxChannel; mapsTo++)
+    {
+      randomMidiMap(random);
+      midiMap[channel].mapsTo = mapsTo;
+      MidiMapItem saved[MaxChannel + 1];
+      memcpy(saved, midiMap, sizeof(saved));
+      word savedSystemFilters = systemFilters;
+
+      PatchRecord record;
+      record.encode();
+      TEST_ASSERT_TRUE(record.isValid());
+      byte unpacked[MaxChannel];
+      for (byte i = 0; i < MaxChannel; i++)
+      {
+        unpacked[i] = saved[i + 1].mapsTo;
+      }
+      // The CRC a backup carries is the one of the old layout
+      byte crc = EepromStore::crc8(0, unpacked, MaxChannel);
+      crc = EepromStore::crc8(crc, record.layers, PatchRecord::LAYERS_SIZE);
+      TEST_ASSERT_EQUAL_HEX8(EepromStore::crc8(crc, record.filters, PatchRecord::FILTERS_SIZE),
+                             record.calculateUnpackedCrc());
+
+      initializeDefaultMidiMap();
+      systemFilters = 0;
+      record.decode();
+      TEST_ASSERT_EQUAL_MEMORY(saved, midiMap, sizeof(saved));
+      TEST_ASSERT_EQUAL_HEX16(savedSystemFilters, systemFilters);
+    }
+  }
+}
+
+/* ---- CONVERSION ---- */
+
+// The layout used before the map was packed
+const byte OLD_PATCHES = 25;
+const int OLD_LAYERS_ADDR = OLD_PATCHES * MaxChannel;
+const int OLD_FILTERS_ADDR = OLD_LAYERS_ADDR + OLD_PATCHES * PatchRecord::LAYERS_SIZE;
+const int OLD_HEADERS_ADDR = OLD_FILTERS_ADDR + OLD_PATCHES * PatchRecord::FILTERS_SIZE;
+const int OLD_LAST_PATCH_ADDR = OLD_HEADERS_ADDR + OLD_PATCHES * 2;
+
+enum OldPatchKind
+{
+  OLD_EMPTY,
+  OLD_VERSION_1,
+  OLD_NO_HEADER, // saved before patches had a header
+  OLD_CORRUPT
+};
+
+struct OldPatch
+{
+  byte kind;
+  byte map[MaxChannel];
+  byte layers[PatchRecord::LAYERS_SIZE];
+  byte filters[PatchRecord::FILTERS_SIZE];
+};
+
+struct OldBank
+{
+  byte eeprom[NativeAvr::EEPROM_SIZE];
+  OldPatch patches[OLD_PATCHES];
+};
+
+/**
+ * Makes a bank in the old layout with a random kind of patch at each number. The
+ * last patch number is OLD_LAST_PATCH, in the given wear levelled slot.
+ */
+void makeOldBank(unsigned int seed, byte latestSlot, OldBank &bank)
+{
+  std::mt19937 random(seed);
+  memset(bank.eeprom, 255, sizeof(bank.eeprom));
+  for (byte number = 0; number < OLD_PATCHES; number++)
+  {
+    OldPatch &patch = bank.patches[number];
+    // Every kind turns up in the first few patches of each bank
+    patch.kind = (number < 4) ? (number + seed) % 4 : random() % 4;
+    if (patch.kind == OLD_EMPTY)
+    {
+      continue;
+    }
+    for (byte i = 0; i < MaxChannel; i++)
+    {
+      patch.map[i] = 1 + random() % MaxChannel;
+    }
+    byte count = random() % (MidiRoutingTable::MAX_LAYERS + 1);
+    memset(patch.layers, 255, sizeof(patch.layers));
+    patch.layers[0] = count;
+    for (byte i = 1; i <= count; i++)
+    {
+      patch.layers[i] = random();
+    }
+    for (byte i = 0; i < PatchRecord::FILTERS_SIZE; i++)
+    {
+      patch.filters[i] = random();
+    }
+    memcpy(bank.eeprom + number * MaxChannel, patch.map, MaxChannel);
+    memcpy(bank.eeprom + OLD_LAYERS_ADDR + number * PatchRecord::LAYERS_SIZE, patch.layers, PatchRecord::LAYERS_SIZE);
+    memcpy(bank.eeprom + OLD_FILTERS_ADDR + number * PatchRecord::FILTERS_SIZE, patch.filters, PatchRecord::FILTERS_SIZE);
+
+    byte crc = EepromStore::crc8(0, patch.map, MaxChannel);
+    crc = EepromStore::crc8(crc, patch.layers, PatchRecord::LAYERS_SIZE);
+    crc = EepromStore::crc8(crc, patch.filters, PatchRecord::FILTERS_SIZE);
+    byte *header = bank.eeprom + OLD_HEADERS_ADDR + number * 2;
+    if (patch.kind == OLD_VERSION_1 || patch.kind == OLD_CORRUPT)
+    {
+      header[0] = 1;
+      header[1] = (patch.kind == OLD_CORRUPT) ? crc ^ 1 : crc;
+    }
+  }
+  // Earlier last patch numbers in the slots before it. The value of the last slot is the
+  // last byte of the EEPROM.
+  for (byte slot = 0; slot <= latestSlot; slot++)
+  {
+    bank.eeprom[OLD_LAST_PATCH_ADDR + slot * 2] = 5 + slot;
+    bank.eeprom[OLD_LAST_PATCH_ADDR + slot * 2 + 1] = (slot == latestSlot) ? OLD_LAST_PATCH : random() % OLD_PATCHES;
+  }
+}
+
+/**
+ * Checks a converted bank, byte for byte, against the old bank it came from
+ */
+void assertConverted(const OldBank &bank, const byte *eeprom, const char *what)
+{
+  char message[80];
+  TEST_ASSERT_EQUAL_HEX8_MESSAGE(PatchManager::LAYOUT_PACKED, eeprom[PatchManager::LAYOUT_ADDR], what);
+  for (byte number = 0; number < PatchManager::MAX_PATCHES; number++)
+  {
+    PatchRecord record;
+    memcpy(record.map, eeprom + number * PatchRecord::MAP_SIZE, PatchRecord::MAP_SIZE);
+    memcpy(record.layers, eeprom + PatchManager::LAYERS_ADDR + number * PatchRecord::LAYERS_SIZE, PatchRecord::LAYERS_SIZE);
+    memcpy(record.filters, eeprom + PatchManager::FILTERS_ADDR + number * PatchRecord::FILTERS_SIZE, PatchRecord::FILTERS_SIZE);
+    memcpy(&record.version, eeprom + PatchManager::HEADERS_ADDR + number * PatchManager::HEADER_SIZE, PatchManager::HEADER_SIZE);
+
+    const OldPatch *patch = (number < OLD_PATCHES) ? &bank.patches[number] : NULL;
+    snprintf(message, sizeof(message), "%s, patch %u", what, number);
+    if (patch == NULL || patch->kind == OLD_EMPTY)
+    {
+      TEST_ASSERT_TRUE_MESSAGE(record.isEmpty(), message);
+    }
+    else if (patch->kind == OLD_CORRUPT)
+    {
+      TEST_ASSERT_FALSE_MESSAGE(record.isValid(), message);
+    }
+    else
+    {
+      TEST_ASSERT_TRUE_MESSAGE(!record.isEmpty() && record.isValid(), message);
+      for (byte channel = 1; channel <= MaxChannel; channel++)
+      {
+        TEST_ASSERT_EQUAL_MESSAGE(patch->map[channel - 1], record.mapsTo(channel), message);
+      }
+      TEST_ASSERT_EQUAL_HEX8_ARRAY_MESSAGE(patch->layers, record.layers, PatchRecord::LAYERS_SIZE, message);
+      TEST_ASSERT_EQUAL_HEX8_ARRAY_MESSAGE(patch->filters, record.filters, PatchRecord::FILTERS_SIZE, message);
+    }
+  }
+}
+
+OldBank oldBank;
+
+struct PowerUp
+{
+  unsigned long cutBefore; // The write the power is cut before, or NO_CUT
+  byte eeprom[NativeAvr::EEPROM_SIZE];
+};
+
+struct PoweredUp
+{
+  byte eeprom[NativeAvr::EEPROM_SIZE];
+  unsigned long writes;
+  bool cut;
+  byte lastPatch;
+};
+
+PowerUp powerUp;
+PoweredUp poweredUp;
+
+/**
+ * Powers up with the given EEPROM and runs until the EEPROM has been written, or
+ * the power is cut
+ */
+void powerUpWith(void *context, void *result)
+{
+  const PowerUp &with = *(const PowerUp *)context;
+  PoweredUp &after = *(PoweredUp *)result;
+  memcpy(NativeAvr::eeprom(), with.eeprom, NativeAvr::EEPROM_SIZE);
+  if (with.cutBefore != NO_CUT)
+  {
+    NativeAvr::cutPowerBeforeWrite(with.cutBefore);
+  }
+  after.cut = false;
+  after.lastPatch = 255;
+  try
+  {
+    NativeAvr::boot();
+    after.lastPatch = patchManager.readLastPatchNumber();
+    while (EepromStorage.busy())
+    {
+      NativeAvr::runLoop();
+    }
+  }
+  catch (NativeAvr::PowerCut &)
+  {
+    after.cut = true;
+  }
+  after.writes = NativeAvr::eepromWrites();
+  memcpy(after.eeprom, NativeAvr::eeprom(), NativeAvr::EEPROM_SIZE);
+}
+
+/**
+ * Powers up with the given EEPROM, cut before the given write unless it is NO_CUT
+ */
+void powerUpFrom(const byte *eeprom, unsigned long cutBefore)
+{
+  powerUp.cutBefore = cutBefore;
+  memcpy(powerUp.eeprom, eeprom, NativeAvr::EEPROM_SIZE);
+  TEST_ASSERT_TRUE(NativeAvr::runInChild(powerUpWith, &powerUp, &poweredUp, sizeof(poweredUp)));
+}
+
+void test_an_old_bank_is_converted()
+{
+  for (unsigned int seed = 0; seed < 12; seed++)
+  {
+    makeOldBank(seed, seed, oldBank);
+    powerUpFrom(oldBank.eeprom, NO_CUT);
+    TEST_ASSERT_FALSE(poweredUp.cut);
+    assertConverted(oldBank, poweredUp.eeprom, "converted");
+    TEST_ASSERT_EQUAL(OLD_LAST_PATCH, poweredUp.lastPatch);
+
+    // and left alone at the next power up
+    byte converted[NativeAvr::EEPROM_SIZE];
+    memcpy(converted, poweredUp.eeprom, sizeof(converted));
+    powerUpFrom(converted, NO_CUT);
+    TEST_ASSERT_EQUAL(0, poweredUp.writes);
+    TEST_ASSERT_EQUAL(OLD_LAST_PATCH, poweredUp.lastPatch);
+  }
+}
+
+void test_a_conversion_cut_short_at_any_write_is_finished()
+{
+  // The last patch number in the first slot, in the slot kept through the conversion and
+  // in the slot that shares the last byte with the layout
+  const byte latestSlots[3] = {0, 8, 11};
+  for (unsigned int seed = 0; seed < 3; seed++)
+  {
+    makeOldBank(100 + seed, latestSlots[seed], oldBank);
+    powerUpFrom(oldBank.eeprom, NO_CUT);
+    unsigned long writes = poweredUp.writes;
+    TEST_ASSERT_GREATER_THAN(0, writes);
+
+    for (unsigned long cut = 0; cut < writes; cut++)
+    {
+      powerUpFrom(oldBank.eeprom, cut);
+      TEST_ASSERT_TRUE(poweredUp.cut);
+      byte cutShort[NativeAvr::EEPROM_SIZE];
+      memcpy(cutShort, poweredUp.eeprom, sizeof(cutShort));
+
+      powerUpFrom(cutShort, NO_CUT);
+      TEST_ASSERT_FALSE(poweredUp.cut);
+      char what[48];
+      snprintf(what, sizeof(what), "bank %u cut before write %lu", 100 + seed, cut);
+      assertConverted(oldBank, poweredUp.eeprom, what);
+      TEST_ASSERT_EQUAL_MESSAGE(OLD_LAST_PATCH, poweredUp.lastPatch, what);
+    }
+    char message[64];
+    snprintf(message, sizeof(message), "bank %u: cut before each of %lu writes", 100 + seed, writes);
+    TEST_MESSAGE(message);
+  }
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_ISOLATED_TEST(test_every_pair_of_channels_packs_into_one_byte);
+  RUN_ISOLATED_TEST(test_every_packed_byte_unpacks_and_packs_again);
+  RUN_ISOLATED_TEST(test_every_channel_of_the_midimap_round_trips);
+  RUN_TEST(test_an_old_bank_is_converted);
+  RUN_TEST(test_a_conversion_cut_short_at_any_write_is_finished);
+  return UNITY_END();
+}
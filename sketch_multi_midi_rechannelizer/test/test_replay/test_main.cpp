@@ -0,0 +1,161 @@
+/*
+ * Replays the captures in test/captures through the sketch on the emulated
+ * UNO, once forwarding cut-through and once parsed, with every channel mapped
+ * to itself.
+ *
+ * Cut-through must send exactly what came in, less the status bytes running
+ * status makes unnecessary. Parsed mode must send the same messages, but the
+ * MIDI library hands over a realtime byte that arrives inside a message before
+ * the message, and reads a note on with velocity 0 as a note off. So parsed
+ * output is checked against the capture taken apart into messages and put back
+ * together, and the cut-through output is put through the same and must then
+ * match the parsed output byte for byte.
+ *
+ * For each run the test reports messages per second and the time per message
+ * on the host, counting the passes of loop() that had bytes to forward, the
+ * worst time on the UNO from the last byte of a message arriving to the last
+ * byte of its copy being sent, and the most bytes that waited in the receive
+ * buffer. Host times include the emulator, so only compare them between
+ * builds on one machine. MIDI_REPLAY_BENCHMARK times the forwarder on the
+ * device.
+ */
+
+#include <NativeAvr.h>
+#include <NativeAvrUnity.h>
+#include <chrono>
+#include "../MidiCapture.h"
+
+#include "../../src/main.cpp"
+
+const size_t MAX_REPLAY_OUTPUT = 32768;
+
+struct ReplayRun
+{
+  const char *capture;
+  byte mode;
+};
+
+struct ReplayResult
+{
+  size_t outputLength;
+  byte output[MAX_REPLAY_OUTPUT];
+  size_t messages;
+  unsigned long long hostNanos;
+  NativeAvr::Cycles worstLatency;
+  byte highWater;
+  unsigned int overflows;
+  unsigned long overruns;
+};
+
+ReplayResult cutThroughResult;
+ReplayResult parsedResult;
+
+void replay(void *context, void *result)
+{
+  const ReplayRun &run = *(const ReplayRun *)context;
+  ReplayResult &replayed = *(ReplayResult *)result;
+  std::vector<CaptureByte> capture;
+  TEST_ASSERT_TRUE(loadCapture(run.capture, capture));
+
+  forwardingMode = run.mode;
+  NativeAvr::boot();
+
+  std::vector<NativeAvr::Cycles> arrived;
+  NativeAvr::Cycles start = NativeAvr::now();
+  for (size_t i = 0; i < capture.size(); i++)
+  {
+    arrived.push_back(NativeAvr::receiveAt(start + capture[i].at, &capture[i].value, 1));
+  }
+  // Only passes of loop() that had bytes waiting are timed, so the time between
+  // the notes of a midi file isn't counted
+  replayed.hostNanos = 0;
+  NativeAvr::Cycles end = NativeAvr::receiveIdleAt() + 100 * NativeAvr::CYCLES_PER_MS;
+  while (NativeAvr::now() < end)
+  {
+    bool waiting = MidiSerial.available() > 0;
+    std::chrono::steady_clock::time_point began = std::chrono::steady_clock::now();
+    NativeAvr::runLoop();
+    if (waiting)
+    {
+      replayed.hostNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - began).count();
+    }
+  }
+
+  std::vector<byte> output = NativeAvr::sentBytes();
+  TEST_ASSERT_LESS_OR_EQUAL(MAX_REPLAY_OUTPUT, output.size());
+  replayed.outputLength = output.size();
+  memcpy(replayed.output, output.data(), output.size());
+
+  std::vector<byte> input = captureBytes(capture);
+  replayed.messages = splitMessages(input, false).size();
+  replayed.worstLatency = worstLatency(input, arrived, run.mode == FORWARD_PARSED);
+  replayed.highWater = MidiSerial.highWaterMark();
+  replayed.overflows = MidiSerial.overflowCount();
+  replayed.overruns = NativeAvr::receiveOverruns();
+}
+
+void report(const char *capture, const char *mode, const ReplayResult &result)
+{
+  char message[200];
+  snprintf(message, sizeof(message),
+           "%s %s: %u messages, %.0f/s and %.2fus each on the host, worst latency %.3fms, %u bytes waiting at most",
+           capture, mode, (unsigned)result.messages, result.messages * 1e9 / result.hostNanos,
+           result.hostNanos / 1000.0 / result.messages, (double)result.worstLatency / NativeAvr::CYCLES_PER_MS,
+           result.highWater);
+  TEST_MESSAGE(message);
+}
+
+void replayCapture(const char *name)
+{
+  std::vector<CaptureByte> capture;
+  TEST_ASSERT_TRUE_MESSAGE(loadCapture(name, capture), "the capture could not be read");
+  std::vector<byte> input = captureBytes(capture);
+
+  ReplayRun cutThrough = {name, FORWARD_CUT_THROUGH};
+  ReplayRun parsed = {name, FORWARD_PARSED};
+  TEST_ASSERT_TRUE(NativeAvr::runInChild(replay, &cutThrough, &cutThroughResult, sizeof(cutThroughResult)));
+  TEST_ASSERT_TRUE(NativeAvr::runInChild(replay, &parsed, &parsedResult, sizeof(parsedResult)));
+  report(name, "cut-through", cutThroughResult);
+  report(name, "parsed", parsedResult);
+
+  std::vector<byte> cutThroughOutput(cutThroughResult.output, cutThroughResult.output + cutThroughResult.outputLength);
+  std::vector<byte> parsedOutput(parsedResult.output, parsedResult.output + parsedResult.outputLength);
+  assertSameBytes(applyRunningStatus(input), cutThroughOutput, "cut-through");
+  assertSameBytes(joinMessages(splitMessages(input, true)), parsedOutput, "parsed");
+  assertSameBytes(joinMessages(splitMessages(cutThroughOutput, true)), parsedOutput, "cut-through against parsed");
+
+  TEST_ASSERT_EQUAL_MESSAGE(0, cutThroughResult.overflows + cutThroughResult.overruns, "cut-through lost bytes");
+  TEST_ASSERT_EQUAL_MESSAGE(0, parsedResult.overflows + parsedResult.overruns, "parsed lost bytes");
+}
+
+void test_piano_capture()
+{
+  replayCapture("piano.mid");
+}
+
+void test_band_capture()
+{
+  replayCapture("band.mid");
+}
+
+void test_sequencer_capture()
+{
+  replayCapture("sequencer.raw");
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_piano_capture);
+  RUN_TEST(test_band_capture);
+  RUN_TEST(test_sequencer_capture);
+  return UNITY_END();
+}
@@ -0,0 +1,371 @@
+/*
+ * Dumping and loading the patch bank with system exclusive messages.
+ *
+ * The chunk codec is checked on its own for every payload length and byte
+ * value. Then the whole bank is dumped from one UNO and the dump replayed back
+ * to back at line rate into a freshly erased one, with notes between the
+ * chunks. A patch that arrives while the last one is still being stored is
+ * refused with a NAK, so the sender sends whatever was refused again until
+ * every patch has been acknowledged, as a librarian would. The restored bank
+ * must match, and every note must be forwarded with nothing lost.
+ */
+
+#include <NativeAvr.h>
+#include <NativeAvrUnity.h>
+#include "../MidiCapture.h"
+
+#include "../../src/main.cpp"
+#include "../PatchBank.h"
+
+const NativeAvr::Cycles MS = NativeAvr::CYCLES_PER_MS;
+const NativeAvr::Cycles ANSWER_TIMEOUT = 500 * MS;
+const byte MAX_ROUNDS = 40;
+const size_t MAX_DUMP_LENGTH = 4096;
+
+/**
+ * Keeps whatever is written to it
+ */
+class ByteBuffer : public Print
+{
+public:
+  std::vector<byte> bytes;
+  size_t write(uint8_t value)
+  {
+    bytes.push_back(value);
+    return 1;
+  }
+};
+
+/* ---- CODEC ---- */
+
+byte receivedCommand;
+byte receivedIndex;
+std::vector<byte> receivedPayload;
+unsigned int receivedCount;
+unsigned int errorCount;
+
+void codecReceived(byte command, byte index, const byte *payload, byte length)
+{
+  receivedCommand = command;
+  receivedIndex = index;
+  receivedPayload.assign(payload, payload + length);
+  receivedCount++;
+}
+
+void codecError(byte command, byte index)
+{
+  receivedCommand = command;
+  receivedIndex = index;
+  errorCount++;
+}
+
+void feed(SysExChunkReader &reader, const std::vector<byte> &message)
+{
+  for (size_t i = 0; i < message.size(); i++)
+  {
+    reader.receive(message[i]);
+  }
+}
+
+void test_every_chunk_round_trips()
+{
+  SysExChunkReader reader(SYSEX_HEADER, sizeof(SYSEX_HEADER), codecReceived, codecError);
+  byte payload[SYSEX_CHUNK_SIZE];
+  for (int first = 0; first < 256; first++)
+  {
+    for (byte length = 0; length <= SYSEX_CHUNK_SIZE; length++)
+    {
+      for (byte i = 0; i < length; i++)
+      {
+        payload[i] = first + i * 37;
+      }
+      ByteBuffer message;
+      writeSysExChunk(message, SYSEX_HEADER, sizeof(SYSEX_HEADER), length & 0x7F, first & 0x7F, payload, length);
+      TEST_ASSERT_EQUAL(5 + sizeof(SYSEX_HEADER) + length * 2, message.bytes.size());
+      for (size_t i = 1; i < message.bytes.size() - 1; i++)
+      {
+        TEST_ASSERT_LESS_THAN(0x80, message.bytes[i]);
+      }
+
+      receivedCount = 0;
+      feed(reader, message.bytes);
+      TEST_ASSERT_EQUAL(1, receivedCount);
+      TEST_ASSERT_EQUAL(length & 0x7F, receivedCommand);
+      TEST_ASSERT_EQUAL(first & 0x7F, receivedIndex);
+      TEST_ASSERT_EQUAL(length, receivedPayload.size());
+      if (length > 0)
+      {
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(payload, receivedPayload.data(), length);
+      }
+    }
+  }
+  TEST_ASSERT_EQUAL(0, errorCount);
+}
+
+void test_a_damaged_chunk_is_reported()
+{
+  SysExChunkReader reader(SYSEX_HEADER, sizeof(SYSEX_HEADER), codecReceived, codecError);
+  byte payload[sizeof(PatchRecord)];
+  for (byte i = 0; i < sizeof(payload); i++)
+  {
+    payload[i] = i * 11;
+  }
+  ByteBuffer good;
+  writeSysExChunk(good, SYSEX_HEADER, sizeof(SYSEX_HEADER), SYSEX_PATCH, 9, payload, sizeof(payload));
+
+  // Each data byte after the header changed in turn, and a realtime byte in the middle
+  receivedCount = errorCount = 0;
+  for (size_t i = 1 + sizeof(SYSEX_HEADER) + 2; i < good.bytes.size() - 1; i++)
+  {
+    std::vector<byte> damaged = good.bytes;
+    damaged[i] ^= 0x01;
+    feed(reader, damaged);
+  }
+  TEST_ASSERT_EQUAL(0, receivedCount);
+  TEST_ASSERT_EQUAL(good.bytes.size() - 1 - sizeof(SYSEX_HEADER) - 2 - 1, errorCount);
+  TEST_ASSERT_EQUAL(SYSEX_PATCH, receivedCommand);
+  TEST_ASSERT_EQUAL(9, receivedIndex);
+
+  std::vector<byte> withClock = good.bytes;
+  withClock.insert(withClock.begin() + 20, 0xF8);
+  feed(reader, withClock);
+  TEST_ASSERT_EQUAL(1, receivedCount);
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(payload, receivedPayload.data(), sizeof(payload));
+
+  // Someone else's message is ignored
+  std::vector<byte> other = good.bytes;
+  other[2] = 0x00;
+  feed(reader, other);
+  TEST_ASSERT_EQUAL(1, receivedCount);
+}
+
+/* ---- DUMP AND LOAD ---- */
+
+struct Dump
+{
+  size_t length;
+  byte messages[MAX_DUMP_LENGTH];
+  byte bank[BANK_SIZE];
+};
+
+struct Load
+{
+  byte bank[BANK_SIZE];
+  unsigned int rounds;
+  unsigned int naks;
+  unsigned int notes;
+  byte highWater;
+  unsigned int overflows;
+  unsigned long overruns;
+  NativeAvr::Cycles took;
+};
+
+Dump dump;
+Load loaded;
+
+void dumpBank(void *context, void *result)
+{
+  Dump &dumped = *(Dump *)result;
+  NativeAvr::boot();
+  fillBank();
+  NativeAvr::clearSent();
+
+  ByteBuffer request;
+  writeSysExChunk(request, SYSEX_HEADER, sizeof(SYSEX_HEADER), SYSEX_DUMP_REQUEST, 0, NULL, 0);
+  NativeAvr::receive(request.bytes.data(), request.bytes.size());
+  NativeAvr::runUntil(NativeAvr::receiveIdleAt() + 2000 * MS);
+
+  // The request is forwarded like any other message, then the dump follows it
+  std::vector<byte> sent = NativeAvr::sentBytes();
+  TEST_ASSERT_EQUAL_HEX8_ARRAY(request.bytes.data(), sent.data(), request.bytes.size());
+  sent.erase(sent.begin(), sent.begin() + request.bytes.size());
+  TEST_ASSERT_EQUAL(PatchManager::MAX_PATCHES * (5 + sizeof(SYSEX_HEADER) + 2 * sizeof(PatchRecord)), sent.size());
+  dumped.length = sent.size();
+  memcpy(dumped.messages, sent.data(), sent.size());
+  memcpy(dumped.bank, NativeAvr::eeprom(), BANK_SIZE);
+}
+
+/**
+ * The patch messages of a dump, each with the patch number it carries
+ */
+std::vector<CapturedMessage> dumpMessages(const Dump &dumped)
+{
+  std::vector<byte> stream(dumped.messages, dumped.messages + dumped.length);
+  return splitMessages(stream, false);
+}
+
+/**
+ * The patch numbers acknowledged and refused in the output from the given position on
+ */
+void readAnswers(size_t from, std::vector<bool> &acknowledged, std::vector<byte> &refused)
+{
+  std::vector<byte> output = NativeAvr::sentBytes();
+  output.erase(output.begin(), output.begin() + from);
+  std::vector<CapturedMessage> messages = splitMessages(output, false);
+  for (size_t i = 0; i < messages.size(); i++)
+  {
+    const std::vector<byte> &message = messages[i].bytes;
+    if (message.size() == 5 + sizeof(SYSEX_HEADER) && memcmp(&message[1], SYSEX_HEADER, sizeof(SYSEX_HEADER)) == 0)
+    {
+      byte command = message[1 + sizeof(SYSEX_HEADER)];
+      byte patch = message[2 + sizeof(SYSEX_HEADER)];
+      TEST_ASSERT_LESS_THAN(PatchManager::MAX_PATCHES, patch);
+      if (command == SYSEX_ACK)
+      {
+        acknowledged[patch] = true;
+      }
+      else if (command == SYSEX_NAK)
+      {
+        refused.push_back(patch);
+      }
+    }
+  }
+}
+
+/**
+ * Sends each patch message of the dump with a note on and off after it, all back to
+ * back at line rate. Sends the ones that were refused again the same way until every
+ * patch has been acknowledged.
+ */
+void loadBank(void *context, void *result)
+{
+  const Dump &dumped = *(const Dump *)context;
+  Load &load = *(Load *)result;
+  std::vector<CapturedMessage> patches = dumpMessages(dumped);
+  TEST_ASSERT_EQUAL(PatchManager::MAX_PATCHES, patches.size());
+
+  NativeAvr::boot();
+  while (splashActive)
+  {
+    NativeAvr::runLoop();
+  }
+  NativeAvr::clearSent();
+  NativeAvr::Cycles start = NativeAvr::now();
+
+  std::vector<bool> acknowledged(PatchManager::MAX_PATCHES, false);
+  std::vector<byte> toSend;
+  for (byte patch = 0; patch < PatchManager::MAX_PATCHES; patch++)
+  {
+    toSend.push_back(patch);
+  }
+  std::vector<byte> notes;
+  load.rounds = load.naks = 0;
+  while (!toSend.empty() && load.rounds < MAX_ROUNDS)
+  {
+    std::vector<byte> stream;
+    for (size_t i = 0; i < toSend.size(); i++)
+    {
+      const std::vector<byte> &message = patches[toSend[i]].bytes;
+      stream.insert(stream.end(), message.begin(), message.end());
+      byte note[6] = {0x90, (byte)(36 + notes.size() % 48), 100, 0x80, (byte)(36 + notes.size() % 48), 0};
+      stream.insert(stream.end(), note, note + 6);
+      notes.insert(notes.end(), note, note + 6);
+    }
+    size_t answersFrom = NativeAvr::sent().size();
+    NativeAvr::receive(stream.data(), stream.size());
+    NativeAvr::runUntil(NativeAvr::receiveIdleAt() + ANSWER_TIMEOUT);
+
+    std::vector<byte> refused;
+    readAnswers(answersFrom, acknowledged, refused);
+    load.naks += refused.size();
+    toSend.clear();
+    for (byte patch = 0; patch < PatchManager::MAX_PATCHES; patch++)
+    {
+      if (!acknowledged[patch])
+      {
+        toSend.push_back(patch);
+      }
+    }
+    load.rounds++;
+  }
+  load.took = NativeAvr::now() - start;
+  TEST_ASSERT_TRUE_MESSAGE(toSend.empty(), "not every patch was acknowledged");
+
+  // Every note is forwarded, in order, among the copies of the dump and the answers
+  std::vector<byte> forwardedNotes;
+  std::vector<CapturedMessage> output = splitMessages(NativeAvr::sentBytes(), false);
+  for (size_t i = 0; i < output.size(); i++)
+  {
+    if (output[i].bytes[0] < 0xF0)
+    {
+      forwardedNotes.insert(forwardedNotes.end(), output[i].bytes.begin(), output[i].bytes.end());
+    }
+  }
+  assertSameBytes(notes, forwardedNotes, "notes between the chunks");
+  load.notes = notes.size() / 3;
+  load.highWater = MidiSerial.highWaterMark();
+  load.overflows = MidiSerial.overflowCount();
+  load.overruns = NativeAvr::receiveOverruns();
+  memcpy(load.bank, NativeAvr::eeprom(), BANK_SIZE);
+}
+
+void test_a_dump_replayed_at_line_rate_restores_the_bank()
+{
+  TEST_ASSERT_TRUE(NativeAvr::runInChild(dumpBank, NULL, &dump, sizeof(dump)));
+  TEST_ASSERT_TRUE(NativeAvr::runInChild(loadBank, &dump, &loaded, sizeof(loaded)));
+
+  char message[160];
+  snprintf(message, sizeof(message),
+           "%u byte dump loaded in %.0fms over %u rounds, %u refused while busy, %u notes between, %u bytes waiting at most",
+           (unsigned)dump.length, (double)loaded.took / MS, loaded.rounds, loaded.naks, loaded.notes, loaded.highWater);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_EQUAL_MESSAGE(0, loaded.overflows + loaded.overruns, "bytes were lost");
+  for (byte number = 0; number < PatchManager::MAX_PATCHES; number++)
+  {
+    assertSamePatch(dump.bank, loaded.bank, number);
+  }
+}
+
+void test_a_patch_with_a_bad_checksum_is_refused()
+{
+  TEST_ASSERT_TRUE(NativeAvr::runInChild(dumpBank, NULL, &dump, sizeof(dump)));
+  std::vector<CapturedMessage> patches = dumpMessages(dump);
+
+  NativeAvr::boot();
+  while (splashActive)
+  {
+    NativeAvr::runLoop();
+  }
+  std::vector<byte> damaged = patches[2].bytes;
+  damaged[10] ^= 0x01;
+  NativeAvr::clearSent();
+  unsigned int writes = EepromStorage.writeCount;
+  NativeAvr::receive(damaged.data(), damaged.size());
+  NativeAvr::runUntil(NativeAvr::receiveIdleAt() + ANSWER_TIMEOUT);
+
+  std::vector<bool> acknowledged(PatchManager::MAX_PATCHES, false);
+  std::vector<byte> refused;
+  readAnswers(0, acknowledged, refused);
+  TEST_ASSERT_EQUAL(1, refused.size());
+  TEST_ASSERT_EQUAL(2, refused[0]);
+  TEST_ASSERT_EQUAL(writes, EepromStorage.writeCount);
+  TEST_ASSERT_EQUAL(1, sysExReader.checksumErrors);
+
+  // Sent again undamaged, it is stored
+  size_t answersFrom = NativeAvr::sent().size();
+  NativeAvr::receive(patches[2].bytes.data(), patches[2].bytes.size());
+  NativeAvr::runUntil(NativeAvr::receiveIdleAt() + ANSWER_TIMEOUT);
+  refused.clear();
+  readAnswers(answersFrom, acknowledged, refused);
+  TEST_ASSERT_EQUAL(0, refused.size());
+  TEST_ASSERT_TRUE(acknowledged[2]);
+  assertSamePatch(dump.bank, NativeAvr::eeprom(), 2);
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_ISOLATED_TEST(test_every_chunk_round_trips);
+  RUN_ISOLATED_TEST(test_a_damaged_chunk_is_reported);
+  RUN_TEST(test_a_dump_replayed_at_line_rate_restores_the_bank);
+  RUN_ISOLATED_TEST(test_a_patch_with_a_bad_checksum_is_refused);
+  return UNITY_END();
+}
@@ -0,0 +1,234 @@
+/*
+ * MIDI keeps being forwarded while the UI changes: the splash, every menu
+ * page, the transient "saved!" style messages and the edits on each page.
+ *
+ * A note is played on channel 1 every 2ms throughout, and the buttons only
+ * change the routing of other channels, so everything must come out exactly
+ * as it went in. The worst latency of a message and the longest pass of
+ * loop() are reported for each test and must stay within a few ms.
+ */
+
+#include <NativeAvr.h>
+#include <NativeAvrUnity.h>
+#include "../Keypad.h"
+#include "../MidiCapture.h"
+
+#include "../../src/main.cpp"
+
+const NativeAvr::Cycles MS = NativeAvr::CYCLES_PER_MS;
+const NativeAvr::Cycles NOTE_PERIOD = 2 * MS;
+const NativeAvr::Cycles MAX_LATENCY = 5 * MS;
+const NativeAvr::Cycles MAX_LOOP_TIME = 5 * MS;
+
+std::vector<byte> notesSent;
+std::vector<NativeAvr::Cycles> notesArrived;
+
+/**
+ * Plays notes on channel 1 from now for the given time, with running status
+ * unless every note is to have its status byte
+ */
+void playNotes(NativeAvr::Cycles duration, bool runningStatus = true)
+{
+  std::vector<byte> stream;
+  NativeAvr::Cycles start = NativeAvr::now();
+  for (unsigned int i = 0; i * NOTE_PERIOD < duration; i++)
+  {
+    byte message[3] = {0x90, (byte)(i % 128), (byte)(1 + (i / 128) % 127)};
+    for (byte b = (i == 0 || !runningStatus) ? 0 : 1; b < 3; b++)
+    {
+      notesSent.push_back(message[b]);
+      notesArrived.push_back(NativeAvr::receiveAt(start + i * NOTE_PERIOD, &message[b], 1));
+    }
+  }
+}
+
+void bootAndPlay(NativeAvr::Cycles duration, bool runningStatus = true)
+{
+  NativeAvr::boot();
+  NativeAvr::resetLongestLoop();
+  playNotes(duration, runningStatus);
+}
+
+/**
+ * Runs until the notes have all arrived, then checks every one was forwarded in time
+ */
+void assertForwardedThroughout(const char *what)
+{
+  TEST_ASSERT_LESS_THAN_MESSAGE(NativeAvr::receiveIdleAt(), NativeAvr::now(), "the UI took longer than the notes");
+  NativeAvr::runUntil(NativeAvr::receiveIdleAt() + 20 * MS);
+  assertSameBytes(applyRunningStatus(notesSent), NativeAvr::sentBytes(), what);
+
+  NativeAvr::Cycles latency = worstLatency(notesSent, notesArrived, false);
+  char message[120];
+  snprintf(message, sizeof(message), "%s: %u notes, worst latency %.3fms, longest loop() %.3fms", what,
+           (unsigned)splitMessages(notesSent, false).size(), (double)latency / MS, (double)NativeAvr::longestLoop() / MS);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(MAX_LATENCY, latency, "latency");
+  TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(MAX_LOOP_TIME, NativeAvr::longestLoop(), "loop() time");
+  TEST_ASSERT_EQUAL(0, MidiSerial.overflowCount());
+}
+
+void finishSplash()
+{
+  while (splashActive)
+  {
+    NativeAvr::runLoop();
+  }
+}
+
+void goToPage(byte page)
+{
+  for (byte i = 0; curMenuIndex != page && i < NUM_MENU_PAGES; i++)
+  {
+    pressButton(BUTTON_SELECT);
+  }
+  TEST_ASSERT_EQUAL(page, curMenuIndex);
+}
+
+/**
+ * Presses a button that shows a transient message, and waits for it to go
+ */
+void pressForMessage(byte button, const char *message)
+{
+  pressButton(button);
+  NativeAvr::runFor(20 * MS); // a save shows its message once the writes finish
+  TEST_ASSERT_EQUAL_MEMORY_MESSAGE(message, lcdDisplay.line(1), strlen(message), "the message wasn't shown");
+  while (messageActive || storedMessage != NULL)
+  {
+    NativeAvr::runLoop();
+  }
+}
+
+void test_the_splash()
+{
+  bootAndPlay(2500 * MS);
+  NativeAvr::runFor(100 * MS);
+  TEST_ASSERT_TRUE(splashActive);
+  TEST_ASSERT_EQUAL_STRING("MIDIChannelizer!", lcdDisplay.line(0));
+  finishSplash();
+  NativeAvr::runFor(100 * MS);
+  TEST_ASSERT_EQUAL_STRING("LOAD PATCH      ", lcdDisplay.line(0));
+  assertForwardedThroughout("splash");
+}
+
+void test_every_menu_page()
+{
+  bootAndPlay(6000 * MS);
+  finishSplash();
+  for (byte i = 0; i <= NUM_MENU_PAGES; i++)
+  {
+    pressButton(BUTTON_SELECT);
+  }
+  TEST_ASSERT_EQUAL(MENU_MIDIMAP, curMenuIndex);
+  assertForwardedThroughout("menu pages");
+}
+
+void test_the_patch_pages()
+{
+  bootAndPlay(10000 * MS);
+  finishSplash();
+
+  goToPage(MENU_SAVE_PATCH);
+  pressButton(BUTTON_UP);
+  pressForMessage(BUTTON_RIGHT, "saved! w=");
+  goToPage(MENU_LOAD_PATCH);
+  pressForMessage(BUTTON_RIGHT, "loaded!");
+  goToPage(MENU_CLEAR_PATCH);
+  pressForMessage(BUTTON_RIGHT, "cleared! w=");
+  goToPage(MENU_LOAD_PATCH);
+  pressForMessage(BUTTON_RIGHT, "loaded!");
+  goToPage(MENU_RESET_MIDIMAP);
+  pressForMessage(BUTTON_RIGHT, "reset!");
+  assertForwardedThroughout("patch pages");
+}
+
+void test_editing_the_routing_of_other_channels()
+{
+  bootAndPlay(10000 * MS);
+  finishSplash();
+
+  goToPage(MENU_MIDIMAP);
+  pressButton(BUTTON_RIGHT); // channel 2
+  pressButton(BUTTON_UP);    // mapped to 3
+  pressButton(BUTTON_DOWN);
+  pressButton(BUTTON_UP);
+  TEST_ASSERT_EQUAL(3, midiMap[2].mapsTo);
+
+  // The pages share the selected input channel
+  goToPage(MENU_MIDI_LAYERS);
+  pressButton(BUTTON_LEFT); // channel 3
+  pressButton(BUTTON_UP);
+  pressButton(BUTTON_RIGHT); // layered onto channel 2
+  pressButton(BUTTON_DOWN);
+  TEST_ASSERT_TRUE(midiMap[3].hasLayer(2));
+
+  goToPage(MENU_MIDI_FILTERS);
+  pressButton(BUTTON_LEFT); // channel 4
+  pressButton(BUTTON_UP);
+  pressButton(BUTTON_RIGHT); // a message type filtered
+  pressButton(BUTTON_DOWN);
+  TEST_ASSERT_NOT_EQUAL(0, midiMap[4].filters);
+
+  TEST_ASSERT_EQUAL(1, midiMap[1].mapsTo);
+  TEST_ASSERT_EQUAL(0, midiMap[1].layers);
+  TEST_ASSERT_EQUAL(0, midiMap[1].filters);
+  assertForwardedThroughout("routing edits");
+}
+
+/**
+ * Switching mode forgets the running status, as the forwarder that takes over
+ * hasn't seen the status byte, so here every note has its status byte
+ */
+void test_changing_the_forwarding_mode()
+{
+  bootAndPlay(5000 * MS, false);
+  finishSplash();
+  goToPage(MENU_FORWARD_MODE);
+  for (byte i = 0; i < 6; i++)
+  {
+    pressButton(i % 2 ? BUTTON_DOWN : BUTTON_UP);
+    TEST_ASSERT_EQUAL(i % 2 ? FORWARD_CUT_THROUGH : FORWARD_PARSED, forwardingMode);
+  }
+  assertForwardedThroughout("forwarding mode");
+}
+
+void test_the_monitor_program_and_backup_pages()
+{
+  bootAndPlay(6000 * MS);
+  finishSplash();
+  goToPage(DEBUG_MENU_MONITOR);
+  NativeAvr::runFor(300 * MS);
+  goToPage(MENU_PROGRAM_CHANNEL);
+  pressButton(BUTTON_UP); // program changes on channel 1 select patches, and are written to the EEPROM
+  pressButton(BUTTON_UP);
+  pressButton(BUTTON_DOWN);
+  TEST_ASSERT_EQUAL(1, programChannel);
+  // The backup page forwards until RIGHT arms it
+  goToPage(MENU_BACKUP_PATCHES);
+  pressButton(BUTTON_UP);
+  pressButton(BUTTON_LEFT);
+  TEST_ASSERT_FALSE(backupArmed);
+  assertForwardedThroughout("monitor, program and backup pages");
+}
+
+void setUp()
+{
+  notesSent.clear();
+  notesArrived.clear();
+}
+
+void tearDown()
+{
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_ISOLATED_TEST(test_the_splash);
+  RUN_ISOLATED_TEST(test_every_menu_page);
+  RUN_ISOLATED_TEST(test_the_patch_pages);
+  RUN_ISOLATED_TEST(test_editing_the_routing_of_other_channels);
+  RUN_ISOLATED_TEST(test_changing_the_forwarding_mode);
+  RUN_ISOLATED_TEST(test_the_monitor_program_and_backup_pages);
+  return UNITY_END();
+}
@@ -74,6 +74,7 @@ Rotary::Rotary(char _pin1, char _pin2) {
   pin2 = _pin2;
   // Initialise state.
   state = R_START;
+  steps = 0;
 }
 
 void Rotary::begin(bool pullup) {
@@ -97,3 +98,41 @@ unsigned char Rotary::process() {
   // Return emit bits, ie the generated event.
   return state & 0x30;
 }
+
+/*
+ * Turns on the pin change interrupts of both pins. The sketch's ISR for
+ * their port (e.g. PCINT2_vect for pins 0-7) must call processInterrupt(),
+ * and process() must not then be called from loop().
+ */
+void Rotary::enableInterrupt() {
+  *digitalPinToPCMSK(pin1) |= 1 << digitalPinToPCMSKbit(pin1);
+  *digitalPinToPCMSK(pin2) |= 1 << digitalPinToPCMSKbit(pin2);
+  *digitalPinToPCICR(pin1) |= 1 << digitalPinToPCICRbit(pin1);
+  *digitalPinToPCICR(pin2) |= 1 << digitalPinToPCICRbit(pin2);
+}
+
+/*
+ * Runs the state machine from the pin change interrupt and adds each step to
+ * the count: +1 clockwise, -1 counter-clockwise.
+ */
+void Rotary::processInterrupt() {
+  unsigned char result = process();
+  if (result == DIR_CW) {
+    steps++;
+  } else if (result == DIR_CCW) {
+    steps--;
+  }
+}
+
+/*
+ * Returns the steps counted since the last call and starts counting again,
+ * so a fast spin is read in one go however long loop() took.
+ */
+int Rotary::readSteps() {
+  uint8_t oldSREG = SREG;
+  cli();
+  int result = steps;
+  steps = 0;
+  SREG = oldSREG;
+  return result;
+}
@@ -18,14 +18,26 @@
 // Counter-clockwise step.
 #define DIR_CCW 0x20
 
+// The state table: the next state for each state (row) and pin reading
+// (column, pin2 << 1 | pin1). The emit bits above are or'ed into the state.
+#ifdef HALF_STEP
+extern const unsigned char ttable[6][4];
+#else
+extern const unsigned char ttable[7][4];
+#endif
+
 class Rotary
 {
   public:
     Rotary(char, char);
     unsigned char process();
     void begin(bool pullup=true);
+    void enableInterrupt();
+    void processInterrupt();
+    int readSteps();
   private:
     unsigned char state;
+    volatile int steps;
     unsigned char pin1;
     unsigned char pin2;
 };
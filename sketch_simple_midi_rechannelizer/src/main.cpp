@@ -1,208 +1,223 @@
 #include <MIDI.h>
 #include <midi_DEFS.h>
-#include "LedControl.h"
-#include <Rotary.h>
+#include "Max7219.h"
+#include <PinRotary.h>
 
 MIDI_CREATE_INSTANCE(HardwareSerial, Serial, midiA);
 
 const byte MaxChannel = 16;
 
 /*
-  DIN connects to pin 12
-  CLK connects to pin 11
+  The led matrix is driven by the hardware SPI
+  DIN connects to pin 11 (MOSI)
+  CLK connects to pin 13 (SCK)
   CS connects to pin 10
 */
-LedControl lc = LedControl(12, 11, 10, 1);
+Max7219 lc = Max7219(10, 1);
 
-// Rotary encoder
-Rotary rotary = Rotary(2, 3);
+// Rotary encoder on pins 2 and 3. It is decoded in the pin change interrupt so detents
+// aren't missed while loop() is busy with midi
+PinRotary<2, 3> rotary;
 
 /*
   --------------------------------------------------------------------------------------
   Variables
   --------------------------------------------------------------------------------------
 */
-byte character1[8] = {
-    B00000000,
-    B00001000,
-    B00011000,
-    B00001000,
-    B00001000,
-    B00001000,
-    B00000000,
-    B11111111};
-
-byte character2[8] = {
-    B00000000,
-    B00111100,
-    B00000100,
-    B00111100,
-    B00100000,
-    B00111100,
-    B00000000,
-    B11111111};
-
-byte character3[8] = {
-    B00000000,
-    B00111100,
-    B00000100,
-    B00111100,
-    B00000100,
-    B00111100,
-    B00000000,
-    B11111111};
-
-byte character4[8] = {
-    B00000000,
-    B00100100,
-    B00100100,
-    B00111100,
-    B00000100,
-    B00000100,
-    B00000000,
-    B11111111};
-
-byte character5[8] = {
-    B00000000,
-    B00111100,
-    B00100000,
-    B00111100,
-    B00000100,
-    B00111100,
-    B00000000,
-    B11111111};
-
-byte character6[8] = {
-    B00000000,
-    B00111100,
-    B00100000,
-    B00111100,
-    B00100100,
-    B00111100,
-    B00000000,
-    B11111111};
-
-byte character7[8] = {
-    B00000000,
-    B00111100,
-    B00000100,
-    B00000100,
-    B00000100,
-    B00000100,
-    B00000000,
-    B11111111};
-
-byte character8[8] = {
-    B00000000,
-    B00111100,
-    B00100100,
-    B00111100,
-    B00100100,
-    B00111100,
-    B00000000,
-    B11111111};
-
-byte character9[8] = {
-    B00000000,
-    B00111100,
-    B00100100,
-    B00111100,
-    B00000100,
-    B00111100,
-    B00000000,
-    B11111111};
-
-byte character10[8] = {
-    B00000000,
-    B00101110,
-    B01101010,
-    B00101010,
-    B00101010,
-    B00101110,
-    B00000000,
-    B11111111};
-
-byte character11[8] = {
-    B00000000,
-    B00100100,
-    B01101100,
-    B00100100,
-    B00100100,
-    B00100100,
-    B00000000,
-    B11111111};
-
-byte character12[8] = {
-    B00000000,
-    B00101110,
-    B01100010,
-    B00101110,
-    B00101000,
-    B00101110,
-    B00000000,
-    B11111111};
-
-byte character13[8] = {
-    B00000000,
-    B00101110,
-    B01100010,
-    B00101110,
-    B00100010,
-    B00101110,
-    B00000000,
-    B11111111};
-
-byte character14[8] = {
-    B00000000,
-    B00101010,
-    B01101010,
-    B00101110,
-    B00100010,
-    B00100010,
-    B00000000,
-    B11111111};
-
-byte character15[8] = {
-    B00000000,
-    B00101110,
-    B01101000,
-    B00101110,
-    B00100010,
-    B00101110,
-    B00000000,
-    B11111111};
-
-byte character16[8] = {
-    B00000000,
-    B00101110,
-    B01101000,
-    B00101110,
-    B00101010,
-    B00101110,
-    B00000000,
-    B11111111};
-
+// The channel numbers 1-16 shown on the led matrix, one byte per row. They are kept in
+// flash as there is little SRAM to spare
 const byte maxNum = 16;
-byte *characters[maxNum] = {
-    character1, character2, character3, character4, character5, character6, character7, character8,
-    character9, character10, character11, character12, character13, character14, character15, character16};
+const byte characters[maxNum][8] PROGMEM = {
+    // 1
+    {
+        B00000000,
+        B00001000,
+        B00011000,
+        B00001000,
+        B00001000,
+        B00001000,
+        B00000000,
+        B11111111},
+    // 2
+    {
+        B00000000,
+        B00111100,
+        B00000100,
+        B00111100,
+        B00100000,
+        B00111100,
+        B00000000,
+        B11111111},
+    // 3
+    {
+        B00000000,
+        B00111100,
+        B00000100,
+        B00111100,
+        B00000100,
+        B00111100,
+        B00000000,
+        B11111111},
+    // 4
+    {
+        B00000000,
+        B00100100,
+        B00100100,
+        B00111100,
+        B00000100,
+        B00000100,
+        B00000000,
+        B11111111},
+    // 5
+    {
+        B00000000,
+        B00111100,
+        B00100000,
+        B00111100,
+        B00000100,
+        B00111100,
+        B00000000,
+        B11111111},
+    // 6
+    {
+        B00000000,
+        B00111100,
+        B00100000,
+        B00111100,
+        B00100100,
+        B00111100,
+        B00000000,
+        B11111111},
+    // 7
+    {
+        B00000000,
+        B00111100,
+        B00000100,
+        B00000100,
+        B00000100,
+        B00000100,
+        B00000000,
+        B11111111},
+    // 8
+    {
+        B00000000,
+        B00111100,
+        B00100100,
+        B00111100,
+        B00100100,
+        B00111100,
+        B00000000,
+        B11111111},
+    // 9
+    {
+        B00000000,
+        B00111100,
+        B00100100,
+        B00111100,
+        B00000100,
+        B00111100,
+        B00000000,
+        B11111111},
+    // 10
+    {
+        B00000000,
+        B00101110,
+        B01101010,
+        B00101010,
+        B00101010,
+        B00101110,
+        B00000000,
+        B11111111},
+    // 11
+    {
+        B00000000,
+        B00100100,
+        B01101100,
+        B00100100,
+        B00100100,
+        B00100100,
+        B00000000,
+        B11111111},
+    // 12
+    {
+        B00000000,
+        B00101110,
+        B01100010,
+        B00101110,
+        B00101000,
+        B00101110,
+        B00000000,
+        B11111111},
+    // 13
+    {
+        B00000000,
+        B00101110,
+        B01100010,
+        B00101110,
+        B00100010,
+        B00101110,
+        B00000000,
+        B11111111},
+    // 14
+    {
+        B00000000,
+        B00101010,
+        B01101010,
+        B00101110,
+        B00100010,
+        B00100010,
+        B00000000,
+        B11111111},
+    // 15
+    {
+        B00000000,
+        B00101110,
+        B01101000,
+        B00101110,
+        B00100010,
+        B00101110,
+        B00000000,
+        B11111111},
+    // 16
+    {
+        B00000000,
+        B00101110,
+        B01101000,
+        B00101110,
+        B00101010,
+        B00101110,
+        B00000000,
+        B11111111}};
+
+// The rows showing on the led matrix, so that only rows that change are sent
+byte displayedRows[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+
+// Rows sent to the display and rows that didn't need sending because they were already showing
+unsigned long rowFramesSent = 0;
+unsigned long rowFramesSaved = 0;
 
 // The currently selected midi channel
 byte midiChannel = 1;
 
-// The direction of rotation of the rotary encoder
-byte direction = 0;
-
 bool enableThru = false;
 
 /**
- * Display a character on the 8x8 led matrix
- */ 
-void displayCharacter(byte character[8])
+ * Display a character from flash on the 8x8 led matrix. Only the rows that differ from
+ * what is already showing are sent, and glyphs share their bottom rows.
+ */
+void displayCharacter(const byte *character)
 {
-  for (int c = 0; c < 8; c++)
+  for (byte c = 0; c < 8; c++)
   {
-    lc.setRow(0, c, character[c]);
+    byte row = pgm_read_byte(&character[c]);
+    if (row == displayedRows[c])
+    {
+      rowFramesSaved++;
+      continue;
+    }
+    lc.setRow(0, c, row);
+    displayedRows[c] = row;
+    rowFramesSent++;
   }
 
   //  This code offsets the characters down and removes the red underline
@@ -214,20 +229,187 @@ void displayCharacter(byte character[8])
   //  lc.setRow(0, 7, B00000000);
 }
 
-void changeMidiChannel(byte direction)
+/**
+ * Move the midi channel on by a number of encoder steps, clockwise is positive.
+ * Channels wrap around from 16 to 1 and back.
+ */
+void changeMidiChannel(int steps)
 {
-  if (direction == DIR_CW)
+  int channel = (midiChannel - 1 + steps) % MaxChannel;
+  if (channel < 0)
   {
-    // increment
-    midiChannel = (midiChannel < 16) ? midiChannel + 1 : 1;
+    channel += MaxChannel;
   }
-  else
+  midiChannel = channel + 1;
+}
+
+/**
+ * Pin change interrupt for the encoder pins, 2 and 3 are both on port D
+ */
+ISR(PCINT2_vect)
+{
+  rotary.processInterrupt();
+}
+
+// Set to 1 with a build flag to time the encoder decoding at power up
+#ifndef ROTARY_BENCHMARK
+#define ROTARY_BENCHMARK 0
+#endif
+
+// Set to 1 with a build flag to time sending frames to the led matrix at power up
+#ifndef MAX7219_BENCHMARK
+#define MAX7219_BENCHMARK 0
+#endif
+
+#if ROTARY_BENCHMARK || MAX7219_BENCHMARK
+/*
+   -------------------------------------------------------------------------------------------
+   BENCHMARKS
+   Only built with a benchmark flag. At power up the code is timed with Timer1 counting
+   every CPU cycle, and the results are sent on the serial port at 115200 baud before it
+   is switched to MIDI, e.g. "PinRotary::process() 21.0 cycles, 1.3us". The times include
+   the loop around the calls.
+   -------------------------------------------------------------------------------------------
+*/
+const unsigned int BENCHMARK_RUNS = 1000;
+const byte BENCHMARK_BATCH = 100; // Calls timed at once, few enough that TCNT1 can't wrap
+
+// Results of the calls end up here, so the compiler can't leave the calls out
+volatile byte benchmarkSink;
+
+/**
+ * Sends a result on the serial port as cycles and microseconds per run
+ */
+void printBenchmark(const __FlashStringHelper *name, unsigned long cycles)
+{
+  unsigned long tenths = cycles * 10 / BENCHMARK_RUNS;
+  Serial.print(name);
+  Serial.print(' ');
+  Serial.print(tenths / 10);
+  Serial.print('.');
+  Serial.print(tenths % 10);
+  Serial.print(F(" cycles, "));
+  tenths /= F_CPU / 1000000UL;
+  Serial.print(tenths / 10);
+  Serial.print('.');
+  Serial.print(tenths % 10);
+  Serial.println(F("us"));
+}
+
+/**
+ * Times process() of Rotary, which reads the pins with digitalRead(), against PinRotary on
+ * the same pins. Interrupts are off so the encoder and millis() don't add to the times.
+ */
+void runRotaryBenchmark()
+{
+  Rotary pinLookupRotary(2, 3);
+  PinRotary<2, 3> portRotary;
+  unsigned long lookupCycles = 0;
+  unsigned long portCycles = 0;
+  byte seen = 0;
+
+  byte oldSREG = SREG;
+  cli();
+  for (unsigned int run = 0; run < BENCHMARK_RUNS; run += BENCHMARK_BATCH)
   {
-    // decrement
-    midiChannel = (midiChannel > 1) ? midiChannel - 1 : 16;
+    word start = TCNT1;
+    for (byte i = 0; i < BENCHMARK_BATCH; i++)
+    {
+      seen |= pinLookupRotary.process();
+    }
+    lookupCycles += (word)(TCNT1 - start);
+
+    start = TCNT1;
+    for (byte i = 0; i < BENCHMARK_BATCH; i++)
+    {
+      seen |= portRotary.process();
+    }
+    portCycles += (word)(TCNT1 - start);
   }
+  SREG = oldSREG;
+  benchmarkSink = seen;
+
+  printBenchmark(F("Rotary::process()"), lookupCycles);
+  printBenchmark(F("PinRotary::process()"), portCycles);
 }
 
+/**
+ * Times sending all 8 rows of a glyph to the led matrix: the setRow() calls, and until the
+ * last row has gone when the rows are queued. Interrupts stay on, as the SPI interrupt
+ * sends the queue, so the odd millis() tick is included.
+ */
+void runMax7219Benchmark()
+{
+  unsigned long setRowCycles = 0;
+  unsigned long frameCycles = 0;
+  for (unsigned int frame = 0; frame < BENCHMARK_RUNS; frame++)
+  {
+    const byte *character = characters[frame % maxNum];
+    word start = TCNT1;
+    for (byte row = 0; row < 8; row++)
+    {
+      lc.setRow(0, row, pgm_read_byte(&character[row]));
+    }
+    word queued = TCNT1;
+    lc.flush();
+    word sent = TCNT1;
+    setRowCycles += (word)(queued - start);
+    frameCycles += (word)(sent - start);
+  }
+
+  printBenchmark(F("Max7219 8 x setRow()"), setRowCycles);
+  printBenchmark(F("Max7219 frame sent"), frameCycles);
+  lc.clearDisplay(0); // as displayedRows expects
+
+  // Then step through the channels one at a time, as turning the encoder does
+  unsigned long stepCycles = 0;
+  for (unsigned int step = 0; step < BENCHMARK_RUNS; step++)
+  {
+    word start = TCNT1;
+    displayCharacter(characters[step % maxNum]);
+    lc.flush();
+    stepCycles += (word)(TCNT1 - start);
+  }
+
+  printBenchmark(F("displayCharacter() step sent"), stepCycles);
+  Serial.print(F("rows sent "));
+  Serial.print(rowFramesSent);
+  Serial.print(F(", already showing "));
+  Serial.println(rowFramesSaved);
+
+  // Start from a blank matrix and fresh counts, as at power up
+  lc.clearDisplay(0);
+  memset(displayedRows, 0, sizeof(displayedRows));
+  rowFramesSent = 0;
+  rowFramesSaved = 0;
+}
+
+/**
+ * Runs the benchmarks built in and sends their results. Timer1 is set up by the Arduino
+ * core for analogWrite() on pins 9 and 10, which the sketch doesn't use, and is put back
+ * afterwards.
+ */
+void runBenchmarks()
+{
+  byte oldTCCR1A = TCCR1A;
+  byte oldTCCR1B = TCCR1B;
+  TCCR1A = 0;
+  TCCR1B = 1 << CS10; // normal mode, one count per cycle
+
+  Serial.begin(115200);
+#if ROTARY_BENCHMARK
+  runRotaryBenchmark();
+#endif
+#if MAX7219_BENCHMARK
+  runMax7219Benchmark();
+#endif
+  Serial.flush();
+
+  TCCR1A = oldTCCR1A;
+  TCCR1B = oldTCCR1B;
+}
+#endif
+
 /*
    -------------------------------------------------------------------------------------------
    SETUP
@@ -236,13 +418,19 @@ void changeMidiChannel(byte direction)
 void setup()
 {
   rotary.begin();
+  rotary.enableInterrupt();
 
+  lc.begin();
   lc.shutdown(0, false);
   // Set brightness to a medium value
   lc.setIntensity(0, 2);
   // Clear the display
   lc.clearDisplay(0);
 
+#if ROTARY_BENCHMARK || MAX7219_BENCHMARK
+  runBenchmarks();
+#endif
+
   displayCharacter(characters[midiChannel - 1]);
 
   // Initiate MIDI communications, listen to all channels
@@ -270,12 +458,14 @@ void setup()
 
 void loop()
 {
-  direction = rotary.process();
-  if (direction) {
-    changeMidiChannel(direction);
+  // However many steps were turned since the last pass are applied at once
+  int steps = rotary.readSteps();
+  if (steps != 0)
+  {
+    changeMidiChannel(steps);
     displayCharacter(characters[midiChannel - 1]);
   }
-  
+
   if (enableThru)
   {
     // Thru on A has already pushed the input message to out A.
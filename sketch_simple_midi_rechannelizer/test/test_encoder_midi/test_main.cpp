@@ -0,0 +1,269 @@
+/*
+ * The encoder turned as fast as a hand can spin it, with bouncing contacts,
+ * while MIDI arrives at the full line rate. Every detent must be counted by
+ * the pin change interrupt, the led matrix must end up showing the channel
+ * the encoder was turned to, and every message must be forwarded on the
+ * channel selected when it was read.
+ *
+ * The messages are sent with their status byte, so the output is the same
+ * size as the input and can keep up with it. Running status input at the
+ * line rate can't be forwarded in full, as the MIDI library sends every
+ * message with its status.
+ */
+
+#include <NativeAvr.h>
+#include <NativeAvrUnity.h>
+#include <vector>
+
+#include "../../src/main.cpp"
+
+const NativeAvr::Cycles MS = NativeAvr::CYCLES_PER_MS;
+const NativeAvr::Cycles US = NativeAvr::CYCLES_PER_US;
+const NativeAvr::Cycles BOUNCE = 20 * US;
+const byte ENCODER_PIN1 = 2;
+const byte ENCODER_PIN2 = 3;
+const byte MESSAGE_SIZE = 3;
+
+// A change of an encoder pin, scheduled for the emulation to make
+struct PinEdge
+{
+  byte pin;
+  bool high;
+};
+
+std::vector<PinEdge> edges;
+std::vector<byte> input;
+std::vector<NativeAvr::Cycles> inputArrived;
+
+void changePin(void *context)
+{
+  const PinEdge &edge = *(const PinEdge *)context;
+  NativeAvr::setPin(edge.pin, edge.high);
+}
+
+/**
+ * Schedules the edges collected, each at its time. They are only scheduled once
+ * they are all collected, as the emulation keeps a pointer to each.
+ */
+void scheduleEdges(const std::vector<NativeAvr::Cycles> &times)
+{
+  for (size_t i = 0; i < edges.size(); i++)
+  {
+    NativeAvr::schedule(times[i], changePin, &edges[i]);
+  }
+}
+
+/**
+ * Turns the encoder through each of the turns in order, clockwise if positive, with
+ * one detent every period and a gap between turns. Each detent is the four edges of
+ * the quadrature cycle, and every other edge bounces once before it settles.
+ * Returns the time the last turn has settled.
+ */
+NativeAvr::Cycles turnEncoderBy(const std::vector<int> &turns, NativeAvr::Cycles period)
+{
+  std::vector<NativeAvr::Cycles> times;
+  NativeAvr::Cycles at = NativeAvr::now() + 10 * MS;
+  for (size_t turn = 0; turn < turns.size(); turn++)
+  {
+    int count = (turns[turn] > 0) ? turns[turn] : -turns[turn];
+    // The first pin to fall leads the turn: pin 2 follows for clockwise
+    byte lead = (turns[turn] > 0) ? ENCODER_PIN2 : ENCODER_PIN1;
+    byte follow = (turns[turn] > 0) ? ENCODER_PIN1 : ENCODER_PIN2;
+    const byte pins[4] = {lead, follow, lead, follow};
+    const bool levels[4] = {false, false, true, true};
+    for (int detent = 0; detent < count; detent++)
+    {
+      for (byte edge = 0; edge < 4; edge++)
+      {
+        NativeAvr::Cycles edgeAt = at + detent * period + edge * period / 4;
+        bool bounce = edge % 2 == 0;
+        if (bounce)
+        {
+          edges.push_back({pins[edge], levels[edge]});
+          times.push_back(edgeAt);
+          edges.push_back({pins[edge], !levels[edge]});
+          times.push_back(edgeAt + BOUNCE / 2);
+          edgeAt += BOUNCE;
+        }
+        edges.push_back({pins[edge], levels[edge]});
+        times.push_back(edgeAt);
+      }
+    }
+    at += count * period + 20 * MS;
+  }
+  scheduleEdges(times);
+  return at;
+}
+
+/**
+ * Sends note ons and offs on every channel at the full line rate for the given
+ * time, each with its status byte. Returns the time the last byte arrives.
+ */
+NativeAvr::Cycles playAtLineRate(NativeAvr::Cycles duration)
+{
+  NativeAvr::Cycles start = NativeAvr::now();
+  NativeAvr::Cycles idle = start;
+  for (unsigned int i = 0; i * MESSAGE_SIZE * NativeAvr::uartByteCycles() < duration; i++)
+  {
+    byte message[MESSAGE_SIZE] = {(byte)(((i % 2) ? 0x80 : 0x90) | (i / 2) % 16), (byte)(36 + i % 48), (byte)(1 + i % 127)};
+    idle = NativeAvr::receive(message, MESSAGE_SIZE);
+    input.insert(input.end(), message, message + MESSAGE_SIZE);
+    inputArrived.push_back(idle);
+  }
+  return idle;
+}
+
+/**
+ * The channel the encoder moves to from channel 1 after the given turns
+ */
+byte channelAfter(const std::vector<int> &turns)
+{
+  int steps = 0;
+  for (size_t turn = 0; turn < turns.size(); turn++)
+  {
+    steps += turns[turn];
+  }
+  return 1 + ((steps % MaxChannel) + MaxChannel) % MaxChannel;
+}
+
+/**
+ * Works out what the led matrix shows from the register writes sent on the SPI
+ */
+void readDisplay(byte rows[8])
+{
+  const std::vector<byte> &spi = NativeAvr::spiSent();
+  memset(rows, 0, 8);
+  for (size_t i = 0; i + 1 < spi.size(); i += 2)
+  {
+    byte opcode = spi[i];
+    if (opcode >= 1 && opcode <= 8)
+    {
+      rows[opcode - 1] = spi[i + 1];
+    }
+  }
+}
+
+void assertShowsChannel(byte channel)
+{
+  byte rows[8];
+  readDisplay(rows);
+  for (byte row = 0; row < 8; row++)
+  {
+    TEST_ASSERT_EQUAL_HEX8_MESSAGE(pgm_read_byte(&characters[channel - 1][row]), rows[row], "led matrix row");
+  }
+}
+
+/**
+ * Checks every message was forwarded unchanged apart from its channel, which must be
+ * one the encoder passed through. Returns how many were sent on the final channel.
+ */
+size_t assertForwarded(byte finalChannel, NativeAvr::Cycles &worstLatency)
+{
+  const std::vector<NativeAvr::SentByte> &output = NativeAvr::sent();
+  TEST_ASSERT_EQUAL_MESSAGE(input.size(), output.size(), "bytes forwarded");
+  size_t onFinalChannel = 0;
+  worstLatency = 0;
+  for (size_t i = 0; i < input.size(); i += MESSAGE_SIZE)
+  {
+    char message[48];
+    snprintf(message, sizeof(message), "message %u", (unsigned)(i / MESSAGE_SIZE));
+    TEST_ASSERT_EQUAL_HEX8_MESSAGE(input[i] & 0xF0, output[i].value & 0xF0, message);
+    TEST_ASSERT_EQUAL_HEX8_MESSAGE(input[i + 1], output[i + 1].value, message);
+    TEST_ASSERT_EQUAL_HEX8_MESSAGE(input[i + 2], output[i + 2].value, message);
+    if ((output[i].value & 0x0F) + 1 == finalChannel)
+    {
+      onFinalChannel++;
+    }
+    NativeAvr::Cycles latency = output[i + 2].at - inputArrived[i / MESSAGE_SIZE];
+    if (latency > worstLatency)
+    {
+      worstLatency = latency;
+    }
+  }
+  // Once the encoder has stopped everything goes to the final channel
+  TEST_ASSERT_EQUAL_MESSAGE(finalChannel, (output[output.size() - MESSAGE_SIZE].value & 0x0F) + 1, "channel at the end");
+  TEST_ASSERT_EQUAL(0, NativeAvr::receiveOverruns());
+  return onFinalChannel;
+}
+
+void bootWithEncoderAtRest()
+{
+  NativeAvr::setPin(ENCODER_PIN1, true);
+  NativeAvr::setPin(ENCODER_PIN2, true);
+  NativeAvr::boot();
+  NativeAvr::runFor(1 * MS); // for the queued rows to be sent
+  assertShowsChannel(1);
+}
+
+void test_every_detent_is_counted()
+{
+  bootWithEncoderAtRest();
+  std::vector<int> turns = {40, -7, 23, -100, 5};
+  NativeAvr::Cycles settled = turnEncoderBy(turns, 2 * MS);
+  NativeAvr::runUntil(settled + 10 * MS);
+
+  TEST_ASSERT_EQUAL(channelAfter(turns), midiChannel);
+  assertShowsChannel(midiChannel);
+  TEST_ASSERT_EQUAL(0, NativeAvr::spiCollisions());
+}
+
+void test_the_display_follows_a_fast_spin()
+{
+  bootWithEncoderAtRest();
+  // 1000 detents a second, faster than a hand can turn a detented encoder
+  std::vector<int> turns = {-300, 77};
+  NativeAvr::Cycles settled = turnEncoderBy(turns, 1 * MS);
+  NativeAvr::resetLongestLoop();
+  NativeAvr::runUntil(settled + 10 * MS);
+
+  char message[100];
+  snprintf(message, sizeof(message), "%u rows sent, %u already showing, longest loop() %.3fms",
+           (unsigned)rowFramesSent, (unsigned)rowFramesSaved, (double)NativeAvr::longestLoop() / MS);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_EQUAL(channelAfter(turns), midiChannel);
+  assertShowsChannel(midiChannel);
+}
+
+void test_midi_at_the_line_rate_is_forwarded_while_turning()
+{
+  bootWithEncoderAtRest();
+  std::vector<int> turns = {9, -3, 20, -17, 6};
+  NativeAvr::Cycles settled = turnEncoderBy(turns, 2 * MS);
+  NativeAvr::Cycles idle = playAtLineRate(settled - NativeAvr::now() + 200 * MS);
+  NativeAvr::resetLongestLoop();
+  NativeAvr::runUntil(idle + 20 * MS);
+
+  byte finalChannel = channelAfter(turns);
+  TEST_ASSERT_EQUAL(finalChannel, midiChannel);
+  assertShowsChannel(finalChannel);
+  NativeAvr::Cycles latency;
+  size_t onFinalChannel = assertForwarded(finalChannel, latency);
+  // at least the 200ms after the last turn
+  TEST_ASSERT_GREATER_OR_EQUAL(200 * MS / (MESSAGE_SIZE * NativeAvr::uartByteCycles()), onFinalChannel);
+
+  char message[120];
+  snprintf(message, sizeof(message), "%u messages forwarded, longest loop() %.3fms, worst latency %.3fms",
+           (unsigned)(input.size() / MESSAGE_SIZE), (double)NativeAvr::longestLoop() / MS, (double)latency / MS);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_LESS_THAN(2 * MESSAGE_SIZE * NativeAvr::uartByteCycles(), latency);
+}
+
+void setUp()
+{
+  edges.clear();
+  input.clear();
+  inputArrived.clear();
+}
+
+void tearDown()
+{
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_ISOLATED_TEST(test_every_detent_is_counted);
+  RUN_ISOLATED_TEST(test_the_display_follows_a_fast_spin);
+  RUN_ISOLATED_TEST(test_midi_at_the_line_rate_is_forwarded_while_turning);
+  return UNITY_END();
+}